@@ -0,0 +1,312 @@
+/*
+ * Micro-benchmark of the receive and send hot paths: parsing lines into
+ * irc_msgs, dispatching them to hooks and serializing them again, the
+ * way irc_push_message does. Every line of the corpus is run through
+ * each stage on its own and through all of them together.
+ *
+ *   bench_irc [corpus] [rounds]
+ *
+ * The corpus is a file of lines, or the .idx of a capture circ recorded,
+ * of which the server lines are used.
+ *
+ * Allocations are counted by wrapping malloc, calloc and realloc at link
+ * time, see the bench_irc target.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "irc/capture.h"
+#include "irc/hooks.h"
+#include "irc/parser.h"
+#include "irc/serializer.h"
+
+#ifndef BENCH_CORPUS
+#define BENCH_CORPUS "bench/corpus.irc"
+#endif
+
+#define BENCH_DEFAULT_ROUNDS 20000
+
+static size_t allocations;
+
+void *
+__real_malloc (size_t size);
+void *
+__real_calloc (size_t n, size_t size);
+void *
+__real_realloc (void *ptr, size_t size);
+
+void *
+__wrap_malloc (size_t size)
+{
+	allocations++;
+	return __real_malloc (size);
+}
+
+void *
+__wrap_calloc (size_t n, size_t size)
+{
+	allocations++;
+	return __real_calloc (n, size);
+}
+
+void *
+__wrap_realloc (void *ptr, size_t size)
+{
+	allocations++;
+	return __real_realloc (ptr, size);
+}
+
+typedef struct corpus
+{
+	char *data;
+	char **lines;
+	size_t *lens;
+	size_t len;
+} corpus;
+
+static size_t dispatched;
+static uint8_t out[8192];
+
+static void
+count_hook (const irc_server *s, const irc_msg *msg)
+{
+	dispatched++;
+}
+
+static void
+privmsg_hook (const irc_server *s, const irc_msg *msg)
+{
+	/* Roughly what the scheme entry looks at before queueing */
+	if (msg->params.len > 1 && msg->params.params[1][0] == '%')
+		dispatched++;
+}
+
+/* The corpus from the server lines of a capture, without their CRLF */
+static int
+load_capture (const char *path, corpus *c)
+{
+	irc_capture_reader r;
+	if (irc_capture_reader_open (&r, path, 0) == -1) {
+		perror (path);
+		return -1;
+	}
+
+	size_t size = 0;
+	irc_capture_record rec;
+	while (irc_capture_next (&r, &rec))
+		if (rec.dir == IRC_CAPTURE_IN)
+			size += rec.len + 1;
+	irc_capture_reader_close (&r);
+
+	if (irc_capture_reader_open (&r, path, 0) == -1)
+		return -1;
+
+	size_t cap = 64;
+	c->data = malloc (size + 1);
+	c->lines = malloc (cap * sizeof (char *));
+	c->lens = malloc (cap * sizeof (size_t));
+	c->len = 0;
+	if (c->data == NULL) {
+		irc_capture_reader_close (&r);
+		return -1;
+	}
+
+	char *at = c->data;
+	while (irc_capture_next (&r, &rec)) {
+		size_t len = rec.len;
+		while (len > 0 && (rec.line[len - 1] == '\n' || rec.line[len - 1] == '\r'))
+			len--;
+		if (rec.dir != IRC_CAPTURE_IN || len == 0)
+			continue;
+
+		if (c->len == cap) {
+			cap *= 2;
+			c->lines = realloc (c->lines, cap * sizeof (char *));
+			c->lens = realloc (c->lens, cap * sizeof (size_t));
+		}
+		memcpy (at, rec.line, len);
+		at[len] = '\0';
+		c->lines[c->len] = at;
+		c->lens[c->len] = len;
+		c->len++;
+		at += len + 1;
+	}
+	irc_capture_reader_close (&r);
+
+	return c->len > 0 ? 0 : -1;
+}
+
+static int
+load_corpus (const char *path, corpus *c)
+{
+	size_t path_len = strlen (path);
+	if (path_len > 4 && strcmp (path + path_len - 4, ".idx") == 0)
+		return load_capture (path, c);
+
+	FILE *f = fopen (path, "rb");
+	if (f == NULL) {
+		perror (path);
+		return -1;
+	}
+
+	fseek (f, 0, SEEK_END);
+	long size = ftell (f);
+	rewind (f);
+
+	c->data = malloc (size + 1);
+	if (c->data == NULL || fread (c->data, 1, size, f) != (size_t)size) {
+		fclose (f);
+		return -1;
+	}
+	fclose (f);
+	c->data[size] = '\0';
+
+	size_t cap = 64;
+	c->lines = malloc (cap * sizeof (char *));
+	c->lens = malloc (cap * sizeof (size_t));
+	c->len = 0;
+
+	for (char *line = strtok (c->data, "\n"); line != NULL; line = strtok (NULL, "\n")) {
+		size_t len = strlen (line);
+		if (len > 0 && line[len - 1] == '\r')
+			line[--len] = '\0';
+		if (len == 0)
+			continue;
+
+		if (c->len == cap) {
+			cap *= 2;
+			c->lines = realloc (c->lines, cap * sizeof (char *));
+			c->lens = realloc (c->lens, cap * sizeof (size_t));
+		}
+		c->lines[c->len] = line;
+		c->lens[c->len] = len;
+		c->len++;
+	}
+
+	return c->len > 0 ? 0 : -1;
+}
+
+static irc_msg *
+parse_line (const char *line, size_t len)
+{
+	irc_msg *msg = alloc_msg_sized (len);
+	if (msg == NULL)
+		return NULL;
+
+	if (!ircmsg_parse ((const uint8_t *)line, len, &parse_cbs, msg) || msg->command == NULL) {
+		irc_msg_unref (msg);
+		return NULL;
+	}
+
+	return msg;
+}
+
+static size_t
+serialize (const irc_msg *msg)
+{
+	void *user_data = (irc_msg *)msg;
+	size_t len = ircmsg_serialize_buffer_len (&serializer_cbs, user_data);
+	if (len > sizeof (out) || !ircmsg_serialize (out, len, &serializer_cbs, user_data))
+		return 0;
+
+	return len;
+}
+
+static double
+now (void)
+{
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+report (const char *stage, size_t msgs, double secs, size_t allocs)
+{
+	printf ("%-10s %12.0f msgs/s %9.1f ns/msg %7.2f allocs/msg\n",
+		stage,
+		msgs / secs,
+		secs * 1e9 / msgs,
+		(double)allocs / msgs);
+}
+
+int
+main (int argc, char **argv)
+{
+	const char *path = argc > 1 ? argv[1] : BENCH_CORPUS;
+	long rounds = argc > 2 ? strtol (argv[2], NULL, 10) : BENCH_DEFAULT_ROUNDS;
+	if (rounds <= 0)
+		rounds = BENCH_DEFAULT_ROUNDS;
+
+	corpus c;
+	if (load_corpus (path, &c) < 0) {
+		fprintf (stderr, "Couldn't load a corpus from %s\n", path);
+		return 1;
+	}
+
+	irc_server server = { .name = "bench" };
+	init_hooks ();
+	add_hook ("*", count_hook);
+	add_hook ("PRIVMSG", privmsg_hook);
+	add_hook ("353", count_hook);
+	add_hook ("PING", count_hook);
+
+	irc_msg **parsed = malloc (c.len * sizeof (irc_msg *));
+	for (size_t i = 0; i < c.len; ++i) {
+		parsed[i] = parse_line (c.lines[i], c.lens[i]);
+		if (parsed[i] == NULL) {
+			fprintf (stderr, "Couldn't parse line %zu: %s\n", i + 1, c.lines[i]);
+			return 1;
+		}
+	}
+
+	size_t msgs = c.len * rounds;
+	size_t bytes = 0;
+	printf ("%zu lines, %ld rounds\n", c.len, rounds);
+
+	size_t allocs = allocations;
+	double start = now ();
+	for (long r = 0; r < rounds; ++r)
+		for (size_t i = 0; i < c.len; ++i)
+			irc_msg_unref (parse_line (c.lines[i], c.lens[i]));
+	report ("parse", msgs, now () - start, allocations - allocs);
+
+	allocs = allocations;
+	start = now ();
+	for (long r = 0; r < rounds; ++r)
+		for (size_t i = 0; i < c.len; ++i)
+			exec_message_hooks (&server, parsed[i]);
+	report ("dispatch", msgs, now () - start, allocations - allocs);
+
+	allocs = allocations;
+	start = now ();
+	for (long r = 0; r < rounds; ++r)
+		for (size_t i = 0; i < c.len; ++i)
+			bytes += serialize (parsed[i]);
+	report ("serialize", msgs, now () - start, allocations - allocs);
+
+	allocs = allocations;
+	start = now ();
+	for (long r = 0; r < rounds; ++r)
+		for (size_t i = 0; i < c.len; ++i) {
+			irc_msg *msg = parse_line (c.lines[i], c.lens[i]);
+			exec_message_hooks (&server, msg);
+			bytes += serialize (msg);
+			irc_msg_unref (msg);
+		}
+	report ("all", msgs, now () - start, allocations - allocs);
+
+	/* Keeps the work from being optimized out */
+	fprintf (stderr, "%zu hooks run, %zu bytes serialized\n", dispatched, bytes);
+
+	for (size_t i = 0; i < c.len; ++i)
+		irc_msg_unref (parsed[i]);
+	free (parsed);
+	free (c.lines);
+	free (c.lens);
+	free (c.data);
+	return 0;
+}
@@ -0,0 +1,658 @@
+/*
+ * A scripted ircd for load testing circ end to end. It takes one client,
+ * registers it (with SASL PLAIN if the client asks for it), and once the
+ * client has joined every flood channel it sends it PRIVMSGs of the form
+ *
+ *   :loadN!load@mock.test PRIVMSG #loadK :%echo <seq>
+ *
+ * round-robin over the channels at a fixed rate. Replies whose text starts
+ * with a sequence number are matched to the message that triggered them,
+ * and the command-to-reply latency and throughput are reported at the end.
+ *
+ *   mock_ircd [-p port] [-t cert,key] [-c channels] [-r msgs/s] [-n msgs]
+ *             [-x command] [-s] [-w drain secs] [-R capture.idx]
+ *
+ * -s holds registration until CAP END, the way servers do while SASL is
+ * being negotiated. -R plays the server lines of a capture circ recorded
+ * (see capture_dir in the config) instead of the flood, at the pace they
+ * were captured at, and only counts the replies. See bench/run_load.sh
+ * for running it against circ.
+ */
+#include <arpa/inet.h>
+#include <errno.h>
+#include <ev.h>
+#include <fcntl.h>
+#include <gnutls/gnutls.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "irc/capture.h"
+
+#define MOCK_NAME "mock.test"
+#define MOCK_LINE_MAX 8192
+/* How often the flood timer tops up to the configured rate */
+#define MOCK_TICK 0.001
+
+typedef struct mock_opts
+{
+	int port;
+	const char *cert;
+	const char *key;
+	int channels;
+	double rate;
+	size_t count;
+	const char *command;
+	bool hold_for_cap;
+	double drain;
+	const char *replay;
+} mock_opts;
+
+typedef struct mock_client
+{
+	int fd;
+	gnutls_session_t tls;
+	ev_io io;
+	char buf[MOCK_LINE_MAX * 2];
+	size_t len;
+	char nick[64];
+	bool got_nick;
+	bool got_user;
+	bool in_cap;
+	bool registered;
+	int joined;
+} mock_client;
+
+static mock_opts opts = {
+	.port = 6667,
+	.channels = 1,
+	.rate = 1000,
+	.count = 10000,
+	.command = "%echo",
+	.drain = 5,
+};
+
+static gnutls_certificate_credentials_t creds;
+static mock_client *client;
+static ev_io accept_watcher;
+static ev_timer flood_timer;
+static ev_timer drain_timer;
+
+static double *sent_at;
+static double *latency;
+static size_t sent;
+static size_t answered;
+static size_t unmatched;
+static double flood_start;
+static double last_reply;
+
+static irc_capture_reader capture;
+static irc_capture_record captured;
+static bool have_captured;
+static uint64_t capture_first_ts;
+static size_t replies;
+
+static void
+finish (struct ev_loop *loop);
+
+static int
+write_all (mock_client *c, const char *data, size_t len)
+{
+	while (len > 0) {
+		ssize_t n = c->tls != NULL ? gnutls_record_send (c->tls, data, len)
+					   : write (c->fd, data, len);
+		if (n < 0) {
+			bool again = c->tls != NULL ? n == GNUTLS_E_AGAIN || n == GNUTLS_E_INTERRUPTED
+						    : errno == EAGAIN || errno == EINTR;
+			if (!again)
+				return -1;
+
+			/* The bot is behind, waiting here is part of what's measured */
+			struct pollfd pfd = { .fd = c->fd, .events = POLLOUT };
+			poll (&pfd, 1, -1);
+			continue;
+		}
+
+		data += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static void
+send_line (mock_client *c, const char *fmt, ...)
+{
+	char line[MOCK_LINE_MAX];
+	va_list ap;
+	va_start (ap, fmt);
+	int len = vsnprintf (line, sizeof (line) - 2, fmt, ap);
+	va_end (ap);
+
+	if (len < 0)
+		return;
+	if ((size_t)len > sizeof (line) - 3)
+		len = sizeof (line) - 3;
+	line[len++] = '\r';
+	line[len++] = '\n';
+
+	if (write_all (c, line, len) < 0)
+		perror ("write");
+}
+
+static void
+try_register (mock_client *c)
+{
+	if (c->registered || !c->got_nick || !c->got_user || c->in_cap)
+		return;
+
+	const char *n = c->nick;
+	send_line (c, ":" MOCK_NAME " 001 %s :Welcome to the mock network %s", n, n);
+	send_line (c, ":" MOCK_NAME " 002 %s :Your host is " MOCK_NAME, n);
+	send_line (c, ":" MOCK_NAME " 003 %s :This server was created just now", n);
+	send_line (c, ":" MOCK_NAME " 004 %s " MOCK_NAME " mock-1.0 io ov", n);
+	send_line (c,
+		   ":" MOCK_NAME " 005 %s CHANTYPES=# PREFIX=(ov)@+ NETWORK=Mock "
+		   ":are supported by this server",
+		   n);
+	send_line (c, ":" MOCK_NAME " 375 %s :- " MOCK_NAME " Message of the day -", n);
+	send_line (c, ":" MOCK_NAME " 376 %s :End of /MOTD command.", n);
+	c->registered = true;
+}
+
+static void
+flood_cb (struct ev_loop *loop, ev_timer *w, int revents)
+{
+	double now = ev_now (loop);
+	size_t due = (size_t)((now - flood_start) * opts.rate) + 1;
+	if (due > opts.count)
+		due = opts.count;
+
+	for (; sent < due; ++sent) {
+		sent_at[sent] = ev_time ();
+		send_line (client,
+			   ":load%zu!load@" MOCK_NAME " PRIVMSG #load%zu :%s %zu",
+			   sent % 100,
+			   sent % opts.channels + 1,
+			   opts.command,
+			   sent);
+	}
+
+	if (sent == opts.count) {
+		ev_timer_stop (loop, w);
+		ev_timer_set (&drain_timer, opts.drain, 0.);
+		ev_timer_start (loop, &drain_timer);
+	}
+}
+
+/* Send the captured server lines that are due, like flood_cb */
+static void
+replay_cb (struct ev_loop *loop, ev_timer *w, int revents)
+{
+	double now = ev_now (loop);
+
+	for (;;) {
+		if (!have_captured && !irc_capture_next (&capture, &captured)) {
+			ev_timer_stop (loop, w);
+			ev_timer_set (&drain_timer, opts.drain, 0.);
+			ev_timer_start (loop, &drain_timer);
+			return;
+		}
+		have_captured = true;
+
+		if (captured.dir != IRC_CAPTURE_IN) {
+			have_captured = false;
+			continue;
+		}
+
+		if (sent == 0)
+			capture_first_ts = captured.ts_ns;
+		if (flood_start + (captured.ts_ns - capture_first_ts) / 1e9 > now)
+			return;
+
+		if (write_all (client, captured.line, captured.len) < 0)
+			perror ("write");
+		have_captured = false;
+		sent++;
+	}
+}
+
+static void
+drain_cb (struct ev_loop *loop, ev_timer *w, int revents)
+{
+	finish (loop);
+}
+
+static void
+start_flood (struct ev_loop *loop)
+{
+	if (opts.replay != NULL) {
+		fprintf (stderr, "Joined %d channels, replaying %s\n", client->joined, opts.replay);
+		ev_now_update (loop);
+		flood_start = ev_now (loop);
+		ev_timer_init (&flood_timer, replay_cb, 0., MOCK_TICK);
+		ev_timer_start (loop, &flood_timer);
+		return;
+	}
+
+	fprintf (stderr, "Joined %d channels, flooding %zu messages at %.0f/s\n",
+		 client->joined,
+		 opts.count,
+		 opts.rate);
+
+	ev_now_update (loop);
+	flood_start = ev_now (loop);
+	ev_timer_init (&flood_timer, flood_cb, 0., MOCK_TICK);
+	ev_timer_start (loop, &flood_timer);
+}
+
+static void
+got_reply (struct ev_loop *loop, const char *text)
+{
+	/* Nothing to match replies to a capture with */
+	if (opts.replay != NULL) {
+		last_reply = ev_time ();
+		replies++;
+		return;
+	}
+
+	char *end;
+	unsigned long long seq = strtoull (text, &end, 10);
+	if (end == text || seq >= sent || sent_at[seq] == 0) {
+		unmatched++;
+		return;
+	}
+
+	last_reply = ev_time ();
+	latency[answered++] = last_reply - sent_at[seq];
+	/* Only the first reply to a message counts */
+	sent_at[seq] = 0;
+
+	if (answered == opts.count)
+		finish (loop);
+}
+
+/*
+ * Split line into the command and up to 15 params, the last one may be a
+ * trailing one. Tags and the prefix are skipped, clients don't send much
+ * of either.
+ */
+static int
+split_line (char *line, char **params, int max)
+{
+	int n = 0;
+	if (*line == '@' && (line = strchr (line, ' ')) != NULL)
+		while (*line == ' ')
+			line++;
+	if (line != NULL && *line == ':' && (line = strchr (line, ' ')) != NULL)
+		while (*line == ' ')
+			line++;
+
+	while (line != NULL && *line != '\0' && n < max) {
+		if (*line == ':' && n > 0) {
+			params[n++] = line + 1;
+			break;
+		}
+
+		params[n++] = line;
+		if ((line = strchr (line, ' ')) != NULL) {
+			*line++ = '\0';
+			while (*line == ' ')
+				line++;
+		}
+	}
+
+	return n;
+}
+
+static void
+handle_line (struct ev_loop *loop, mock_client *c, char *line)
+{
+	char *p[16];
+	int n = split_line (line, p, 16);
+	if (n == 0)
+		return;
+
+	const char *cmd = p[0];
+	if (strcasecmp (cmd, "PRIVMSG") == 0 && n > 2) {
+		got_reply (loop, p[2]);
+	} else if (strcasecmp (cmd, "PING") == 0) {
+		send_line (c, ":" MOCK_NAME " PONG " MOCK_NAME " :%s", n > 1 ? p[1] : "");
+	} else if (strcasecmp (cmd, "CAP") == 0 && n > 1) {
+		if (strcasecmp (p[1], "LS") == 0) {
+			c->in_cap = true;
+			send_line (c, ":" MOCK_NAME " CAP * LS :sasl");
+		} else if (strcasecmp (p[1], "REQ") == 0) {
+			c->in_cap = opts.hold_for_cap;
+			send_line (c, ":" MOCK_NAME " CAP * ACK :%s", n > 2 ? p[2] : "");
+		} else if (strcasecmp (p[1], "END") == 0) {
+			c->in_cap = false;
+			try_register (c);
+		}
+	} else if (strcasecmp (cmd, "AUTHENTICATE") == 0 && n > 1) {
+		if (strcmp (p[1], "PLAIN") == 0) {
+			send_line (c, "AUTHENTICATE +");
+		} else {
+			/* Any credentials do */
+			const char *nick = c->got_nick ? c->nick : "*";
+			send_line (c,
+				   ":" MOCK_NAME " 900 %s %s!u@" MOCK_NAME " %s :You are now logged in",
+				   nick,
+				   nick,
+				   nick);
+			send_line (c, ":" MOCK_NAME " 903 %s :SASL authentication successful", nick);
+		}
+	} else if (strcasecmp (cmd, "NICK") == 0 && n > 1) {
+		snprintf (c->nick, sizeof (c->nick), "%s", p[1]);
+		c->got_nick = true;
+		try_register (c);
+	} else if (strcasecmp (cmd, "USER") == 0) {
+		c->got_user = true;
+		try_register (c);
+	} else if (strcasecmp (cmd, "JOIN") == 0 && n > 1 && c->registered) {
+		for (char *save, *chan = strtok_r (p[1], ",", &save); chan != NULL;
+		     chan = strtok_r (NULL, ",", &save)) {
+			send_line (c, ":%s!u@" MOCK_NAME " JOIN %s", c->nick, chan);
+			send_line (c, ":" MOCK_NAME " 353 %s = %s :%s", c->nick, chan, c->nick);
+			send_line (c, ":" MOCK_NAME " 366 %s %s :End of /NAMES list.", c->nick, chan);
+			if (strncmp (chan, "#load", 5) == 0)
+				c->joined++;
+		}
+
+		if (c->joined == opts.channels && !ev_is_active (&flood_timer) && sent == 0)
+			start_flood (loop);
+	} else if (strcasecmp (cmd, "QUIT") == 0) {
+		finish (loop);
+	}
+}
+
+static void
+client_cb (struct ev_loop *loop, ev_io *w, int revents)
+{
+	mock_client *c = w->data;
+
+	for (;;) {
+		if (c->len == sizeof (c->buf)) {
+			/* A line longer than the buffer, nothing sane sends that */
+			c->len = 0;
+		}
+
+		ssize_t n = c->tls != NULL ? gnutls_record_recv (c->tls, c->buf + c->len,
+								sizeof (c->buf) - c->len)
+					   : read (c->fd, c->buf + c->len, sizeof (c->buf) - c->len);
+		if (n < 0) {
+			if (c->tls != NULL ? n == GNUTLS_E_AGAIN || n == GNUTLS_E_INTERRUPTED
+					   : errno == EAGAIN || errno == EINTR)
+				return;
+		}
+		if (n <= 0) {
+			fprintf (stderr, "Client disconnected\n");
+			finish (loop);
+			return;
+		}
+		c->len += n;
+
+		char *start = c->buf;
+		char *end;
+		while ((end = memchr (start, '\n', c->buf + c->len - start)) != NULL) {
+			*end = '\0';
+			if (end > start && end[-1] == '\r')
+				end[-1] = '\0';
+			handle_line (loop, c, start);
+			if (client == NULL)
+				return;
+			start = end + 1;
+		}
+
+		c->len -= start - c->buf;
+		memmove (c->buf, start, c->len);
+	}
+}
+
+static void
+accept_cb (struct ev_loop *loop, ev_io *w, int revents)
+{
+	int fd = accept (w->fd, NULL, NULL);
+	if (fd < 0)
+		return;
+
+	int one = 1;
+	setsockopt (fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof (one));
+
+	mock_client *c = calloc (1, sizeof (mock_client));
+	c->fd = fd;
+
+	if (creds != NULL) {
+		gnutls_init (&c->tls, GNUTLS_SERVER);
+		gnutls_set_default_priority (c->tls);
+		gnutls_credentials_set (c->tls, GNUTLS_CRD_CERTIFICATE, creds);
+		gnutls_certificate_server_set_request (c->tls, GNUTLS_CERT_IGNORE);
+		gnutls_transport_set_int (c->tls, fd);
+
+		/* Still blocking, nothing else is going on yet */
+		int ret;
+		do {
+			ret = gnutls_handshake (c->tls);
+		} while (ret < 0 && gnutls_error_is_fatal (ret) == 0);
+
+		if (ret < 0) {
+			fprintf (stderr, "TLS handshake failed: %s\n", gnutls_strerror (ret));
+			gnutls_deinit (c->tls);
+			close (fd);
+			free (c);
+			return;
+		}
+	}
+
+	fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK);
+
+	/* One client per run, the numbers mean nothing otherwise */
+	ev_io_stop (loop, w);
+	client = c;
+	ev_io_init (&c->io, client_cb, fd, EV_READ);
+	c->io.data = c;
+	ev_io_start (loop, &c->io);
+	fprintf (stderr, "Client connected%s\n", c->tls != NULL ? " over TLS" : "");
+}
+
+static int
+compare_doubles (const void *a, const void *b)
+{
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+static double
+percentile (double p)
+{
+	size_t i = (size_t)(p * answered);
+	return latency[i < answered ? i : answered - 1] * 1e3;
+}
+
+static void
+report (void)
+{
+	if (opts.replay != NULL) {
+		printf ("replayed %zu lines over %.3fs, %zu replies\n",
+			sent,
+			(last_reply > flood_start ? last_reply : ev_time ()) - flood_start,
+			replies);
+		return;
+	}
+
+	printf ("channels %d, sent %zu, answered %zu, lost %zu, unmatched %zu\n",
+		opts.channels,
+		sent,
+		answered,
+		sent - answered,
+		unmatched);
+	if (answered == 0)
+		return;
+
+	qsort (latency, answered, sizeof (double), compare_doubles);
+	printf ("latency ms: p50 %.3f  p99 %.3f  p999 %.3f  max %.3f\n",
+		percentile (0.5),
+		percentile (0.99),
+		percentile (0.999),
+		latency[answered - 1] * 1e3);
+
+	double secs = last_reply - flood_start;
+	if (secs > 0)
+		printf ("throughput: %.0f replies/s over %.3fs (offered %.0f/s)\n",
+			answered / secs,
+			secs,
+			opts.rate);
+}
+
+static void
+finish (struct ev_loop *loop)
+{
+	if (client != NULL) {
+		ev_io_stop (loop, &client->io);
+		if (client->tls != NULL) {
+			gnutls_bye (client->tls, GNUTLS_SHUT_WR);
+			gnutls_deinit (client->tls);
+		}
+		close (client->fd);
+		free (client);
+		client = NULL;
+	}
+
+	ev_timer_stop (loop, &flood_timer);
+	ev_timer_stop (loop, &drain_timer);
+	ev_break (loop, EVBREAK_ALL);
+}
+
+static void
+usage (const char *prog)
+{
+	fprintf (stderr,
+		 "usage: %s [-p port] [-t cert,key] [-c channels] [-r msgs/s] [-n msgs]\n"
+		 "          [-x command] [-s] [-w drain secs] [-R capture.idx]\n",
+		 prog);
+	exit (2);
+}
+
+static void
+parse_opts (int argc, char **argv)
+{
+	int opt;
+	while ((opt = getopt (argc, argv, "p:t:c:r:n:x:sw:R:")) != -1) {
+		switch (opt) {
+		case 'p':
+			opts.port = atoi (optarg);
+			break;
+		case 't': {
+			char *comma = strchr (optarg, ',');
+			if (comma == NULL)
+				usage (argv[0]);
+			*comma = '\0';
+			opts.cert = optarg;
+			opts.key = comma + 1;
+			break;
+		}
+		case 'c':
+			opts.channels = atoi (optarg);
+			break;
+		case 'r':
+			opts.rate = strtod (optarg, NULL);
+			break;
+		case 'n':
+			opts.count = strtoull (optarg, NULL, 10);
+			break;
+		case 'x':
+			opts.command = optarg;
+			break;
+		case 's':
+			opts.hold_for_cap = true;
+			break;
+		case 'w':
+			opts.drain = strtod (optarg, NULL);
+			break;
+		case 'R':
+			opts.replay = optarg;
+			break;
+		default:
+			usage (argv[0]);
+		}
+	}
+
+	if (opts.channels <= 0 || opts.rate <= 0 || opts.count == 0)
+		usage (argv[0]);
+}
+
+int
+main (int argc, char **argv)
+{
+	parse_opts (argc, argv);
+
+	if (opts.cert != NULL) {
+		gnutls_global_init ();
+		gnutls_certificate_allocate_credentials (&creds);
+		int ret = gnutls_certificate_set_x509_key_file (creds,
+								opts.cert,
+								opts.key,
+								GNUTLS_X509_FMT_PEM);
+		if (ret < 0) {
+			fprintf (stderr, "Couldn't load %s: %s\n", opts.cert, gnutls_strerror (ret));
+			return 1;
+		}
+	}
+
+	if (opts.replay != NULL && irc_capture_reader_open (&capture, opts.replay, 0) == -1) {
+		perror (opts.replay);
+		return 1;
+	}
+
+	sent_at = calloc (opts.count, sizeof (double));
+	latency = calloc (opts.count, sizeof (double));
+	if (sent_at == NULL || latency == NULL) {
+		perror ("calloc");
+		return 1;
+	}
+
+	int fd = socket (AF_INET, SOCK_STREAM, 0);
+	int one = 1;
+	setsockopt (fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof (one));
+
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_port = htons (opts.port),
+		.sin_addr.s_addr = htonl (INADDR_LOOPBACK),
+	};
+	if (bind (fd, (struct sockaddr *)&addr, sizeof (addr)) < 0 || listen (fd, 1) < 0) {
+		perror ("bind");
+		return 1;
+	}
+
+	struct ev_loop *loop = EV_DEFAULT;
+	ev_io_init (&accept_watcher, accept_cb, fd, EV_READ);
+	ev_io_start (loop, &accept_watcher);
+	ev_init (&flood_timer, flood_cb);
+	ev_init (&drain_timer, drain_cb);
+	fprintf (stderr, "Listening on 127.0.0.1:%d\n", opts.port);
+
+	ev_run (loop, 0);
+
+	report ();
+
+	close (fd);
+	if (opts.replay != NULL)
+		irc_capture_reader_close (&capture);
+	free (sent_at);
+	free (latency);
+	if (creds != NULL) {
+		gnutls_certificate_free_credentials (creds);
+		gnutls_global_deinit ();
+	}
+	return 0;
+}
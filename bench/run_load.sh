@@ -0,0 +1,128 @@
+#!/bin/sh
+# End to end load test: runs circ against bench/mock_ircd on localhost and
+# prints the command-to-reply latency and throughput mock_ircd measured.
+#
+#   bench/run_load.sh [-b build dir] [-c channels] [-m modules] [-r msgs/s]
+#                     [-n msgs] [-t] [-S]
+#
+# -m is the number of loaded modules. One of them is echo.scm, the replies
+# of which are measured, the rest hook every PRIVMSG and look at it the way
+# a typical module does, so the dispatch cost grows with it. -t connects
+# over TLS with a throwaway certificate, -S goes through SASL first.
+#
+# Build circ and mock_ircd first: `make circ mock_ircd` in the build dir.
+set -e
+
+src=$(cd "$(dirname "$0")/.." && pwd)
+build=$src/build
+channels=1
+modules=1
+rate=1000
+count=10000
+tls=false
+sasl=false
+port=16667
+
+while getopts b:c:m:r:n:tS opt; do
+	case $opt in
+	b) build=$(cd "$OPTARG" && pwd) ;;
+	c) channels=$OPTARG ;;
+	m) modules=$OPTARG ;;
+	r) rate=$OPTARG ;;
+	n) count=$OPTARG ;;
+	t) tls=true ;;
+	S) sasl=true ;;
+	*) sed -n '4,5p' "$0" >&2; exit 2 ;;
+	esac
+done
+
+for bin in circ mock_ircd; do
+	if [ ! -x "$build/$bin" ]; then
+		echo "No $build/$bin, build it or pass -b" >&2
+		exit 1
+	fi
+done
+
+work=$(mktemp -d)
+trap 'kill $circ_pid 2>/dev/null; rm -rf "$work"' EXIT INT TERM
+
+# circ reads its config, modules and scheme libraries relative to its cwd
+ln -s "$build/chibi-scheme" "$work/chibi-scheme"
+ln -s "$src/scheme_libs" "$work/scheme_libs"
+mkdir "$work/scheme_mods"
+cp "$src/scheme_mods/echo.scm" "$work/scheme_mods/"
+
+i=1
+while [ "$i" -lt "$modules" ]; do
+	cat >"$work/scheme_mods/load$i.scm" <<-'EOF'
+		(load "scheme_libs/privmsg.scm")
+
+		(define (look)
+		  (let ((nick (get-nick))
+		        (text (cadr (get-message-params))))
+		    (string-length text)))
+
+		(register-hook "PRIVMSG" look)
+	EOF
+	i=$((i + 1))
+done
+
+chans=""
+i=1
+while [ "$i" -le "$channels" ]; do
+	chans="$chans${chans:+, }\"#load$i\""
+	i=$((i + 1))
+done
+
+ircd_opts="-p $port -c $channels -r $rate -n $count"
+if $tls; then
+	openssl req -x509 -newkey rsa:2048 -nodes -days 1 -subj /CN=mock.test \
+		-keyout "$work/key.pem" -out "$work/cert.pem" 2>/dev/null
+	ircd_opts="$ircd_opts -t $work/cert.pem,$work/key.pem"
+fi
+if $sasl; then
+	ircd_opts="$ircd_opts -s"
+fi
+
+# The flood limits are out of the way, the numbers are about circ
+cat >"$work/config.json" <<EOF
+{
+	"debug": false,
+	"cmd_prefix": "%",
+	"db_path": "db.sqlite",
+	"scheme_mod_dir": "./scheme_mods/",
+	"servers": [
+		{
+			"name": "Mock",
+			"host": "127.0.0.1",
+			"port": "$port",
+			"secure": $tls,
+			"flood": {
+				"burst": 1000000,
+				"rate": 1000000.0
+			},
+			"channels": [$chans],
+			"user": {
+				"nickname": "circ",
+				"ident": "circ",
+				"realname": "circ load test",
+				"sasl_enabled": $sasl,
+				"sasl_user": "circ",
+				"sasl_pass": "circ"
+			}
+		}
+	],
+	"modules": []
+}
+EOF
+
+echo "channels $channels, modules $modules, rate $rate/s, $count msgs, tls $tls, sasl $sasl"
+
+"$build/mock_ircd" $ircd_opts &
+ircd_pid=$!
+sleep 0.2
+
+(cd "$work" && exec "$build/circ" >"$work/circ.log" 2>&1) &
+circ_pid=$!
+
+wait $ircd_pid
@@ -0,0 +1,89 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "irc/buffer.h"
+
+#define IRC_BUFFER_MIN_CAP 4096
+
+void
+irc_buffer_init (irc_buffer *b)
+{
+	b->data = NULL;
+	b->head = 0;
+	b->tail = 0;
+	b->cap = 0;
+}
+
+void
+irc_buffer_free (irc_buffer *b)
+{
+	free (b->data);
+	irc_buffer_init (b);
+}
+
+void
+irc_buffer_clear (irc_buffer *b)
+{
+	b->head = 0;
+	b->tail = 0;
+}
+
+char *
+irc_buffer_reserve (irc_buffer *b, size_t n)
+{
+	if (b->cap - b->tail >= n)
+		return b->data + b->tail;
+
+	/* Reuse the consumed space at the front before growing */
+	size_t len = b->tail - b->head;
+	if (b->head > 0 && b->cap - len >= n) {
+		memmove (b->data, b->data + b->head, len);
+		b->head = 0;
+		b->tail = len;
+		return b->data + b->tail;
+	}
+
+	size_t cap = b->cap > 0 ? b->cap : IRC_BUFFER_MIN_CAP;
+	while (cap - len < n)
+		cap *= 2;
+
+	char *data = malloc (cap);
+	if (data == NULL)
+		return NULL;
+
+	if (len > 0)
+		memcpy (data, b->data + b->head, len);
+	free (b->data);
+
+	b->data = data;
+	b->head = 0;
+	b->tail = len;
+	b->cap = cap;
+	return b->data + b->tail;
+}
+
+void
+irc_buffer_commit (irc_buffer *b, size_t n)
+{
+	b->tail += n;
+}
+
+int
+irc_buffer_append (irc_buffer *b, const char *data, size_t n)
+{
+	char *dst = irc_buffer_reserve (b, n);
+	if (dst == NULL)
+		return -1;
+
+	memcpy (dst, data, n);
+	irc_buffer_commit (b, n);
+	return 0;
+}
+
+void
+irc_buffer_consume (irc_buffer *b, size_t n)
+{
+	b->head += n;
+	if (b->head >= b->tail)
+		irc_buffer_clear (b);
+}
@@ -0,0 +1,392 @@
+#include "irc/capture.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CAPTURE_MAGIC "CIRCCAP"
+#define CAPTURE_INDEX_MAGIC "CIRCIDX"
+#define CAPTURE_VERSION 1
+/* Capture time between index entries */
+#define CAPTURE_INDEX_INTERVAL_NS 1000000000ull
+
+/* Everything in the files is 8 byte aligned and in host byte order */
+typedef struct capture_segment_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t seq;
+	uint64_t started; /* CLOCK_REALTIME ns, for people reading it */
+	uint64_t used;	  /* bytes of records after the header */
+} capture_segment_header;
+
+typedef struct capture_record_header
+{
+	uint64_t ts_ns;
+	uint32_t len;
+	uint8_t dir;
+	uint8_t reserved[3];
+} capture_record_header;
+
+typedef struct capture_index_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t reserved;
+	uint64_t started;
+	char server[IRC_CAPTURE_SERVER_LEN];
+} capture_index_header;
+
+typedef struct capture_index_entry
+{
+	uint64_t ts_ns;
+	uint32_t seq;
+	uint32_t reserved;
+	uint64_t offset; /* of a record, from the end of the segment header */
+} capture_index_entry;
+
+#define CAPTURE_ALIGN(n) (((n) + 7) & ~(size_t)7)
+
+static uint64_t
+capture_clock (clockid_t clock)
+{
+	struct timespec ts;
+	clock_gettime (clock, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static char *
+capture_segment_path (const char *base, uint32_t seq)
+{
+	size_t len = strlen (base) + sizeof (".000000.cap") + 4;
+	char *path = malloc (len);
+	if (path != NULL)
+		snprintf (path, len, "%s.%06u.cap", base, seq);
+	return path;
+}
+
+static int
+capture_write_all (int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	while (len > 0) {
+		ssize_t n = write (fd, p, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static capture_segment_header *
+capture_header (char *seg)
+{
+	return (capture_segment_header *)seg;
+}
+
+/* Create, size and map segment cap->seq */
+static int
+capture_start_segment (irc_capture *cap)
+{
+	char *path = capture_segment_path (cap->base, cap->seq);
+	if (path == NULL)
+		return -1;
+
+	int fd = open (path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+	free (path);
+	if (fd < 0)
+		return -1;
+
+	if (ftruncate (fd, IRC_CAPTURE_SEGMENT_SIZE) < 0) {
+		close (fd);
+		return -1;
+	}
+
+	char *seg = mmap (NULL, IRC_CAPTURE_SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (seg == MAP_FAILED) {
+		close (fd);
+		return -1;
+	}
+
+	capture_segment_header *h = capture_header (seg);
+	memcpy (h->magic, CAPTURE_MAGIC, sizeof (h->magic));
+	h->version = CAPTURE_VERSION;
+	h->seq = cap->seq;
+	h->started = capture_clock (CLOCK_REALTIME);
+	h->used = 0;
+
+	cap->seg_fd = fd;
+	cap->seg = seg;
+	/* Index the first line of every segment */
+	cap->next_index_ns = 0;
+	return 0;
+}
+
+/* Unmap the current segment and cut it down to what was written */
+static void
+capture_end_segment (irc_capture *cap)
+{
+	if (cap->seg == NULL)
+		return;
+
+	off_t size = sizeof (capture_segment_header) + capture_header (cap->seg)->used;
+	munmap (cap->seg, IRC_CAPTURE_SEGMENT_SIZE);
+	/* If this fails the file keeps its zeroes, the header says where the end is */
+	(void)!ftruncate (cap->seg_fd, size);
+	close (cap->seg_fd);
+	cap->seg = NULL;
+	cap->seg_fd = -1;
+}
+
+int
+irc_capture_open (irc_capture *cap, const char *dir, const char *server)
+{
+	uint64_t now = capture_clock (CLOCK_REALTIME);
+	time_t secs = now / 1000000000ull;
+	struct tm tm;
+	char stamp[32];
+	gmtime_r (&secs, &tm);
+	strftime (stamp, sizeof (stamp), "%Y%m%d-%H%M%S", &tm);
+
+	size_t len = strlen (dir) + strlen (server) + strlen (stamp) + 3;
+	cap->base = malloc (len);
+	if (cap->base == NULL)
+		return -1;
+	snprintf (cap->base, len, "%s/%s-%s", dir, server, stamp);
+	/* Server names are ours to pick, but not every one makes a file name */
+	for (char *p = cap->base + strlen (dir) + 1; *p != '\0'; p++)
+		if (*p == '/')
+			*p = '_';
+
+	char *index_path = malloc (len + 4);
+	if (index_path == NULL) {
+		free (cap->base);
+		return -1;
+	}
+	snprintf (index_path, len + 4, "%s.idx", cap->base);
+	cap->index_fd = open (index_path, O_WRONLY | O_CREAT | O_EXCL | O_APPEND | O_CLOEXEC, 0644);
+	free (index_path);
+	if (cap->index_fd < 0) {
+		free (cap->base);
+		return -1;
+	}
+
+	capture_index_header h = { .version = CAPTURE_VERSION, .started = now };
+	memcpy (h.magic, CAPTURE_INDEX_MAGIC, sizeof (h.magic));
+	snprintf (h.server, sizeof (h.server), "%s", server);
+
+	cap->start_ns = capture_clock (CLOCK_MONOTONIC);
+	cap->seq = 0;
+	cap->seg = NULL;
+	cap->seg_fd = -1;
+	if (capture_write_all (cap->index_fd, &h, sizeof (h)) == -1 || capture_start_segment (cap) == -1) {
+		int saved = errno;
+		close (cap->index_fd);
+		free (cap->base);
+		errno = saved;
+		return -1;
+	}
+
+	return 0;
+}
+
+int
+irc_capture_append (irc_capture *cap, irc_capture_dir dir, const char *line, size_t len)
+{
+	if (cap->seg == NULL)
+		return -1;
+
+	const size_t room = IRC_CAPTURE_SEGMENT_SIZE - sizeof (capture_segment_header);
+	size_t need = CAPTURE_ALIGN (sizeof (capture_record_header) + len);
+	if (need > room)
+		return 0;
+
+	capture_segment_header *h = capture_header (cap->seg);
+	if (h->used + need > room) {
+		capture_end_segment (cap);
+		cap->seq++;
+		if (capture_start_segment (cap) == -1)
+			return -1;
+		h = capture_header (cap->seg);
+	}
+
+	uint64_t ts = capture_clock (CLOCK_MONOTONIC) - cap->start_ns;
+	if (ts >= cap->next_index_ns) {
+		capture_index_entry e = { .ts_ns = ts, .seq = cap->seq, .offset = h->used };
+		if (capture_write_all (cap->index_fd, &e, sizeof (e)) == -1) {
+			capture_end_segment (cap);
+			return -1;
+		}
+		cap->next_index_ns = ts + CAPTURE_INDEX_INTERVAL_NS;
+	}
+
+	char *at = cap->seg + sizeof (capture_segment_header) + h->used;
+	capture_record_header *r = (capture_record_header *)at;
+	r->ts_ns = ts;
+	r->len = len;
+	r->dir = dir;
+	memcpy (at + sizeof (*r), line, len);
+
+	/* Last, so the header never covers a half written line */
+	h->used += need;
+	return 0;
+}
+
+void
+irc_capture_close (irc_capture *cap)
+{
+	capture_end_segment (cap);
+	close (cap->index_fd);
+	free (cap->base);
+}
+
+/* Map segment r->seq for reading */
+static int
+capture_map_segment (irc_capture_reader *r)
+{
+	char *path = capture_segment_path (r->base, r->seq);
+	if (path == NULL)
+		return -1;
+
+	int fd = open (path, O_RDONLY | O_CLOEXEC);
+	free (path);
+	if (fd < 0)
+		return -1;
+
+	struct stat st;
+	if (fstat (fd, &st) < 0 || (size_t)st.st_size < sizeof (capture_segment_header)) {
+		close (fd);
+		return -1;
+	}
+
+	char *seg = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close (fd);
+	if (seg == MAP_FAILED)
+		return -1;
+
+	capture_segment_header *h = capture_header (seg);
+	if (memcmp (h->magic, CAPTURE_MAGIC, sizeof (h->magic)) != 0 || h->version != CAPTURE_VERSION) {
+		munmap (seg, st.st_size);
+		errno = EINVAL;
+		return -1;
+	}
+
+	r->seg = seg;
+	r->seg_len = st.st_size;
+	r->end = sizeof (capture_segment_header) + h->used;
+	if (r->end > r->seg_len)
+		r->end = r->seg_len;
+	r->pos = sizeof (capture_segment_header);
+	return 0;
+}
+
+static void
+capture_unmap_segment (irc_capture_reader *r)
+{
+	if (r->seg != NULL)
+		munmap (r->seg, r->seg_len);
+	r->seg = NULL;
+}
+
+/* The record at r->pos, moving on through the segments. NULL at the end */
+static const capture_record_header *
+capture_peek (irc_capture_reader *r)
+{
+	for (;;) {
+		if (r->seg == NULL)
+			return NULL;
+
+		if (r->pos + sizeof (capture_record_header) <= r->end) {
+			const capture_record_header *h = (const capture_record_header *)(r->seg + r->pos);
+			if (r->pos + sizeof (*h) + h->len <= r->end)
+				return h;
+		}
+
+		capture_unmap_segment (r);
+		r->seq++;
+		if (capture_map_segment (r) == -1)
+			return NULL;
+	}
+}
+
+int
+irc_capture_reader_open (irc_capture_reader *r, const char *index_path, double from_secs)
+{
+	size_t len = strlen (index_path);
+	if (len < 4 || strcmp (index_path + len - 4, ".idx") != 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	FILE *f = fopen (index_path, "rb");
+	if (f == NULL)
+		return -1;
+
+	capture_index_header h;
+	if (fread (&h, sizeof (h), 1, f) != 1
+	    || memcmp (h.magic, CAPTURE_INDEX_MAGIC, sizeof (h.magic)) != 0
+	    || h.version != CAPTURE_VERSION) {
+		fclose (f);
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* The last entry at or before from, the records after it are skipped */
+	uint64_t from = from_secs > 0 ? (uint64_t)(from_secs * 1e9) : 0;
+	capture_index_entry e, start = { 0 };
+	while (fread (&e, sizeof (e), 1, f) == 1 && e.ts_ns <= from)
+		start = e;
+	fclose (f);
+
+	r->base = strndup (index_path, len - 4);
+	if (r->base == NULL)
+		return -1;
+	memcpy (r->server, h.server, sizeof (r->server));
+	r->server[sizeof (r->server) - 1] = '\0';
+
+	r->seq = start.seq;
+	r->seg = NULL;
+	if (capture_map_segment (r) == -1) {
+		free (r->base);
+		return -1;
+	}
+	r->pos += start.offset;
+
+	const capture_record_header *rh;
+	while ((rh = capture_peek (r)) != NULL && rh->ts_ns < from)
+		r->pos += CAPTURE_ALIGN (sizeof (*rh) + rh->len);
+
+	return 0;
+}
+
+bool
+irc_capture_next (irc_capture_reader *r, irc_capture_record *rec)
+{
+	const capture_record_header *h = capture_peek (r);
+	if (h == NULL)
+		return false;
+
+	rec->ts_ns = h->ts_ns;
+	rec->dir = h->dir == IRC_CAPTURE_OUT ? IRC_CAPTURE_OUT : IRC_CAPTURE_IN;
+	rec->line = (const char *)(h + 1);
+	rec->len = h->len;
+	r->pos += CAPTURE_ALIGN (sizeof (*h) + h->len);
+	return true;
+}
+
+void
+irc_capture_reader_close (irc_capture_reader *r)
+{
+	capture_unmap_segment (r);
+	free (r->base);
+}
@@ -0,0 +1,162 @@
+#include <ctype.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "irc/command.h"
+#include "log/log.h"
+
+static const char *known_verbs[] = {
+	[IRC_CMD_PRIVMSG - IRC_CMD_NUMERIC_COUNT] = "PRIVMSG",
+	[IRC_CMD_NOTICE - IRC_CMD_NUMERIC_COUNT] = "NOTICE",
+	[IRC_CMD_JOIN - IRC_CMD_NUMERIC_COUNT] = "JOIN",
+	[IRC_CMD_PART - IRC_CMD_NUMERIC_COUNT] = "PART",
+	[IRC_CMD_QUIT - IRC_CMD_NUMERIC_COUNT] = "QUIT",
+	[IRC_CMD_NICK - IRC_CMD_NUMERIC_COUNT] = "NICK",
+	[IRC_CMD_MODE - IRC_CMD_NUMERIC_COUNT] = "MODE",
+	[IRC_CMD_TOPIC - IRC_CMD_NUMERIC_COUNT] = "TOPIC",
+	[IRC_CMD_KICK - IRC_CMD_NUMERIC_COUNT] = "KICK",
+	[IRC_CMD_INVITE - IRC_CMD_NUMERIC_COUNT] = "INVITE",
+	[IRC_CMD_PING - IRC_CMD_NUMERIC_COUNT] = "PING",
+	[IRC_CMD_PONG - IRC_CMD_NUMERIC_COUNT] = "PONG",
+	[IRC_CMD_ERROR - IRC_CMD_NUMERIC_COUNT] = "ERROR",
+	[IRC_CMD_CAP - IRC_CMD_NUMERIC_COUNT] = "CAP",
+	[IRC_CMD_AUTHENTICATE - IRC_CMD_NUMERIC_COUNT] = "AUTHENTICATE",
+	[IRC_CMD_ACCOUNT - IRC_CMD_NUMERIC_COUNT] = "ACCOUNT",
+	[IRC_CMD_AWAY - IRC_CMD_NUMERIC_COUNT] = "AWAY",
+	[IRC_CMD_CHGHOST - IRC_CMD_NUMERIC_COUNT] = "CHGHOST",
+	[IRC_CMD_SETNAME - IRC_CMD_NUMERIC_COUNT] = "SETNAME",
+	[IRC_CMD_BATCH - IRC_CMD_NUMERIC_COUNT] = "BATCH",
+	[IRC_CMD_TAGMSG - IRC_CMD_NUMERIC_COUNT] = "TAGMSG",
+	[IRC_CMD_WALLOPS - IRC_CMD_NUMERIC_COUNT] = "WALLOPS",
+	[IRC_CMD_KILL - IRC_CMD_NUMERIC_COUNT] = "KILL",
+	[IRC_CMD_USER - IRC_CMD_NUMERIC_COUNT] = "USER",
+	[IRC_CMD_PASS - IRC_CMD_NUMERIC_COUNT] = "PASS",
+	[IRC_CMD_WHO - IRC_CMD_NUMERIC_COUNT] = "WHO",
+	[IRC_CMD_WHOIS - IRC_CMD_NUMERIC_COUNT] = "WHOIS",
+	[IRC_CMD_NAMES - IRC_CMD_NUMERIC_COUNT] = "NAMES",
+	[IRC_CMD_LIST - IRC_CMD_NUMERIC_COUNT] = "LIST",
+	[IRC_CMD_MOTD - IRC_CMD_NUMERIC_COUNT] = "MOTD",
+	[IRC_CMD_OPER - IRC_CMD_NUMERIC_COUNT] = "OPER",
+};
+
+/*
+ * Perfect hash of the known verbs, see verb_hash. The multipliers were
+ * searched for offline so that no two known verbs share a slot, check
+ * that still holds when adding one. Slots hold the verb's offset + 1.
+ */
+#define SLOT(id) ((id)-IRC_CMD_NUMERIC_COUNT + 1)
+#define VERB_SLOTS 64
+
+static const unsigned char verb_slots[VERB_SLOTS] = {
+	[0] = SLOT (IRC_CMD_SETNAME),
+	[2] = SLOT (IRC_CMD_USER),
+	[3] = SLOT (IRC_CMD_ACCOUNT),
+	[4] = SLOT (IRC_CMD_BATCH),
+	[6] = SLOT (IRC_CMD_TAGMSG),
+	[7] = SLOT (IRC_CMD_TOPIC),
+	[8] = SLOT (IRC_CMD_PING),
+	[14] = SLOT (IRC_CMD_CHGHOST),
+	[15] = SLOT (IRC_CMD_KICK),
+	[16] = SLOT (IRC_CMD_KILL),
+	[19] = SLOT (IRC_CMD_AUTHENTICATE),
+	[23] = SLOT (IRC_CMD_JOIN),
+	[24] = SLOT (IRC_CMD_MOTD),
+	[25] = SLOT (IRC_CMD_MODE),
+	[26] = SLOT (IRC_CMD_NICK),
+	[29] = SLOT (IRC_CMD_OPER),
+	[30] = SLOT (IRC_CMD_WALLOPS),
+	[35] = SLOT (IRC_CMD_CAP),
+	[38] = SLOT (IRC_CMD_PONG),
+	[41] = SLOT (IRC_CMD_AWAY),
+	[42] = SLOT (IRC_CMD_QUIT),
+	[44] = SLOT (IRC_CMD_PASS),
+	[45] = SLOT (IRC_CMD_PART),
+	[46] = SLOT (IRC_CMD_ERROR),
+	[49] = SLOT (IRC_CMD_LIST),
+	[50] = SLOT (IRC_CMD_INVITE),
+	[52] = SLOT (IRC_CMD_NOTICE),
+	[56] = SLOT (IRC_CMD_PRIVMSG),
+	[57] = SLOT (IRC_CMD_WHO),
+	[59] = SLOT (IRC_CMD_NAMES),
+	[63] = SLOT (IRC_CMD_WHOIS),
+};
+
+static inline unsigned
+verb_hash (const char *command, size_t len)
+{
+	unsigned first = command[0] & 0xDF;
+	unsigned second = command[1] & 0xDF;
+	unsigned last = command[len - 1] & 0xDF;
+	return (first * 25 + second * 5 + last + len) % VERB_SLOTS;
+}
+
+/*
+ * Verbs interned at runtime, only ever appended to and never freed. The
+ * lock is only for interning, a verb is in place before dynamic_len is
+ * released past it, so lookups read without it.
+ */
+static pthread_mutex_t dynamic_lock = PTHREAD_MUTEX_INITIALIZER;
+static char *dynamic_verbs[IRC_CMD_DYNAMIC_COUNT];
+static atomic_int dynamic_len;
+
+static irc_command_id
+lookup_dynamic (const char *command, size_t len)
+{
+	int n = atomic_load_explicit (&dynamic_len, memory_order_acquire);
+	for (int i = 0; i < n; ++i)
+		if (strncasecmp (dynamic_verbs[i], command, len) == 0 &&
+		    dynamic_verbs[i][len] == '\0')
+			return IRC_CMD_DYNAMIC_START + i;
+
+	return IRC_CMD_UNKNOWN;
+}
+
+irc_command_id
+irc_command_lookup (const char *command, size_t len)
+{
+	if (len == 3 && isdigit ((unsigned char)command[0]) &&
+	    isdigit ((unsigned char)command[1]) && isdigit ((unsigned char)command[2]))
+		return (command[0] - '0') * 100 + (command[1] - '0') * 10 + (command[2] - '0');
+
+	if (len >= 2) {
+		int slot = verb_slots[verb_hash (command, len)];
+		if (slot != 0) {
+			const char *verb = known_verbs[slot - 1];
+			if (strncasecmp (verb, command, len) == 0 && verb[len] == '\0')
+				return IRC_CMD_NUMERIC_COUNT + slot - 1;
+		}
+	}
+
+	/* Only verbs somebody hooked are interned, anything else the server
+	 * sends stays unknown without taking a slot */
+	return lookup_dynamic (command, len);
+}
+
+irc_command_id
+irc_command_intern (const char *command)
+{
+	size_t len = strlen (command);
+	irc_command_id id = irc_command_lookup (command, len);
+	if (id != IRC_CMD_UNKNOWN)
+		return id;
+
+	pthread_mutex_lock (&dynamic_lock);
+	id = lookup_dynamic (command, len);
+	if (id == IRC_CMD_UNKNOWN) {
+		int n = atomic_load_explicit (&dynamic_len, memory_order_relaxed);
+		char *verb = n < IRC_CMD_DYNAMIC_COUNT ? strdup (command) : NULL;
+		if (verb != NULL) {
+			dynamic_verbs[n] = verb;
+			atomic_store_explicit (&dynamic_len, n + 1, memory_order_release);
+			id = IRC_CMD_DYNAMIC_START + n;
+		} else {
+			log_info ("Can't intern command %s\n", command);
+		}
+	}
+	pthread_mutex_unlock (&dynamic_lock);
+
+	return id;
+}
@@ -1,99 +1,187 @@
-#include <glib.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "hooks.h"
+#include "log/log.h"
 
-static GHashTable *hooks;
+/* The hooks added for each command and the ones for every message */
+static irc_hook *hooks[IRC_CMD_COUNT];
+static irc_hook *wildcard_hooks;
+
+/*
+ * What a message runs, indexed by its command: its own hooks followed by
+ * the wildcard ones, NULL terminated. Rebuilt whenever a hook is added,
+ * commands without hooks of their own share wildcard_dispatch.
+ */
+static irc_hook **dispatch[IRC_CMD_COUNT];
+static irc_hook **wildcard_dispatch;
+
+static irc_hook *empty_dispatch[] = { NULL };
 
-void
-g_free_irc_hook (gpointer hook);
-void
-free_irc_hook (irc_hook *hook);
-irc_hook *
-create_irc_hook (const char *command, void (*f) (const irc_server *, const irc_msg *));
 static irc_hook *
-get_hooks_private (const char *command);
-static gboolean
-command_strings_equal (gconstpointer a, gconstpointer b);
+create_irc_hook (irc_command_id command, const char *command_name, const char *name, irc_hook_fn f);
+static void
+append_hook (irc_hook **head, irc_hook *hook);
+static irc_hook **
+build_dispatch (irc_hook *own);
+static void
+set_dispatch (irc_hook ***slot, irc_hook **hooks);
 
 void
 init_hooks (void)
 {
-	if (hooks != NULL)
-		return;
-
-	hooks = g_hash_table_new_full (
-	  g_str_hash, command_strings_equal, g_free, g_free_irc_hook);
+	if (wildcard_dispatch == NULL)
+		wildcard_dispatch = empty_dispatch;
 }
 
-static gboolean
-command_strings_equal (gconstpointer a, gconstpointer b)
+static irc_hook *
+create_irc_hook (irc_command_id command, const char *command_name, const char *name, irc_hook_fn f)
 {
-	return strcmp ((const char *)a, (const char *)b) == 0;
+	irc_hook *hook = calloc (1, sizeof (irc_hook));
+	if (hook == NULL)
+		return NULL;
+
+	hook->command_name = strdup (command_name);
+	if (hook->command_name == NULL) {
+		free (hook);
+		return NULL;
+	}
+
+	hook->command = command;
+	hook->entry = f;
+	hook->name = name;
+	hook->next = NULL;
+
+	return hook;
 }
 
-void
-g_free_irc_hook (gpointer hook)
+static void
+append_hook (irc_hook **head, irc_hook *hook)
 {
-	free_irc_hook ((irc_hook *)hook);
+	while (*head != NULL)
+		head = &(*head)->next;
+	*head = hook;
 }
 
-void
-free_irc_hook (irc_hook *hook)
+static irc_hook **
+build_dispatch (irc_hook *own)
 {
-	while (hook != NULL) {
-		irc_hook *tmp = hook;
-		free (hook->command);
-		free (hook->entry);
-		hook = hook->next;
-		free (tmp);
-	}
+	size_t len = 0;
+	irc_hook *hook;
+	for (hook = own; hook != NULL; hook = hook->next)
+		len++;
+	for (hook = wildcard_hooks; hook != NULL; hook = hook->next)
+		len++;
+
+	if (len == 0)
+		return empty_dispatch;
+
+	irc_hook **hooks = malloc ((len + 1) * sizeof (*hooks));
+	if (hooks == NULL)
+		return NULL;
+
+	size_t i = 0;
+	for (hook = own; hook != NULL; hook = hook->next)
+		hooks[i++] = hook;
+	for (hook = wildcard_hooks; hook != NULL; hook = hook->next)
+		hooks[i++] = hook;
+	hooks[i] = NULL;
+
+	return hooks;
 }
 
-irc_hook *
-create_irc_hook (const char *command, void (*f) (const irc_server *, const irc_msg *))
+static void
+set_dispatch (irc_hook ***slot, irc_hook **hooks)
 {
-	irc_hook *hook = malloc (sizeof (irc_hook));
-	hook->command = strdup (command);
-	hook->entry = f;
-	hook->next = NULL;
+	if (hooks == NULL) {
+		log_info ("Out of memory adding a hook\n");
+		return;
+	}
 
-	return hook;
+	if (*slot != empty_dispatch)
+		free (*slot);
+	*slot = hooks;
 }
 
 void
-add_hook (const char *command, void (*f) (const irc_server *, const irc_msg *))
+add_named_hook (const char *command, const char *name, irc_hook_fn f)
 {
-	irc_hook *hook = create_irc_hook (command, f);
-	irc_hook *head = get_hooks_private (command);
-	if (head == NULL) {
-		g_hash_table_insert (hooks, hook->command, hook);
-	} else if (head == NULL) {
-		head = hook;
-	} else {
-		while (head->next != NULL)
-			head = head->next;
-		head->next = hook;
+	init_hooks ();
+
+	if (strcmp (command, "*") == 0) {
+		irc_hook *hook = create_irc_hook (IRC_CMD_UNKNOWN, command, name, f);
+		if (hook == NULL)
+			return;
+		append_hook (&wildcard_hooks, hook);
+
+		/* Every command runs the wildcard hooks */
+		set_dispatch (&wildcard_dispatch, build_dispatch (NULL));
+		for (int id = 0; id < IRC_CMD_COUNT; ++id)
+			if (hooks[id] != NULL)
+				set_dispatch (&dispatch[id], build_dispatch (hooks[id]));
+		return;
 	}
+
+	irc_command_id id = irc_command_intern (command);
+	if (id == IRC_CMD_UNKNOWN)
+		return;
+
+	irc_hook *hook = create_irc_hook (id, command, name, f);
+	if (hook == NULL)
+		return;
+	append_hook (&hooks[id], hook);
+
+	if (dispatch[id] == NULL)
+		dispatch[id] = empty_dispatch;
+	set_dispatch (&dispatch[id], build_dispatch (hooks[id]));
 }
 
-static irc_hook *
-get_hooks_private (const char *command)
+void
+exec_hooks (const irc_server *s, const char *command, const irc_msg *msg)
 {
-	return (irc_hook *)g_hash_table_lookup (hooks, command);
+	irc_command_id id = irc_command_lookup (command, strlen (command));
+	if (id == IRC_CMD_UNKNOWN)
+		return;
+
+	uint64_t start = irc_metrics_now ();
+	irc_hook *hook;
+	for (hook = hooks[id]; hook != NULL; hook = hook->next) {
+		hook->entry (s, msg);
+
+		uint64_t end = irc_metrics_now ();
+		irc_histogram_record (&hook->time, end - start);
+		start = end;
+	}
 }
 
-const irc_hook *
-get_hooks (const char *command)
+void
+exec_message_hooks (const irc_server *s, const irc_msg *msg)
 {
-	return get_hooks_private (command);
+	irc_hook **run = dispatch[msg->command_id];
+	if (run == NULL)
+		run = wildcard_dispatch;
+	if (run == NULL)
+		return;
+
+	/* One hook ending is the next one starting */
+	uint64_t start = irc_metrics_now ();
+	for (; *run != NULL; ++run) {
+		(*run)->entry (s, msg);
+
+		uint64_t end = irc_metrics_now ();
+		irc_histogram_record (&(*run)->time, end - start);
+		start = end;
+	}
 }
 
 void
-exec_hooks (const irc_server *s, const char *command, const irc_msg *msg)
+irc_foreach_hook (irc_hook_stats_fn fn, void *data)
 {
-	const irc_hook *hook;
-	for (hook = get_hooks (command); hook != NULL; hook = hook->next)
-		// FIXME this entry isn't free'd
-		hook->entry (s, msg);
+	irc_hook *hook;
+	for (int id = 0; id < IRC_CMD_COUNT; ++id)
+		for (hook = hooks[id]; hook != NULL; hook = hook->next)
+			fn (hook, data);
+	for (hook = wildcard_hooks; hook != NULL; hook = hook->next)
+		fn (hook, data);
 }
@@ -3,11 +3,10 @@
 #include <netdb.h>	 // getaddrinfo
 #include <sys/socket.h>    // Socket handling
 
-#include <err.h> // err for panics
 #include <errno.h>
-#include <fcntl.h>
 #include <pthread.h> // pthread_mutex_*
 #include <stdbool.h>
+#include <stddef.h> // offsetof
 #include <stdio.h>
 #include <stdlib.h> // malloc, free
 #include <string.h>
@@ -16,472 +15,1378 @@
 #include <glib.h>
 
 #include "hooks.h"
+#include "irc/buffer.h"
+#include "irc/capture.h"
+#include "irc/metrics.h"
+#include "irc/mpsc.h"
+#include "irc/sendq.h"
+#include "irc/text.h"
 
 #include "b64/b64.h"
+#include "utlist/list.h"
 
 #include "log/log.h"
 
 #define IRC_MESSAGE_SIZE 8192 // IRCv3 message size + 1 for '\0'
 
-typedef struct message_queue
+/* Large enough to hold a partial line plus a full read behind it */
+#define IRC_RECV_BUFFER_SIZE (IRC_MESSAGE_SIZE * 2)
+
+/* Lines other threads can have in flight to a connection at once */
+#define IRC_OUT_QUEUE_SIZE 256
+#define IRC_OUT_LINE_SIZE 1024
+
+/* Lines as servers relay them, CRLF included, without tags */
+#define IRC_LINE_SIZE 512
+/* Room for ident@host while the server hasn't shown us ours */
+#define IRC_GUESS_USERHOST_LEN 74
+/* Less room than this for text is a mistake, not a short line */
+#define IRC_MIN_TEXT_ROOM 32
+
+/* Seconds from irc_server_connect until the connection has to be ready */
+#define IRC_CONNECT_TIMEOUT 30.
+
+/* Reconnect backoff in seconds, doubled for every failed attempt */
+#define IRC_RECONNECT_MIN_DELAY 1.
+#define IRC_RECONNECT_MAX_DELAY 300.
+
+/* Captured lines a replay hands on before the loop gets a turn */
+#define IRC_REPLAY_BATCH 256
+/* Seconds between looks at the backlog once a replay ran out of lines */
+#define IRC_REPLAY_DRAIN_POLL 0.01
+
+typedef struct irc_out_line
 {
-	char *message;
-	struct message_queue *next;
-} message_queue;
+	size_t len;
+	char data[IRC_OUT_LINE_SIZE];
+} irc_out_line;
 
-typedef struct
+typedef enum irc_connection_state
+{
+	IRC_CONNECTION_CLOSED,
+	IRC_CONNECTION_RESOLVING,
+	IRC_CONNECTION_CONNECTING,
+	IRC_CONNECTION_HANDSHAKING,
+	IRC_CONNECTION_READY,
+} irc_connection_state;
+
+struct irc_resolve_job;
+struct irc_playback;
+
+typedef struct irc_connection
 {
 	const irc_server *server;
+	irc_connection_state state;
+	/* Connection setup, see irc_server_connect */
+	struct irc_resolve_job *resolve_job;
+	struct addrinfo *addrs;
+	struct addrinfo *next_addr;
+	ev_io setup_watcher;
+	ev_timer setup_timer;
+	bool tls_inited;
+	/* Session data of the last TLS connection, to resume it next time */
+	gnutls_datum_t tls_resume_data;
+	/* Reconnecting, attempts since the server last let us register */
+	ev_timer reconnect_timer;
+	unsigned reconnect_attempts;
+	bool quitting;
 	gnutls_session_t tls_session;
 	gnutls_certificate_credentials_t tls_creds;
 	int socket;
-	bool ev_is_running;
 	ev_io watcher;
-	ev_timer timer;
-	message_queue *read_queue;
-	pthread_mutex_t read_queue_mtx;
-	message_queue *write_queue;
-	pthread_mutex_t write_queue_mtx;
-	ev_io ev_init_watcher;
+	ev_io write_watcher;
+	char recv_buf[IRC_RECV_BUFFER_SIZE];
+	size_t recv_len;
+	bool recv_discard;
+	irc_buffer write_buf;
+	bool tls_send_again;
+	/* Lines held back by flood control before they go to write_buf */
+	irc_sendq sendq;
+	ev_timer flood_timer;
+	/* Lines pushed from threads other than the loop's */
+	irc_mpsc out_queue;
+	ev_async out_async;
+	irc_conn_stats stats;
+	/* See irc_backlog_hold, reading_paused is set while the watcher is off */
+	atomic_size_t backlog_msgs;
+	atomic_size_t backlog_bytes;
+	atomic_bool reading_paused;
+	atomic_ullong shed;
+	ev_async resume_async;
+	/* Channel membership, forgotten whenever the connection closes */
+	irc_state chan_state;
+	/* Recording its traffic, NULL unless the server has a capture_dir */
+	irc_capture *capture;
+	/* Set on connections fed from a capture instead of a socket */
+	struct irc_playback *replay;
+	struct irc_connection *next;
 } irc_connection;
 
-int
-setnonblock (int fd);
-int
-verify_socket (int sock);
+/* A capture being fed to a connection, see irc_replay */
+typedef struct irc_playback
+{
+	irc_connection *conn;
+	irc_capture_reader reader;
+	irc_capture_record next;
+	bool have_next;
+	bool fast;
+	uint64_t first_ts;
+	double started;
+	size_t lines;
+	ev_timer timer;
+} irc_playback;
+
+/* getaddrinfo runs on a thread of its own, the loop picks up the result */
+typedef struct irc_resolve_job
+{
+	/* Only touched on the loop thread, NULL once nobody is waiting */
+	irc_connection *conn;
+	char *host;
+	char *port;
+	int ret;
+	struct addrinfo *addrs;
+	struct irc_resolve_job *next;
+} irc_resolve_job;
+
 static void
 irc_loop_read_callback (EV_P_ ev_io *w, int re);
 static void
-irc_timeout_callback (EV_P_ ev_timer *w, int re);
+irc_loop_write_callback (EV_P_ ev_io *w, int re);
+static void
+irc_out_queue_callback (EV_P_ ev_async *w, int re);
+static void
+irc_drain_out_queue (irc_connection *conn);
+static void
+irc_resume_callback (EV_P_ ev_async *w, int re);
+static void
+irc_check_backlog (irc_connection *c);
+static void
+irc_queue_output (irc_connection *conn, const char *buf, size_t len);
 static void
-irc_process_read_message_queue (irc_connection *conn);
+irc_output_queued (irc_connection *conn);
 static void
-irc_process_write_message_queue (irc_connection *conn);
+irc_schedule_output (irc_connection *conn);
+static void
+irc_flood_timer_callback (EV_P_ ev_timer *w, int re);
 static int
-irc_read_bytes (const irc_server *, char *, size_t);
+irc_flush_output (irc_connection *conn);
 static int
-irc_write_message (const irc_server *s, irc_msg *message);
+irc_read_messages (irc_connection *conn);
+static void
+irc_process_recv_buffer (irc_connection *conn);
+static ssize_t
+irc_read_bytes (irc_connection *conn, char *, size_t);
+static ssize_t
+irc_write_bytes (irc_connection *conn, const char *buf, size_t nbytes);
+static void
+handle_message (irc_connection *conn, const char *message, size_t msg_len);
 static int
-irc_write_bytes (const irc_server *s, const char *buf, size_t nbytes);
+irc_start_resolve (irc_connection *c);
+static void *
+irc_resolve_thread (void *data);
 static void
-handle_message (irc_connection *conn, const char *message);
-int
-irc_create_socket (const irc_server *);
+irc_resolved_callback (EV_P_ ev_async *w, int re);
+static void
+irc_connect_next_address (irc_connection *c);
+static void
+irc_setup_callback (EV_P_ ev_io *w, int re);
+static void
+irc_setup_timeout_callback (EV_P_ ev_timer *w, int re);
+static void
+irc_continue_handshake (irc_connection *c);
+static void
+irc_connection_ready (irc_connection *c);
+static void
+irc_start_capture (irc_connection *c);
+static void
+irc_record (irc_connection *c, irc_capture_dir dir, const char *line, size_t len);
+static void
+irc_connect_failed (irc_connection *c, const char *reason);
+static void
+irc_connection_lost (irc_connection *c, const char *reason);
+static void
+irc_schedule_reconnect (irc_connection *c);
+static void
+irc_reconnect_callback (EV_P_ ev_timer *w, int re);
 int
-setup_irc_connection (const irc_server *, int);
-void
 encrypt_irc_connection (irc_connection *);
 irc_connection *
-create_irc_connection (const irc_server *, int);
+create_irc_connection (const irc_server *);
 int
 make_irc_connection_entry (irc_connection *);
 irc_connection *
 get_irc_server_connection (const irc_server *);
 irc_connection *
 get_irc_connection_from_watcher (const ev_io *w);
+static void
+close_irc_connection (irc_connection *c);
+static void
+free_irc_connection (irc_connection *c);
 bool
 server_connected (const irc_server *s);
-bool
-connections_cap_reached (void);
 
-/* conns simply holds the connections we use, it should be replaced later */
-#define MAX_CONNECTIONS 10
-static irc_connection *conns[MAX_CONNECTIONS + 1];
+/*
+ * connections holds every irc_connection ever made. A connection stays
+ * around after it's closed, other threads only ever reach it through
+ * its irc_server and may still be pushing to it.
+ */
+static irc_connection *connections;
 
-// Simply adds O_NONBLOCK to the file descriptor of choice
-int
-setnonblock (int fd)
-{
-	int flags;
+/* The thread running the event loop, the one that makes connections */
+static pthread_t loop_thread;
 
-	flags = fcntl (fd, F_GETFL);
-	flags |= O_NONBLOCK;
-	return fcntl (fd, F_SETFL, flags);
+static inline bool
+on_loop_thread (void)
+{
+	return pthread_equal (pthread_self (), loop_thread);
 }
 
-/* Check if the socket is already Read- or Writeable */
+/* Finished resolve jobs waiting for the loop */
+static pthread_mutex_t resolved_lock = PTHREAD_MUTEX_INITIALIZER;
+static irc_resolve_job *resolved_jobs;
+static ev_async resolved_async;
+
+/*
+ * Start connecting to server s, return -1 if that couldn't be started.
+ * Resolving, connecting and the TLS handshake all happen on the event
+ * loop, the PREINIT hooks run once the connection is ready. From then
+ * on the connection is reestablished whenever it fails.
+ */
 int
-verify_socket (int sock)
+irc_server_connect (const irc_server *s)
 {
-	struct timeval tv;
-	fd_set readfds, writefds;
-	int error;
+	/* Don't attempt to connect if we're already connected to this server */
+	irc_connection *c = get_irc_server_connection (s);
+	if (c != NULL && c->state != IRC_CONNECTION_CLOSED) {
+		log_info ("Server already connected\n");
+		return -1;
+	}
 
-	FD_SET (sock, &readfds);
-	FD_SET (sock, &writefds);
+	c = create_irc_connection (s);
+	if (c == NULL) {
+		log_info ("Out of memory connecting to %s\n", s->name);
+		return -1;
+	}
+	make_irc_connection_entry (c);
 
-	puts ("check write\n");
-	tv.tv_sec = 10;
-	tv.tv_usec = 500000;
-	int rv = select (sock + 1, &readfds, &writefds, NULL, &tv);
+	c->quitting = false;
+	ev_timer_stop (irc_get_event_loop (), &c->reconnect_timer);
 
-	if (rv == -1) {
-		perror ("client: connect failed");
-		exit (EXIT_FAILURE);
-	} else if (rv == 0) {
-		perror ("client: connect timeout");
-		exit (EXIT_FAILURE);
+	if (irc_start_resolve (c) == -1) {
+		irc_connect_failed (c, "couldn't start resolving the host");
+		return 0;
 	}
 
-	if (FD_ISSET (sock, &writefds) || FD_ISSET (sock, &readfds)) {
-		socklen_t len = sizeof (error);
-		if (getsockopt (sock, SOL_SOCKET, SO_ERROR, &error, &len) < 0) {
-			perror ("client: socket not writeable");
-			exit (EXIT_FAILURE);
-		}
-	} else {
-		perror ("client: select error: sock not set");
-		exit (EXIT_FAILURE);
-	}
+	ev_timer_set (&c->setup_timer, IRC_CONNECT_TIMEOUT, 0.);
+	ev_timer_start (irc_get_event_loop (), &c->setup_timer);
 
 	return 0;
 }
 
-/*
- * Attempts to connect to server s,
- * return -1 if there's an error, 0 if it succeeded
- */
-int
-irc_server_connect (const irc_server *s)
+/* Hand the lookup of the server's address to a thread of its own */
+static int
+irc_start_resolve (irc_connection *c)
 {
-	/*
-	 * For now, don't attempt to connect if we're already connected
-	 * to this server or if we have too many connections
-	 */
-	if (server_connected (s)) {
-		log_info ("Server already connected");
-		return -1;
+	struct ev_loop *loop = irc_get_event_loop ();
+	if (!ev_is_active (&resolved_async)) {
+		ev_async_init (&resolved_async, irc_resolved_callback);
+		ev_async_start (loop, &resolved_async);
+		ev_unref (loop);
 	}
 
-	if (connections_cap_reached ()) {
-		log_info ("To Many Connections");
+	irc_resolve_job *job = malloc (sizeof (*job));
+	if (job == NULL)
+		return -1;
+
+	job->conn = c;
+	job->host = strdup (c->server->host);
+	job->port = strdup (c->server->port);
+	job->addrs = NULL;
+	job->next = NULL;
+
+	pthread_t thread;
+	pthread_attr_t attr;
+	pthread_attr_init (&attr);
+	pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+
+	if (job->host == NULL || job->port == NULL ||
+	    pthread_create (&thread, &attr, irc_resolve_thread, job) != 0) {
+		pthread_attr_destroy (&attr);
+		free (job->host);
+		free (job->port);
+		free (job);
 		return -1;
 	}
+	pthread_attr_destroy (&attr);
+
+	c->resolve_job = job;
+	c->state = IRC_CONNECTION_RESOLVING;
+	return 0;
+}
+
+static void *
+irc_resolve_thread (void *data)
+{
+	irc_resolve_job *job = data;
 
-	int sock = irc_create_socket (s);
-	if (sock == -1) {
-		err (1, "failed creating socket");
+	struct addrinfo hints;
+	memset (&hints, 0, sizeof (hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	job->ret = getaddrinfo (job->host, job->port, &hints, &job->addrs);
+
+	pthread_mutex_lock (&resolved_lock);
+	LL_PREPEND (resolved_jobs, job);
+	pthread_mutex_unlock (&resolved_lock);
+
+	ev_async_send (irc_get_event_loop (), &resolved_async);
+	return NULL;
+}
+
+/* irc_resolved_callback continues the connections whose lookup finished */
+static void
+irc_resolved_callback (EV_P_ ev_async *w, int re)
+{
+	pthread_mutex_lock (&resolved_lock);
+	irc_resolve_job *jobs = resolved_jobs;
+	resolved_jobs = NULL;
+	pthread_mutex_unlock (&resolved_lock);
+
+	irc_resolve_job *job, *tmp;
+	LL_FOREACH_SAFE (jobs, job, tmp) {
+		irc_connection *c = job->conn;
+
+		if (c == NULL) {
+			if (job->ret == 0)
+				freeaddrinfo (job->addrs);
+		} else {
+			c->resolve_job = NULL;
+			if (job->ret != 0) {
+				irc_connect_failed (c, gai_strerror (job->ret));
+			} else {
+				c->addrs = c->next_addr = job->addrs;
+				irc_connect_next_address (c);
+			}
+		}
+
+		free (job->host);
+		free (job->port);
+		free (job);
 	}
+}
+
+/* Start a non-blocking connect to the next address that takes one */
+static void
+irc_connect_next_address (irc_connection *c)
+{
+	for (; c->next_addr != NULL; c->next_addr = c->next_addr->ai_next) {
+		struct addrinfo *ai = c->next_addr;
+
+		int sock = socket (ai->ai_family,
+				   ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+				   ai->ai_protocol);
+		if (sock == -1) {
+			log_debug ("socket for %s: %s\n", c->server->name, strerror (errno));
+			continue;
+		}
+
+		if (connect (sock, ai->ai_addr, ai->ai_addrlen) == 0 || errno == EINPROGRESS) {
+			c->socket = sock;
+			c->state = IRC_CONNECTION_CONNECTING;
+			ev_io_set (&c->setup_watcher, sock, EV_WRITE);
+			ev_io_start (irc_get_event_loop (), &c->setup_watcher);
+			return;
+		}
 
-	int ret = setup_irc_connection (s, sock);
-	if (ret == 1)
-		err (1, "failed creating connection");
-	else if (ret != 0) {
-		perror ("client: could not connect");
-		exit (EXIT_FAILURE);
+		log_debug ("connect to %s: %s\n", c->server->name, strerror (errno));
+		close (sock);
 	}
 
-	return 0;
+	irc_connect_failed (c, "no address could be connected to");
 }
 
-/* Start an I/O event loop for reading server s. */
-void
-irc_do_event_loop (const irc_server *s)
+/* irc_setup_callback moves a connection along once its socket is ready */
+static void
+irc_setup_callback (EV_P_ ev_io *w, int re)
 {
-	irc_connection *conn = get_irc_server_connection (s);
+	irc_connection *c =
+	  (irc_connection *)((char *)w - offsetof (irc_connection, setup_watcher));
 
-	struct ev_loop *loop = EV_DEFAULT;
-	conn->ev_is_running = true;
+	if (c->state == IRC_CONNECTION_CONNECTING) {
+		int error = 0;
+		socklen_t len = sizeof (error);
+		if (getsockopt (c->socket, SOL_SOCKET, SO_ERROR, &error, &len) == -1)
+			error = errno;
+
+		ev_io_stop (EV_A_ w);
+		if (error != 0) {
+			log_debug ("connect to %s: %s\n", c->server->name, strerror (error));
+			close (c->socket);
+			c->socket = -1;
+			c->next_addr = c->next_addr->ai_next;
+			irc_connect_next_address (c);
+			return;
+		}
 
-	/* We First start the loop with the init callback to perform
-	 * our initial setup like SASL and JOINing our channels.
-	 * After that is finished the init loop stops the watcher
-	 * and starts it again with the main callback.
-	 */
-	ev_io_init (&conn->watcher, irc_loop_read_callback, conn->socket, EV_READ);
-	ev_io_start (loop, &conn->watcher);
+		freeaddrinfo (c->addrs);
+		c->addrs = c->next_addr = NULL;
 
-	ev_timer_init (&conn->timer, irc_timeout_callback, 6, 0);
-	ev_timer_start (loop, &conn->timer);
+		if (!c->server->secure) {
+			irc_connection_ready (c);
+			return;
+		}
 
-	while (conn->ev_is_running) {
-		ev_run (loop, EVRUN_ONCE);
-		irc_process_read_message_queue (conn);
-		irc_process_write_message_queue (conn);
+		log_debug ("Encrypting connection\n");
+		if (encrypt_irc_connection (c) == -1) {
+			irc_connect_failed (c, "couldn't set up TLS");
+			return;
+		}
+		c->state = IRC_CONNECTION_HANDSHAKING;
 	}
 
-	ev_timer_stop (loop, &conn->timer);
-	ev_io_stop (loop, &conn->ev_init_watcher);
-	ev_io_stop (loop, &conn->watcher);
-	ev_loop_destroy (loop);
+	irc_continue_handshake (c);
 }
 
-/* irc_loop_read_callback handles a single IRC message synchronously */
+/* Take the TLS handshake as far as the socket allows */
 static void
-irc_loop_read_callback (EV_P_ ev_io *w, int re)
+irc_continue_handshake (irc_connection *c)
 {
-	irc_connection *conn = get_irc_connection_from_watcher (w);
-	char *buf = malloc (IRC_MESSAGE_SIZE);
-	memset (buf, 0, IRC_MESSAGE_SIZE);
-	irc_read_message (conn->server, buf);
-	log_debug ("main loop: %s\n", buf);
-
-	pthread_mutex_lock (&conn->read_queue_mtx);
-	message_queue *mq = conn->read_queue;
-	if (mq == NULL) {
-		conn->read_queue = malloc (sizeof (message_queue));
-		conn->read_queue->message = buf;
-		conn->read_queue->next = NULL;
-	} else {
-		while (mq->next != NULL)
-			mq = mq->next;
+	int ret;
+	do {
+		ret = gnutls_handshake (c->tls_session);
+	} while (ret < 0 && ret != GNUTLS_E_AGAIN && !gnutls_error_is_fatal (ret));
+
+	if (ret == GNUTLS_E_AGAIN) {
+		/* Wait for the direction the handshake got stuck in */
+		int events = gnutls_record_get_direction (c->tls_session) ? EV_WRITE : EV_READ;
+		struct ev_loop *loop = irc_get_event_loop ();
 
-		mq->next = malloc (sizeof (conn->read_queue));
-		mq->next->message = buf;
-		mq->next->next = NULL;
+		ev_io_stop (loop, &c->setup_watcher);
+		ev_io_set (&c->setup_watcher, c->socket, events);
+		ev_io_start (loop, &c->setup_watcher);
+		return;
+	}
+
+	if (ret < 0) {
+		irc_connect_failed (c, gnutls_strerror (ret));
+		return;
 	}
-	pthread_mutex_unlock (&conn->read_queue_mtx);
 
-	ev_break (EV_A_ EVBREAK_ALL);
+	if (gnutls_session_is_resumed (c->tls_session))
+		log_debug ("Resumed TLS session with %s\n", c->server->name);
+
+	irc_connection_ready (c);
 }
 
+/* irc_setup_timeout_callback gives up on a connection that took too long */
 static void
-irc_timeout_callback (EV_P_ ev_timer *w, int re)
+irc_setup_timeout_callback (EV_P_ ev_timer *w, int re)
 {
-	ev_break (EV_A_ EVBREAK_ONE);
+	irc_connection *c =
+	  (irc_connection *)((char *)w - offsetof (irc_connection, setup_timer));
+
+	irc_connect_failed (c, "timed out");
 }
 
+/* Start talking to the server over the connected socket */
 static void
-irc_process_read_message_queue (irc_connection *conn)
+irc_connection_ready (irc_connection *c)
 {
-	message_queue *next;
-	while (conn->read_queue != NULL) {
-		handle_message (conn, conn->read_queue->message);
-		next = conn->read_queue->next;
+	struct ev_loop *loop = irc_get_event_loop ();
+
+	ev_io_stop (loop, &c->setup_watcher);
+	ev_timer_stop (loop, &c->setup_timer);
+	c->state = IRC_CONNECTION_READY;
+	log_info ("Connected to %s\n", c->server->name);
 
-		pthread_mutex_lock (&conn->read_queue_mtx);
-		free (conn->read_queue->message);
-		free (conn->read_queue);
-		conn->read_queue = next;
-		pthread_mutex_unlock (&conn->read_queue_mtx);
+	atomic_store (&c->reading_paused, false);
+	ev_io_init (&c->watcher, irc_loop_read_callback, c->socket, EV_READ);
+	ev_io_start (loop, &c->watcher);
+
+	/* Started whenever there is something to send */
+	ev_io_init (&c->write_watcher, irc_loop_write_callback, c->socket, EV_WRITE);
+
+	/* One capture covers every reconnect of the connection */
+	if (c->capture == NULL && c->server->capture_dir != NULL && c->server->capture_dir[0] != '\0')
+		irc_start_capture (c);
+
+	exec_hooks (c->server, "PREINIT", NULL);
+
+	/* Anything other threads pushed while we were away goes out now */
+	irc_drain_out_queue (c);
+}
+
+static void
+irc_start_capture (irc_connection *c)
+{
+	c->capture = malloc (sizeof (irc_capture));
+	if (c->capture == NULL || irc_capture_open (c->capture, c->server->capture_dir, c->server->name) == -1) {
+		log_info_at (&(log_fields){ .server = c->server->name },
+			     "Couldn't start a capture in %s: %s\n",
+			     c->server->capture_dir,
+			     strerror (errno));
+		free (c->capture);
+		c->capture = NULL;
+		return;
 	}
+
+	log_info_at (&(log_fields){ .server = c->server->name },
+		     "Capturing traffic to %s.idx\n",
+		     c->capture->base);
 }
 
+/* Add a raw line to the connection's capture, if it has one */
 static void
-irc_process_write_message_queue (irc_connection *conn)
+irc_record (irc_connection *c, irc_capture_dir dir, const char *line, size_t len)
 {
-	message_queue *next;
-	char *str;
-	while (conn->write_queue != NULL) {
-		str = conn->write_queue->message;
-		next = conn->write_queue->next;
-		irc_write_bytes (conn->server, str, strlen (str));
+	if (c->capture == NULL || irc_capture_append (c->capture, dir, line, len) == 0)
+		return;
 
-		pthread_mutex_lock (&conn->write_queue_mtx);
-		free (conn->write_queue->message);
-		free (conn->write_queue);
-		conn->write_queue = next;
-		pthread_mutex_unlock (&conn->write_queue_mtx);
-	}
+	log_info_at (&(log_fields){ .server = c->server->name },
+		     "Capture failed, not recording anymore: %s\n",
+		     strerror (errno));
+	irc_capture_close (c->capture);
+	free (c->capture);
+	c->capture = NULL;
 }
 
 static void
-handle_message (irc_connection *conn, const char *message)
+irc_connect_failed (irc_connection *c, const char *reason)
 {
-	size_t msg_len = strlen (message);
+	log_info ("Connecting to %s failed: %s\n", c->server->name, reason);
+	irc_schedule_reconnect (c);
+}
 
-	if (msg_len == 0)
+static void
+irc_connection_lost (irc_connection *c, const char *reason)
+{
+	log_info ("Lost connection to %s: %s\n", c->server->name, reason);
+	irc_schedule_reconnect (c);
+}
+
+/*
+ * Close c and connect again after a backoff. The irc_server, its hooks
+ * and the modules stay as they are, so PREINIT picks up where we left.
+ */
+static void
+irc_schedule_reconnect (irc_connection *c)
+{
+	close_irc_connection (c);
+	if (c->quitting)
 		return;
 
-	struct irc_msg *parsed_msg = alloc_msg ();
-	const int ret = ircmsg_parse (message, msg_len, &parse_cbs, parsed_msg);
+	unsigned shift = c->reconnect_attempts < 16 ? c->reconnect_attempts : 16;
+	double delay = IRC_RECONNECT_MIN_DELAY * (1u << shift);
+	if (delay > IRC_RECONNECT_MAX_DELAY)
+		delay = IRC_RECONNECT_MAX_DELAY;
 
-	if (ret == 0) {
-		log_info ("ERROR: parsing message\n");
-	} else {
-		exec_hooks (conn->server, parsed_msg->command, parsed_msg);
-		exec_hooks (conn->server, "*", parsed_msg);
-		free_msg (parsed_msg);
+	/* Jitter keeps servers that dropped together from coming back at once */
+	delay = g_random_double_range (delay / 2, delay);
+	c->reconnect_attempts++;
+
+	log_info ("Reconnecting to %s in %.1f seconds\n", c->server->name, delay);
+	ev_timer_set (&c->reconnect_timer, delay, 0.);
+	ev_timer_start (irc_get_event_loop (), &c->reconnect_timer);
+}
+
+/* irc_reconnect_callback starts the next connection attempt */
+static void
+irc_reconnect_callback (EV_P_ ev_timer *w, int re)
+{
+	irc_connection *c =
+	  (irc_connection *)((char *)w - offsetof (irc_connection, reconnect_timer));
+
+	irc_server_connect (c->server);
+}
+
+/* The backlog is empty once the replay ran out, say how it went and stop */
+static void
+irc_replay_finish (irc_playback *rp)
+{
+	struct ev_loop *loop = irc_get_event_loop ();
+	irc_connection *c = rp->conn;
+
+	if (atomic_load (&c->backlog_msgs) > 0) {
+		ev_timer_set (&rp->timer, IRC_REPLAY_DRAIN_POLL, 0.);
+		ev_timer_start (loop, &rp->timer);
+		return;
+	}
+
+	double secs = ev_time () - rp->started;
+	log_info_at (&(log_fields){ .server = c->server->name },
+		     "Replayed %zu lines in %.3fs (%.0f lines/s), %llu lines and %llu bytes out\n",
+		     rp->lines,
+		     secs,
+		     secs > 0 ? rp->lines / secs : 0.,
+		     (unsigned long long)c->stats.lines_out,
+		     (unsigned long long)c->stats.bytes_out);
+	ev_break (loop, EVBREAK_ALL);
+}
+
+/* irc_replay_callback hands on the captured lines that are due */
+static void
+irc_replay_callback (EV_P_ ev_timer *w, int re)
+{
+	irc_playback *rp = (irc_playback *)((char *)w - offsetof (irc_playback, timer));
+	irc_connection *c = rp->conn;
+
+	for (int i = 0; i < IRC_REPLAY_BATCH; ++i) {
+		/* irc_resume_callback starts the timer again */
+		if (atomic_load (&c->reading_paused))
+			return;
+
+		if (!rp->have_next && !irc_capture_next (&rp->reader, &rp->next)) {
+			irc_replay_finish (rp);
+			return;
+		}
+		rp->have_next = true;
+
+		/* What we sent back then is what the handlers send now */
+		if (rp->next.dir != IRC_CAPTURE_IN) {
+			rp->have_next = false;
+			continue;
+		}
+
+		if (rp->lines == 0) {
+			rp->first_ts = rp->next.ts_ns;
+			rp->started = ev_now (EV_A);
+		}
+
+		if (!rp->fast) {
+			double wait = rp->started + (rp->next.ts_ns - rp->first_ts) / 1e9 - ev_now (EV_A);
+			if (wait > 0) {
+				ev_timer_set (w, wait, 0.);
+				ev_timer_start (EV_A_ w);
+				return;
+			}
+		}
+
+		rp->have_next = false;
+		rp->lines++;
+		handle_message (c, rp->next.line, rp->next.len);
 	}
+
+	ev_timer_set (w, 0., 0.);
+	ev_timer_start (EV_A_ w);
 }
 
-/* irc_read_message reads an IRC message to a buffer */
 int
-irc_read_message (const irc_server *s, char buf[IRC_MESSAGE_SIZE])
+irc_replay (const irc_server *s, const char *path, double from, bool fast)
 {
-	int n = 1;
-	int i = 0;
+	if (get_irc_server_connection (s) != NULL) {
+		log_info ("Server already connected\n");
+		return -1;
+	}
 
-	irc_connection *c = get_irc_server_connection (s);
-	if (c == NULL)
+	irc_playback *rp = malloc (sizeof (irc_playback));
+	if (rp == NULL)
 		return -1;
 
-	for (i = 0;
-	     buf[i - 2] != '\r' && buf[i - 1] != '\n' && i < IRC_MESSAGE_SIZE - 1;
-	     i++) {
-		n = irc_read_bytes (s, buf + i, 1);
+	if (irc_capture_reader_open (&rp->reader, path, from) == -1) {
+		log_info ("Couldn't read the capture %s: %s\n", path, strerror (errno));
+		free (rp);
+		return -1;
 	}
 
-	buf[i] = '\0';
-	buf[IRC_MESSAGE_SIZE - 1] = '\0';
+	irc_connection *c = create_irc_connection (s);
+	if (c == NULL) {
+		log_info ("Out of memory replaying to %s\n", s->name);
+		irc_capture_reader_close (&rp->reader);
+		free (rp);
+		return -1;
+	}
+	make_irc_connection_entry (c);
 
-	return i;
+	rp->conn = c;
+	rp->have_next = false;
+	rp->fast = fast;
+	rp->first_ts = 0;
+	rp->started = ev_now (irc_get_event_loop ());
+	rp->lines = 0;
+	c->replay = rp;
+
+	/* Ready from the start and never reconnected. PREINIT doesn't run,
+	 * the capture has the registration in it */
+	c->state = IRC_CONNECTION_READY;
+	c->quitting = true;
+	ev_io_init (&c->watcher, irc_loop_read_callback, -1, EV_READ);
+	ev_io_init (&c->write_watcher, irc_loop_write_callback, -1, EV_WRITE);
+
+	ev_timer_init (&rp->timer, irc_replay_callback, 0., 0.);
+	ev_timer_start (irc_get_event_loop (), &rp->timer);
+
+	log_info ("Replaying %s (captured on %s) to %s%s\n",
+		  path,
+		  rp->reader.server,
+		  s->name,
+		  fast ? " as fast as it goes" : "");
+	return 0;
 }
 
-/* Read nbytes from the irc_server's connection */
-static int
-irc_read_bytes (const irc_server *s, char *buf, size_t nbytes)
+/* The loop every connection is driven by */
+struct ev_loop *
+irc_get_event_loop (void)
 {
-	if (buf == NULL)
-		return -1;
+	return EV_DEFAULT;
+}
 
-	int ret;
-	irc_connection *c = get_irc_server_connection (s);
-	if (c == NULL)
-		return -1;
+/*
+ * Run the event loop for all connected servers.
+ * Returns once the last connection is closed.
+ */
+void
+irc_do_event_loop (void)
+{
+	ev_run (irc_get_event_loop (), 0);
+}
 
-	if (s->secure)
-		ret = gnutls_record_recv (c->tls_session, buf, nbytes);
-	else
-		ret = recv (c->socket, buf, nbytes, 0);
+/* irc_loop_read_callback drains the socket and handles every complete line */
+static void
+irc_loop_read_callback (EV_P_ ev_io *w, int re)
+{
+	irc_connection *conn = get_irc_connection_from_watcher (w);
 
-	return ret;
+	int ret = irc_read_messages (conn);
+	if (ret == 0)
+		irc_connection_lost (conn, "closed by the server");
+	else if (ret < 0)
+		irc_connection_lost (conn, "error reading");
+}
+
+/* irc_loop_write_callback sends queued output once the socket takes it */
+static void
+irc_loop_write_callback (EV_P_ ev_io *w, int re)
+{
+	irc_connection *conn =
+	  (irc_connection *)((char *)w - offsetof (irc_connection, write_watcher));
+
+	int ret = irc_flush_output (conn);
+	if (ret == 0) {
+		ev_io_stop (EV_A_ w);
+	} else if (ret < 0) {
+		irc_connection_lost (conn, "error writing");
+	}
+}
+
+/* irc_out_queue_callback picks up lines pushed from other threads */
+static void
+irc_out_queue_callback (EV_P_ ev_async *w, int re)
+{
+	irc_connection *conn =
+	  (irc_connection *)((char *)w - offsetof (irc_connection, out_async));
+
+	irc_drain_out_queue (conn);
+}
+
+/* Messages in the backlog are charged for their whole allocation */
+static size_t
+irc_backlog_size (const irc_msg *msg)
+{
+	return sizeof (irc_msg) + msg->arena_cap;
+}
+
+/* Whether the backlog is past 1/div of the server's limits */
+static bool
+irc_backlog_over (irc_connection *c, size_t div)
+{
+	const irc_server *s = c->server;
+	size_t msgs = atomic_load (&c->backlog_msgs);
+	size_t bytes = atomic_load (&c->backlog_bytes);
+
+	return (s->backlog_max_msgs > 0 && msgs > s->backlog_max_msgs / div) ||
+	       (s->backlog_max_bytes > 0 && bytes > s->backlog_max_bytes / div);
 }
 
-/* Serialize an irc_msg and send it to the server */
 void
-irc_push_message (const irc_server *s, irc_msg *message)
+irc_backlog_hold (const irc_server *s, const irc_msg *msg)
 {
-	size_t serialized_length =
-	  ircmsg_serialize_buffer_len (&serializer_cbs,
-				       message);
+	irc_connection *c = get_irc_server_connection (s);
+	if (c == NULL)
+		return;
 
-	uint8_t *serialize_buf = calloc (serialized_length + 1,
-					 sizeof (*serialize_buf));
+	atomic_fetch_add (&c->backlog_msgs, 1);
+	atomic_fetch_add (&c->backlog_bytes, irc_backlog_size (msg));
+}
 
-	ircmsg_serialize (serialize_buf, serialized_length, &serializer_cbs, message);
+void
+irc_backlog_release (const irc_server *s, const irc_msg *msg)
+{
+	irc_connection *c = get_irc_server_connection (s);
+	if (c == NULL)
+		return;
 
-	irc_push_string (s, (char *)serialize_buf);
+	atomic_fetch_sub (&c->backlog_msgs, 1);
+	atomic_fetch_sub (&c->backlog_bytes, irc_backlog_size (msg));
+	if (atomic_load (&c->reading_paused) && !irc_backlog_over (c, 2))
+		ev_async_send (irc_get_event_loop (), &c->resume_async);
+}
 
-	/* free_msg (message); */
+bool
+irc_backlog_full (const irc_server *s)
+{
+	irc_connection *c = get_irc_server_connection (s);
+	return c != NULL && irc_backlog_over (c, 1);
 }
 
 void
-irc_push_string (const irc_server *s, const char *str)
+irc_backlog_shed (const irc_server *s)
 {
 	irc_connection *c = get_irc_server_connection (s);
+	if (c != NULL)
+		atomic_fetch_add_explicit (&c->shed, 1, memory_order_relaxed);
+}
 
-	pthread_mutex_lock (&c->write_queue_mtx);
-	message_queue *mq;
-	if (c->write_queue == NULL) {
-		c->write_queue = malloc (sizeof (message_queue));
-		c->write_queue->message = strdup (str);
-		c->write_queue->next = NULL;
+/* Stop reading while the handlers are too far behind */
+static void
+irc_check_backlog (irc_connection *c)
+{
+	if (atomic_load (&c->reading_paused) || !irc_backlog_over (c, 1))
+		return;
+
+	ev_io_stop (irc_get_event_loop (), &c->watcher);
+	atomic_store (&c->reading_paused, true);
+	c->stats.read_pauses++;
+	log_info_at (&(log_fields){ .server = c->server->name },
+		     "Handlers are behind, not reading until they catch up\n");
+
+	/* Releases from before the flag was set didn't look at it */
+	if (!irc_backlog_over (c, 2))
+		ev_async_send (irc_get_event_loop (), &c->resume_async);
+}
+
+/* irc_resume_callback reads again once the backlog is down to half */
+static void
+irc_resume_callback (EV_P_ ev_async *w, int re)
+{
+	irc_connection *c =
+	  (irc_connection *)((char *)w - offsetof (irc_connection, resume_async));
+
+	if (!atomic_load (&c->reading_paused) || irc_backlog_over (c, 2))
+		return;
+
+	atomic_store (&c->reading_paused, false);
+	if (c->state != IRC_CONNECTION_READY)
+		return;
+
+	log_info_at (&(log_fields){ .server = c->server->name }, "Handlers caught up, reading again\n");
+	if (c->replay != NULL) {
+		ev_timer_set (&c->replay->timer, 0., 0.);
+		ev_timer_start (EV_A_ &c->replay->timer);
+		return;
+	}
+	ev_io_start (EV_A_ &c->watcher);
+
+	/* TLS may have records from before the pause that the socket won't
+	 * wake us up for */
+	irc_loop_read_callback (EV_A_ &c->watcher, EV_READ);
+}
+
+static void
+irc_drain_out_queue (irc_connection *conn)
+{
+	irc_out_line *line;
+	while ((line = irc_mpsc_peek (&conn->out_queue)) != NULL) {
+		irc_queue_output (conn, line->data, line->len);
+		irc_mpsc_release (&conn->out_queue, line);
+	}
+}
+
+/* Append to the output buffer of conn, loop thread only */
+static void
+irc_queue_output (irc_connection *conn, const char *buf, size_t len)
+{
+	if (conn->state != IRC_CONNECTION_READY) {
+		log_info ("Not connected to %s, dropping message\n",
+			  conn->server->name);
+		return;
+	}
+
+	const char *target;
+	size_t target_len;
+	irc_sendq_lane lane = irc_sendq_classify (buf, len, &target, &target_len);
+
+	/* Nothing is waiting and the bucket has room, skip the queue */
+	if (irc_sendq_can_send (&conn->sendq, lane, ev_now (irc_get_event_loop ()))) {
+		if (irc_buffer_append (&conn->write_buf, buf, len) == -1) {
+			log_info ("Out of memory queueing message for %s\n",
+				  conn->server->name);
+			return;
+		}
+
+		irc_sendq_take (&conn->sendq);
+		conn->stats.lines_out++;
+		irc_record (conn, IRC_CAPTURE_OUT, buf, len);
+		irc_output_queued (conn);
+		return;
+	}
+
+	char *dst = irc_sendq_reserve (&conn->sendq, lane, target, target_len, len);
+	if (dst == NULL) {
+		log_info ("Out of memory queueing message for %s\n",
+			  conn->server->name);
+		return;
+	}
+
+	memcpy (dst, buf, len);
+	if (!irc_sendq_commit (&conn->sendq, lane, target, target_len, len))
+		return;
+	conn->stats.lines_out++;
+	irc_record (conn, IRC_CAPTURE_OUT, buf, len);
+	irc_schedule_output (conn);
+}
+
+/* Let out whatever flood control allows and wait for the rest */
+static void
+irc_schedule_output (irc_connection *conn)
+{
+	struct ev_loop *loop = irc_get_event_loop ();
+	double wait;
+
+	if (irc_sendq_flush (&conn->sendq, &conn->write_buf, ev_now (loop), &wait)) {
+		if (!ev_is_active (&conn->flood_timer)) {
+			ev_timer_set (&conn->flood_timer, wait, 0.);
+			ev_timer_start (loop, &conn->flood_timer);
+		}
+	}
+
+	if (irc_buffer_len (&conn->write_buf) > 0)
+		irc_output_queued (conn);
+}
+
+/* irc_flood_timer_callback runs once a held back line may be sent */
+static void
+irc_flood_timer_callback (EV_P_ ev_timer *w, int re)
+{
+	irc_connection *conn =
+	  (irc_connection *)((char *)w - offsetof (irc_connection, flood_timer));
+
+	irc_schedule_output (conn);
+}
+
+static void
+irc_output_queued (irc_connection *conn)
+{
+	/* Nobody is listening to a replay */
+	if (conn->replay != NULL) {
+		conn->stats.bytes_out += irc_buffer_len (&conn->write_buf);
+		irc_buffer_clear (&conn->write_buf);
+		return;
+	}
+
+	/* Everything queued until the socket is writeable goes out together */
+	if (!ev_is_active (&conn->write_watcher))
+		ev_io_start (irc_get_event_loop (), &conn->write_watcher);
+}
+
+/*
+ * Send as much of the output buffer as the socket takes in one go,
+ * everything that has been queued up goes out in as few writes as possible.
+ * Returns 0 once everything is sent, 1 if the socket would block and
+ * -1 on errors.
+ */
+static int
+irc_flush_output (irc_connection *conn)
+{
+	int ret = 0;
+
+	while (irc_buffer_len (&conn->write_buf) > 0) {
+		ssize_t n = irc_write_bytes (conn,
+					     irc_buffer_data (&conn->write_buf),
+					     irc_buffer_len (&conn->write_buf));
+		if (n == -1) {
+			ret = 1;
+			break;
+		} else if (n < 0) {
+			ret = -1;
+			break;
+		}
+
+		irc_buffer_consume (&conn->write_buf, n);
+		conn->stats.bytes_out += n;
+	}
+
+	return ret;
+}
+
+static void
+handle_message (irc_connection *conn, const char *message, size_t msg_len)
+{
+	if (msg_len == 0)
+		return;
+
+	log_debug_at (&(log_fields){ .server = conn->server->name }, "main loop: %.*s", (int)msg_len, message);
+	irc_record (conn, IRC_CAPTURE_IN, message, msg_len);
+
+	/* The only allocation a received message costs */
+	struct irc_msg *parsed_msg = alloc_msg_sized (msg_len);
+	if (parsed_msg == NULL)
+		return;
+
+	conn->stats.lines_in++;
+	uint64_t start = irc_metrics_now ();
+	const int ret = ircmsg_parse (message, msg_len, &parse_cbs, parsed_msg);
+	irc_histogram_record (&conn->stats.parse, irc_metrics_now () - start);
+
+	if (ret == 0 || parsed_msg->command == NULL) {
+		log_info ("ERROR: parsing message\n");
 	} else {
-		for (mq = c->write_queue; mq->next != NULL; mq = mq->next)
-			;
+		/* Registered, the server is willing to have us */
+		if (parsed_msg->command_id == IRC_RPL_WELCOME)
+			conn->reconnect_attempts = 0;
 
-		mq->next = malloc (sizeof (message_queue));
-		mq->next->message = strdup (str);
-		mq->next->next = NULL;
+		exec_message_hooks (conn->server, parsed_msg);
 	}
-	pthread_mutex_unlock (&c->write_queue_mtx);
+	/* Hooks that handle it later hold on to their own reference */
+	irc_msg_unref (parsed_msg);
+	irc_check_backlog (conn);
 }
 
-/* Write nbytes to the irc_server's connection */
+/*
+ * Read everything that is available on the connection into its receive
+ * buffer, handing each complete line to handle_message as it arrives.
+ * Returns 1 once the socket would block, 0 on EOF and -1 on errors.
+ */
 static int
-irc_write_bytes (const irc_server *s, const char *buf, size_t nbytes)
+irc_read_messages (irc_connection *conn)
 {
-	if (buf == NULL)
-		return -1;
+	for (;;) {
+		size_t space = IRC_RECV_BUFFER_SIZE - conn->recv_len;
+		if (space == 0) {
+			/* No line terminator in a full buffer, the line is
+			 * longer than IRC allows. Throw it away up to the
+			 * next newline. */
+			log_info ("Discarding oversized line from %s\n",
+				  conn->server->name);
+			conn->recv_len = 0;
+			conn->recv_discard = true;
+			space = IRC_RECV_BUFFER_SIZE;
+		}
 
-	int ret;
-	irc_connection *c = get_irc_server_connection (s);
-	if (c == NULL) {
-		puts ("emptry connection");
-		return -1;
+		ssize_t n = irc_read_bytes (conn, conn->recv_buf + conn->recv_len, space);
+		if (n == 0)
+			return 0;
+		if (n == -1)
+			return 1;
+		if (n < 0)
+			return -1;
+
+		conn->stats.bytes_in += n;
+		conn->recv_len += n;
+		irc_process_recv_buffer (conn);
+
+		/* The rest waits in the socket, and in TLS's buffers */
+		if (atomic_load (&conn->reading_paused))
+			return 1;
+	}
+}
+
+/* Handle every complete line in the receive buffer and keep the remainder */
+static void
+irc_process_recv_buffer (irc_connection *conn)
+{
+	char *start = conn->recv_buf;
+	char *end = conn->recv_buf + conn->recv_len;
+	char *eol;
+
+	while (start < end && (eol = (char *)irc_text_find_eol (start, end - start)) != NULL) {
+		size_t len = eol - start + 1;
+		if (conn->recv_discard)
+			conn->recv_discard = false;
+		else
+			handle_message (conn, start, len);
+		start = eol + 1;
 	}
 
-	log_debug ("sending command: %s\n", buf);
+	/* Move the partial line to the front for the next read */
+	conn->recv_len = end - start;
+	if (conn->recv_len > 0 && start != conn->recv_buf)
+		memmove (conn->recv_buf, start, conn->recv_len);
+}
 
-	if (s->secure) {
-		ret = gnutls_record_send (c->tls_session, buf, nbytes);
+/*
+ * Read at most nbytes from the connection.
+ * Returns the number of bytes read, 0 on EOF, -1 if the read would block
+ * and -2 on errors.
+ */
+static ssize_t
+irc_read_bytes (irc_connection *c, char *buf, size_t nbytes)
+{
+	if (buf == NULL)
+		return -2;
+
+	ssize_t ret;
+	if (c->server->secure) {
+		for (;;) {
+			ret = gnutls_record_recv (c->tls_session, buf, nbytes);
+			if (ret >= 0)
+				break;
+			if (ret == GNUTLS_E_INTERRUPTED)
+				continue;
+			if (ret == GNUTLS_E_AGAIN)
+				return -1;
+			if (gnutls_error_is_fatal (ret))
+				return -2;
+			log_info ("TLS warning: %s\n", gnutls_strerror (ret));
+		}
 	} else {
-		ret = send (c->socket, buf, nbytes, 0);
+		do {
+			ret = recv (c->socket, buf, nbytes, 0);
+		} while (ret == -1 && errno == EINTR);
+
+		if (ret == -1)
+			return (errno == EAGAIN || errno == EWOULDBLOCK) ? -1 : -2;
 	}
 
 	return ret;
 }
 
-/* Creates a socket to connect to the irc_server s and returns it */
-int
-irc_create_socket (const irc_server *s)
+/*
+ * Serialize an irc_msg and send it to the server. The message is written
+ * straight into the output buffer, or the queue slot when called from
+ * another thread. The caller keeps ownership of message.
+ */
+void
+irc_push_message (const irc_server *s, const irc_msg *message)
 {
-	int ret, sock = -1;
-	struct addrinfo *ai = NULL, *ai_head, hints;
-
-	memset (&hints, 0, sizeof (hints));
-	hints.ai_family = AF_UNSPEC;
-	hints.ai_socktype = SOCK_STREAM;
-	ret = getaddrinfo (s->host, s->port, &hints, &ai);
-	ai_head = ai;
-	if (ret) {
-		perror ("client: address");
-		exit (EXIT_FAILURE);
+	irc_connection *c = get_irc_server_connection (s);
+	if (c == NULL) {
+		log_info ("Not connected to %s, dropping message\n", s->name);
+		return;
 	}
 
-	/* Try the address info until we get a valid socket */
-	int conn = -1;
-	while (conn == -1 && ai != NULL) {
-		sock = socket (ai->ai_family, ai->ai_socktype, ai->ai_protocol);
-		if (sock == -1) {
-			perror ("client: socket");
-			continue;
+	/* The only write through the cast is a tag value getting unescaped
+	 * in place on first read, once, which irc_msg_tag_value makes
+	 * thread safe through the tag's atomic state */
+	void *user_data = (irc_msg *)message;
+	size_t len = ircmsg_serialize_buffer_len (&serializer_cbs, user_data);
+
+	if (on_loop_thread ()) {
+		if (c->state != IRC_CONNECTION_READY) {
+			log_info ("Not connected to %s, dropping message\n", s->name);
+			return;
 		}
 
-		/* [> We have a valid socket. Setup the connection <] */
-		conn = connect (sock, ai->ai_addr, ai->ai_addrlen);
-		if (conn == -1 || errno) {
-			close (sock);
-			conn = -1;
-			ai = ai->ai_next;
-			errno = 0;
+		irc_sendq_lane lane =
+		  irc_sendq_lane_for (message->command, strlen (message->command));
+		const char *target = "";
+		if (lane == IRC_LANE_BULK && message->params.len > 0)
+			target = message->params.params[0];
+		size_t target_len = strlen (target);
+
+		bool direct = irc_sendq_can_send (&c->sendq, lane, ev_now (irc_get_event_loop ()));
+		char *dst = direct
+			      ? irc_buffer_reserve (&c->write_buf, len)
+			      : irc_sendq_reserve (&c->sendq, lane, target, target_len, len);
+		if (dst == NULL) {
+			log_info ("Out of memory queueing message for %s\n", s->name);
+			return;
 		}
+
+		if (!ircmsg_serialize ((uint8_t *)dst, len, &serializer_cbs, user_data)) {
+			log_info ("Couldn't serialize %s for %s\n", message->command, s->name);
+			return;
+		}
+
+		/* Recorded before anything is sent, a flush may free dst */
+		if (direct) {
+			irc_buffer_commit (&c->write_buf, len);
+			irc_sendq_take (&c->sendq);
+			c->stats.lines_out++;
+			irc_record (c, IRC_CAPTURE_OUT, dst, len);
+			irc_output_queued (c);
+		} else if (irc_sendq_commit (&c->sendq, lane, target, target_len, len)) {
+			c->stats.lines_out++;
+			irc_record (c, IRC_CAPTURE_OUT, dst, len);
+			irc_schedule_output (c);
+		}
+		return;
+	}
+
+	if (len > IRC_OUT_LINE_SIZE) {
+		log_info ("Message for %s too long, dropping it\n", s->name);
+		return;
 	}
 
-	freeaddrinfo (ai_head);
+	irc_out_line *line = irc_mpsc_reserve (&c->out_queue);
+	if (line == NULL) {
+		log_info ("Output queue for %s full, dropping message\n", s->name);
+		return;
+	}
 
-	return sock;
+	/* A reserved slot has to be published, an empty line sends nothing */
+	line->len = len;
+	if (!ircmsg_serialize ((uint8_t *)line->data, len, &serializer_cbs, user_data)) {
+		log_info ("Couldn't serialize %s for %s\n", message->command, s->name);
+		line->len = 0;
+	}
+	irc_mpsc_publish (line);
+
+	ev_async_send (irc_get_event_loop (), &c->out_async);
 }
 
-/* setup an IRC connection to server s, return whether it succeeded */
-int
-setup_irc_connection (const irc_server *s, int sock)
+/* Send command with params, built on the stack without allocating */
+void
+irc_push_command (const irc_server *s, char *command, int params_length, char *params[])
 {
-	irc_connection *c = create_irc_connection (s, sock);
-	if (c == NULL)
-		return 1;
+	irc_msg msg;
+	irc_msg_init (&msg, NULL, command, params_length, params);
+	irc_push_message (s, &msg);
+}
 
-	make_irc_connection_entry (c);
-	if (s->secure) {
-		log_debug ("Encrypting connection\n");
-		encrypt_irc_connection (c);
+/*
+ * Queue str to be sent to server s. Safe to call from any thread, lines
+ * from other threads are handed to the loop through a lock-free queue.
+ */
+void
+irc_push_string (const irc_server *s, const char *str)
+{
+	irc_connection *c = get_irc_server_connection (s);
+	if (c == NULL) {
+		log_info ("Not connected to %s, dropping message\n", s->name);
+		return;
 	}
 
-	int ret = setnonblock (c->socket);
-	if (ret == -1) {
-		perror ("client: socket O_NONBLOCK");
-		exit (EXIT_FAILURE);
+	size_t len = strlen (str);
+	if (on_loop_thread ()) {
+		irc_queue_output (c, str, len);
+		return;
 	}
 
-	verify_socket (sock);
+	if (len > IRC_OUT_LINE_SIZE) {
+		log_info ("Message for %s too long, dropping it\n", s->name);
+		return;
+	}
 
-	return 0;
+	irc_out_line *line = irc_mpsc_reserve (&c->out_queue);
+	if (line == NULL) {
+		log_info ("Output queue for %s full, dropping message\n", s->name);
+		return;
+	}
+
+	memcpy (line->data, str, len);
+	line->len = len;
+	irc_mpsc_publish (line);
+
+	ev_async_send (irc_get_event_loop (), &c->out_async);
+}
+
+/* How much text fits on a line relayed as :prefix command target :text */
+static size_t
+irc_text_room (const irc_server *s, const char *command, const char *target, bool action)
+{
+	irc_connection *c = get_irc_server_connection (s);
+	size_t prefix = c != NULL ? irc_state_self_prefix_len (&c->chan_state) : 0;
+	if (prefix == 0)
+		prefix = strlen (s->user->nickname) + 1 + IRC_GUESS_USERHOST_LEN;
+
+	size_t overhead = 1 + prefix + 1 + strlen (command) + 1 + strlen (target) + 2 + 2;
+	if (action)
+		overhead += sizeof ("\001ACTION \001") - 1;
+
+	return overhead < IRC_LINE_SIZE ? IRC_LINE_SIZE - overhead : 0;
 }
 
-/* Encrypt the irc_connection c with GnuTLS */
 void
-encrypt_irc_connection (irc_connection *c)
+irc_push_text (const irc_server *s,
+	       const char *command,
+	       const char *target,
+	       const char *text,
+	       size_t len,
+	       bool action)
 {
-	int ret;
+	size_t max = irc_text_room (s, command, target, action);
+	if (max < IRC_MIN_TEXT_ROOM) {
+		log_info ("No room for text to %s on %s, dropping it\n", target, s->name);
+		return;
+	}
+
+	while (len > 0) {
+		size_t next;
+		size_t n = irc_text_line (text, len, max, &next);
+
+		/* Empty lines aren't sent */
+		if (n > 0) {
+			char line[IRC_LINE_SIZE];
+			int line_len = action ? snprintf (line, sizeof (line), "\001ACTION %.*s\001", (int)n, text)
+					      : snprintf (line, sizeof (line), "%.*s", (int)n, text);
+			if (line_len > 0) {
+				char *params[] = { (char *)target, line };
+				irc_push_command (s, (char *)command, 2, params);
+			}
+		}
+
+		text += next;
+		len -= next;
+	}
+}
+
+/*
+ * Write at most nbytes to the connection.
+ * Returns the number of bytes written, -1 if the write would block
+ * and -2 on errors.
+ */
+static ssize_t
+irc_write_bytes (irc_connection *c, const char *buf, size_t nbytes)
+{
+	ssize_t ret;
+
+	if (c->server->secure) {
+		/* GnuTLS puts up to a full record together from buf. After
+		 * EAGAIN it has to be called again with the same data, which
+		 * passing NULL tells it to take from its own buffer. */
+		for (;;) {
+			if (c->tls_send_again)
+				ret = gnutls_record_send (c->tls_session, NULL, 0);
+			else
+				ret = gnutls_record_send (c->tls_session, buf, nbytes);
+
+			if (ret == GNUTLS_E_INTERRUPTED || ret == GNUTLS_E_AGAIN) {
+				c->tls_send_again = true;
+				if (ret == GNUTLS_E_AGAIN)
+					return -1;
+				continue;
+			}
+			c->tls_send_again = false;
+			if (ret < 0)
+				return -2;
+			break;
+		}
+	} else {
+		do {
+			ret = send (c->socket, buf, nbytes, MSG_NOSIGNAL);
+		} while (ret == -1 && errno == EINTR);
 
+		if (ret == -1)
+			return (errno == EAGAIN || errno == EWOULDBLOCK) ? -1 : -2;
+	}
+
+	log_debug_at (&(log_fields){ .server = c->server->name }, "sent: %.*s", (int)ret, buf);
+
+	return ret;
+}
+
+/* Set up GnuTLS on the connected socket of c, -1 if that fails */
+int
+encrypt_irc_connection (irc_connection *c)
+{
 	/* Initialize the credentials */
-	gnutls_certificate_allocate_credentials (&c->tls_creds);
+	if (gnutls_certificate_allocate_credentials (&c->tls_creds) < 0)
+		return -1;
 
 	/* Initialize the session */
-	gnutls_init (&c->tls_session, GNUTLS_CLIENT | GNUTLS_NONBLOCK);
+	if (gnutls_init (&c->tls_session, GNUTLS_CLIENT | GNUTLS_NONBLOCK) < 0) {
+		gnutls_certificate_free_credentials (c->tls_creds);
+		return -1;
+	}
+	c->tls_inited = true;
 	gnutls_set_default_priority (c->tls_session);
 
+	/* Skip the full handshake if the server still knows our last session */
+	if (c->tls_resume_data.size > 0)
+		gnutls_session_set_data (c->tls_session,
+					 c->tls_resume_data.data,
+					 c->tls_resume_data.size);
+
 	/* Set credentials information */
 	gnutls_credentials_set (
 	  c->tls_session, GNUTLS_CRD_CERTIFICATE, c->tls_creds);
@@ -490,45 +1395,96 @@ encrypt_irc_connection (irc_connection *c)
 				c->server->host,
 				strlen (c->server->host));
 
-	/* Link the socket to GnuTLS */
+	/* Link the socket to GnuTLS, the handshake is driven by the loop */
 	gnutls_transport_set_int (c->tls_session, c->socket);
-	do {
-		/* Perform the handshake or die trying */
-		ret = gnutls_handshake (c->tls_session);
-	} while (ret == GNUTLS_E_INTERRUPTED || ret == GNUTLS_E_AGAIN);
+	return 0;
 }
 
-/* Create an irc_connection for irc_server s */
+/*
+ * Create an irc_connection for irc_server s, or reuse the one left behind
+ * by an earlier connection to it
+ */
 irc_connection *
-create_irc_connection (const irc_server *s, int sock)
+create_irc_connection (const irc_server *s)
 {
-	irc_connection *c = malloc (sizeof (irc_connection));
-	if (c == NULL)
-		return NULL;
+	irc_connection *c = get_irc_server_connection (s);
+	if (c == NULL) {
+		c = malloc (sizeof (irc_connection));
+		if (c == NULL)
+			return NULL;
+
+		if (irc_mpsc_init (&c->out_queue, IRC_OUT_QUEUE_SIZE, sizeof (irc_out_line)) == -1) {
+			free (c);
+			return NULL;
+		}
 
-	c->server = s;
-	c->socket = sock;
-	c->read_queue = NULL;
-	pthread_mutex_init (&c->read_queue_mtx, NULL);
-	c->write_queue = NULL;
-	pthread_mutex_init (&c->write_queue_mtx, NULL);
+		if (irc_sendq_init (&c->sendq, s->flood_burst, s->flood_rate, s->sendq_max_bytes) == -1) {
+			irc_mpsc_free (&c->out_queue);
+			free (c);
+			return NULL;
+		}
+
+		if (irc_state_init (&c->chan_state) == -1) {
+			irc_sendq_free (&c->sendq);
+			irc_mpsc_free (&c->out_queue);
+			free (c);
+			return NULL;
+		}
+		ev_init (&c->flood_timer, irc_flood_timer_callback);
+		memset (&c->stats, 0, sizeof (c->stats));
+		atomic_init (&c->backlog_msgs, 0);
+		atomic_init (&c->backlog_bytes, 0);
+		atomic_init (&c->reading_paused, false);
+		atomic_init (&c->shed, 0);
+		c->capture = NULL;
+		c->replay = NULL;
+
+		c->server = s;
+		c->state = IRC_CONNECTION_CLOSED;
+		c->socket = -1;
+		c->resolve_job = NULL;
+		c->addrs = c->next_addr = NULL;
+		c->tls_inited = false;
+		c->tls_resume_data.data = NULL;
+		c->tls_resume_data.size = 0;
+		c->reconnect_attempts = 0;
+		c->quitting = false;
+		ev_init (&c->setup_watcher, irc_setup_callback);
+		ev_init (&c->setup_timer, irc_setup_timeout_callback);
+		ev_init (&c->reconnect_timer, irc_reconnect_callback);
+		irc_buffer_init (&c->write_buf);
+		c->next = NULL;
+
+		/* The async watcher alone shouldn't keep the loop running */
+		ev_async_init (&c->out_async, irc_out_queue_callback);
+		ev_async_start (irc_get_event_loop (), &c->out_async);
+		ev_unref (irc_get_event_loop ());
+		ev_async_init (&c->resume_async, irc_resume_callback);
+		ev_async_start (irc_get_event_loop (), &c->resume_async);
+		ev_unref (irc_get_event_loop ());
+	}
+
+	c->recv_len = 0;
+	c->recv_discard = false;
+	irc_buffer_clear (&c->write_buf);
+	c->tls_send_again = false;
 
 	return c;
 }
 
-/* Store the irc_connection *c in the conns array */
+/* Make the irc_connection *c reachable through its irc_server */
 int
 make_irc_connection_entry (irc_connection *c)
 {
-	int i;
-	for (i = 0; i < MAX_CONNECTIONS; i++) {
-		if (conns[i] == NULL) {
-			conns[i] = c;
-			return 0;
-		}
-	}
+	if (connections == NULL)
+		loop_thread = pthread_self ();
 
-	return -1;
+	if (c->server->connection == c)
+		return 0;
+
+	LL_PREPEND (connections, c);
+	((irc_server *)c->server)->connection = c;
+	return 0;
 }
 
 /*
@@ -538,70 +1494,156 @@ make_irc_connection_entry (irc_connection *c)
 irc_connection *
 get_irc_server_connection (const irc_server *s)
 {
-	int i;
-	for (i = 0; conns[i] != NULL; i++) {
-		if (s == conns[i]->server)
-			return conns[i];
-	}
-
-	return NULL;
+	return s->connection;
 }
 
-/* Return the irc_connection for the server watched by the given watcher */
+/* Return the irc_connection embedding the given watcher */
 irc_connection *
 get_irc_connection_from_watcher (const ev_io *w)
 {
-	int i;
-	for (i = 0; conns[i] != NULL; i++) {
-		if (w == &conns[i]->watcher)
-			return conns[i];
+	return (irc_connection *)((char *)w - offsetof (irc_connection, watcher));
+}
+
+/* Stop watching connection c and close it, wherever its setup got to */
+static void
+close_irc_connection (irc_connection *c)
+{
+	if (c->state == IRC_CONNECTION_CLOSED)
+		return;
+
+	struct ev_loop *loop = irc_get_event_loop ();
+	ev_io_stop (loop, &c->setup_watcher);
+	ev_timer_stop (loop, &c->setup_timer);
+	ev_io_stop (loop, &c->watcher);
+	ev_io_stop (loop, &c->write_watcher);
+	ev_timer_stop (loop, &c->flood_timer);
+
+	/* A lookup still running is left to finish on its own */
+	if (c->resolve_job != NULL) {
+		c->resolve_job->conn = NULL;
+		c->resolve_job = NULL;
+	}
+	if (c->addrs != NULL) {
+		freeaddrinfo (c->addrs);
+		c->addrs = c->next_addr = NULL;
 	}
 
-	return NULL;
+	if (c->tls_inited) {
+		/* With TLS 1.3 the tickets come after the handshake, so the
+		 * session data is only complete now */
+		if (c->state == IRC_CONNECTION_READY) {
+			gnutls_free (c->tls_resume_data.data);
+			c->tls_resume_data.data = NULL;
+			c->tls_resume_data.size = 0;
+			gnutls_session_get_data2 (c->tls_session, &c->tls_resume_data);
+		}
+		gnutls_deinit (c->tls_session);
+		gnutls_certificate_free_credentials (c->tls_creds);
+		c->tls_inited = false;
+	}
+	if (c->socket != -1)
+		close (c->socket);
+	c->socket = -1;
+	c->state = IRC_CONNECTION_CLOSED;
+
+	irc_buffer_clear (&c->write_buf);
+	irc_sendq_clear (&c->sendq);
+	irc_state_clear (&c->chan_state);
+}
+
+/* Close connection c and free everything that belongs to it */
+static void
+free_irc_connection (irc_connection *c)
+{
+	c->quitting = true;
+	close_irc_connection (c);
+	ev_timer_stop (irc_get_event_loop (), &c->reconnect_timer);
+	gnutls_free (c->tls_resume_data.data);
+
+	ev_ref (irc_get_event_loop ());
+	ev_async_stop (irc_get_event_loop (), &c->out_async);
+	ev_ref (irc_get_event_loop ());
+	ev_async_stop (irc_get_event_loop (), &c->resume_async);
+	irc_mpsc_free (&c->out_queue);
+	irc_buffer_free (&c->write_buf);
+	irc_sendq_free (&c->sendq);
+	irc_state_free (&c->chan_state);
+	if (c->capture != NULL) {
+		irc_capture_close (c->capture);
+		free (c->capture);
+	}
+	if (c->replay != NULL) {
+		ev_timer_stop (irc_get_event_loop (), &c->replay->timer);
+		irc_capture_reader_close (&c->replay->reader);
+		free (c->replay);
+	}
+
+	LL_DELETE (connections, c);
+	((irc_server *)c->server)->connection = NULL;
+	free (c);
 }
 
 void
 quit_irc_connection (const irc_server *s)
 {
 	irc_connection *conn = get_irc_server_connection (s);
+	if (conn == NULL)
+		return;
 
 	char *params[1] = { "go i must now" };
-	irc_msg *quit_msg = irc_msg_new (NULL, "QUIT", 1, params);
-	irc_push_message (s, quit_msg);
+	irc_push_command (s, "QUIT", 1, params);
 
-	conn->ev_is_running = false;
-	gnutls_deinit (conn->tls_session);
-	gnutls_certificate_free_credentials (conn->tls_creds);
-	gnutls_global_deinit ();
-	close (conn->socket);
-	free (conn);
+	/* Get the QUIT out before the socket goes away */
+	irc_drain_out_queue (conn);
+	irc_flush_output (conn);
+	free_irc_connection (conn);
 }
 
-/* Returns whether the server is connected */
-bool
-server_connected (const irc_server *s)
+irc_state *
+irc_server_state (const irc_server *s)
 {
-	return get_irc_server_connection (s) != NULL;
+	irc_connection *c = get_irc_server_connection (s);
+	return c != NULL ? &c->chan_state : NULL;
 }
 
-/* Returns whether the connections cap is reached */
+/* Returns whether the server is connected */
 bool
-connections_cap_reached ()
+server_connected (const irc_server *s)
 {
-	return conns[MAX_CONNECTIONS - 1] != NULL;
+	irc_connection *c = get_irc_server_connection (s);
+	return c != NULL && c->state == IRC_CONNECTION_READY;
 }
 
 const irc_server *
 irc_get_server_from_name (const char *name)
 {
-	int i;
-	for (i = 0; conns[i] != NULL; i++)
-		if (strcmp (name, conns[i]->server->name) == 0)
-			return conns[i]->server;
+	irc_connection *c;
+	LL_FOREACH (connections, c) {
+		if (strcmp (name, c->server->name) == 0)
+			return c->server;
+	}
 
 	return NULL;
 }
 
+void
+irc_foreach_connection (irc_conn_stats_fn fn, void *data)
+{
+	irc_connection *c;
+	LL_FOREACH (connections, c) {
+		c->stats.recv_queued = c->recv_len;
+		c->stats.write_queued = irc_buffer_len (&c->write_buf);
+		c->stats.sendq_queued = irc_sendq_len (&c->sendq);
+		c->stats.out_queued = irc_mpsc_len (&c->out_queue);
+		c->stats.shed = atomic_load_explicit (&c->shed, memory_order_relaxed);
+		c->stats.coalesced = c->sendq.coalesced;
+		c->stats.sendq_dropped = c->sendq.dropped;
+		c->stats.backlog_msgs = atomic_load (&c->backlog_msgs);
+		c->stats.backlog_bytes = atomic_load (&c->backlog_bytes);
+		fn (c->server, c->state == IRC_CONNECTION_READY, &c->stats, data);
+	}
+}
+
 const char *
 irc_get_server_name (const irc_server *s)
 {
@@ -0,0 +1,49 @@
+/*
+ * A growable byte buffer that is appended to at its tail and consumed
+ * from its head
+ */
+#ifndef IRC_BUFFER_H
+#define IRC_BUFFER_H
+
+#include <stddef.h>
+
+typedef struct irc_buffer
+{
+	char *data;
+	size_t head; /* first byte that hasn't been consumed */
+	size_t tail; /* one past the last byte written */
+	size_t cap;
+} irc_buffer;
+
+void
+irc_buffer_init (irc_buffer *b);
+void
+irc_buffer_free (irc_buffer *b);
+void
+irc_buffer_clear (irc_buffer *b);
+
+/* Make room for n more bytes and return where they go, NULL on OOM */
+char *
+irc_buffer_reserve (irc_buffer *b, size_t n);
+/* Mark n bytes of the reserved space as written */
+void
+irc_buffer_commit (irc_buffer *b, size_t n);
+int
+irc_buffer_append (irc_buffer *b, const char *data, size_t n);
+/* Drop n bytes from the head of the buffer */
+void
+irc_buffer_consume (irc_buffer *b, size_t n);
+
+static inline const char *
+irc_buffer_data (const irc_buffer *b)
+{
+	return b->data + b->head;
+}
+
+static inline size_t
+irc_buffer_len (const irc_buffer *b)
+{
+	return b->tail - b->head;
+}
+
+#endif /* IRC_BUFFER_H */
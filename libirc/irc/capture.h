@@ -0,0 +1,83 @@
+/*
+ * Raw traffic captures. Every line a connection receives or sends is
+ * appended, with the time since the capture started and its direction,
+ * to a segment file that is mapped into memory, so recording a line is
+ * a memcpy. A full segment is closed and the next one started:
+ *
+ *   <dir>/<server>-<YYYYmmdd-HHMMSS>.idx
+ *   <dir>/<server>-<YYYYmmdd-HHMMSS>.000000.cap, .000001.cap, ...
+ *
+ * The .idx file names the server and has an entry about every second
+ * of capture time pointing into the segments, a reader seeks with it.
+ * A segment's header says how much of it is records, a capture cut
+ * short by a crash reads fine up to the last whole line.
+ *
+ * Nothing here knows about connections or the event loop, the bench
+ * and mock server tools read captures with it as well.
+ */
+#ifndef IRC_CAPTURE_H
+#define IRC_CAPTURE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define IRC_CAPTURE_SEGMENT_SIZE (16 * 1024 * 1024)
+#define IRC_CAPTURE_SERVER_LEN 48
+
+typedef enum irc_capture_dir
+{
+	IRC_CAPTURE_IN,
+	IRC_CAPTURE_OUT,
+} irc_capture_dir;
+
+/* Where a capture is being written, only touched on one thread */
+typedef struct irc_capture
+{
+	char *base; /* the paths without their suffix */
+	uint64_t start_ns;
+	uint64_t next_index_ns;
+	int index_fd;
+	uint32_t seq;
+	int seg_fd;
+	char *seg; /* the mapped segment, NULL once the capture failed */
+} irc_capture;
+
+typedef struct irc_capture_record
+{
+	uint64_t ts_ns; /* since the capture started */
+	irc_capture_dir dir;
+	const char *line; /* CRLF included, valid until the next record */
+	size_t len;
+} irc_capture_record;
+
+typedef struct irc_capture_reader
+{
+	char *base;
+	char server[IRC_CAPTURE_SERVER_LEN];
+	uint32_t seq;
+	char *seg;
+	size_t seg_len;
+	size_t end; /* of the records in seg */
+	size_t pos;
+} irc_capture_reader;
+
+/* Start a capture of server's traffic in dir, -1 with errno set if not */
+int
+irc_capture_open (irc_capture *cap, const char *dir, const char *server);
+/* Returns -1 if the line couldn't be recorded, the capture is over then */
+int
+irc_capture_append (irc_capture *cap, irc_capture_dir dir, const char *line, size_t len);
+void
+irc_capture_close (irc_capture *cap);
+
+/* Read the capture index_path names from from_secs into it, -1 if it can't */
+int
+irc_capture_reader_open (irc_capture_reader *r, const char *index_path, double from_secs);
+/* The next line in the capture, false at its end */
+bool
+irc_capture_next (irc_capture_reader *r, irc_capture_record *rec);
+void
+irc_capture_reader_close (irc_capture_reader *r);
+
+#endif /* IRC_CAPTURE_H */
@@ -0,0 +1,67 @@
+/*
+ * IRC commands interned to small integers, so hooks can be looked up by
+ * indexing an array. Numerics are their own number, known verbs have a
+ * fixed ID and other verbs get one the first time they're seen.
+ */
+#ifndef IRC_COMMAND_H
+#define IRC_COMMAND_H
+
+#include <stddef.h>
+
+typedef int irc_command_id;
+
+#define IRC_CMD_NUMERIC_COUNT 1000
+/* Room for verbs interned at runtime, hooks for e.g. "PREINIT" */
+#define IRC_CMD_DYNAMIC_COUNT 256
+
+/* Numerics are their own ID */
+#define IRC_RPL_WELCOME 1
+
+enum
+{
+	IRC_CMD_PRIVMSG = IRC_CMD_NUMERIC_COUNT,
+	IRC_CMD_NOTICE,
+	IRC_CMD_JOIN,
+	IRC_CMD_PART,
+	IRC_CMD_QUIT,
+	IRC_CMD_NICK,
+	IRC_CMD_MODE,
+	IRC_CMD_TOPIC,
+	IRC_CMD_KICK,
+	IRC_CMD_INVITE,
+	IRC_CMD_PING,
+	IRC_CMD_PONG,
+	IRC_CMD_ERROR,
+	IRC_CMD_CAP,
+	IRC_CMD_AUTHENTICATE,
+	IRC_CMD_ACCOUNT,
+	IRC_CMD_AWAY,
+	IRC_CMD_CHGHOST,
+	IRC_CMD_SETNAME,
+	IRC_CMD_BATCH,
+	IRC_CMD_TAGMSG,
+	IRC_CMD_WALLOPS,
+	IRC_CMD_KILL,
+	IRC_CMD_USER,
+	IRC_CMD_PASS,
+	IRC_CMD_WHO,
+	IRC_CMD_WHOIS,
+	IRC_CMD_NAMES,
+	IRC_CMD_LIST,
+	IRC_CMD_MOTD,
+	IRC_CMD_OPER,
+	IRC_CMD_KNOWN_END,
+	IRC_CMD_DYNAMIC_START = IRC_CMD_KNOWN_END,
+	/* Any verb that hasn't been interned */
+	IRC_CMD_UNKNOWN = IRC_CMD_DYNAMIC_START + IRC_CMD_DYNAMIC_COUNT,
+	IRC_CMD_COUNT,
+};
+
+/* The ID of command, IRC_CMD_UNKNOWN if it has none yet */
+irc_command_id
+irc_command_lookup (const char *command, size_t len);
+/* The ID of command, giving it one if needed */
+irc_command_id
+irc_command_intern (const char *command);
+
+#endif /* IRC_COMMAND_H */
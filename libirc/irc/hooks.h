@@ -2,21 +2,40 @@
 #define IRC_HOOKS_H
 
 #include "irc.h"
+#include "irc/command.h"
+#include "irc/metrics.h"
+
+typedef void (*irc_hook_fn) (const irc_server *, const irc_msg *msg);
 
 typedef struct irc_hook
 {
-	char *command;
-	void (*entry) (const irc_server *, const irc_msg *msg);
+	irc_command_id command;
+	irc_hook_fn entry;
+	/* What the hook's metrics are labelled with */
+	const char *command_name;
+	const char *name;
+	irc_histogram time;
 	struct irc_hook *next;
 } irc_hook;
 
+/* Hooks are added and run on the event loop's thread */
 void
 init_hooks (void);
+/* Hook command, or every message received for "*" */
 void
-add_hook (const char *command, void (*f) (const irc_server *, const irc_msg *));
-const irc_hook *
-get_hooks (const char *command);
+add_named_hook (const char *command, const char *name, irc_hook_fn f);
+/* Hooks are named after their function */
+#define add_hook(command, f) add_named_hook ((command), #f, (f))
+/* Run the hooks added for command alone */
 void
 exec_hooks (const irc_server *s, const char *command, const irc_msg *msg);
+/* Run the hooks of msg's command followed by the "*" hooks */
+void
+exec_message_hooks (const irc_server *s, const irc_msg *msg);
+
+typedef void (*irc_hook_stats_fn) (const irc_hook *hook, void *data);
+/* Call fn for every hook, on the loop thread */
+void
+irc_foreach_hook (irc_hook_stats_fn fn, void *data);
 
 #endif /* IRC_HOOKS_H */
@@ -6,8 +6,10 @@
 #include <stdlib.h>
 #include <stdint.h>
 
+#include "irc/metrics.h"
 #include "irc/parser.h"
 #include "irc/serializer.h"
+#include "irc/state.h"
 
 typedef struct irc_user
 {
@@ -20,12 +22,18 @@ typedef struct irc_user
 	char *sasl_pass;
 } irc_user;
 
+/* Messages and bytes of them handlers may hold, see irc_backlog_hold */
+#define IRC_BACKLOG_DEFAULT_MSGS 10000
+#define IRC_BACKLOG_DEFAULT_BYTES (32 * 1024 * 1024)
+
 typedef struct irc_channel
 {
 	char channel[1024];
 	struct irc_channel *next;
 } irc_channel;
 
+struct irc_connection;
+
 typedef struct irc_server
 {
 	char *name;
@@ -34,27 +42,92 @@ typedef struct irc_server
 	bool secure;
 	struct irc_user *user;
 	struct irc_channel *channels;
+	/* Flood control, lines let through at once and lines per second */
+	double flood_burst;
+	double flood_rate;
+	/* Limits on what waits for handlers and for the socket, 0 for none */
+	size_t backlog_max_msgs;
+	size_t backlog_max_bytes;
+	size_t sendq_max_bytes;
+	/* Where to capture the connection's traffic, NULL or "" for nowhere */
+	char *capture_dir;
+	struct irc_server *next;
+
+	/* Managed by libirc, set while there is a connection to the server */
+	struct irc_connection *connection;
 } irc_server;
 
+struct ev_loop;
+
 void
 register_core_hooks (void);
 
 int
 irc_server_connect (const irc_server *);
+/*
+ * Feed the server lines of a capture, from its index at path, to s as if
+ * the server was sending them, from seconds into the capture on. fast
+ * hands them on as quickly as the handlers take them, otherwise the
+ * pauses between them are kept. Nothing is sent anywhere. Once every
+ * line is handled the event loop is stopped.
+ */
+int
+irc_replay (const irc_server *s, const char *path, double from, bool fast);
+struct ev_loop *
+irc_get_event_loop (void);
 void
-irc_do_event_loop (const irc_server *);
+irc_do_event_loop (void);
 void
-irc_do_init_event_loop (const irc_server *);
-int
-irc_read_message (const irc_server *, char *);
+irc_push_message (const irc_server *s, const irc_msg *message);
 void
-irc_push_message (const irc_server *s, irc_msg *message);
+irc_push_command (const irc_server *s, char *command, int params_length, char *params[]);
 void
 irc_push_string (const irc_server *s, const char *str);
+/*
+ * Send len bytes of text to target with command, PRIVMSG or NOTICE, as
+ * a CTCP ACTION if action is set. Text too long for one line once the
+ * server puts our prefix in front is split over as many lines as it
+ * takes, at newlines, spaces or UTF-8 character boundaries.
+ */
+void
+irc_push_text (const irc_server *s,
+	       const char *command,
+	       const char *target,
+	       const char *text,
+	       size_t len,
+	       bool action);
 const irc_server *
 irc_get_server_from_name (const char *name);
 const char *
 irc_get_server_name (const irc_server *);
+/* Channels and users seen on the connection to s, NULL if there's none */
+irc_state *
+irc_server_state (const irc_server *s);
+
+/*
+ * Received messages handed on to be handled later count towards the
+ * connection's backlog until released. Past either limit the connection
+ * stops reading, leaving the rest to TCP, and reads again once the
+ * backlog is down to half. Release may be called from any thread.
+ */
+void
+irc_backlog_hold (const irc_server *s, const irc_msg *msg);
+void
+irc_backlog_release (const irc_server *s, const irc_msg *msg);
+/* Whether the backlog is past its limits, for handlers that can shed */
+bool
+irc_backlog_full (const irc_server *s);
+/* Count a message a handler skipped to shed load */
+void
+irc_backlog_shed (const irc_server *s);
+
+typedef void (*irc_conn_stats_fn) (const irc_server *s,
+				   bool connected,
+				   const irc_conn_stats *stats,
+				   void *data);
+/* Call fn with the stats of every connection, on the loop thread */
+void
+irc_foreach_connection (irc_conn_stats_fn fn, void *data);
 
 void
 quit_irc_connection (const irc_server *s);
@@ -4,35 +4,107 @@
 #ifndef IRC_MSG_H
 #define IRC_MSG_H
 
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 
+#include "irc/command.h"
+
+/* RFC 1459 allows no more than 15 parameters */
+#define IRC_MSG_MAX_PARAMS 15
+#define IRC_MSG_MAX_TAGS 32
+
+/*
+ * Tag values are kept escaped until somebody asks for them, see
+ * irc_msg_get_tag. value is NULL for tags without a value.
+ */
 typedef struct irc_msg_tag
 {
 	char *name;
 	char *value;
+	atomic_uchar value_state;
 } irc_msg_tag;
 
 typedef struct irc_msg_tags
 {
 	int len;
-	struct irc_msg_tag **tags;
+	struct irc_msg_tag tags[IRC_MSG_MAX_TAGS];
+	/* Indices into tags, sorted by tag name */
+	unsigned char by_name[IRC_MSG_MAX_TAGS];
 } irc_msg_tags;
 
 typedef struct irc_msg_params
 {
 	int len;
-	char **params;
+	char *params[IRC_MSG_MAX_PARAMS];
 } irc_msg_params;
 
+/*
+ * A message and the strings it points to are a single allocation:
+ * parsed messages copy every part of the line into their arena, so
+ * they stay valid after the receive buffer moves on.
+ */
 typedef struct irc_msg
 {
-	struct irc_msg_tags *tags;
+	struct irc_msg_tags tags;
 	char *prefix;
 	char *command;
-	struct irc_msg_params *params;
+	irc_command_id command_id;
+	struct irc_msg_params params;
+
+	/* Received messages are shared by whoever handles them */
+	atomic_int refs;
+
+	size_t arena_len;
+	size_t arena_cap;
+	char arena[];
 } irc_msg;
 
+/*
+ * Take another reference to a message from the parser, which frees it
+ * once the last one is dropped. The count isn't part of what const
+ * promises, so this works on const messages too.
+ */
+irc_msg *
+irc_msg_ref (const irc_msg *msg);
+void
+irc_msg_unref (irc_msg *msg);
+
 irc_msg *
 irc_msg_new (char *prefix, char *command, int params_length, char *params[]);
+/*
+ * Set up an irc_msg without an arena, e.g. on the stack. The message
+ * points to the strings passed in, nothing is copied.
+ */
+void
+irc_msg_init (irc_msg *msg, char *prefix, char *command, int params_length, char *params[]);
+
+/*
+ * The unescaped value of tag name, "" if the tag has no value and NULL
+ * if the message doesn't carry it
+ */
+const char *
+irc_msg_get_tag (const irc_msg *msg, const char *name);
+/* The unescaped value of the tag at tags[idx] */
+const char *
+irc_msg_tag_value (const irc_msg *msg, int idx);
+
+/*
+ * The parts of a nick!ident@host prefix, pointing into the prefix.
+ * Parts the prefix doesn't have, e.g. for servers, are NULL.
+ */
+typedef struct irc_prefix
+{
+	const char *nick;
+	size_t nick_len;
+	const char *ident;
+	size_t ident_len;
+	const char *host;
+	size_t host_len;
+} irc_prefix;
+
+void
+irc_prefix_split (const char *prefix, irc_prefix *out);
 
 #endif
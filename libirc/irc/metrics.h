@@ -0,0 +1,90 @@
+/*
+ * Always-on counters and latency histograms for the hot paths. Every
+ * counter has one writer at a time, the loop thread or the worker that
+ * holds a module, so recording is a relaxed load and store without any
+ * locked instruction. Readers on other threads may see a sample that is
+ * half recorded, which is off by one at worst.
+ */
+#ifndef IRC_METRICS_H
+#define IRC_METRICS_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/* Bucket i counts samples below 2^(i + IRC_HIST_MIN_SHIFT) ns, the last
+ * one everything above. The first bound is about a microsecond, the last
+ * about two minutes. */
+#define IRC_HIST_MIN_SHIFT 10
+#define IRC_HIST_BUCKETS 28
+
+typedef struct irc_histogram
+{
+	atomic_ullong buckets[IRC_HIST_BUCKETS];
+	atomic_ullong count;
+	atomic_ullong sum_ns;
+} irc_histogram;
+
+/* What a connection has seen, kept across reconnects */
+typedef struct irc_conn_stats
+{
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+	uint64_t lines_in;
+	uint64_t lines_out;
+	irc_histogram parse;
+	uint64_t read_pauses; /* times handlers fell behind and reading stopped */
+
+	/* Filled in when the stats are reported */
+	uint64_t shed;		 /* messages handlers skipped to shed load */
+	uint64_t coalesced;	 /* lines not sent for being queued already */
+	uint64_t sendq_dropped;	 /* lines not sent for the send queue limit */
+	size_t backlog_msgs;	 /* received messages handlers still hold */
+	size_t backlog_bytes;
+	size_t recv_queued;  /* partial line waiting for the rest */
+	size_t write_queued; /* bytes waiting for the socket */
+	size_t sendq_queued; /* bytes held back by flood control */
+	size_t out_queued;   /* lines other threads pushed, not yet picked up */
+} irc_conn_stats;
+
+static inline uint64_t
+irc_metrics_now (void)
+{
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static inline void
+irc_counter_add (atomic_ullong *c, uint64_t n)
+{
+	atomic_store_explicit (c, atomic_load_explicit (c, memory_order_relaxed) + n,
+			       memory_order_relaxed);
+}
+
+static inline void
+irc_histogram_record (irc_histogram *h, uint64_t ns)
+{
+	int bits = ns > 0 ? 64 - __builtin_clzll (ns) : 0;
+	int b = bits > IRC_HIST_MIN_SHIFT ? bits - IRC_HIST_MIN_SHIFT : 0;
+	if (b >= IRC_HIST_BUCKETS)
+		b = IRC_HIST_BUCKETS - 1;
+
+	irc_counter_add (&h->buckets[b], 1);
+	irc_counter_add (&h->count, 1);
+	irc_counter_add (&h->sum_ns, ns);
+}
+
+/* The upper bound of bucket i in nanoseconds, 0 for the last one */
+static inline uint64_t
+irc_histogram_bound (int i)
+{
+	return i < IRC_HIST_BUCKETS - 1 ? (uint64_t)1 << (i + IRC_HIST_MIN_SHIFT) : 0;
+}
+
+/* The bound below which a fraction q of the samples are, in nanoseconds */
+uint64_t
+irc_histogram_quantile (const irc_histogram *h, double q);
+
+#endif /* IRC_METRICS_H */
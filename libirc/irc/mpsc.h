@@ -0,0 +1,58 @@
+/*
+ * A bounded, lock-free multi-producer/single-consumer queue.
+ * Elements live inline in a preallocated ring, so pushing and popping
+ * never allocate. Producers reserve a slot, fill it in and publish it,
+ * the consumer peeks at the oldest published slot and releases it once
+ * it is done with it.
+ */
+#ifndef IRC_MPSC_H
+#define IRC_MPSC_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define IRC_MPSC_CACHE_LINE 64
+
+typedef struct irc_mpsc
+{
+	char *cells;
+	size_t cell_size;
+	size_t mask;
+	/*
+	 * Producers and the consumer each get their own cache line. Padded
+	 * a line apart rather than aligned, queues live in malloc'd structs
+	 * that don't get more than max_align_t.
+	 */
+	char pad_head[IRC_MPSC_CACHE_LINE];
+	atomic_size_t enqueue_pos;
+	char pad_enqueue[IRC_MPSC_CACHE_LINE - sizeof (atomic_size_t)];
+	atomic_size_t dequeue_pos;
+	char pad_dequeue[IRC_MPSC_CACHE_LINE - sizeof (atomic_size_t)];
+} irc_mpsc;
+
+/* capacity is rounded up to a power of two */
+int
+irc_mpsc_init (irc_mpsc *q, size_t capacity, size_t elem_size);
+void
+irc_mpsc_free (irc_mpsc *q);
+
+/* Claim a slot to fill in, NULL if the queue is full. Any thread. */
+void *
+irc_mpsc_reserve (irc_mpsc *q);
+/* Make a reserved slot visible to the consumer */
+void
+irc_mpsc_publish (void *elem);
+
+/* The oldest published element, NULL if there is none. Consumer only. */
+void *
+irc_mpsc_peek (irc_mpsc *q);
+/* Hand the element returned by irc_mpsc_peek back to the producers */
+void
+irc_mpsc_release (irc_mpsc *q, void *elem);
+
+/* Approximate number of queued elements */
+size_t
+irc_mpsc_len (irc_mpsc *q);
+
+#endif /* IRC_MPSC_H */
@@ -5,23 +5,28 @@
 #include "ircmsg/parser.h"
 #include "irc/message.h"
 
-struct irc_msg_tags *
-allocate_tags (void);
-struct irc_msg_params *
-allocate_params (void);
+/* irc_msg_tag.value_state */
+enum
+{
+	IRC_TAG_UNESCAPED,
+	IRC_TAG_UNESCAPING,
+	IRC_TAG_ESCAPED,
+};
 
-void
-append_tag (struct irc_msg_tag *tag, struct irc_msg_tags *tags);
-void
+bool
+append_tag (char *name, char *value, bool escaped, struct irc_msg_tags *tags);
+/* Index of tag name in tags->by_name, or where it would go as ~index */
+int
+find_tag (const struct irc_msg_tags *tags, const char *name, size_t name_len);
+bool
 append_param (char *param, struct irc_msg_params *params);
 
-void
-free_tags (struct irc_msg_tags *tags);
-void
-free_params (struct irc_msg_params *params);
-
+/* A message without an arena, its strings are owned by the caller */
 struct irc_msg *
 alloc_msg (void);
+/* A message with enough arena to parse a raw line of raw_len bytes */
+struct irc_msg *
+alloc_msg_sized (size_t raw_len);
 void
 free_msg (struct irc_msg *msg);
 
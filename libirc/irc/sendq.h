@@ -0,0 +1,99 @@
+/*
+ * Outbound flood control. Lines wait in one of three lanes and are let
+ * out through a token bucket, urgent before core before bulk. Bulk lines
+ * are queued per target and the targets take turns.
+ */
+#ifndef IRC_SENDQ_H
+#define IRC_SENDQ_H
+
+#include <glib.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "irc/buffer.h"
+
+#define IRC_SENDQ_DEFAULT_BURST 5
+#define IRC_SENDQ_DEFAULT_RATE 1.0
+#define IRC_SENDQ_DEFAULT_MAX_BYTES (1024 * 1024)
+
+typedef enum irc_sendq_lane
+{
+	IRC_LANE_URGENT, /* keeps the connection alive, never waits */
+	IRC_LANE_CORE,   /* joining and managing channels */
+	IRC_LANE_BULK,   /* everything else, fair between targets */
+} irc_sendq_lane;
+
+typedef struct irc_sendq_target
+{
+	char *name;
+	irc_buffer lines;
+	/* Ring of the targets that have lines waiting */
+	struct irc_sendq_target *prev, *next;
+} irc_sendq_target;
+
+typedef struct irc_sendq
+{
+	irc_buffer urgent;
+	irc_buffer core;
+	GHashTable *targets;
+	irc_sendq_target *pending; /* the target that goes next */
+
+	double burst; /* bucket size in lines */
+	double rate;  /* lines per second, 0 to not limit */
+	double tokens;
+	double last_refill;
+
+	/* Bulk lines past max_bytes waiting are dropped, 0 for no limit */
+	size_t max_bytes;
+	size_t bulk_len;
+	/* Bulk lines not queued, for already waiting or for the limit */
+	unsigned long long coalesced;
+	unsigned long long dropped;
+} irc_sendq;
+
+int
+irc_sendq_init (irc_sendq *q, double burst, double rate, size_t max_bytes);
+void
+irc_sendq_free (irc_sendq *q);
+/* Drop every waiting line */
+void
+irc_sendq_clear (irc_sendq *q);
+
+irc_sendq_lane
+irc_sendq_lane_for (const char *command, size_t len);
+/* Find the lane and, for bulk lines, the target of a serialized line */
+irc_sendq_lane
+irc_sendq_classify (const char *line, size_t len, const char **target, size_t *target_len);
+
+/*
+ * Whether a line for lane can skip the queue and be written right away,
+ * irc_sendq_take has to be called when it is
+ */
+bool
+irc_sendq_can_send (irc_sendq *q, irc_sendq_lane lane, double now);
+void
+irc_sendq_take (irc_sendq *q);
+
+/*
+ * Queue a line of len bytes. Reserve returns where the line goes, NULL on
+ * OOM, and commit queues it once it's written. A bulk line the same as
+ * one already waiting for its target, or one past max_bytes, isn't
+ * queued and commit returns false.
+ */
+char *
+irc_sendq_reserve (irc_sendq *q, irc_sendq_lane lane, const char *target, size_t target_len, size_t len);
+bool
+irc_sendq_commit (irc_sendq *q, irc_sendq_lane lane, const char *target, size_t target_len, size_t len);
+
+/*
+ * Move every line the bucket allows to out. Returns true if lines are
+ * still waiting, wait is then set to the seconds until the next token.
+ */
+bool
+irc_sendq_flush (irc_sendq *q, irc_buffer *out, double now, double *wait);
+
+/* Bytes waiting in every lane */
+size_t
+irc_sendq_len (const irc_sendq *q);
+
+#endif /* IRC_SENDQ_H */
@@ -0,0 +1,103 @@
+/*
+ * Who is in which channel, as far as the messages a connection received
+ * tell. The state hooks in core_hooks.c feed it from JOIN, PART, KICK,
+ * QUIT, NICK, MODE and NAMES replies, only channels we are in are kept.
+ *
+ * Nicks and channel names are compared under the server's CASEMAPPING.
+ * Every user is kept once however many channels they share with us,
+ * their ident@host strings are interned since many users share a cloak.
+ *
+ * Updates happen on the loop thread, the queries can be called from any
+ * thread and hold a read lock while they run.
+ */
+#ifndef IRC_STATE_H
+#define IRC_STATE_H
+
+#include <glib.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "irc/text.h"
+
+/* Membership modes are bits in a byte, one per PREFIX mode */
+#define IRC_STATE_MAX_PREFIXES 8
+
+typedef struct irc_state
+{
+	GRWLock lock;
+	GHashTable *users;    /* folded nick -> irc_state_user */
+	GHashTable *channels; /* folded name -> irc_state_chan */
+	GHashTable *hosts;    /* interned ident@host -> its reference count */
+	char *self;	      /* our nick, once the server told us */
+
+	/* From ISUPPORT, the RFC 1459 defaults until the server says */
+	irc_casemapping casemapping;
+	char prefix_modes[IRC_STATE_MAX_PREFIXES + 1]; /* "ov" */
+	char prefix_chars[IRC_STATE_MAX_PREFIXES + 1]; /* "@+" */
+	uint8_t chanmode_types[128];		       /* see state.c */
+} irc_state;
+
+int
+irc_state_init (irc_state *st);
+void
+irc_state_free (irc_state *st);
+/* Forget every channel and user and what ISUPPORT said */
+void
+irc_state_clear (irc_state *st);
+
+/*
+ * Updates, on the loop thread. Where a user is passed it can be a nick
+ * or a nick!ident@host prefix, users are only tracked while they share
+ * a channel with us.
+ */
+void
+irc_state_welcome (irc_state *st, const char *nick);
+/* The tokens of an RPL_ISUPPORT (005) */
+void
+irc_state_isupport (irc_state *st, int argc, char **argv);
+void
+irc_state_join (irc_state *st, const char *user, const char *channel);
+/* For PART and KICK alike */
+void
+irc_state_part (irc_state *st, const char *user, const char *channel);
+void
+irc_state_quit (irc_state *st, const char *user);
+void
+irc_state_nick (irc_state *st, const char *user, const char *nick);
+/* A channel MODE, argv[0] is the mode string and its arguments follow */
+void
+irc_state_mode (irc_state *st, const char *channel, int argc, char **argv);
+/* The names of an RPL_NAMREPLY (353), with their prefixes */
+void
+irc_state_names (irc_state *st, const char *channel, const char *names);
+
+/* Queries, from any thread */
+typedef void (*irc_state_name_fn) (const char *name, void *data);
+/* Call fn with every member of channel, false if we aren't in it */
+bool
+irc_state_channel_users (irc_state *st, const char *channel, irc_state_name_fn fn, void *data);
+/* Call fn with every channel nick shares with us, false if there's none */
+bool
+irc_state_user_channels (irc_state *st, const char *nick, irc_state_name_fn fn, void *data);
+/*
+ * The mode letters nick has in channel, highest first, written to out.
+ * False if nick isn't in the channel.
+ */
+bool
+irc_state_user_modes (irc_state *st,
+		      const char *channel,
+		      const char *nick,
+		      char out[IRC_STATE_MAX_PREFIXES + 1]);
+/* nick's ident@host, copied to out, false if it isn't known */
+bool
+irc_state_user_host (irc_state *st, const char *nick, char *out, size_t out_len);
+
+/* The CASEMAPPING names are compared under, see irc/text.h */
+irc_casemapping
+irc_state_casemapping (irc_state *st);
+
+/* Length of our own nick!ident@host, 0 until a message showed it */
+size_t
+irc_state_self_prefix_len (irc_state *st);
+
+#endif /* IRC_STATE_H */
@@ -0,0 +1,54 @@
+/*
+ * Text kernels for the hot paths: splitting message text into lines the
+ * server will relay whole, finding line ends, stripping formatting,
+ * checking UTF-8 and folding case the way the server does.
+ *
+ * They work 16 bytes at a time with SSE2 on x86-64 and NEON on AArch64,
+ * and a byte at a time elsewhere.
+ */
+#ifndef IRC_TEXT_H
+#define IRC_TEXT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef enum irc_casemapping
+{
+	IRC_CASEMAP_RFC1459,	    /* A-Z[\]^ fold to a-z{|}~ */
+	IRC_CASEMAP_STRICT_RFC1459, /* the same without ^ and ~ */
+	IRC_CASEMAP_ASCII,
+} irc_casemapping;
+
+/*
+ * Bytes of the first line of text when lines take at most max bytes.
+ * A line ends at a newline, else at the last space that fits, else at
+ * the last UTF-8 character boundary that fits. *next is set to where
+ * the following line starts, past the newline or space broken at.
+ */
+size_t
+irc_text_line (const char *text, size_t len, size_t max, size_t *next);
+
+/* The first '\n' in the len bytes at p, NULL if there's none */
+const char *
+irc_text_find_eol (const char *p, size_t len);
+
+/*
+ * Copy src to dst without the mIRC bold, colour, italics, monospace,
+ * reverse, strikethrough, underline and reset codes, returning the
+ * length left. dst may be src, it needs room for len bytes.
+ */
+size_t
+irc_text_strip_formatting (char *dst, const char *src, size_t len);
+
+/* Whether s is well formed UTF-8, without overlongs or surrogates */
+bool
+irc_text_valid_utf8 (const char *s, size_t len);
+
+/* Fold len bytes of src into dst under map, dst may be src */
+void
+irc_text_casefold (char *dst, const char *src, size_t len, irc_casemapping map);
+/* Whether a and b are the same nick or channel under map */
+bool
+irc_text_caseeq (const char *a, size_t a_len, const char *b, size_t b_len, irc_casemapping map);
+
+#endif /* IRC_TEXT_H */
@@ -1,5 +1,7 @@
+#include <sched.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "log/log.h"
 #include "irc/parser.h"
@@ -9,16 +11,145 @@ irc_msg *
 irc_msg_new (char *prefix, char *command, int params_length, char *params[])
 {
 	irc_msg *msg = alloc_msg ();
-	msg->tags = allocate_tags ();
-	msg->params = allocate_params ();
+	if (msg == NULL)
+		return NULL;
+
+	irc_msg_init (msg, prefix, command, params_length, params);
+	return msg;
+};
+
+void
+irc_msg_init (irc_msg *msg, char *prefix, char *command, int params_length, char *params[])
+{
+	msg->tags.len = 0;
 	msg->prefix = prefix;
 	msg->command = command;
+	msg->command_id = irc_command_lookup (command, strlen (command));
+	msg->params.len = 0;
+	atomic_init (&msg->refs, 1);
+	msg->arena_len = 0;
+	msg->arena_cap = 0;
 
 	for (int i = 0; i < params_length; i++) {
-		append_param (params[i], msg->params);
+		if (!append_param (params[i], &msg->params))
+			log_info ("irc_msg_init: too many params for %s\n", command);
 	}
+}
 
-	msg->params->len = params_length;
+/* Undo IRCv3 tag value escaping, the value only ever shrinks */
+static void
+unescape_tag_value (char *value)
+{
+	char *in = value, *out = value;
 
-	return msg;
-};
+	while (*in != '\0') {
+		if (*in != '\\') {
+			*out++ = *in++;
+			continue;
+		}
+
+		in++;
+		switch (*in) {
+			case ':':
+				*out++ = ';';
+				break;
+			case 's':
+				*out++ = ' ';
+				break;
+			case 'r':
+				*out++ = '\r';
+				break;
+			case 'n':
+				*out++ = '\n';
+				break;
+			case '\0':
+				/* A trailing backslash is dropped */
+				continue;
+			default:
+				*out++ = *in;
+				break;
+		}
+		in++;
+	}
+
+	*out = '\0';
+}
+
+const char *
+irc_msg_tag_value (const irc_msg *msg, int idx)
+{
+	/* Unescaping happens in place, the first reader does it while any
+	 * others on different threads wait for it to finish */
+	irc_msg_tag *tag = (irc_msg_tag *)&msg->tags.tags[idx];
+	unsigned char state = IRC_TAG_ESCAPED;
+
+	if (atomic_compare_exchange_strong_explicit (&tag->value_state,
+						     &state,
+						     IRC_TAG_UNESCAPING,
+						     memory_order_acquire,
+						     memory_order_acquire)) {
+		unescape_tag_value (tag->value);
+		atomic_store_explicit (&tag->value_state,
+				       IRC_TAG_UNESCAPED,
+				       memory_order_release);
+	} else {
+		while (state == IRC_TAG_UNESCAPING) {
+			sched_yield ();
+			state = atomic_load_explicit (&tag->value_state,
+						      memory_order_acquire);
+		}
+	}
+
+	return tag->value != NULL ? tag->value : "";
+}
+
+const char *
+irc_msg_get_tag (const irc_msg *msg, const char *name)
+{
+	int idx = find_tag (&msg->tags, name, strlen (name));
+	if (idx < 0)
+		return NULL;
+
+	return irc_msg_tag_value (msg, msg->tags.by_name[idx]);
+}
+
+void
+irc_prefix_split (const char *prefix, irc_prefix *out)
+{
+	*out = (irc_prefix){ 0 };
+	if (prefix == NULL)
+		return;
+
+	const char *bang = strchr (prefix, '!');
+	const char *at = strchr (bang != NULL ? bang : prefix, '@');
+
+	out->nick = prefix;
+	out->nick_len = bang != NULL ? (size_t)(bang - prefix)
+				     : at != NULL ? (size_t)(at - prefix) : strlen (prefix);
+	if (bang != NULL) {
+		out->ident = bang + 1;
+		out->ident_len = at != NULL ? (size_t)(at - out->ident) : strlen (out->ident);
+	}
+	if (at != NULL) {
+		out->host = at + 1;
+		out->host_len = strlen (out->host);
+	}
+}
+
+irc_msg *
+irc_msg_ref (const irc_msg *msg)
+{
+	irc_msg *m = (irc_msg *)msg;
+	atomic_fetch_add_explicit (&m->refs, 1, memory_order_relaxed);
+	return m;
+}
+
+void
+irc_msg_unref (irc_msg *msg)
+{
+	if (msg == NULL)
+		return;
+
+	if (atomic_fetch_sub_explicit (&msg->refs, 1, memory_order_acq_rel) == 1)
+		free_msg (msg);
+}
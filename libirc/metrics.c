@@ -0,0 +1,23 @@
+#include "irc/metrics.h"
+
+uint64_t
+irc_histogram_quantile (const irc_histogram *h, double q)
+{
+	uint64_t count = atomic_load_explicit (&h->count, memory_order_relaxed);
+	if (count == 0)
+		return 0;
+
+	uint64_t rank = (uint64_t)(q * count);
+	if (rank >= count)
+		rank = count - 1;
+
+	uint64_t seen = 0;
+	for (int i = 0; i < IRC_HIST_BUCKETS - 1; ++i) {
+		seen += atomic_load_explicit (&h->buckets[i], memory_order_relaxed);
+		if (seen > rank)
+			return irc_histogram_bound (i);
+	}
+
+	/* Slower than the last bound, that's all that can be said */
+	return (uint64_t)1 << (IRC_HIST_BUCKETS - 1 + IRC_HIST_MIN_SHIFT);
+}
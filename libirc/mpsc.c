@@ -0,0 +1,121 @@
+/*
+ * Bounded MPSC queue after Dmitry Vyukov's bounded MPMC queue.
+ * Every cell carries a sequence number telling whose turn it is:
+ * seq == pos means the cell at pos is free for a producer,
+ * seq == pos + 1 means it holds a published element for the consumer.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "irc/mpsc.h"
+
+typedef struct mpsc_cell
+{
+	atomic_size_t seq;
+	_Alignas (max_align_t) char data[];
+} mpsc_cell;
+
+static inline mpsc_cell *
+cell_at (irc_mpsc *q, size_t pos)
+{
+	return (mpsc_cell *)(q->cells + (pos & q->mask) * q->cell_size);
+}
+
+static inline mpsc_cell *
+cell_of (void *elem)
+{
+	return (mpsc_cell *)((char *)elem - offsetof (mpsc_cell, data));
+}
+
+int
+irc_mpsc_init (irc_mpsc *q, size_t capacity, size_t elem_size)
+{
+	size_t size = 2;
+	while (size < capacity)
+		size *= 2;
+
+	size_t align = _Alignof (mpsc_cell);
+	q->cell_size = (sizeof (mpsc_cell) + elem_size + align - 1) & ~(align - 1);
+	q->mask = size - 1;
+	q->cells = malloc (size * q->cell_size);
+	if (q->cells == NULL)
+		return -1;
+
+	for (size_t i = 0; i < size; i++)
+		atomic_init (&cell_at (q, i)->seq, i);
+
+	atomic_init (&q->enqueue_pos, 0);
+	atomic_init (&q->dequeue_pos, 0);
+	return 0;
+}
+
+void
+irc_mpsc_free (irc_mpsc *q)
+{
+	free (q->cells);
+	q->cells = NULL;
+}
+
+void *
+irc_mpsc_reserve (irc_mpsc *q)
+{
+	size_t pos = atomic_load_explicit (&q->enqueue_pos, memory_order_relaxed);
+
+	for (;;) {
+		mpsc_cell *cell = cell_at (q, pos);
+		size_t seq = atomic_load_explicit (&cell->seq, memory_order_acquire);
+		intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+
+		if (dif == 0) {
+			if (atomic_compare_exchange_weak_explicit (&q->enqueue_pos,
+								   &pos,
+								   pos + 1,
+								   memory_order_relaxed,
+								   memory_order_relaxed))
+				return cell->data;
+		} else if (dif < 0) {
+			/* The consumer hasn't released this cell yet */
+			return NULL;
+		} else {
+			pos = atomic_load_explicit (&q->enqueue_pos, memory_order_relaxed);
+		}
+	}
+}
+
+void
+irc_mpsc_publish (void *elem)
+{
+	mpsc_cell *cell = cell_of (elem);
+	size_t seq = atomic_load_explicit (&cell->seq, memory_order_relaxed);
+	atomic_store_explicit (&cell->seq, seq + 1, memory_order_release);
+}
+
+void *
+irc_mpsc_peek (irc_mpsc *q)
+{
+	size_t pos = atomic_load_explicit (&q->dequeue_pos, memory_order_relaxed);
+	mpsc_cell *cell = cell_at (q, pos);
+	size_t seq = atomic_load_explicit (&cell->seq, memory_order_acquire);
+
+	if (seq != pos + 1)
+		return NULL;
+	return cell->data;
+}
+
+void
+irc_mpsc_release (irc_mpsc *q, void *elem)
+{
+	mpsc_cell *cell = cell_of (elem);
+	size_t pos = atomic_load_explicit (&q->dequeue_pos, memory_order_relaxed);
+
+	atomic_store_explicit (&cell->seq, pos + q->mask + 1, memory_order_release);
+	atomic_store_explicit (&q->dequeue_pos, pos + 1, memory_order_relaxed);
+}
+
+size_t
+irc_mpsc_len (irc_mpsc *q)
+{
+	size_t deq = atomic_load_explicit (&q->dequeue_pos, memory_order_relaxed);
+	size_t enq = atomic_load_explicit (&q->enqueue_pos, memory_order_relaxed);
+	return enq > deq ? enq - deq : 0;
+}
@@ -4,44 +4,34 @@
 #include "irc/parser.h"
 #include "log/log.h"
 
-static size_t
-ptrarr_len (const void **ptrarr)
+/* Copy len bytes of str into the message arena as a C string */
+static char *
+arena_strndup (struct irc_msg *msg, const uint8_t *str, size_t len)
 {
-	size_t count = 0;
-	for (const void **iter = ptrarr; *iter != NULL; ++iter) {
-		++count;
+	if (msg->arena_len + len + 1 > msg->arena_cap) {
+		log_info ("irc_msg arena exhausted\n");
+		return NULL;
 	}
-	return count;
-}
-
-static void
-ptrarr_resize (void ***ptrarr, size_t new_size)
-{
-	*ptrarr = realloc (*ptrarr, (new_size + 1) * sizeof (**ptrarr));
-	(*ptrarr)[new_size] = NULL;
-}
 
-static char *
-alloc_strlen (const char *str, size_t len)
-{
-	char *ret = calloc (len + 1, sizeof (*ret));
-	if (str != NULL)
+	char *ret = msg->arena + msg->arena_len;
+	if (len > 0)
 		memcpy (ret, str, len);
+	ret[len] = '\0';
+	msg->arena_len += len + 1;
 	return ret;
 }
 
 void
 parse_start_message (void *user_data)
 {
-	struct irc_msg *msg = user_data;
-	msg = alloc_msg ();
+	(void)user_data;
 }
 
 void
 parse_start_tags (void *user_data)
 {
 	struct irc_msg *msg = user_data;
-	msg->tags = allocate_tags ();
+	msg->tags.len = 0;
 }
 
 void
@@ -49,35 +39,26 @@ parse_on_tag (const uint8_t *name, size_t name_len, const uint8_t *esc_value, si
 {
 	struct irc_msg *msg = user_data;
 
-	// If the tag name is unique (as in hasn't been seen before)
-	// allocate a new tag.
-	bool is_duplicate = false;
-
-	struct irc_msg_tag *tag = NULL;
-	char *current_name = alloc_strlen ((const char *)name, name_len);
-	for (size_t i = 0; i < ptrarr_len ((const void **)msg->tags); ++i) {
-		tag = msg->tags->tags[i];
-		if (strcmp (tag->name, current_name) == 0) {
-			free (current_name);
-			is_duplicate = true;
-			break;
-		}
-	}
-	if (!is_duplicate) {
-		tag = calloc (1, sizeof (*tag));
-		tag->name = current_name;
-	}
-
-	size_t value_len = ircmsg_tag_value_unescaped_size (esc_value, esc_value_len);
-	if (is_duplicate) {
-		free (tag->value);
+	/* Values are copied as they are and only unescaped when read */
+	char *value = NULL;
+	if (esc_value_len > 0)
+		value = arena_strndup (msg, esc_value, esc_value_len);
+	bool escaped = value != NULL && memchr (value, '\\', esc_value_len) != NULL;
+
+	// If the tag name has been seen before the later value wins
+	int idx = find_tag (&msg->tags, (const char *)name, name_len);
+	if (idx >= 0) {
+		struct irc_msg_tag *tag = &msg->tags.tags[msg->tags.by_name[idx]];
+		tag->value = value;
+		atomic_store_explicit (&tag->value_state,
+				       escaped ? IRC_TAG_ESCAPED : IRC_TAG_UNESCAPED,
+				       memory_order_relaxed);
+		return;
 	}
-	tag->value = value_len > 0 ? calloc (value_len + 1, sizeof (*tag->value)) : NULL;
-
-	ircmsg_tag_value_unescape (esc_value, esc_value_len, (uint8_t *)tag->value, value_len);
 
-	if (!is_duplicate)
-		append_tag (tag, msg->tags);
+	char *tag_name = arena_strndup (msg, name, name_len);
+	if (tag_name == NULL || !append_tag (tag_name, value, escaped, &msg->tags))
+		log_debug ("dropping tag %.*s\n", (int)name_len, name);
 }
 
 void
@@ -91,7 +72,7 @@ parse_on_prefix (const uint8_t *prefix, size_t prefix_len, void *user_data)
 {
 	struct irc_msg *msg = user_data;
 
-	msg->prefix = alloc_strlen ((const char *)prefix, prefix_len);
+	msg->prefix = arena_strndup (msg, prefix, prefix_len);
 }
 
 void
@@ -99,23 +80,25 @@ parse_on_command (const uint8_t *command, size_t command_len, void *user_data)
 {
 	struct irc_msg *msg = user_data;
 
-	msg->command = alloc_strlen ((const char *)command, command_len);
+	msg->command = arena_strndup (msg, command, command_len);
+	msg->command_id = irc_command_lookup ((const char *)command, command_len);
 }
 
 void
 parse_start_params (void *user_data)
 {
 	struct irc_msg *msg = user_data;
-	msg->params = allocate_params ();
+	msg->params.len = 0;
 }
 
 void
 parse_on_param (const uint8_t *param, size_t param_len, void *user_data)
 {
 	struct irc_msg *msg = user_data;
-	char *captured_param = alloc_strlen ((const char *)param, param_len);
+	char *captured_param = arena_strndup (msg, param, param_len);
 
-	append_param (captured_param, msg->params);
+	if (captured_param == NULL || !append_param (captured_param, &msg->params))
+		log_debug ("dropping param %.*s\n", (int)param_len, param);
 }
 
 void
@@ -133,9 +116,9 @@ parse_end_message (void *user_data)
 void
 parse_on_error (ircmsg_parser_err_code error, void *user_data)
 {
-	struct irc_msg *msg = user_data;
-	free_msg (msg);
-	msg = NULL;
+	/* The message is freed by whoever allocated it */
+	(void)error;
+	(void)user_data;
 }
 
 const ircmsg_parser_callbacks parse_cbs = {
@@ -158,88 +141,91 @@ const ircmsg_parser_callbacks parse_cbs = {
 	.on_error = parse_on_error,
 };
 
-struct irc_msg_tags *
-allocate_tags (void)
+int
+find_tag (const struct irc_msg_tags *tags, const char *name, size_t name_len)
 {
-	struct irc_msg_tags *ret = calloc (1, sizeof (*ret));
-	ret->len = 0;
-	return ret;
-}
+	int lo = 0, hi = tags->len;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		const char *other = tags->tags[tags->by_name[mid]].name;
 
-struct irc_msg_params *
-allocate_params (void)
-{
-	struct irc_msg_params *ret = calloc (1, sizeof (*ret));
-	ret->len = 0;
-	return ret;
+		int cmp = strncmp (other, name, name_len);
+		if (cmp == 0 && other[name_len] != '\0')
+			cmp = 1;
+
+		if (cmp == 0)
+			return mid;
+		else if (cmp < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return ~lo;
 }
 
-void
-append_tag (struct irc_msg_tag *tag, struct irc_msg_tags *tags)
+bool
+append_tag (char *name, char *value, bool escaped, struct irc_msg_tags *tags)
 {
-	size_t new_len = tags->len + 1;
-	puts ("a");
-	ptrarr_resize ((void ***)&tags->tags, new_len);
-	tags->tags[tags->len] = tag;
-	tags->len = new_len;
+	if (tags->len == IRC_MSG_MAX_TAGS)
+		return false;
+
+	int pos = find_tag (tags, name, strlen (name));
+	if (pos >= 0)
+		return false;
+	pos = ~pos;
+
+	struct irc_msg_tag *tag = &tags->tags[tags->len];
+	tag->name = name;
+	tag->value = value;
+	atomic_init (&tag->value_state, escaped ? IRC_TAG_ESCAPED : IRC_TAG_UNESCAPED);
+
+	memmove (tags->by_name + pos + 1, tags->by_name + pos, tags->len - pos);
+	tags->by_name[pos] = tags->len;
+	tags->len++;
+	return true;
 }
 
-void
+bool
 append_param (char *param, struct irc_msg_params *params)
 {
-	size_t new_len = params->len + 1;
-	ptrarr_resize ((void ***)&params->params, new_len);
-	params->params[params->len] = param;
-	params->len = new_len;
-}
-
-void
-free_tags (struct irc_msg_tags *tags)
-{
-	if (tags != NULL) {
-		if (tags->tags != NULL) {
-			for (size_t i = 0; i < tags->len; ++i) {
-				free (tags->tags[i]->name);
-				free (tags->tags[i]->value);
-				free (tags->tags[i]);
-			}
-		}
-		free (tags);
-	}
-}
+	if (params->len == IRC_MSG_MAX_PARAMS)
+		return false;
 
-void
-free_params (struct irc_msg_params *params)
-{
-	if (params != NULL) {
-		if (params->params != NULL) {
-			for (size_t i = 0; i < params->len; ++i) {
-				free (params->params[i]);
-			}
-		}
-		free (params);
-	}
+	params->params[params->len++] = param;
+	return true;
 }
 
 struct irc_msg *
 alloc_msg (void)
 {
-	struct irc_msg *ret = calloc (1, sizeof (*ret));
+	return alloc_msg_sized (0);
+}
+
+struct irc_msg *
+alloc_msg_sized (size_t raw_len)
+{
+	/* Each part of the line gets copied with a terminating '\0', there
+	 * are never more parts than bytes in the line. */
+	size_t arena_cap = raw_len > 0 ? raw_len * 2 + 1 : 0;
+
+	struct irc_msg *ret = malloc (sizeof (*ret) + arena_cap);
+	if (ret == NULL)
+		return NULL;
+
+	ret->tags.len = 0;
+	ret->prefix = NULL;
+	ret->command = NULL;
+	ret->command_id = IRC_CMD_UNKNOWN;
+	ret->params.len = 0;
+	atomic_init (&ret->refs, 1);
+	ret->arena_len = 0;
+	ret->arena_cap = arena_cap;
 	return ret;
 }
 
 void
 free_msg (struct irc_msg *msg)
 {
-	if (msg == NULL)
-		return;
-	free_tags (msg->tags);
-	free_params (msg->params);
-	if (msg->prefix != NULL) {
-		free (msg->prefix);
-	}
-	if (msg->command != NULL) {
-		free (msg->command);
-	}
 	free (msg);
 }
@@ -0,0 +1,357 @@
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "irc/sendq.h"
+#include "irc/text.h"
+#include "log/log.h"
+#include "utlist/list.h"
+
+/* Drained targets are kept for reuse until there are this many */
+#define IRC_SENDQ_KEEP_TARGETS 32
+
+/* Every queued line is its length followed by the line itself */
+typedef size_t irc_sendq_header;
+
+static void
+free_target (gpointer data)
+{
+	irc_sendq_target *t = data;
+	irc_buffer_free (&t->lines);
+	free (t->name);
+	free (t);
+}
+
+int
+irc_sendq_init (irc_sendq *q, double burst, double rate, size_t max_bytes)
+{
+	irc_buffer_init (&q->urgent);
+	irc_buffer_init (&q->core);
+	q->targets = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, free_target);
+	if (q->targets == NULL)
+		return -1;
+	q->pending = NULL;
+
+	q->burst = burst >= 1 ? burst : 1;
+	q->rate = rate > 0 ? rate : 0;
+	q->tokens = q->burst;
+	q->last_refill = 0;
+
+	q->max_bytes = max_bytes;
+	q->bulk_len = 0;
+	q->coalesced = q->dropped = 0;
+	return 0;
+}
+
+void
+irc_sendq_free (irc_sendq *q)
+{
+	irc_buffer_free (&q->urgent);
+	irc_buffer_free (&q->core);
+	g_hash_table_destroy (q->targets);
+	q->pending = NULL;
+}
+
+void
+irc_sendq_clear (irc_sendq *q)
+{
+	irc_buffer_clear (&q->urgent);
+	irc_buffer_clear (&q->core);
+	g_hash_table_remove_all (q->targets);
+	q->pending = NULL;
+	q->tokens = q->burst;
+	q->bulk_len = 0;
+}
+
+irc_sendq_lane
+irc_sendq_lane_for (const char *command, size_t len)
+{
+	static const char *urgent[] = { "PING", "PONG", "PASS", "NICK", "USER", "CAP", "AUTHENTICATE", "QUIT" };
+	static const char *core[] = { "JOIN", "PART", "MODE", "TOPIC", "KICK", "INVITE" };
+
+	for (size_t i = 0; i < sizeof (urgent) / sizeof (*urgent); ++i)
+		if (strlen (urgent[i]) == len && strncasecmp (urgent[i], command, len) == 0)
+			return IRC_LANE_URGENT;
+
+	for (size_t i = 0; i < sizeof (core) / sizeof (*core); ++i)
+		if (strlen (core[i]) == len && strncasecmp (core[i], command, len) == 0)
+			return IRC_LANE_CORE;
+
+	return IRC_LANE_BULK;
+}
+
+/* Skip to the start of the next space separated word */
+static const char *
+next_word (const char *p, const char *end)
+{
+	while (p < end && *p != ' ')
+		p++;
+	while (p < end && *p == ' ')
+		p++;
+	return p;
+}
+
+static size_t
+word_len (const char *p, const char *end)
+{
+	const char *start = p;
+	while (p < end && *p != ' ' && *p != '\r' && *p != '\n')
+		p++;
+	return p - start;
+}
+
+irc_sendq_lane
+irc_sendq_classify (const char *line, size_t len, const char **target, size_t *target_len)
+{
+	const char *p = line, *end = line + len;
+
+	*target = "";
+	*target_len = 0;
+
+	/* Tags and a prefix come before the command */
+	if (p < end && *p == '@')
+		p = next_word (p, end);
+	if (p < end && *p == ':')
+		p = next_word (p, end);
+
+	size_t command_len = word_len (p, end);
+	irc_sendq_lane lane = irc_sendq_lane_for (p, command_len);
+	if (lane != IRC_LANE_BULK)
+		return lane;
+
+	p = next_word (p, end);
+	if (p < end && *p != ':') {
+		*target = p;
+		*target_len = word_len (p, end);
+	}
+
+	return lane;
+}
+
+static void
+refill (irc_sendq *q, double now)
+{
+	if (q->rate == 0)
+		return;
+
+	if (now > q->last_refill) {
+		q->tokens += (now - q->last_refill) * q->rate;
+		if (q->tokens > q->burst)
+			q->tokens = q->burst;
+	}
+	q->last_refill = now;
+}
+
+bool
+irc_sendq_can_send (irc_sendq *q, irc_sendq_lane lane, double now)
+{
+	if (irc_buffer_len (&q->urgent) > 0)
+		return false;
+	if (lane == IRC_LANE_URGENT)
+		return true;
+
+	refill (q, now);
+	if (q->rate > 0 && q->tokens < 1)
+		return false;
+
+	if (irc_buffer_len (&q->core) > 0)
+		return false;
+
+	return lane == IRC_LANE_CORE || q->pending == NULL;
+}
+
+void
+irc_sendq_take (irc_sendq *q)
+{
+	/* Urgent lines don't wait but are still counted by the server, so
+	 * they may leave the bucket in debt */
+	if (q->rate > 0)
+		q->tokens -= 1;
+}
+
+/*
+ * Targets are keyed by their folded name, so #Chan and #chan share one.
+ * The queue doesn't know the server's casemapping, rfc1459 folds the
+ * most and a line is only coalesced with one that has the same bytes.
+ */
+static irc_sendq_target *
+get_target (irc_sendq *q, const char *name, size_t name_len)
+{
+	char *key = g_alloca (name_len + 1);
+	irc_text_casefold (key, name, name_len, IRC_CASEMAP_RFC1459);
+	key[name_len] = '\0';
+
+	irc_sendq_target *t = g_hash_table_lookup (q->targets, key);
+	if (t != NULL)
+		return t;
+
+	t = malloc (sizeof (*t));
+	if (t == NULL)
+		return NULL;
+
+	t->name = strdup (key);
+	if (t->name == NULL) {
+		free (t);
+		return NULL;
+	}
+	irc_buffer_init (&t->lines);
+	t->prev = t->next = NULL;
+
+	g_hash_table_insert (q->targets, t->name, t);
+	return t;
+}
+
+static irc_buffer *
+lane_buffer (irc_sendq *q, irc_sendq_lane lane, irc_sendq_target *t)
+{
+	switch (lane) {
+		case IRC_LANE_URGENT:
+			return &q->urgent;
+		case IRC_LANE_CORE:
+			return &q->core;
+		default:
+			return &t->lines;
+	}
+}
+
+char *
+irc_sendq_reserve (irc_sendq *q, irc_sendq_lane lane, const char *target, size_t target_len, size_t len)
+{
+	irc_sendq_target *t = NULL;
+	if (lane == IRC_LANE_BULK && (t = get_target (q, target, target_len)) == NULL)
+		return NULL;
+
+	char *dst = irc_buffer_reserve (lane_buffer (q, lane, t), sizeof (irc_sendq_header) + len);
+	if (dst == NULL)
+		return NULL;
+
+	return dst + sizeof (irc_sendq_header);
+}
+
+/* Whether the line of len bytes at the tail of t is already waiting */
+static bool
+already_waiting (irc_sendq_target *t, size_t len)
+{
+	const char *line = t->lines.data + t->lines.tail + sizeof (irc_sendq_header);
+	const char *p = irc_buffer_data (&t->lines);
+	const char *end = p + irc_buffer_len (&t->lines);
+
+	while (p < end) {
+		irc_sendq_header waiting;
+		memcpy (&waiting, p, sizeof (waiting));
+		p += sizeof (waiting);
+		if (waiting == len && memcmp (p, line, len) == 0)
+			return true;
+		p += waiting;
+	}
+
+	return false;
+}
+
+bool
+irc_sendq_commit (irc_sendq *q, irc_sendq_lane lane, const char *target, size_t target_len, size_t len)
+{
+	irc_sendq_target *t = NULL;
+	if (lane == IRC_LANE_BULK) {
+		t = get_target (q, target, target_len);
+
+		/* A repeated reply says nothing new, let the first one do */
+		if (already_waiting (t, len)) {
+			q->coalesced++;
+			return false;
+		}
+		size_t need = sizeof (irc_sendq_header) + len;
+		if (q->max_bytes > 0 && q->bulk_len + need > q->max_bytes) {
+			q->dropped++;
+			/* A target made for this line alone would never be freed,
+			 * flushing only sees the ones in the ring */
+			if (irc_buffer_len (&t->lines) == 0 && t->next == NULL)
+				g_hash_table_remove (q->targets, t->name);
+			return false;
+		}
+		q->bulk_len += need;
+	}
+
+	irc_buffer *b = lane_buffer (q, lane, t);
+	irc_sendq_header header = len;
+	memcpy (b->data + b->tail, &header, sizeof (header));
+	irc_buffer_commit (b, sizeof (header) + len);
+
+	/* Targets with nothing waiting aren't in the ring, new ones go last */
+	if (t != NULL && t->next == NULL)
+		CDL_APPEND (q->pending, t);
+	return true;
+}
+
+/* Move the first line of b to out, false if out can't take it */
+static bool
+move_line (irc_buffer *b, irc_buffer *out)
+{
+	irc_sendq_header len;
+	memcpy (&len, irc_buffer_data (b), sizeof (len));
+
+	if (irc_buffer_append (out, irc_buffer_data (b) + sizeof (len), len) == -1)
+		return false;
+
+	irc_buffer_consume (b, sizeof (len) + len);
+	return true;
+}
+
+bool
+irc_sendq_flush (irc_sendq *q, irc_buffer *out, double now, double *wait)
+{
+	while (irc_buffer_len (&q->urgent) > 0) {
+		if (!move_line (&q->urgent, out))
+			goto oom;
+		irc_sendq_take (q);
+	}
+
+	refill (q, now);
+	while (q->rate == 0 || q->tokens >= 1) {
+		if (irc_buffer_len (&q->core) > 0) {
+			if (!move_line (&q->core, out))
+				goto oom;
+		} else if (q->pending != NULL) {
+			irc_sendq_target *t = q->pending;
+			size_t before = irc_buffer_len (&t->lines);
+			if (!move_line (&t->lines, out))
+				goto oom;
+			q->bulk_len -= before - irc_buffer_len (&t->lines);
+
+			q->pending = t->next;
+			if (irc_buffer_len (&t->lines) == 0) {
+				CDL_DELETE (q->pending, t);
+				t->prev = t->next = NULL;
+				if (g_hash_table_size (q->targets) > IRC_SENDQ_KEEP_TARGETS)
+					g_hash_table_remove (q->targets, t->name);
+			}
+		} else {
+			return false;
+		}
+
+		irc_sendq_take (q);
+	}
+
+	*wait = (1 - q->tokens) / q->rate;
+	return true;
+
+oom:
+	log_info ("Out of memory flushing the send queue\n");
+	*wait = 1;
+	return true;
+}
+
+size_t
+irc_sendq_len (const irc_sendq *q)
+{
+	size_t len = irc_buffer_len (&q->urgent) + irc_buffer_len (&q->core);
+
+	const irc_sendq_target *t = q->pending;
+	if (t != NULL)
+		do {
+			len += irc_buffer_len (&t->lines);
+			t = t->next;
+		} while (t != q->pending);
+
+	return len;
+}
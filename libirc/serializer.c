@@ -47,16 +47,6 @@ serializer_on_param (size_t param_idx,
 		     const uint8_t **param,
 		     void *user_data);
 
-static size_t
-ptrarr_len (const void **ptrarr)
-{
-	size_t count = 0;
-	for (const void **iter = ptrarr; *iter != NULL; ++iter) {
-		++count;
-	}
-	return count;
-}
-
 ircmsg_serializer_callbacks serializer_cbs = {
 	.tag_count = serializer_tag_count,
 	.on_tag = serializer_on_tag,
@@ -70,7 +60,7 @@ size_t
 serializer_tag_count (void *user_data)
 {
 	struct irc_msg *msg = user_data;
-	return msg->tags != NULL ? ptrarr_len ((const void **)msg->tags) : 0;
+	return msg->tags.len;
 }
 
 void
@@ -82,14 +72,15 @@ serializer_on_tag (size_t tag_idx,
 		   void *user_data)
 {
 	struct irc_msg *msg = user_data;
-	struct irc_msg_tag *t = msg->tags->tags[tag_idx];
+	struct irc_msg_tag *t = &msg->tags.tags[tag_idx];
 
 	*tag_len = strlen (t->name);
 	*tag = (uint8_t *)t->name;
 
 	if (t->value != NULL) {
-		*val_len = strlen (t->value);
-		*val = (uint8_t *)t->value;
+		const char *value = irc_msg_tag_value (msg, tag_idx);
+		*val_len = strlen (value);
+		*val = (uint8_t *)value;
 	} else {
 		*val_len = 0;
 		*val = NULL;
@@ -123,7 +114,7 @@ size_t
 serializer_param_count (void *user_data)
 {
 	struct irc_msg *msg = user_data;
-	return msg->params->len;
+	return msg->params.len;
 }
 
 void
@@ -133,7 +124,7 @@ serializer_on_param (size_t param_idx,
 		     void *user_data)
 {
 	struct irc_msg *msg = user_data;
-	char *p = msg->params->params[param_idx];
+	char *p = msg->params.params[param_idx];
 	*param_len = strlen (p);
 	*param = (uint8_t *)p;
 }
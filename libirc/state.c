@@ -0,0 +1,647 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "irc/message.h"
+#include "irc/state.h"
+#include "utlist/list.h"
+
+/* Nicks, channels and hosts all come from lines no longer than this */
+#define STATE_KEY_MAX 512
+
+/* How a channel mode takes an argument, from ISUPPORT CHANMODES */
+enum
+{
+	MODE_NO_ARG,	 /* D, and modes nobody told us about */
+	MODE_ARG,	 /* A lists and B settings */
+	MODE_ARG_ON_SET, /* C, only when set */
+};
+
+typedef struct irc_state_member
+{
+	struct irc_state_user *user;
+	struct irc_state_chan *chan;
+	uint8_t modes; /* bit i is prefix_modes[i] */
+	/* The other channels of the user */
+	struct irc_state_member *prev, *next;
+} irc_state_member;
+
+typedef struct irc_state_user
+{
+	char *nick;
+	char *key;
+	const char *host; /* interned, NULL until a message showed it */
+	irc_state_member *channels;
+} irc_state_user;
+
+typedef struct irc_state_chan
+{
+	char *name;
+	char *key;
+	GHashTable *members; /* irc_state_user -> irc_state_member */
+} irc_state_chan;
+
+/* An interned ident@host, the hosts table maps str to it */
+typedef struct state_host
+{
+	unsigned refs;
+	char str[];
+} state_host;
+
+/* s folded under the server's casemapping, false if it's too long */
+static bool
+state_fold (const irc_state *st, const char *s, size_t len, char out[STATE_KEY_MAX])
+{
+	if (len >= STATE_KEY_MAX)
+		return false;
+
+	irc_text_casefold (out, s, len, st->casemapping);
+	out[len] = '\0';
+	return true;
+}
+
+static bool
+state_is_self (const irc_state *st, const char *nick, size_t len)
+{
+	return st->self != NULL &&
+	       irc_text_caseeq (nick, len, st->self, strlen (st->self), st->casemapping);
+}
+
+static const char *
+state_intern_host (irc_state *st, const char *host)
+{
+	state_host *h = g_hash_table_lookup (st->hosts, host);
+	if (h == NULL) {
+		size_t len = strlen (host);
+		h = malloc (sizeof (state_host) + len + 1);
+		if (h == NULL)
+			return NULL;
+		h->refs = 0;
+		memcpy (h->str, host, len + 1);
+		g_hash_table_insert (st->hosts, h->str, h);
+	}
+
+	h->refs++;
+	return h->str;
+}
+
+static void
+state_release_host (irc_state *st, const char *host)
+{
+	if (host == NULL)
+		return;
+
+	state_host *h = (state_host *)(host - offsetof (state_host, str));
+	if (--h->refs == 0)
+		g_hash_table_remove (st->hosts, h->str);
+}
+
+/* Remember the ident@host of the prefix p, if it has one */
+static void
+state_set_host (irc_state *st, irc_state_user *u, const irc_prefix *p)
+{
+	if (p->host == NULL)
+		return;
+
+	char host[STATE_KEY_MAX];
+	int len;
+	if (p->ident != NULL)
+		len = snprintf (host,
+				sizeof (host),
+				"%.*s@%.*s",
+				(int)p->ident_len,
+				p->ident,
+				(int)p->host_len,
+				p->host);
+	else
+		len = snprintf (host, sizeof (host), "%.*s", (int)p->host_len, p->host);
+	if (len < 0 || (size_t)len >= sizeof (host))
+		return;
+
+	if (u->host != NULL && strcmp (u->host, host) == 0)
+		return;
+
+	state_release_host (st, u->host);
+	u->host = state_intern_host (st, host);
+}
+
+static irc_state_user *
+state_find_user (const irc_state *st, const char *nick, size_t len)
+{
+	char key[STATE_KEY_MAX];
+	if (!state_fold (st, nick, len, key))
+		return NULL;
+	return g_hash_table_lookup (st->users, key);
+}
+
+/* The user of prefix p, added if we didn't know them */
+static irc_state_user *
+state_get_user (irc_state *st, const irc_prefix *p)
+{
+	char key[STATE_KEY_MAX];
+	if (p->nick == NULL || p->nick_len == 0 || !state_fold (st, p->nick, p->nick_len, key))
+		return NULL;
+
+	irc_state_user *u = g_hash_table_lookup (st->users, key);
+	if (u == NULL) {
+		u = calloc (1, sizeof (irc_state_user));
+		if (u == NULL)
+			return NULL;
+		u->nick = g_strndup (p->nick, p->nick_len);
+		u->key = g_strdup (key);
+		g_hash_table_insert (st->users, u->key, u);
+	}
+
+	state_set_host (st, u, p);
+	return u;
+}
+
+/* Users are only kept while they share a channel with us */
+static void
+state_drop_user (irc_state *st, irc_state_user *u)
+{
+	g_hash_table_remove (st->users, u->key);
+	state_release_host (st, u->host);
+	g_free (u->nick);
+	g_free (u->key);
+	free (u);
+}
+
+static irc_state_chan *
+state_find_chan (const irc_state *st, const char *name)
+{
+	char key[STATE_KEY_MAX];
+	if (!state_fold (st, name, strlen (name), key))
+		return NULL;
+	return g_hash_table_lookup (st->channels, key);
+}
+
+static irc_state_chan *
+state_add_chan (irc_state *st, const char *name)
+{
+	char key[STATE_KEY_MAX];
+	if (!state_fold (st, name, strlen (name), key))
+		return NULL;
+
+	irc_state_chan *c = calloc (1, sizeof (irc_state_chan));
+	if (c == NULL)
+		return NULL;
+	c->name = g_strdup (name);
+	c->key = g_strdup (key);
+	c->members = g_hash_table_new (g_direct_hash, g_direct_equal);
+	g_hash_table_insert (st->channels, c->key, c);
+	return c;
+}
+
+static irc_state_member *
+state_add_member (irc_state *st, irc_state_chan *c, const irc_prefix *p)
+{
+	irc_state_user *u = state_get_user (st, p);
+	if (u == NULL)
+		return NULL;
+
+	irc_state_member *m = g_hash_table_lookup (c->members, u);
+	if (m != NULL)
+		return m;
+
+	m = calloc (1, sizeof (irc_state_member));
+	if (m == NULL) {
+		if (u->channels == NULL)
+			state_drop_user (st, u);
+		return NULL;
+	}
+	m->user = u;
+	m->chan = c;
+	g_hash_table_insert (c->members, u, m);
+	DL_APPEND (u->channels, m);
+	return m;
+}
+
+static void
+state_remove_member (irc_state *st, irc_state_member *m)
+{
+	irc_state_user *u = m->user;
+	g_hash_table_remove (m->chan->members, u);
+	DL_DELETE (u->channels, m);
+	free (m);
+
+	if (u->channels == NULL)
+		state_drop_user (st, u);
+}
+
+/* Free channel c and its memberships, the channels table is left alone */
+static void
+state_free_chan (irc_state *st, irc_state_chan *c)
+{
+	GHashTableIter iter;
+	gpointer value;
+	g_hash_table_iter_init (&iter, c->members);
+	while (g_hash_table_iter_next (&iter, NULL, &value)) {
+		irc_state_member *m = value;
+		irc_state_user *u = m->user;
+		DL_DELETE (u->channels, m);
+		free (m);
+		if (u->channels == NULL)
+			state_drop_user (st, u);
+	}
+
+	g_hash_table_destroy (c->members);
+	g_free (c->name);
+	g_free (c->key);
+	free (c);
+}
+
+static void
+state_forget_channels (irc_state *st)
+{
+	GHashTableIter iter;
+	gpointer value;
+	g_hash_table_iter_init (&iter, st->channels);
+	while (g_hash_table_iter_next (&iter, NULL, &value)) {
+		g_hash_table_iter_steal (&iter);
+		state_free_chan (st, value);
+	}
+}
+
+static void
+state_set_chanmodes (irc_state *st, const char *spec)
+{
+	memset (st->chanmode_types, MODE_NO_ARG, sizeof (st->chanmode_types));
+
+	int group = 0;
+	for (const char *c = spec; *c != '\0'; ++c) {
+		if (*c == ',') {
+			group++;
+			continue;
+		}
+		if ((unsigned char)*c >= sizeof (st->chanmode_types))
+			continue;
+
+		st->chanmode_types[(unsigned char)*c] =
+		  group < 2 ? MODE_ARG : group == 2 ? MODE_ARG_ON_SET : MODE_NO_ARG;
+	}
+}
+
+/* PREFIX=(modes)chars, modes and chars pair up */
+static void
+state_set_prefix (irc_state *st, const char *spec)
+{
+	if (spec[0] == '\0') {
+		st->prefix_modes[0] = st->prefix_chars[0] = '\0';
+		return;
+	}
+
+	const char *close = strchr (spec, ')');
+	if (spec[0] != '(' || close == NULL)
+		return;
+
+	size_t n = close - spec - 1;
+	if (n > IRC_STATE_MAX_PREFIXES || strlen (close + 1) != n)
+		return;
+
+	memcpy (st->prefix_modes, spec + 1, n);
+	st->prefix_modes[n] = '\0';
+	memcpy (st->prefix_chars, close + 1, n);
+	st->prefix_chars[n] = '\0';
+}
+
+static void
+state_reset_isupport (irc_state *st)
+{
+	st->casemapping = IRC_CASEMAP_RFC1459;
+	state_set_prefix (st, "(ov)@+");
+	state_set_chanmodes (st, "beI,k,l,imnpst");
+}
+
+int
+irc_state_init (irc_state *st)
+{
+	g_rw_lock_init (&st->lock);
+	st->users = g_hash_table_new (g_str_hash, g_str_equal);
+	st->channels = g_hash_table_new (g_str_hash, g_str_equal);
+	st->hosts = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, free);
+	if (st->users == NULL || st->channels == NULL || st->hosts == NULL)
+		return -1;
+
+	st->self = NULL;
+	state_reset_isupport (st);
+	return 0;
+}
+
+void
+irc_state_free (irc_state *st)
+{
+	irc_state_clear (st);
+	g_hash_table_destroy (st->users);
+	g_hash_table_destroy (st->channels);
+	g_hash_table_destroy (st->hosts);
+	g_rw_lock_clear (&st->lock);
+}
+
+void
+irc_state_clear (irc_state *st)
+{
+	g_rw_lock_writer_lock (&st->lock);
+	state_forget_channels (st);
+	state_reset_isupport (st);
+	g_free (st->self);
+	st->self = NULL;
+	g_rw_lock_writer_unlock (&st->lock);
+}
+
+void
+irc_state_welcome (irc_state *st, const char *nick)
+{
+	g_rw_lock_writer_lock (&st->lock);
+	g_free (st->self);
+	st->self = g_strdup (nick);
+	g_rw_lock_writer_unlock (&st->lock);
+}
+
+void
+irc_state_isupport (irc_state *st, int argc, char **argv)
+{
+	g_rw_lock_writer_lock (&st->lock);
+	for (int i = 0; i < argc; ++i) {
+		const char *tok = argv[i];
+		irc_casemapping casemapping = st->casemapping;
+		char prefix_modes[IRC_STATE_MAX_PREFIXES + 1];
+		strcpy (prefix_modes, st->prefix_modes);
+
+		if (strncmp (tok, "PREFIX=", 7) == 0)
+			state_set_prefix (st, tok + 7);
+		else if (strncmp (tok, "CHANMODES=", 10) == 0)
+			state_set_chanmodes (st, tok + 10);
+		else if (strcmp (tok, "CASEMAPPING=ascii") == 0)
+			st->casemapping = IRC_CASEMAP_ASCII;
+		else if (strcmp (tok, "CASEMAPPING=strict-rfc1459") == 0)
+			st->casemapping = IRC_CASEMAP_STRICT_RFC1459;
+		else if (strcmp (tok, "CASEMAPPING=rfc1459") == 0)
+			st->casemapping = IRC_CASEMAP_RFC1459;
+
+		/* The keys and mode bits would be wrong now. Servers send
+		 * ISUPPORT before we join anything, so there's nothing to lose */
+		if (casemapping != st->casemapping || strcmp (prefix_modes, st->prefix_modes) != 0)
+			state_forget_channels (st);
+	}
+	g_rw_lock_writer_unlock (&st->lock);
+}
+
+void
+irc_state_join (irc_state *st, const char *user, const char *channel)
+{
+	irc_prefix p;
+	irc_prefix_split (user, &p);
+	if (p.nick == NULL)
+		return;
+
+	g_rw_lock_writer_lock (&st->lock);
+	irc_state_chan *c = state_find_chan (st, channel);
+	if (c == NULL && state_is_self (st, p.nick, p.nick_len))
+		c = state_add_chan (st, channel);
+	if (c != NULL)
+		state_add_member (st, c, &p);
+	g_rw_lock_writer_unlock (&st->lock);
+}
+
+void
+irc_state_part (irc_state *st, const char *user, const char *channel)
+{
+	irc_prefix p;
+	irc_prefix_split (user, &p);
+	if (p.nick == NULL)
+		return;
+
+	g_rw_lock_writer_lock (&st->lock);
+	irc_state_chan *c = state_find_chan (st, channel);
+	if (c != NULL && state_is_self (st, p.nick, p.nick_len)) {
+		g_hash_table_remove (st->channels, c->key);
+		state_free_chan (st, c);
+	} else if (c != NULL) {
+		irc_state_user *u = state_find_user (st, p.nick, p.nick_len);
+		irc_state_member *m = u != NULL ? g_hash_table_lookup (c->members, u) : NULL;
+		if (m != NULL)
+			state_remove_member (st, m);
+	}
+	g_rw_lock_writer_unlock (&st->lock);
+}
+
+void
+irc_state_quit (irc_state *st, const char *user)
+{
+	irc_prefix p;
+	irc_prefix_split (user, &p);
+	if (p.nick == NULL)
+		return;
+
+	g_rw_lock_writer_lock (&st->lock);
+	irc_state_user *u = state_find_user (st, p.nick, p.nick_len);
+	if (u != NULL) {
+		/* The last one frees u */
+		irc_state_member *m, *tmp;
+		DL_FOREACH_SAFE (u->channels, m, tmp)
+			state_remove_member (st, m);
+	}
+	g_rw_lock_writer_unlock (&st->lock);
+}
+
+void
+irc_state_nick (irc_state *st, const char *user, const char *nick)
+{
+	irc_prefix p;
+	irc_prefix_split (user, &p);
+	char key[STATE_KEY_MAX];
+	if (p.nick == NULL || !state_fold (st, nick, strlen (nick), key))
+		return;
+
+	g_rw_lock_writer_lock (&st->lock);
+	if (state_is_self (st, p.nick, p.nick_len)) {
+		g_free (st->self);
+		st->self = g_strdup (nick);
+	}
+
+	irc_state_user *u = state_find_user (st, p.nick, p.nick_len);
+	if (u != NULL) {
+		g_hash_table_steal (st->users, u->key);
+
+		/* Somebody we missed leaving */
+		irc_state_user *old = g_hash_table_lookup (st->users, key);
+		if (old != NULL) {
+			irc_state_member *m, *tmp;
+			DL_FOREACH_SAFE (old->channels, m, tmp)
+				state_remove_member (st, m);
+		}
+
+		g_free (u->nick);
+		g_free (u->key);
+		u->nick = g_strdup (nick);
+		u->key = g_strdup (key);
+		g_hash_table_insert (st->users, u->key, u);
+		state_set_host (st, u, &p);
+	}
+	g_rw_lock_writer_unlock (&st->lock);
+}
+
+void
+irc_state_mode (irc_state *st, const char *channel, int argc, char **argv)
+{
+	if (argc < 1)
+		return;
+
+	g_rw_lock_writer_lock (&st->lock);
+	irc_state_chan *c = state_find_chan (st, channel);
+	bool set = true;
+	int arg = 1;
+	for (const char *mode = argv[0]; c != NULL && *mode != '\0'; ++mode) {
+		if (*mode == '+' || *mode == '-') {
+			set = *mode == '+';
+			continue;
+		}
+
+		const char *prefix = strchr (st->prefix_modes, *mode);
+		if (prefix != NULL) {
+			if (arg >= argc)
+				break;
+
+			const char *nick = argv[arg++];
+			irc_state_user *u = state_find_user (st, nick, strlen (nick));
+			irc_state_member *m = u != NULL ? g_hash_table_lookup (c->members, u) : NULL;
+			uint8_t bit = 1u << (prefix - st->prefix_modes);
+			if (m != NULL)
+				m->modes = set ? m->modes | bit : m->modes & ~bit;
+			continue;
+		}
+
+		unsigned char ch = *mode;
+		int type = ch < sizeof (st->chanmode_types) ? st->chanmode_types[ch] : MODE_NO_ARG;
+		if (type == MODE_ARG || (type == MODE_ARG_ON_SET && set))
+			arg++;
+	}
+	g_rw_lock_writer_unlock (&st->lock);
+}
+
+void
+irc_state_names (irc_state *st, const char *channel, const char *names)
+{
+	g_rw_lock_writer_lock (&st->lock);
+	irc_state_chan *c = state_find_chan (st, channel);
+	const char *name = names;
+	while (c != NULL && *name != '\0') {
+		size_t len = strcspn (name, " ");
+		char entry[STATE_KEY_MAX];
+		if (len > 0 && len < sizeof (entry)) {
+			memcpy (entry, name, len);
+			entry[len] = '\0';
+
+			/* Every prefix the user has with multi-prefix, the highest otherwise */
+			uint8_t modes = 0;
+			char *nick = entry;
+			const char *prefix;
+			while (*nick != '\0' && (prefix = strchr (st->prefix_chars, *nick)) != NULL) {
+				modes |= 1u << (prefix - st->prefix_chars);
+				nick++;
+			}
+
+			irc_prefix p;
+			irc_prefix_split (nick, &p);
+			irc_state_member *m = state_add_member (st, c, &p);
+			if (m != NULL)
+				m->modes = modes;
+		}
+
+		name += len;
+		name += strspn (name, " ");
+	}
+	g_rw_lock_writer_unlock (&st->lock);
+}
+
+bool
+irc_state_channel_users (irc_state *st, const char *channel, irc_state_name_fn fn, void *data)
+{
+	g_rw_lock_reader_lock (&st->lock);
+	irc_state_chan *c = state_find_chan (st, channel);
+	if (c != NULL) {
+		GHashTableIter iter;
+		gpointer key;
+		g_hash_table_iter_init (&iter, c->members);
+		while (g_hash_table_iter_next (&iter, &key, NULL))
+			fn (((irc_state_user *)key)->nick, data);
+	}
+	g_rw_lock_reader_unlock (&st->lock);
+
+	return c != NULL;
+}
+
+bool
+irc_state_user_channels (irc_state *st, const char *nick, irc_state_name_fn fn, void *data)
+{
+	g_rw_lock_reader_lock (&st->lock);
+	irc_state_user *u = state_find_user (st, nick, strlen (nick));
+	if (u != NULL) {
+		irc_state_member *m;
+		DL_FOREACH (u->channels, m)
+			fn (m->chan->name, data);
+	}
+	g_rw_lock_reader_unlock (&st->lock);
+
+	return u != NULL;
+}
+
+bool
+irc_state_user_modes (irc_state *st,
+		      const char *channel,
+		      const char *nick,
+		      char out[IRC_STATE_MAX_PREFIXES + 1])
+{
+	g_rw_lock_reader_lock (&st->lock);
+	irc_state_chan *c = state_find_chan (st, channel);
+	irc_state_user *u = c != NULL ? state_find_user (st, nick, strlen (nick)) : NULL;
+	irc_state_member *m = u != NULL ? g_hash_table_lookup (c->members, u) : NULL;
+	if (m != NULL) {
+		size_t n = 0;
+		for (size_t i = 0; st->prefix_modes[i] != '\0'; ++i)
+			if (m->modes & (1u << i))
+				out[n++] = st->prefix_modes[i];
+		out[n] = '\0';
+	}
+	g_rw_lock_reader_unlock (&st->lock);
+
+	return m != NULL;
+}
+
+bool
+irc_state_user_host (irc_state *st, const char *nick, char *out, size_t out_len)
+{
+	g_rw_lock_reader_lock (&st->lock);
+	irc_state_user *u = state_find_user (st, nick, strlen (nick));
+	bool found = u != NULL && u->host != NULL && out_len > 0;
+	if (found)
+		g_strlcpy (out, u->host, out_len);
+	g_rw_lock_reader_unlock (&st->lock);
+
+	return found;
+}
+
+size_t
+irc_state_self_prefix_len (irc_state *st)
+{
+	size_t len = 0;
+	g_rw_lock_reader_lock (&st->lock);
+	irc_state_user *u = st->self != NULL ? state_find_user (st, st->self, strlen (st->self)) : NULL;
+	if (u != NULL && u->host != NULL)
+		len = strlen (u->nick) + 1 + strlen (u->host);
+	g_rw_lock_reader_unlock (&st->lock);
+
+	return len;
+}
+
+irc_casemapping
+irc_state_casemapping (irc_state *st)
+{
+	g_rw_lock_reader_lock (&st->lock);
+	irc_casemapping map = st->casemapping;
+	g_rw_lock_reader_unlock (&st->lock);
+
+	return map;
+}
@@ -0,0 +1,398 @@
+#include "irc/text.h"
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * A chunk is TEXT_CHUNK bytes in a vector. The comparisons give a mask
+ * with TEXT_STRIDE bits per byte, lowest address first, so the first
+ * byte that matched is the mask's lowest set bit over the stride.
+ */
+#if defined(__SSE2__)
+#include <emmintrin.h>
+
+#define TEXT_CHUNK 16
+#define TEXT_STRIDE 1
+
+typedef __m128i text_vec;
+
+static inline text_vec
+text_load (const char *p)
+{
+	return _mm_loadu_si128 ((const __m128i *)p);
+}
+
+static inline void
+text_store (char *p, text_vec v)
+{
+	_mm_storeu_si128 ((__m128i *)p, v);
+}
+
+static inline uint64_t
+text_mask (text_vec cmp)
+{
+	return (unsigned)_mm_movemask_epi8 (cmp);
+}
+
+static inline text_vec
+text_eq (text_vec v, char c)
+{
+	return _mm_cmpeq_epi8 (v, _mm_set1_epi8 (c));
+}
+
+/* Bytes no greater than max, unsigned */
+static inline text_vec
+text_le (text_vec v, unsigned char max)
+{
+	return _mm_cmpeq_epi8 (_mm_min_epu8 (v, _mm_set1_epi8 (max)), v);
+}
+
+/* Every byte with its high bit set, which movemask already looks at */
+static inline uint64_t
+text_high_mask (text_vec v)
+{
+	return text_mask (v);
+}
+
+static inline text_vec
+text_fold_vec (text_vec v, unsigned char last)
+{
+	text_vec in = text_le (_mm_sub_epi8 (v, _mm_set1_epi8 ('A')), last - 'A');
+	return _mm_or_si128 (v, _mm_and_si128 (in, _mm_set1_epi8 (0x20)));
+}
+
+static inline bool
+text_all_eq (text_vec a, text_vec b)
+{
+	return _mm_movemask_epi8 (_mm_cmpeq_epi8 (a, b)) == 0xFFFF;
+}
+
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+
+#define TEXT_CHUNK 16
+#define TEXT_STRIDE 4
+
+typedef uint8x16_t text_vec;
+
+static inline text_vec
+text_load (const char *p)
+{
+	return vld1q_u8 ((const uint8_t *)p);
+}
+
+static inline void
+text_store (char *p, text_vec v)
+{
+	vst1q_u8 ((uint8_t *)p, v);
+}
+
+/* NEON has no movemask, narrowing leaves four bits of every byte */
+static inline uint64_t
+text_mask (text_vec cmp)
+{
+	uint8x8_t n = vshrn_n_u16 (vreinterpretq_u16_u8 (cmp), 4);
+	return vget_lane_u64 (vreinterpret_u64_u8 (n), 0);
+}
+
+static inline text_vec
+text_eq (text_vec v, char c)
+{
+	return vceqq_u8 (v, vdupq_n_u8 (c));
+}
+
+static inline text_vec
+text_le (text_vec v, unsigned char max)
+{
+	return vcleq_u8 (v, vdupq_n_u8 (max));
+}
+
+static inline uint64_t
+text_high_mask (text_vec v)
+{
+	return text_mask (vcgeq_u8 (v, vdupq_n_u8 (0x80)));
+}
+
+static inline text_vec
+text_fold_vec (text_vec v, unsigned char last)
+{
+	text_vec in = text_le (vsubq_u8 (v, vdupq_n_u8 ('A')), last - 'A');
+	return vorrq_u8 (v, vandq_u8 (in, vdupq_n_u8 (0x20)));
+}
+
+static inline bool
+text_all_eq (text_vec a, text_vec b)
+{
+	return vminvq_u8 (vceqq_u8 (a, b)) == 0xFF;
+}
+#endif
+
+#ifdef TEXT_CHUNK
+static inline size_t
+text_first (uint64_t mask)
+{
+	return __builtin_ctzll (mask) / TEXT_STRIDE;
+}
+#endif
+
+static int
+is_continuation (unsigned char c)
+{
+	return (c & 0xC0) == 0x80;
+}
+
+size_t
+irc_text_line (const char *text, size_t len, size_t max, size_t *next)
+{
+	size_t scan = len < max ? len : max;
+	for (size_t i = 0; i < scan; ++i) {
+		if (text[i] == '\r' || text[i] == '\n') {
+			*next = i + 1;
+			if (text[i] == '\r' && i + 1 < len && text[i + 1] == '\n')
+				*next = i + 2;
+			return i;
+		}
+	}
+
+	if (len <= max) {
+		*next = len;
+		return len;
+	}
+
+	/* Break at the last space that fits, the one right after it too */
+	for (size_t i = max + 1; i > 0; --i) {
+		if (text[i - 1] == ' ') {
+			*next = i;
+			return i - 1;
+		}
+	}
+
+	/* A single long word, cut it in front of a character's first byte */
+	size_t cut = max;
+	while (cut > 0 && max - cut < 3 && is_continuation (text[cut]))
+		cut--;
+	if (cut == 0 || is_continuation (text[cut]))
+		cut = max;
+
+	*next = cut;
+	return cut;
+}
+
+const char *
+irc_text_find_eol (const char *p, size_t len)
+{
+	size_t i = 0;
+#ifdef TEXT_CHUNK
+	for (; i + TEXT_CHUNK <= len; i += TEXT_CHUNK) {
+		uint64_t m = text_mask (text_eq (text_load (p + i), '\n'));
+		if (m != 0)
+			return p + i + text_first (m);
+	}
+#endif
+	for (; i < len; ++i)
+		if (p[i] == '\n')
+			return p + i;
+
+	return NULL;
+}
+
+static bool
+is_format (unsigned char c)
+{
+	switch (c) {
+		case 0x02: /* bold */
+		case 0x03: /* colour */
+		case 0x04: /* hex colour */
+		case 0x0F: /* reset */
+		case 0x11: /* monospace */
+		case 0x16: /* reverse */
+		case 0x1D: /* italics */
+		case 0x1E: /* strikethrough */
+		case 0x1F: /* underline */
+			return true;
+		default:
+			return false;
+	}
+}
+
+static bool
+is_hex (unsigned char c)
+{
+	return (c >= '0' && c <= '9') || ((c | 0x20) >= 'a' && (c | 0x20) <= 'f');
+}
+
+static bool
+is_digit (unsigned char c)
+{
+	return c >= '0' && c <= '9';
+}
+
+/* Past up to max bytes at s[i] that are digits, or hex digits */
+static size_t
+skip_digits (const char *s, size_t len, size_t i, size_t max, bool hex)
+{
+	size_t end = i + max < len ? i + max : len;
+	while (i < end && (hex ? is_hex (s[i]) : is_digit (s[i])))
+		i++;
+	return i;
+}
+
+/* Past the formatting code at s[i], colours take their arguments along */
+static size_t
+skip_format (const char *s, size_t len, size_t i)
+{
+	unsigned char c = s[i++];
+	if (c != 0x03 && c != 0x04)
+		return i;
+
+	bool hex = c == 0x04;
+	size_t digits = hex ? 6 : 2;
+
+	size_t fg = skip_digits (s, len, i, digits, hex);
+	if (fg == i)
+		return i;
+
+	/* A comma is only the background's if digits follow it */
+	if (fg + 1 < len && s[fg] == ',' && (hex ? is_hex (s[fg + 1]) : is_digit (s[fg + 1])))
+		return skip_digits (s, len, fg + 1, digits, hex);
+	return fg;
+}
+
+size_t
+irc_text_strip_formatting (char *dst, const char *src, size_t len)
+{
+	size_t i = 0, out = 0;
+
+	while (i < len) {
+#ifdef TEXT_CHUNK
+		/* Formatting codes are all below 0x20, skip over runs without
+		 * any control characters */
+		while (i + TEXT_CHUNK <= len) {
+			uint64_t m = text_mask (text_le (text_load (src + i), 0x1F));
+			size_t run = m == 0 ? TEXT_CHUNK : text_first (m);
+			if (dst + out != src + i)
+				memmove (dst + out, src + i, run);
+			out += run;
+			i += run;
+			if (run < TEXT_CHUNK)
+				break;
+		}
+		if (i == len)
+			break;
+#endif
+		if (is_format (src[i])) {
+			i = skip_format (src, len, i);
+		} else {
+			dst[out++] = src[i++];
+		}
+	}
+
+	return out;
+}
+
+bool
+irc_text_valid_utf8 (const char *s, size_t len)
+{
+	size_t i = 0;
+
+	while (i < len) {
+#ifdef TEXT_CHUNK
+		/* Mostly ASCII, which takes a look at the high bits */
+		while (i + TEXT_CHUNK <= len && text_high_mask (text_load (s + i)) == 0)
+			i += TEXT_CHUNK;
+		if (i == len)
+			break;
+#endif
+		unsigned char c = s[i];
+		if (c < 0x80) {
+			i++;
+			continue;
+		}
+
+		size_t n;
+		uint32_t cp, min;
+		if ((c & 0xE0) == 0xC0) {
+			n = 1;
+			cp = c & 0x1F;
+			min = 0x80;
+		} else if ((c & 0xF0) == 0xE0) {
+			n = 2;
+			cp = c & 0x0F;
+			min = 0x800;
+		} else if ((c & 0xF8) == 0xF0) {
+			n = 3;
+			cp = c & 0x07;
+			min = 0x10000;
+		} else {
+			return false;
+		}
+
+		if (len - i <= n)
+			return false;
+		for (size_t k = 1; k <= n; ++k) {
+			if (!is_continuation (s[i + k]))
+				return false;
+			cp = cp << 6 | (s[i + k] & 0x3F);
+		}
+		if (cp < min || cp > 0x10FFFF || (cp >= 0xD800 && cp <= 0xDFFF))
+			return false;
+
+		i += n + 1;
+	}
+
+	return true;
+}
+
+/* The last upper case byte under map, they fold by adding 0x20 */
+static unsigned char
+fold_last (irc_casemapping map)
+{
+	switch (map) {
+		case IRC_CASEMAP_RFC1459:
+			return '^';
+		case IRC_CASEMAP_STRICT_RFC1459:
+			return ']';
+		default:
+			return 'Z';
+	}
+}
+
+static inline unsigned char
+fold (unsigned char c, unsigned char last)
+{
+	return c >= 'A' && c <= last ? c + ('a' - 'A') : c;
+}
+
+void
+irc_text_casefold (char *dst, const char *src, size_t len, irc_casemapping map)
+{
+	unsigned char last = fold_last (map);
+	size_t i = 0;
+#ifdef TEXT_CHUNK
+	for (; i + TEXT_CHUNK <= len; i += TEXT_CHUNK)
+		text_store (dst + i, text_fold_vec (text_load (src + i), last));
+#endif
+	for (; i < len; ++i)
+		dst[i] = fold (src[i], last);
+}
+
+bool
+irc_text_caseeq (const char *a, size_t a_len, const char *b, size_t b_len, irc_casemapping map)
+{
+	if (a_len != b_len)
+		return false;
+
+	unsigned char last = fold_last (map);
+	size_t i = 0;
+#ifdef TEXT_CHUNK
+	for (; i + TEXT_CHUNK <= a_len; i += TEXT_CHUNK)
+		if (!text_all_eq (text_fold_vec (text_load (a + i), last),
+				  text_fold_vec (text_load (b + i), last)))
+			return false;
+#endif
+	for (; i < a_len; ++i)
+		if (fold (a[i], last) != fold (b[i], last))
+			return false;
+
+	return true;
+}
@@ -1,25 +1,301 @@
-#include "../src/config/config.h"
 #include "log.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <semaphore.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Bytes of lines a thread can have waiting, a power of two */
+#define LOG_RING_SIZE (64 * 1024)
+/* Longer lines are cut off */
+#define LOG_LINE_MAX 2048
+/* Wake the writer early once a ring is this full */
+#define LOG_WAKE_AT (LOG_RING_SIZE / 4)
+/* How long a line waits at most before it's written */
+#define LOG_INTERVAL_MS 100
+
+/*
+ * The lines of one thread. Only that thread moves head and only the
+ * writer moves tail, so neither side needs a lock.
+ */
+typedef struct log_ring
+{
+	char data[LOG_RING_SIZE];
+	_Alignas (64) atomic_size_t head;
+	_Alignas (64) atomic_size_t tail;
+	atomic_ulong dropped;
+	/* Set once the thread is gone, the writer frees the ring when empty */
+	atomic_bool orphaned;
+	struct log_ring *next;
+} log_ring;
+
+atomic_bool log_debug_on;
+
+static pthread_mutex_t rings_mtx = PTHREAD_MUTEX_INITIALIZER;
+static log_ring *rings;
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+static _Thread_local log_ring *thread_ring;
+
+static int out_fd = STDERR_FILENO;
+static pthread_t writer;
+static sem_t wake;
+static atomic_bool wake_sent;
+static atomic_bool running;
+
+static void *
+log_writer (void *arg);
 
 void
-log_debug (char *fmt, ...)
+log_set_debug (bool on)
+{
+	atomic_store (&log_debug_on, on);
+}
+
+static void
+log_ring_orphan (void *data)
+{
+	log_ring *ring = data;
+	atomic_store (&ring->orphaned, true);
+}
+
+static void
+log_make_key (void)
+{
+	pthread_key_create (&ring_key, log_ring_orphan);
+}
+
+/* The calling thread's ring, set up on its first line */
+static log_ring *
+log_get_ring (void)
 {
-	if (DEBUG) {
-		va_list argptr;
-		va_start (argptr, fmt);
-		vprintf (fmt, argptr);
-		va_end (argptr);
+	if (thread_ring != NULL)
+		return thread_ring;
+
+	log_ring *ring = calloc (1, sizeof (log_ring));
+	if (ring == NULL)
+		return NULL;
+
+	pthread_once (&ring_key_once, log_make_key);
+	pthread_setspecific (ring_key, ring);
+
+	pthread_mutex_lock (&rings_mtx);
+	ring->next = rings;
+	rings = ring;
+	pthread_mutex_unlock (&rings_mtx);
+
+	thread_ring = ring;
+	return ring;
+}
+
+int
+log_start (const char *path)
+{
+	if (path != NULL && path[0] != '\0') {
+		int fd = open (path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+		if (fd < 0) {
+			log_info ("Couldn't open %s for logging: %s\n", path, strerror (errno));
+			return -1;
+		}
+		out_fd = fd;
+	}
+
+	if (sem_init (&wake, 0, 0) < 0)
+		return -1;
+
+	atomic_store (&running, true);
+	if (pthread_create (&writer, NULL, log_writer, NULL) != 0) {
+		atomic_store (&running, false);
+		sem_destroy (&wake);
+		return -1;
 	}
+
+	return 0;
+}
+
+void
+log_stop (void)
+{
+	if (!atomic_exchange (&running, false))
+		return;
+
+	sem_post (&wake);
+	pthread_join (writer, NULL);
+	sem_destroy (&wake);
+}
+
+static void
+write_all (const char *buf, size_t len)
+{
+	while (len > 0) {
+		ssize_t n = write (out_fd, buf, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return;
+		buf += n;
+		len -= n;
+	}
+}
+
+/* vsnprintf at line + *len, keeping *len within the line */
+static void
+log_vappend (char *line, size_t *len, const char *fmt, va_list ap)
+{
+	if (*len >= LOG_LINE_MAX - 1)
+		return;
+
+	int n = vsnprintf (line + *len, LOG_LINE_MAX - *len, fmt, ap);
+	if (n > 0)
+		*len += n;
+	if (*len > LOG_LINE_MAX - 1)
+		*len = LOG_LINE_MAX - 1;
+}
+
+static void
+log_append (char *line, size_t *len, const char *fmt, ...)
+{
+	va_list ap;
+	va_start (ap, fmt);
+	log_vappend (line, len, fmt, ap);
+	va_end (ap);
+}
+
+/* Format a whole line, timestamp to newline, into line */
+static size_t
+log_format (char *line, log_level level, const log_fields *fields, const char *fmt, va_list ap)
+{
+	struct timespec ts;
+	struct tm tm;
+	clock_gettime (CLOCK_REALTIME, &ts);
+	gmtime_r (&ts.tv_sec, &tm);
+
+	size_t len = strftime (line, LOG_LINE_MAX, "%Y-%m-%dT%H:%M:%S", &tm);
+	log_append (line,
+		    &len,
+		    ".%03ldZ %s",
+		    ts.tv_nsec / 1000000,
+		    level == LOG_LEVEL_DEBUG ? "DEBUG" : "INFO ");
+
+	if (fields != NULL && fields->server != NULL)
+		log_append (line, &len, " server=%s", fields->server);
+	if (fields != NULL && fields->module != NULL)
+		log_append (line, &len, " module=%s", fields->module);
+	if (fields != NULL && fields->command != NULL)
+		log_append (line, &len, " command=%s", fields->command);
+
+	log_append (line, &len, " ");
+	log_vappend (line, &len, fmt, ap);
+
+	/* Messages bring their own newlines or raw IRC lines, one is enough */
+	while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+		len--;
+	line[len++] = '\n';
+
+	return len;
 }
 
 void
-log_info (char *fmt, ...)
+log_write (log_level level, const log_fields *fields, const char *fmt, ...)
 {
-	va_list argptr;
-	va_start (argptr, fmt);
-	vprintf (fmt, argptr);
-	va_end (argptr);
+	char line[LOG_LINE_MAX];
+	va_list ap;
+	va_start (ap, fmt);
+	size_t len = log_format (line, level, fields, fmt, ap);
+	va_end (ap);
+
+	log_ring *ring = atomic_load_explicit (&running, memory_order_relaxed) ? log_get_ring () : NULL;
+	if (ring == NULL) {
+		write_all (line, len);
+		return;
+	}
+
+	size_t head = atomic_load_explicit (&ring->head, memory_order_relaxed);
+	size_t tail = atomic_load_explicit (&ring->tail, memory_order_acquire);
+	if (LOG_RING_SIZE - (head - tail) < len) {
+		atomic_fetch_add_explicit (&ring->dropped, 1, memory_order_relaxed);
+		return;
+	}
+
+	size_t at = head & (LOG_RING_SIZE - 1);
+	size_t first = len < LOG_RING_SIZE - at ? len : LOG_RING_SIZE - at;
+	memcpy (ring->data + at, line, first);
+	memcpy (ring->data, line + first, len - first);
+	atomic_store_explicit (&ring->head, head + len, memory_order_release);
+
+	if (head + len - tail >= LOG_WAKE_AT && !atomic_exchange (&wake_sent, true))
+		sem_post (&wake);
+}
+
+/* Write out what ring has, true if it's empty and its thread is gone */
+static bool
+log_drain (log_ring *ring)
+{
+	bool orphaned = atomic_load (&ring->orphaned);
+	size_t tail = atomic_load_explicit (&ring->tail, memory_order_relaxed);
+	size_t head = atomic_load_explicit (&ring->head, memory_order_acquire);
+
+	if (head != tail) {
+		size_t at = tail & (LOG_RING_SIZE - 1);
+		size_t len = head - tail;
+		size_t first = len < LOG_RING_SIZE - at ? len : LOG_RING_SIZE - at;
+
+		write_all (ring->data + at, first);
+		write_all (ring->data, len - first);
+		atomic_store_explicit (&ring->tail, head, memory_order_release);
+	}
+
+	unsigned long dropped = atomic_exchange (&ring->dropped, 0);
+	if (dropped > 0) {
+		char note[64];
+		int n = snprintf (note, sizeof (note), "log: dropped %lu lines\n", dropped);
+		write_all (note, n);
+	}
+
+	return orphaned;
+}
+
+static void
+log_drain_all (void)
+{
+	pthread_mutex_lock (&rings_mtx);
+	log_ring **r = &rings;
+	while (*r != NULL) {
+		log_ring *ring = *r;
+		if (log_drain (ring)) {
+			*r = ring->next;
+			free (ring);
+		} else {
+			r = &ring->next;
+		}
+	}
+	pthread_mutex_unlock (&rings_mtx);
+}
+
+static void *
+log_writer (void *arg)
+{
+	while (atomic_load (&running)) {
+		struct timespec deadline;
+		clock_gettime (CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += LOG_INTERVAL_MS * 1000000L;
+		deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+		deadline.tv_nsec %= 1000000000L;
+
+		while (sem_timedwait (&wake, &deadline) < 0 && errno == EINTR)
+			;
+		atomic_store (&wake_sent, false);
+
+		log_drain_all ();
+	}
+
+	/* Lines that came in while stopping */
+	log_drain_all ();
+	return NULL;
 }
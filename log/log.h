@@ -1,14 +1,61 @@
+/*
+ * Logging that stays off the hot path. Each thread formats its lines
+ * into a ring of its own, a background thread writes them out in
+ * batches. A thread whose ring is full drops the line and the writer
+ * reports how many went missing, logging never blocks.
+ *
+ * Until log_start and after log_stop lines are written right away.
+ */
 #ifndef LOG_H
 #define LOG_H
 
-#ifndef DEBUG
-#define DEBUG 1
-#endif
+#include <stdatomic.h>
+#include <stdbool.h>
+
+typedef enum log_level
+{
+	LOG_LEVEL_DEBUG,
+	LOG_LEVEL_INFO,
+} log_level;
+
+/* What a line is about, NULL fields are left out */
+typedef struct log_fields
+{
+	const char *server;
+	const char *module;
+	const char *command;
+} log_fields;
+
+extern atomic_bool log_debug_on;
 
+/* Write to path, or stderr if it's NULL or empty. -1 if path can't be opened */
+int
+log_start (const char *path);
+/* Write out everything still waiting and stop the writer */
 void
-log_info (char *fmt, ...);
+log_stop (void);
+void
+log_set_debug (bool on);
 
 void
-log_debug (char *fmt, ...);
+log_write (log_level level, const log_fields *fields, const char *fmt, ...)
+  __attribute__ ((format (printf, 3, 4)));
+
+#define log_info(...) log_write (LOG_LEVEL_INFO, NULL, __VA_ARGS__)
+#define log_info_at(fields, ...) log_write (LOG_LEVEL_INFO, (fields), __VA_ARGS__)
+
+/* Built with LOG_NO_DEBUG the debug calls and their arguments are gone,
+ * otherwise they cost a load while debug logging is off */
+#ifdef LOG_NO_DEBUG
+#define log_debug(...) ((void)0)
+#define log_debug_at(fields, ...) ((void)0)
+#else
+#define log_debug(...) log_debug_at (NULL, __VA_ARGS__)
+#define log_debug_at(fields, ...)                                                   \
+	do {                                                                        \
+		if (atomic_load_explicit (&log_debug_on, memory_order_relaxed))     \
+			log_write (LOG_LEVEL_DEBUG, (fields), __VA_ARGS__);         \
+	} while (0)
+#endif
 
 #endif /* LOG_H */
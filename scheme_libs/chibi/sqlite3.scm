@@ -3,6 +3,76 @@
 ;;> management, iteration via fold and/or conversion to lists, and SQL
 ;;> statements as s-expressions.
 
+;;> \section{Statement cache}
+
+;;> How many prepared statements each db keeps around, least recently
+;;> used ones are finalized when more come in.
+
+(define sqlite3-statement-cache-size 32)
+
+;; Ephemerons from each db to its cache, a vector of the (sql . stmt)
+;; entries, most recently used first, and their count.  Caches go away
+;; with their db.
+(define statement-caches '())
+
+(define (db-statement-cache db)
+  (define (live ls)
+    (cond ((null? ls) '())
+          ((ephemeron-broken? (car ls)) (live (cdr ls)))
+          (else (cons (car ls) (live (cdr ls))))))
+  (let lp ((ls statement-caches))
+    (cond
+     ((null? ls)
+      (let ((cache (vector '() 0)))
+        (set! statement-caches
+              (cons (make-ephemeron db cache) (live statement-caches)))
+        cache))
+     ((and (not (ephemeron-broken? (car ls)))
+           (eq? db (ephemeron-key (car ls))))
+      (ephemeron-value (car ls)))
+     (else (lp (cdr ls))))))
+
+;;> Returns a prepared statement for the SQL string \var{sql} on
+;;> \var{db}, reset and with its bindings cleared if it came from the
+;;> cache, or #f if it doesn't compile.
+
+(define (sqlite3-prepare-cached db sql)
+  (let* ((cache (db-statement-cache db))
+         (entries (vector-ref cache 0))
+         (hit (assoc sql entries)))
+    (cond
+     (hit
+      (if (not (eq? hit (car entries)))
+          (vector-set! cache 0 (cons hit (remove-entry hit entries))))
+      (sqlite3-reset (cdr hit))
+      (sqlite3-clear-bindings (cdr hit))
+      (cdr hit))
+     ((sqlite3-prepare db sql)
+      => (lambda (stmt)
+           (let ((entries (cons (cons sql stmt) entries))
+                 (count (+ 1 (vector-ref cache 1))))
+             (cond
+              ((> count sqlite3-statement-cache-size)
+               (sqlite3-finalize (cdr (last-entry entries)))
+               (vector-set! cache 0 (drop-last entries))
+               (vector-set! cache 1 (- count 1)))
+              (else
+               (vector-set! cache 0 entries)
+               (vector-set! cache 1 count)))
+             stmt)))
+     (else #f))))
+
+(define (remove-entry entry ls)
+  (cond ((null? ls) '())
+        ((eq? entry (car ls)) (cdr ls))
+        (else (cons (car ls) (remove-entry entry (cdr ls))))))
+
+(define (last-entry ls)
+  (if (null? (cdr ls)) (car ls) (last-entry (cdr ls))))
+
+(define (drop-last ls)
+  (if (null? (cdr ls)) '() (cons (car ls) (drop-last (cdr ls)))))
+
 ;;> \section{Simple interface}
 
 ;;> The fundamental sqlite3 result iterator.  Executes \var{stmt-obj}
@@ -10,13 +80,15 @@
 ;;> the results, each time calling \var{kons} with two arguments,
 ;;> \var{stmt} and the current accumulator, which starts as
 ;;> \var{knil}.  \var{stmt-obj} can be a prepared statement, a string
-;;> to parse into a statement, or an SSQL sexp.
+;;> to parse into a statement, or an SSQL sexp.  Strings and SSQL are
+;;> only prepared the first time, see \scheme{sqlite3-prepare-cached},
+;;> so \var{kons} shouldn't run the same SQL on \var{db} again.
 
 (define (sqlite3-fold kons knil db stmt . vals)
   (let ((stmt* (cond ((string? stmt)
-                      (sqlite3-prepare db stmt))
+                      (sqlite3-prepare-cached db stmt))
                      ((pair? stmt)
-                      (sqlite3-prepare db (ssql->sql stmt)))
+                      (sqlite3-prepare-cached db (ssql->sql stmt)))
                      (else stmt))))
     (if (not stmt*)
         (error "not a sqlite3 statement" stmt (sqlite3-errmsg db)))
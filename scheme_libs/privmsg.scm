@@ -1,12 +1,7 @@
 (import (chibi string))
 
-(define (send-privmsg target text)
-  (send-raw
-   (string-append "PRIVMSG " target " :" text "\r\n")))
-
-(define (send-action target text)
-  (send-raw
-   (string-append "PRIVMSG " target " :" "\x01" "ACTION " text "\x01" "\r\n")))
+; send-privmsg, send-notice and send-action are native, they split
+; long text over as many lines as it takes
 
 (define (reply text)
   (send-privmsg (get-channel) text))
@@ -19,16 +14,3 @@
 
 (define (get-text)
   (cadr (get-message-params)))
-
-(define (get-nick)
-  (car (string-split (get-message-source) #\!)))
-
-(define (get-ident)
-  (car
-   (string-split
-    (cadr
-     (string-split (get-message-source) #\!))
-    #\@)))
-
-(define (get-host)
-  (cadr (string-split (get-message-source) #\@)))
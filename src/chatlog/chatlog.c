@@ -0,0 +1,262 @@
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sqlite3.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "irc/mpsc.h"
+#include "log/log.h"
+
+#include "chatlog.h"
+
+/* Rows that can wait for the writer, more are dropped */
+#define CHATLOG_QUEUE_SIZE 8192
+/* Wake the writer early once this many rows are waiting */
+#define CHATLOG_BATCH 256
+/* How long a row waits at most before it's committed */
+#define CHATLOG_INTERVAL_MS 500
+/* Rows per transaction, so a backlog doesn't hold the write lock forever */
+#define CHATLOG_TXN_MAX 4096
+
+typedef struct chatlog_row
+{
+	time_t time;
+	bool action;
+	const char *server;
+	const char *channel;
+	const char *nick;
+	const char *message;
+	char strings[];
+} chatlog_row;
+
+static sqlite3 *db;
+static sqlite3_stmt *insert_stmt;
+static irc_mpsc queue;
+static pthread_t writer;
+static sem_t wake;
+static atomic_bool wake_sent;
+static atomic_bool running;
+static atomic_ulong dropped;
+
+static void *
+chatlog_writer (void *arg);
+
+static int
+chatlog_exec (const char *sql)
+{
+	char *errmsg = NULL;
+	if (sqlite3_exec (db, sql, NULL, NULL, &errmsg) != SQLITE_OK) {
+		log_info ("chatlog: %s: %s\n", sql, errmsg != NULL ? errmsg : sqlite3_errmsg (db));
+		sqlite3_free (errmsg);
+		return -1;
+	}
+
+	return 0;
+}
+
+int
+chatlog_open (const char *db_path)
+{
+	if (sqlite3_open_v2 (db_path,
+			     &db,
+			     SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_NOMUTEX,
+			     NULL) != SQLITE_OK) {
+		log_info ("chatlog: Couldn't open %s: %s\n", db_path, sqlite3_errmsg (db));
+		goto err_db;
+	}
+
+	/* Modules may have the database open as well */
+	sqlite3_busy_timeout (db, 5000);
+
+	/* With WAL, NORMAL only syncs at checkpoints and still can't corrupt */
+	if (chatlog_exec ("PRAGMA journal_mode=WAL") < 0 ||
+	    chatlog_exec ("PRAGMA synchronous=NORMAL") < 0 ||
+	    chatlog_exec ("CREATE TABLE IF NOT EXISTS irc_logs (time TIMESTAMP DEFAULT "
+			  "CURRENT_TIMESTAMP, server TEXT, channel TEXT, nick TEXT, "
+			  "message TEXT, action INTEGER)") < 0)
+		goto err_db;
+
+	if (sqlite3_prepare_v2 (db,
+				"INSERT INTO irc_logs (time, server, channel, nick, message, action) "
+				"VALUES (?, ?, ?, ?, ?, ?)",
+				-1,
+				&insert_stmt,
+				NULL) != SQLITE_OK) {
+		log_info ("chatlog: %s\n", sqlite3_errmsg (db));
+		goto err_db;
+	}
+
+	if (irc_mpsc_init (&queue, CHATLOG_QUEUE_SIZE, sizeof (chatlog_row *)) < 0)
+		goto err_stmt;
+	if (sem_init (&wake, 0, 0) < 0)
+		goto err_queue;
+
+	atomic_store (&running, true);
+	if (pthread_create (&writer, NULL, chatlog_writer, NULL) != 0)
+		goto err_sem;
+
+	return 0;
+
+err_sem:
+	atomic_store (&running, false);
+	sem_destroy (&wake);
+err_queue:
+	irc_mpsc_free (&queue);
+err_stmt:
+	sqlite3_finalize (insert_stmt);
+	insert_stmt = NULL;
+err_db:
+	sqlite3_close (db);
+	db = NULL;
+	return -1;
+}
+
+void
+chatlog_close (void)
+{
+	if (!atomic_exchange (&running, false))
+		return;
+
+	sem_post (&wake);
+	pthread_join (writer, NULL);
+
+	/* The queue stays, an append that saw running just before it was
+	 * cleared may still be pushing to it */
+	sqlite3_finalize (insert_stmt);
+	insert_stmt = NULL;
+	sqlite3_close (db);
+	db = NULL;
+}
+
+/* A copy of s in the row's strings at *at, NULL stays NULL */
+static const char *
+row_string (char **at, const char *s, size_t len)
+{
+	if (s == NULL)
+		return NULL;
+
+	char *copy = *at;
+	memcpy (copy, s, len + 1);
+	*at += len + 1;
+	return copy;
+}
+
+bool
+chatlog_append (const char *server,
+		const char *channel,
+		const char *nick,
+		const char *message,
+		bool action)
+{
+	if (!atomic_load_explicit (&running, memory_order_relaxed))
+		return false;
+
+	size_t server_len = server != NULL ? strlen (server) : 0;
+	size_t channel_len = channel != NULL ? strlen (channel) : 0;
+	size_t nick_len = nick != NULL ? strlen (nick) : 0;
+	size_t message_len = message != NULL ? strlen (message) : 0;
+
+	chatlog_row *row = malloc (sizeof (chatlog_row) + server_len + channel_len + nick_len +
+				   message_len + 4);
+	if (row == NULL)
+		return false;
+
+	char *at = row->strings;
+	row->time = time (NULL);
+	row->action = action;
+	row->server = row_string (&at, server, server_len);
+	row->channel = row_string (&at, channel, channel_len);
+	row->nick = row_string (&at, nick, nick_len);
+	row->message = row_string (&at, message, message_len);
+
+	chatlog_row **slot = irc_mpsc_reserve (&queue);
+	if (slot == NULL) {
+		/* Only say so once per burst of drops */
+		if (atomic_fetch_add (&dropped, 1) == 0)
+			log_info ("chatlog: queue full, dropping rows\n");
+		free (row);
+		return false;
+	}
+	*slot = row;
+	irc_mpsc_publish (slot);
+
+	if (irc_mpsc_len (&queue) >= CHATLOG_BATCH && !atomic_exchange (&wake_sent, true))
+		sem_post (&wake);
+
+	return true;
+}
+
+static void
+chatlog_insert (const chatlog_row *row)
+{
+	char timestamp[32];
+	struct tm tm;
+	gmtime_r (&row->time, &tm);
+	/* The format CURRENT_TIMESTAMP uses */
+	strftime (timestamp, sizeof (timestamp), "%Y-%m-%d %H:%M:%S", &tm);
+
+	sqlite3_bind_text (insert_stmt, 1, timestamp, -1, SQLITE_TRANSIENT);
+	sqlite3_bind_text (insert_stmt, 2, row->server, -1, SQLITE_STATIC);
+	sqlite3_bind_text (insert_stmt, 3, row->channel, -1, SQLITE_STATIC);
+	sqlite3_bind_text (insert_stmt, 4, row->nick, -1, SQLITE_STATIC);
+	sqlite3_bind_text (insert_stmt, 5, row->message, -1, SQLITE_STATIC);
+	sqlite3_bind_int (insert_stmt, 6, row->action);
+
+	if (sqlite3_step (insert_stmt) != SQLITE_DONE)
+		log_info ("chatlog: insert: %s\n", sqlite3_errmsg (db));
+	sqlite3_reset (insert_stmt);
+	sqlite3_clear_bindings (insert_stmt);
+}
+
+/* Commit the queued rows */
+static void
+chatlog_commit (void)
+{
+	while (irc_mpsc_peek (&queue) != NULL) {
+		if (chatlog_exec ("BEGIN") < 0)
+			return;
+
+		chatlog_row **slot;
+		int n = 0;
+		while (n < CHATLOG_TXN_MAX && (slot = irc_mpsc_peek (&queue)) != NULL) {
+			chatlog_row *row = *slot;
+			irc_mpsc_release (&queue, slot);
+
+			chatlog_insert (row);
+			free (row);
+			n++;
+		}
+
+		if (chatlog_exec ("COMMIT") < 0)
+			chatlog_exec ("ROLLBACK");
+	}
+
+	unsigned long lost = atomic_exchange (&dropped, 0);
+	if (lost > 0)
+		log_info ("chatlog: dropped %lu rows\n", lost);
+}
+
+static void *
+chatlog_writer (void *arg)
+{
+	while (atomic_load (&running)) {
+		struct timespec deadline;
+		clock_gettime (CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += CHATLOG_INTERVAL_MS * 1000000L;
+		deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+		deadline.tv_nsec %= 1000000000L;
+
+		while (sem_timedwait (&wake, &deadline) < 0 && errno == EINTR)
+			;
+		atomic_store (&wake_sent, false);
+
+		chatlog_commit ();
+	}
+
+	/* Whatever came in while stopping */
+	chatlog_commit ();
+	return NULL;
+}
@@ -0,0 +1,30 @@
+/*
+ * The channel log, rows go into the irc_logs table of the bot's sqlite
+ * database. Appending only queues the row, a background thread commits
+ * whatever has piled up in one transaction, once enough rows are
+ * waiting or the oldest has waited long enough.
+ */
+#ifndef CHATLOG_H
+#define CHATLOG_H
+
+#include <stdbool.h>
+
+/* Open the database in WAL mode and start the writer. Returns -1 on errors. */
+int
+chatlog_open (const char *db_path);
+/* Commit everything queued and stop the writer */
+void
+chatlog_close (void);
+
+/*
+ * Queue a row, any of the strings may be NULL. Returns false if the log
+ * isn't open or the queue is full and the row was dropped. Any thread.
+ */
+bool
+chatlog_append (const char *server,
+		const char *channel,
+		const char *nick,
+		const char *message,
+		bool action);
+
+#endif /* CHATLOG_H */
@@ -1,84 +1,192 @@
 #include <err.h>    // err for panics
 #include <errno.h>  // errno
+#include <ev.h>     // signal watchers
+#include <signal.h> // SIGINT
 #include <unistd.h> // read, write
 
 #include <stdbool.h> // malloc
 #include <stdio.h>   // puts
 #include <stdlib.h>  // malloc
+#include <string.h>  // strcmp
 
 #include <glib.h>
 
+#include "chatlog/chatlog.h"
 #include "config/config.h"
 
 #include "b64/b64.h"
 #include "utlist/list.h"
 
+#include "irc/capture.h"
 #include "irc/hooks.h"
 #include "log/log.h"
 
+#include "metrics/metrics.h"
 #include "scheme/scheme.h"
 
-void
-exitHandler (int sig)
+/*
+ * Quit every server and stop the loop. The connections belong to the
+ * loop, so this runs as one of its watchers, not as a signal handler.
+ * main cleans up the rest once the loop is back.
+ */
+static void
+exit_callback (EV_P_ ev_signal *w, int re)
 {
-	log_debug ("Exiting\n");
+	log_info ("Exiting on signal %d\n", w->signum);
 	config_t *config = get_config ();
-	quit_irc_connection (config->server);
-	free_config ();
+
+	struct irc_server *s;
+	LL_FOREACH (config->servers, s) {
+		quit_irc_connection (s);
+	}
+	ev_break (EV_A_ EVBREAK_ALL);
+}
+
+/* The watchers don't keep the loop running on their own */
+static void
+watch_exit_signals (void)
+{
+	static ev_signal watchers[3];
+	static const int signals[] = { SIGHUP, SIGINT, SIGQUIT };
+	struct ev_loop *loop = irc_get_event_loop ();
+
+	for (size_t i = 0; i < sizeof (signals) / sizeof (signals[0]); ++i) {
+		ev_signal_init (&watchers[i], exit_callback, signals[i]);
+		ev_signal_start (loop, &watchers[i]);
+		ev_unref (loop);
+	}
+}
+
+static void
+usage (const char *prog)
+{
+	fprintf (stderr, "usage: %s [-r capture.idx [-s seconds] [-f]]\n", prog);
+	exit (2);
+}
+
+/* The server a capture was made on, or the first one there is */
+static const irc_server *
+replay_server (const config_t *config, const char *path)
+{
+	irc_capture_reader r;
+	if (irc_capture_reader_open (&r, path, 0) == -1)
+		return config->servers;
+
+	const irc_server *found = config->servers;
+	struct irc_server *s;
+	LL_FOREACH (config->servers, s) {
+		if (strcmp (s->name, r.server) == 0)
+			found = s;
+	}
+	irc_capture_reader_close (&r);
+	return found;
 }
 
 int
 main (int argc, char **argv)
 {
-	signal (SIGHUP, exitHandler);
-	signal (SIGINT, exitHandler);
-	signal (SIGQUIT, exitHandler);
-	signal (SIGILL, exitHandler);
-	signal (SIGTRAP, exitHandler);
-	signal (SIGABRT, exitHandler);
+	watch_exit_signals ();
+
+	/* -r replays a capture instead of connecting, from -s seconds into
+	 * it, -f as fast as it goes */
+	const char *replay = NULL;
+	double replay_from = 0;
+	bool replay_fast = false;
+	int opt;
+	while ((opt = getopt (argc, argv, "r:s:f")) != -1) {
+		switch (opt) {
+			case 'r':
+				replay = optarg;
+				break;
+			case 's':
+				replay_from = strtod (optarg, NULL);
+				break;
+			case 'f':
+				replay_fast = true;
+				break;
+			default:
+				usage (argv[0]);
+		}
+	}
 
 	const char *config_file_path = "./config.json";
 	parse_config (config_file_path);
 
 	struct config_t *config = get_config ();
-
-	log_debug (
-	  "-----\nConnecting to server: %s\nHost: %s\nPort: %s\nSSL: %u\n-----\n",
-	  config->server->name,
-	  config->server->host,
-	  config->server->port,
-	  config->server->secure);
-
-	log_debug ("-----\nNickname %s\nIdent: %s\nRealname: %s\n-----\n",
-		   config->server->user->nickname,
-		   config->server->user->ident,
-		   config->server->user->realname);
+	struct irc_server *s;
+
+	log_set_debug (config->debug);
+	if (log_start (config->log_file) == -1)
+		log_info ("Logging synchronously\n");
+
+	LL_FOREACH (config->servers, s) {
+		log_debug (
+		  "-----\nServer: %s\nHost: %s\nPort: %s\nSSL: %u\n-----\n",
+		  s->name,
+		  s->host,
+		  s->port,
+		  s->secure);
+
+		log_debug ("-----\nNickname %s\nIdent: %s\nRealname: %s\n-----\n",
+			   s->user->nickname,
+			   s->user->ident,
+			   s->user->realname);
+
+		struct irc_channel *elt;
+		LL_FOREACH (s->channels, elt) {
+			log_debug ("%s\n", elt->channel);
+		}
+	}
 
 	log_info ("-----\nCommand Prefix: %s\n-----\n", config->cmd_prefix);
 
-	struct irc_channel *elt;
-	LL_FOREACH (config->server->channels, elt) {
-		log_debug ("%s\n", elt->channel);
-	}
+	/* A replay's messages are in the log already */
+	if (replay != NULL)
+		log_info ("Channel logging is off while replaying\n");
+	else if (chatlog_open (config->db_path) == -1)
+		log_info ("Channel logging is disabled\n");
 
 	init_hooks ();
 	setenv ("CHIBI_MODULE_PATH", "chibi-scheme/lib:scheme_libs", 1);
 	scm_init ();
 	register_core_hooks ();
+	metrics_register_hooks ();
+	if (config->metrics_socket[0] != '\0' && metrics_listen (config->metrics_socket) == -1)
+		log_info ("Metrics are only available through the stats command\n");
+
+	if (replay != NULL) {
+		if (config->servers == NULL || irc_replay (replay_server (config, replay), replay, replay_from, replay_fast) == -1)
+			err (1, "Error replaying %s", replay);
+		irc_do_event_loop ();
+
+		metrics_close ();
+		log_stop ();
+		return 0;
+	}
 
-	log_info ("setting up connection\n");
-	int ret = irc_server_connect (config->server);
-	if (ret == -1) {
-		err (1, "Error Connecting");
+	/* Connections are set up in parallel by the event loop, which runs
+	 * the PREINIT hooks for each of them once it's ready
+	 */
+	int connecting = 0;
+	LL_FOREACH (config->servers, s) {
+		log_info ("setting up connection to %s\n", s->name);
+		if (irc_server_connect (s) == -1) {
+			log_info ("Error connecting to %s\n", s->name);
+			continue;
+		}
+		connecting++;
 	}
-	log_info ("connection setup\n");
 
-	exec_hooks (config->server, "PREINIT", NULL);
+	if (connecting == 0)
+		err (1, "Error Connecting");
 
-	/* Init Event Loop handels auth via sasl and breaks on
-	 * receiving either a MODE or WELCOME message.
+	/* Every server is driven by the same event loop, it returns once
+	 * the last connection is closed.
 	 */
-	irc_do_event_loop (config->server);
+	irc_do_event_loop ();
 
+	metrics_close ();
+	chatlog_close ();
+	log_stop ();
 	return 0;
 }
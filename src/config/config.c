@@ -1,6 +1,7 @@
 #include "config.h"
 #include "cJSON/cJSON.h"
 #include "irc/irc.h"
+#include "irc/sendq.h"
 #include "log/log.h"
 #include "utlist/list.h"
 #include <err.h> // err for panics
@@ -28,11 +29,41 @@ static char *
 cjson_parse_string (const cJSON *json, char *field, char *defaultv)
 {
 	cJSON *value = cJSON_GetObjectItemCaseSensitive (json, field);
-	if (cJSON_IsString (value) && value->valuestring != NULL) {
-		strdup (value->valuestring);
-	} else {
-		strdup (defaultv);
+	if (cJSON_IsString (value) && value->valuestring != NULL)
+		return strdup (value->valuestring);
+	return strdup (defaultv);
+}
+
+static double
+cjson_parse_number (const cJSON *json, char *field, double defaultv)
+{
+	cJSON *value = cJSON_GetObjectItemCaseSensitive (json, field);
+	if (cJSON_IsNumber (value))
+		return value->valuedouble;
+	return defaultv;
+}
+
+/* A string array as a NULL terminated list, empty if field isn't one */
+static char **
+cjson_parse_string_list (const cJSON *json, char *field)
+{
+	cJSON *array = cJSON_GetObjectItemCaseSensitive (json, field);
+	int size = cJSON_IsArray (array) ? cJSON_GetArraySize (array) : 0;
+
+	char **list = calloc (size + 1, sizeof (char *));
+	if (list == NULL)
+		err (1, "config: %s", field);
+
+	int i = 0;
+	cJSON *item = NULL;
+	cJSON_ArrayForEach (item, array)
+	{
+		if (!cJSON_IsString (item) || item->valuestring == NULL)
+			err (1, "config: %s: not a string", field);
+		list[i++] = strdup (item->valuestring);
 	}
+
+	return list;
 }
 
 static struct config_t *config;
@@ -43,26 +74,129 @@ get_config ()
 	return config;
 }
 
-void
-free_config ()
+static void
+free_server (struct irc_server *server)
 {
-	free (config->server->name);
-	free (config->server->host);
-	free (config->server->port);
-
-	free (config->server->user->nickname);
-	free (config->server->user->ident);
-	free (config->server->user->realname);
-	free (config->server->user->sasl_user);
-	free (config->server->user->sasl_pass);
-	free (config->server->user);
+	free (server->name);
+	free (server->host);
+	free (server->port);
+	free (server->capture_dir);
+
+	free (server->user->nickname);
+	free (server->user->ident);
+	free (server->user->realname);
+	free (server->user->sasl_user);
+	free (server->user->sasl_pass);
+	free (server->user);
 
 	/* now delete each element, use the safe iterator */
 	struct irc_channel *l, *tmp;
-	LL_FOREACH_SAFE (config->server->channels, l, tmp) {
-		LL_DELETE (config->server->channels, l);
+	LL_FOREACH_SAFE (server->channels, l, tmp) {
+		LL_DELETE (server->channels, l);
 		free (l);
 	}
+
+	free (server);
+}
+
+void
+free_config ()
+{
+	struct irc_server *s, *tmp;
+	LL_FOREACH_SAFE (config->servers, s, tmp) {
+		LL_DELETE (config->servers, s);
+		free_server (s);
+	}
+
+	scheme_limits *l, *ltmp;
+	LL_FOREACH_SAFE (config->scheme_overrides, l, ltmp) {
+		LL_DELETE (config->scheme_overrides, l);
+		free (l->name);
+		free (l);
+	}
+}
+
+const scheme_limits *
+config_scheme_limits (const char *path)
+{
+	const char *name = strrchr (path, '/');
+	name = name != NULL ? name + 1 : path;
+
+	scheme_limits *l;
+	LL_FOREACH (config->scheme_overrides, l)
+		if (strcmp (l->name, name) == 0)
+			return l;
+
+	return &config->scheme_limits;
+}
+
+/* Fields left out of json keep what defaults has */
+static void
+parse_scheme_limits (const cJSON *json, scheme_limits *l, const scheme_limits *defaults)
+{
+	l->time_ms = cjson_parse_number (json, "time_ms", defaults->time_ms);
+	l->heap_initial = cjson_parse_number (json, "heap_initial_bytes", defaults->heap_initial);
+	l->heap_max = cjson_parse_number (json, "heap_max_bytes", defaults->heap_max);
+	l->strikes = cjson_parse_number (json, "strikes", defaults->strikes);
+}
+
+static struct irc_server *
+parse_server (const cJSON *server)
+{
+	struct irc_server *s = malloc (sizeof (irc_server));
+
+	s->name = cjson_parse_string (server, "name", "snoonet");
+	s->host = cjson_parse_string (server, "host", "irc.snoonet.org");
+	s->port = cjson_parse_string (server, "port", "6667");
+	s->secure = cjson_parse_bool (server, "secure", false);
+	s->next = NULL;
+	s->connection = NULL;
+
+	/* Leave out "flood" for the defaults, a rate of 0 turns it off */
+	cJSON *flood = cJSON_GetObjectItemCaseSensitive (server, "flood");
+	s->flood_burst = cjson_parse_number (flood, "burst", IRC_SENDQ_DEFAULT_BURST);
+	s->flood_rate = cjson_parse_number (flood, "rate", IRC_SENDQ_DEFAULT_RATE);
+
+	/* Likewise for "limits", 0 lifts a limit */
+	cJSON *limits = cJSON_GetObjectItemCaseSensitive (server, "limits");
+	s->backlog_max_msgs = cjson_parse_number (limits, "backlog_messages", IRC_BACKLOG_DEFAULT_MSGS);
+	s->backlog_max_bytes = cjson_parse_number (limits, "backlog_bytes", IRC_BACKLOG_DEFAULT_BYTES);
+	s->sendq_max_bytes = cjson_parse_number (limits, "sendq_bytes", IRC_SENDQ_DEFAULT_MAX_BYTES);
+
+	/* Capturing traffic for replays is off unless there's a directory */
+	s->capture_dir = cjson_parse_string (server, "capture_dir", "");
+
+	/* Add user data to server */
+	cJSON *user = cJSON_GetObjectItemCaseSensitive (server, "user");
+	if (!cJSON_IsObject (user))
+		err (1, "config: server: user is not an object");
+
+	s->user = malloc (sizeof (irc_user));
+
+	s->user->nickname = cjson_parse_string (user, "nickname", "circ");
+	s->user->ident = cjson_parse_string (user, "ident", "circ");
+	s->user->realname = cjson_parse_string (user, "realname", "circ");
+	s->user->sasl_enabled = cjson_parse_bool (user, "sasl_enabled", false);
+	s->user->sasl_user = cjson_parse_string (user, "sasl_user", "circ");
+	s->user->sasl_pass = cjson_parse_string (user, "sasl_pass", "circ");
+
+	/* Iter channels and add to the server */
+	cJSON *channel = NULL;
+	s->channels = NULL;
+	cJSON *channels = cJSON_GetObjectItemCaseSensitive (server, "channels");
+	cJSON_ArrayForEach (channel, channels)
+	{
+		if (cJSON_IsString (channel)) {
+			struct irc_channel *item;
+			item = (irc_channel *)malloc (sizeof *item);
+			strncpy (
+			  item->channel, channel->valuestring, sizeof (item->channel));
+			LL_APPEND (s->channels, item);
+		} else
+			err (1, "config: channel is not a string");
+	}
+
+	return s;
 }
 
 int
@@ -113,49 +247,58 @@ parse_config (const char *config_file_path)
 	config->cmd_prefix = cjson_parse_string (json, "cmd_prefix", "%");
 	config->db_path = cjson_parse_string (json, "db_path", "db.sqlite3");
 	config->scheme_mod_dir = cjson_parse_string (json, "scheme_mod_dir", "scheme_mods/");
+	config->workers = cjson_parse_number (json, "workers", 0);
+	config->log_file = cjson_parse_string (json, "log_file", "");
+	config->metrics_socket = cjson_parse_string (json, "metrics_socket", "");
+	config->owners = cjson_parse_string_list (json, "owners");
+
+	/* Limits for every scheme module, "modules" has them per file name */
+	cJSON *limits = cJSON_GetObjectItemCaseSensitive (json, "scheme_limits");
+	const scheme_limits defaults = {
+		.time_ms = SCHEME_DEFAULT_TIME_MS,
+		.heap_max = SCHEME_DEFAULT_HEAP_MAX,
+		.strikes = SCHEME_DEFAULT_STRIKES,
+	};
+	config->scheme_limits = (scheme_limits){ 0 };
+	parse_scheme_limits (limits, &config->scheme_limits, &defaults);
+
+	config->scheme_overrides = NULL;
+	cJSON *override = NULL;
+	cJSON *overrides = cJSON_GetObjectItemCaseSensitive (limits, "modules");
+	cJSON_ArrayForEach (override, overrides)
+	{
+		if (!cJSON_IsObject (override))
+			err (1, "config: scheme_limits: %s is not an object", override->string);
+		scheme_limits *l = calloc (1, sizeof (scheme_limits));
+		if (l == NULL)
+			err (1, "config: scheme_limits");
+		l->name = strdup (override->string);
+		parse_scheme_limits (override, l, &config->scheme_limits);
+		LL_APPEND (config->scheme_overrides, l);
+	}
 
 	/* Parse Servers section */
-	cJSON *server = cJSON_GetObjectItemCaseSensitive (json, "server");
-	if (cJSON_IsObject (server)) {
-		config->server = malloc (sizeof (irc_server));
-
-		config->server->name = cjson_parse_string (server, "name", "snoonet");
-		config->server->host = cjson_parse_string (server, "host", "irc.snoonet.org");
-		config->server->port = cjson_parse_string (server, "port", "6667");
-		config->server->secure = cjson_parse_bool (server, "secure", false);
-
-		/* Add user data to server */
-		cJSON *user = cJSON_GetObjectItemCaseSensitive (server, "user");
-		if (cJSON_IsObject (user)) {
-			config->server->user = malloc (sizeof (irc_user));
-
-			config->server->user->nickname = cjson_parse_string (user, "nickname", "circ");
-			config->server->user->ident = cjson_parse_string (user, "ident", "circ");
-			config->server->user->realname = cjson_parse_string (user, "realname", "circ");
-			config->server->user->sasl_enabled = cjson_parse_bool (user, "sasl_enabled", false);
-			config->server->user->sasl_user = cjson_parse_string (user, "sasl_user", "circ");
-			config->server->user->sasl_pass = cjson_parse_string (user, "sasl_pass", "circ");
-		}
-
-		/* Iter channels and add to the server */
-		cJSON *channel = NULL;
-		config->server->channels = NULL;
-		cJSON *channels = cJSON_GetObjectItemCaseSensitive (server, "channels");
-		cJSON_ArrayForEach (channel, channels)
+	config->servers = NULL;
+	cJSON *server = NULL;
+	cJSON *servers = cJSON_GetObjectItemCaseSensitive (json, "servers");
+	if (cJSON_IsArray (servers)) {
+		cJSON_ArrayForEach (server, servers)
 		{
-			if (cJSON_IsString (channel)) {
-				struct irc_channel *item;
-				item = (irc_channel *)malloc (sizeof *item);
-				strncpy (
-				  item->channel, channel->valuestring, sizeof (item->channel));
-				LL_APPEND (config->server->channels, item);
-			} else
-				err (1, "config: channel is not a string");
+			if (!cJSON_IsObject (server))
+				err (1, "config: server is not an object");
+			LL_APPEND (config->servers, parse_server (server));
 		}
 	} else {
-		err (1, "config: server is not an object");
+		/* Older configs only have a single server object */
+		server = cJSON_GetObjectItemCaseSensitive (json, "server");
+		if (!cJSON_IsObject (server))
+			err (1, "config: server is not an object");
+		LL_APPEND (config->servers, parse_server (server));
 	}
 
+	if (config->servers == NULL)
+		err (1, "config: no servers configured");
+
 	/* Parse Modules section */
 	int iter = 0;
 	cJSON *module = NULL;
@@ -2,8 +2,7 @@
 #define CONFIG_H
 
 #include <stdbool.h>
-
-#define DEBUG (get_config () && get_config ()->debug)
+#include <stddef.h>
 
 typedef struct module_t
 {
@@ -14,13 +13,34 @@ typedef struct module_t
 	char **matchers;
 } module_t;
 
+#define SCHEME_DEFAULT_TIME_MS 5000
+#define SCHEME_DEFAULT_HEAP_MAX (128 * 1024 * 1024)
+#define SCHEME_DEFAULT_STRIKES 3
+
+/* What a scheme module may take, see "scheme_limits" in config.json */
+typedef struct scheme_limits
+{
+	char *name;	     /* the module file these are for, NULL for the defaults */
+	double time_ms;	     /* per handler call or load, 0 for no limit */
+	size_t heap_initial; /* bytes, 0 for chibi's default */
+	size_t heap_max;     /* bytes, 0 for no limit */
+	int strikes;	     /* violations before a quarantine, 0 for never */
+	struct scheme_limits *next;
+} scheme_limits;
+
 typedef struct config_t
 {
 	bool debug;
 	char *cmd_prefix;
 	char *db_path;
 	char *scheme_mod_dir;
-	struct irc_server *server;
+	int workers; /* threads running scheme handlers, 0 for one per core */
+	char *log_file;	      /* where the log goes, "" for stderr */
+	char *metrics_socket; /* where metrics are served, "" for nowhere */
+	char **owners;	      /* nick!ident@host masks allowed owner commands */
+	scheme_limits scheme_limits;
+	scheme_limits *scheme_overrides;
+	struct irc_server *servers;
 	struct module_t **modules;
 } config_t;
 
@@ -31,5 +51,8 @@ int
 parse_config (const char *config_file_path);
 void
 free_config ();
+/* The limits for the module at path, its own if it has some */
+const scheme_limits *
+config_scheme_limits (const char *path);
 
 #endif /* CONFIG_H */
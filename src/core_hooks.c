@@ -1,5 +1,6 @@
 #include <err.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 #include "b64/b64.h"
 #include "config/config.h"
@@ -12,35 +13,28 @@
 static void
 register_preinit_hook (const irc_server *s, const irc_msg *msg)
 {
-	struct config_t *config = get_config ();
-
 	log_debug ("Registering client...\n");
 
-	char *nick_params[] = { config->server->user->nickname };
-	irc_msg *nick_msg =
-	  irc_msg_new (NULL, "NICK", 1, nick_params);
-	irc_push_message (s, nick_msg);
+	char *nick_params[] = { s->user->nickname };
+	irc_push_command (s, "NICK", 1, nick_params);
 
-	char *user_params[] = { config->server->user->ident, "0", "*", config->server->user->realname };
-	irc_msg *user_msg =
-	  irc_msg_new (NULL, "USER", 4, user_params);
-	irc_push_message (s, user_msg);
+	char *user_params[] = { s->user->ident, "0", "*", s->user->realname };
+	irc_push_command (s, "USER", 4, user_params);
 }
 
 static void
 sasl_preinit_hook (const irc_server *s, const irc_msg *msg)
 {
+	if (!s->user->sasl_enabled)
+		return;
+
 	log_info ("Doing SASL Auth\n");
 
 	char *cap_params[] = { "REQ", "sasl" };
-	irc_msg *cap_msg =
-	  irc_msg_new (NULL, "CAP", 2, cap_params);
-	irc_push_message (s, cap_msg);
+	irc_push_command (s, "CAP", 2, cap_params);
 
 	char *auth_params[] = { "PLAIN" };
-	irc_msg *auth_msg =
-	  irc_msg_new (NULL, "AUTHENTICATE", 1, auth_params);
-	irc_push_message (s, auth_msg);
+	irc_push_command (s, "AUTHENTICATE", 1, auth_params);
 }
 
 static void
@@ -48,9 +42,11 @@ sasl_auth_hook (const irc_server *s, const irc_msg *msg)
 {
 	/* When we receive "AUTHENTICATE +" we can send our user data
 	 */
-	struct config_t *config = get_config ();
-	char *auth_user = config->server->user->sasl_user;
-	char *auth_pass = config->server->user->sasl_pass;
+	if (!s->user->sasl_enabled)
+		return;
+
+	char *auth_user = s->user->sasl_user;
+	char *auth_pass = s->user->sasl_pass;
 
 	log_info ("Doing SASL Auth\n");
 
@@ -64,10 +60,9 @@ sasl_auth_hook (const irc_server *s, const irc_msg *msg)
 	  b64_encode (auth_string, strlen (auth_user) * 2 + strlen (auth_pass) + 2);
 
 	char *auth_params[] = { auth_string_encoded };
-	irc_msg *auth_msg =
-	  irc_msg_new (NULL, "AUTHENTICATE", 1, auth_params);
-	irc_push_message (s, auth_msg);
+	irc_push_command (s, "AUTHENTICATE", 1, auth_params);
 
+	free (auth_string_encoded);
 	g_free (auth_string);
 }
 
@@ -77,15 +72,19 @@ sasl_cap_hook (const irc_server *s, const irc_msg *msg)
 	/* Once we receive the 903 command we know the auth was successful.
 	 * to proceed we need to end the CAP phase
 	 */
+	if (!s->user->sasl_enabled)
+		return;
+
 	char *cap_params[] = { "END" };
-	irc_msg *cap_msg =
-	  irc_msg_new (NULL, "CAP", 1, cap_params);
-	irc_push_message (s, cap_msg);
+	irc_push_command (s, "CAP", 1, cap_params);
 }
 
 static void
 sasl_error_hook (const irc_server *s, const irc_msg *msg)
 {
+	if (!s->user->sasl_enabled)
+		return;
+
 	err (1, "Error during SASL Auth");
 }
 
@@ -96,16 +95,12 @@ channel_join_hook (const irc_server *s, const irc_msg *msg)
 	 * message we know we are auth'ed and can exit the init loop.
 	 * Before that we JOIN the Channels
 	 */
-	struct config_t *config = get_config ();
-
 	log_debug ("Joining Channels: \n");
 
 	struct irc_channel *l;
-	LL_FOREACH (config->server->channels, l) {
+	LL_FOREACH (s->channels, l) {
 		char *join_params[] = { l->channel };
-		irc_msg *join_msg =
-		  irc_msg_new (NULL, "JOIN", 1, join_params);
-		irc_push_message (s, join_msg);
+		irc_push_command (s, "JOIN", 1, join_params);
 	}
 }
 
@@ -114,37 +109,126 @@ ping_hook (const irc_server *s, const irc_msg *msg)
 {
 	/* Responds to PING request with the correct PONG so we don't get timeouted
 	 */
-	char *pong_params[] = { msg->params->params[0] };
-	irc_msg *pong_msg =
-	  irc_msg_new (NULL, "PONG", 1, pong_params);
-	irc_push_message (s, pong_msg);
+	if (msg->params.len < 1)
+		return;
+
+	char *pong_params[] = { msg->params.params[0] };
+	irc_push_command (s, "PONG", 1, pong_params);
 }
 
 static void
 invite_hook (const irc_server *s, const irc_msg *msg)
 {
-	char *join_params[] = { msg->params->params[1] };
-	irc_msg *join_msg =
-	  irc_msg_new (NULL, "JOIN", 1, join_params);
-	irc_push_message (s, join_msg);
+	if (msg->params.len < 2)
+		return;
+
+	char *join_params[] = { msg->params.params[1] };
+	irc_push_command (s, "JOIN", 1, join_params);
+}
+
+/*
+ * Keep the channel state of the connection up to date, these run ahead
+ * of the module hooks for the same message
+ */
+static void
+state_welcome_hook (const irc_server *s, const irc_msg *msg)
+{
+	irc_state *st = irc_server_state (s);
+	if (st != NULL && msg->params.len >= 1)
+		irc_state_welcome (st, msg->params.params[0]);
+}
+
+static void
+state_isupport_hook (const irc_server *s, const irc_msg *msg)
+{
+	/* Our nick first and the "are supported" text last */
+	irc_state *st = irc_server_state (s);
+	if (st != NULL && msg->params.len >= 3)
+		irc_state_isupport (st, msg->params.len - 2, (char **)msg->params.params + 1);
+}
+
+static void
+state_join_hook (const irc_server *s, const irc_msg *msg)
+{
+	irc_state *st = irc_server_state (s);
+	if (st != NULL && msg->prefix != NULL && msg->params.len >= 1)
+		irc_state_join (st, msg->prefix, msg->params.params[0]);
+}
+
+static void
+state_part_hook (const irc_server *s, const irc_msg *msg)
+{
+	irc_state *st = irc_server_state (s);
+	if (st != NULL && msg->prefix != NULL && msg->params.len >= 1)
+		irc_state_part (st, msg->prefix, msg->params.params[0]);
+}
+
+static void
+state_kick_hook (const irc_server *s, const irc_msg *msg)
+{
+	irc_state *st = irc_server_state (s);
+	if (st != NULL && msg->params.len >= 2)
+		irc_state_part (st, msg->params.params[1], msg->params.params[0]);
+}
+
+static void
+state_quit_hook (const irc_server *s, const irc_msg *msg)
+{
+	irc_state *st = irc_server_state (s);
+	if (st != NULL && msg->prefix != NULL)
+		irc_state_quit (st, msg->prefix);
+}
+
+static void
+state_nick_hook (const irc_server *s, const irc_msg *msg)
+{
+	irc_state *st = irc_server_state (s);
+	if (st != NULL && msg->prefix != NULL && msg->params.len >= 1)
+		irc_state_nick (st, msg->prefix, msg->params.params[0]);
+}
+
+static void
+state_mode_hook (const irc_server *s, const irc_msg *msg)
+{
+	/* User modes have no channel to go with them and are ignored */
+	irc_state *st = irc_server_state (s);
+	if (st != NULL && msg->params.len >= 2)
+		irc_state_mode (
+		  st, msg->params.params[0], msg->params.len - 1, (char **)msg->params.params + 1);
+}
+
+static void
+state_names_hook (const irc_server *s, const irc_msg *msg)
+{
+	/* Our nick, the channel's visibility, the channel and the names */
+	irc_state *st = irc_server_state (s);
+	int n = msg->params.len;
+	if (st != NULL && n >= 3)
+		irc_state_names (st, msg->params.params[n - 2], msg->params.params[n - 1]);
 }
 
 void
 register_core_hooks ()
 {
-	struct config_t *config = get_config ();
-
-	/* Handle SASL */
-	if (config->server->user->sasl_enabled) {
-		add_hook ("PREINIT", sasl_preinit_hook);
-		add_hook ("AUTHENTICATE", sasl_auth_hook);
-		add_hook ("900", sasl_cap_hook);
-		add_hook ("903", sasl_cap_hook);
-		add_hook ("904", sasl_error_hook);
-	}
+	/* Handle SASL, the hooks skip servers that don't use it */
+	add_hook ("PREINIT", sasl_preinit_hook);
+	add_hook ("AUTHENTICATE", sasl_auth_hook);
+	add_hook ("900", sasl_cap_hook);
+	add_hook ("903", sasl_cap_hook);
+	add_hook ("904", sasl_error_hook);
 
 	add_hook ("PREINIT", register_preinit_hook);
 	add_hook ("INVITE", invite_hook);
 	add_hook ("PING", ping_hook);
 	add_hook ("001", channel_join_hook);
+
+	add_hook ("001", state_welcome_hook);
+	add_hook ("005", state_isupport_hook);
+	add_hook ("353", state_names_hook);
+	add_hook ("JOIN", state_join_hook);
+	add_hook ("PART", state_part_hook);
+	add_hook ("KICK", state_kick_hook);
+	add_hook ("QUIT", state_quit_hook);
+	add_hook ("NICK", state_nick_hook);
+	add_hook ("MODE", state_mode_hook);
 }
@@ -0,0 +1,649 @@
+#define _GNU_SOURCE /* accept4, FNM_CASEFOLD */
+
+#include <errno.h>
+#include <ev.h>
+#include <fnmatch.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "config/config.h"
+#include "irc/buffer.h"
+#include "irc/hooks.h"
+#include "irc/message.h"
+#include "irc/metrics.h"
+#include "log/log.h"
+#include "scheme/scheme.h"
+#include "utlist/list.h"
+
+#include "metrics.h"
+
+/* Modules listed by the stats command, the slowest first */
+#define METRICS_STATS_MODULES 5
+/* Scrapers answered at once, more wait in the listen backlog */
+#define METRICS_MAX_CLIENTS 8
+/* Seconds a scraper has to take its response and hang up */
+#define METRICS_CLIENT_TIMEOUT 5.
+
+/*
+ * A scraper being answered. The response goes out as the socket takes
+ * it, then the request is read out until the scraper hangs up, closing
+ * with unread input would reset the connection under the response.
+ */
+typedef struct metrics_client
+{
+	ev_io io;
+	ev_timer timeout;
+	irc_buffer response;
+	struct metrics_client *prev, *next;
+} metrics_client;
+
+static int listen_fd = -1;
+static char *listen_path;
+static ev_io accept_watcher;
+static metrics_client *clients;
+static int client_count;
+
+static void
+put (irc_buffer *b, const char *fmt, ...)
+{
+	va_list ap;
+	va_start (ap, fmt);
+	int len = vsnprintf (NULL, 0, fmt, ap);
+	va_end (ap);
+
+	char *dst = len >= 0 ? irc_buffer_reserve (b, len + 1) : NULL;
+	if (dst == NULL)
+		return;
+
+	va_start (ap, fmt);
+	vsnprintf (dst, len + 1, fmt, ap);
+	va_end (ap);
+	irc_buffer_commit (b, len);
+}
+
+/* s as a label value, quoted the way the text format wants */
+static const char *
+label (char *out, size_t size, const char *s)
+{
+	size_t i = 0;
+	for (; *s != '\0' && i + 3 < size; ++s) {
+		if (*s == '\\' || *s == '"') {
+			out[i++] = '\\';
+			out[i++] = *s;
+		} else if (*s == '\n') {
+			out[i++] = '\\';
+			out[i++] = 'n';
+		} else {
+			out[i++] = *s;
+		}
+	}
+	out[i] = '\0';
+	return out;
+}
+
+static void
+put_family (irc_buffer *b, const char *name, const char *type, const char *help)
+{
+	put (b, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void
+put_histogram (irc_buffer *b, const char *name, const char *labels, const irc_histogram *h)
+{
+	unsigned long long seen = 0;
+	for (int i = 0; i < IRC_HIST_BUCKETS - 1; ++i) {
+		seen += atomic_load_explicit (&h->buckets[i], memory_order_relaxed);
+		put (b, "%s_bucket{%s,le=\"%g\"} %llu\n", name, labels, irc_histogram_bound (i) / 1e9, seen);
+	}
+
+	unsigned long long count = atomic_load_explicit (&h->count, memory_order_relaxed);
+	put (b, "%s_bucket{%s,le=\"+Inf\"} %llu\n", name, labels, count);
+	put (b, "%s_sum{%s} %.9f\n", name, labels,
+	     atomic_load_explicit (&h->sum_ns, memory_order_relaxed) / 1e9);
+	put (b, "%s_count{%s} %llu\n", name, labels, count);
+}
+
+typedef enum conn_family
+{
+	CONN_CONNECTED,
+	CONN_BYTES_IN,
+	CONN_BYTES_OUT,
+	CONN_LINES_IN,
+	CONN_LINES_OUT,
+	CONN_RECV_QUEUED,
+	CONN_WRITE_QUEUED,
+	CONN_SENDQ_QUEUED,
+	CONN_OUT_QUEUED,
+	CONN_BACKLOG_MSGS,
+	CONN_BACKLOG_BYTES,
+	CONN_READ_PAUSES,
+	CONN_SHED,
+	CONN_COALESCED,
+	CONN_SENDQ_DROPPED,
+	CONN_PARSE,
+	CONN_FAMILY_COUNT,
+} conn_family;
+
+static const struct
+{
+	const char *name;
+	const char *type;
+	const char *help;
+} conn_families[CONN_FAMILY_COUNT] = {
+	{ "circ_connected", "gauge", "Whether the server is connected." },
+	{ "circ_received_bytes_total", "counter", "Bytes read from the server." },
+	{ "circ_sent_bytes_total", "counter", "Bytes written to the server." },
+	{ "circ_received_lines_total", "counter", "Lines received from the server." },
+	{ "circ_sent_lines_total", "counter", "Lines queued to be sent to the server." },
+	{ "circ_recv_buffer_bytes", "gauge", "Bytes of a partial line waiting for the rest." },
+	{ "circ_write_buffer_bytes", "gauge", "Bytes waiting for the socket." },
+	{ "circ_sendq_bytes", "gauge", "Bytes held back by flood control." },
+	{ "circ_out_queue_lines", "gauge", "Lines pushed by other threads, not yet picked up." },
+	{ "circ_backlog_messages", "gauge", "Received messages waiting in module mailboxes." },
+	{ "circ_backlog_bytes", "gauge", "Bytes of received messages waiting in module mailboxes." },
+	{ "circ_read_pauses_total", "counter", "Times reading stopped for the modules to catch up." },
+	{ "circ_shed_messages_total", "counter", "Chat lines modules skipped while behind." },
+	{ "circ_coalesced_lines_total", "counter", "Lines not sent for already waiting to be." },
+	{ "circ_sendq_dropped_lines_total", "counter", "Lines not sent for the send queue limit." },
+	{ "circ_parse_seconds", "histogram", "Time spent parsing a received line." },
+};
+
+typedef struct render
+{
+	irc_buffer *b;
+	int family;
+} render;
+
+static void
+put_connection (const irc_server *s, bool connected, const irc_conn_stats *stats, void *data)
+{
+	render *r = data;
+	const char *name = conn_families[r->family].name;
+
+	char value[256], labels[300];
+	snprintf (labels, sizeof (labels), "server=\"%s\"", label (value, sizeof (value), s->name));
+
+	if (r->family == CONN_PARSE) {
+		put_histogram (r->b, name, labels, &stats->parse);
+		return;
+	}
+
+	unsigned long long values[] = {
+		[CONN_CONNECTED] = connected,
+		[CONN_BYTES_IN] = stats->bytes_in,
+		[CONN_BYTES_OUT] = stats->bytes_out,
+		[CONN_LINES_IN] = stats->lines_in,
+		[CONN_LINES_OUT] = stats->lines_out,
+		[CONN_RECV_QUEUED] = stats->recv_queued,
+		[CONN_WRITE_QUEUED] = stats->write_queued,
+		[CONN_SENDQ_QUEUED] = stats->sendq_queued,
+		[CONN_OUT_QUEUED] = stats->out_queued,
+		[CONN_BACKLOG_MSGS] = stats->backlog_msgs,
+		[CONN_BACKLOG_BYTES] = stats->backlog_bytes,
+		[CONN_READ_PAUSES] = stats->read_pauses,
+		[CONN_SHED] = stats->shed,
+		[CONN_COALESCED] = stats->coalesced,
+		[CONN_SENDQ_DROPPED] = stats->sendq_dropped,
+	};
+	put (r->b, "%s{%s} %llu\n", name, labels, values[r->family]);
+}
+
+static void
+put_hook (const irc_hook *hook, void *data)
+{
+	render *r = data;
+
+	char command[128], name[128], labels[300];
+	snprintf (labels, sizeof (labels), "command=\"%s\",hook=\"%s\"",
+		  label (command, sizeof (command), hook->command_name),
+		  label (name, sizeof (name), hook->name));
+	put_histogram (r->b, "circ_hook_seconds", labels, &hook->time);
+}
+
+typedef enum module_family
+{
+	MODULE_WAIT,
+	MODULE_RUN,
+	MODULE_QUEUED,
+	MODULE_HEAP,
+	MODULE_GC,
+	MODULE_SHED,
+	MODULE_TIMEOUTS,
+	MODULE_HEAP_LIMIT,
+	MODULE_QUARANTINED,
+	MODULE_QUARANTINE_DROPPED,
+	MODULE_FAMILY_COUNT,
+} module_family;
+
+static const struct
+{
+	const char *name;
+	const char *type;
+	const char *help;
+} module_families[MODULE_FAMILY_COUNT] = {
+	{ "circ_module_wait_seconds", "histogram", "Time a handler call waited in the module's mailbox." },
+	{ "circ_module_run_seconds", "histogram", "Time a handler call ran for." },
+	{ "circ_module_mailbox_calls", "gauge", "Handler calls waiting in the module's mailbox." },
+	{ "circ_module_heap_bytes", "gauge", "Size of the module's heap after its last call." },
+	{ "circ_module_gc_total", "counter", "Garbage collections of the module's heap." },
+	{ "circ_module_shed_messages_total", "counter", "Chat lines the module skipped while behind." },
+	{ "circ_module_timeouts_total", "counter", "Calls and loads that ran past the module's time limit." },
+	{ "circ_module_heap_limit_total", "counter", "Calls and loads that ran out of the module's heap." },
+	{ "circ_module_quarantined", "gauge", "1 while the module's calls are dropped for going over its limits." },
+	{ "circ_module_quarantine_dropped_total", "counter", "Calls dropped while the module was quarantined." },
+};
+
+static void
+put_module (const scm_module *mod, size_t queued, void *data)
+{
+	render *r = data;
+	const char *name = module_families[r->family].name;
+
+	char path[512], labels[600];
+	snprintf (labels, sizeof (labels), "module=\"%s\"", label (path, sizeof (path), mod->path));
+
+	switch (r->family) {
+		case MODULE_WAIT:
+			put_histogram (r->b, name, labels, &mod->wait_time);
+			break;
+		case MODULE_RUN:
+			put_histogram (r->b, name, labels, &mod->run_time);
+			break;
+		case MODULE_QUEUED:
+			put (r->b, "%s{%s} %zu\n", name, labels, queued);
+			break;
+		case MODULE_HEAP:
+			put (r->b, "%s{%s} %zu\n", name, labels, atomic_load (&mod->heap_size));
+			break;
+		case MODULE_GC:
+			put (r->b, "%s{%s} %llu\n", name, labels, atomic_load (&mod->gc_count));
+			break;
+		case MODULE_SHED:
+			put (r->b, "%s{%s} %llu\n", name, labels, atomic_load (&mod->shed));
+			break;
+		case MODULE_TIMEOUTS:
+			put (r->b, "%s{%s} %llu\n", name, labels, atomic_load (&mod->timeouts));
+			break;
+		case MODULE_HEAP_LIMIT:
+			put (r->b, "%s{%s} %llu\n", name, labels, atomic_load (&mod->heap_limit_hits));
+			break;
+		case MODULE_QUARANTINED:
+			put (r->b, "%s{%s} %d\n", name, labels, atomic_load (&mod->quarantined) ? 1 : 0);
+			break;
+		case MODULE_QUARANTINE_DROPPED:
+			put (r->b, "%s{%s} %llu\n", name, labels, atomic_load (&mod->quarantine_dropped));
+			break;
+	}
+}
+
+/* Everything in the Prometheus text format */
+static void
+metrics_render (irc_buffer *b)
+{
+	render r = { b, 0 };
+
+	for (r.family = 0; r.family < CONN_FAMILY_COUNT; ++r.family) {
+		put_family (b, conn_families[r.family].name,
+			    conn_families[r.family].type,
+			    conn_families[r.family].help);
+		irc_foreach_connection (put_connection, &r);
+	}
+
+	put_family (b, "circ_hook_seconds", "histogram", "Time a hook ran for a message.");
+	irc_foreach_hook (put_hook, &r);
+
+	for (r.family = 0; r.family < MODULE_FAMILY_COUNT; ++r.family) {
+		put_family (b, module_families[r.family].name,
+			    module_families[r.family].type,
+			    module_families[r.family].help);
+		scm_foreach_module (put_module, &r);
+	}
+}
+
+static void
+metrics_client_free (EV_P_ metrics_client *c)
+{
+	ev_ref (EV_A);
+	ev_io_stop (EV_A_ & c->io);
+	if (ev_is_active (&c->timeout)) {
+		ev_ref (EV_A);
+		ev_timer_stop (EV_A_ & c->timeout);
+	}
+	close (c->io.fd);
+	irc_buffer_free (&c->response);
+	DL_DELETE (clients, c);
+	free (c);
+
+	/* Room again for the scrapers waiting in the backlog */
+	if (client_count-- == METRICS_MAX_CLIENTS && listen_fd >= 0) {
+		ev_io_start (EV_A_ & accept_watcher);
+		ev_unref (EV_A);
+	}
+}
+
+static void
+metrics_client_callback (EV_P_ ev_io *w, int re)
+{
+	metrics_client *c = (metrics_client *)((char *)w - offsetof (metrics_client, io));
+
+	if (re & EV_WRITE) {
+		while (irc_buffer_len (&c->response) > 0) {
+			ssize_t n = send (w->fd, irc_buffer_data (&c->response), irc_buffer_len (&c->response), MSG_NOSIGNAL);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+				return;
+			if (n <= 0) {
+				metrics_client_free (EV_A_ c);
+				return;
+			}
+			irc_buffer_consume (&c->response, n);
+		}
+
+		/* All of it is out, wait for the scraper to hang up */
+		shutdown (w->fd, SHUT_WR);
+		ev_ref (EV_A);
+		ev_io_stop (EV_A_ w);
+		ev_io_set (w, w->fd, EV_READ);
+		ev_io_start (EV_A_ w);
+		ev_unref (EV_A);
+		return;
+	}
+
+	char buf[512];
+	ssize_t n;
+	while ((n = read (w->fd, buf, sizeof (buf))) > 0)
+		;
+	if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+		metrics_client_free (EV_A_ c);
+}
+
+static void
+metrics_client_timeout_callback (EV_P_ ev_timer *w, int re)
+{
+	metrics_client *c = (metrics_client *)((char *)w - offsetof (metrics_client, timeout));
+
+	/* The timer stopped on its own, undo its unref */
+	ev_ref (EV_A);
+	metrics_client_free (EV_A_ c);
+}
+
+/* Nothing is written here, clients are answered as their sockets take it */
+static void
+metrics_accept_callback (EV_P_ ev_io *w, int re)
+{
+	while (client_count < METRICS_MAX_CLIENTS) {
+		int fd = accept4 (w->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0)
+			return;
+
+		metrics_client *c = malloc (sizeof (metrics_client));
+		if (c == NULL) {
+			close (fd);
+			return;
+		}
+
+		irc_buffer_init (&c->response);
+		put (&c->response, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n\r\n");
+		metrics_render (&c->response);
+
+		ev_io_init (&c->io, metrics_client_callback, fd, EV_WRITE);
+		ev_io_start (EV_A_ & c->io);
+		ev_unref (EV_A);
+		ev_timer_init (&c->timeout, metrics_client_timeout_callback, METRICS_CLIENT_TIMEOUT, 0.);
+		ev_timer_start (EV_A_ & c->timeout);
+		ev_unref (EV_A);
+
+		DL_APPEND (clients, c);
+		client_count++;
+	}
+
+	/* Full, see metrics_client_free */
+	ev_ref (EV_A);
+	ev_io_stop (EV_A_ w);
+}
+
+int
+metrics_listen (const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	if (strlen (path) >= sizeof (addr.sun_path)) {
+		log_info ("metrics: %s is too long for a socket path\n", path);
+		return -1;
+	}
+	strcpy (addr.sun_path, path);
+
+	listen_fd = socket (AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (listen_fd < 0)
+		goto err;
+
+	/* Left behind by an earlier run */
+	unlink (path);
+	if (bind (listen_fd, (struct sockaddr *)&addr, sizeof (addr)) < 0)
+		goto err_close;
+	chmod (path, 0600);
+	if (listen (listen_fd, 8) < 0)
+		goto err_close;
+
+	listen_path = strdup (path);
+
+	struct ev_loop *loop = irc_get_event_loop ();
+	ev_io_init (&accept_watcher, metrics_accept_callback, listen_fd, EV_READ);
+	ev_io_start (loop, &accept_watcher);
+	ev_unref (loop);
+	return 0;
+
+err_close:
+	close (listen_fd);
+	listen_fd = -1;
+err:
+	log_info ("metrics: %s: %s\n", path, strerror (errno));
+	return -1;
+}
+
+void
+metrics_close (void)
+{
+	if (listen_fd < 0)
+		return;
+
+	struct ev_loop *loop = irc_get_event_loop ();
+	if (ev_is_active (&accept_watcher)) {
+		ev_ref (loop);
+		ev_io_stop (loop, &accept_watcher);
+	}
+	close (listen_fd);
+	listen_fd = -1;
+
+	metrics_client *c, *tmp;
+	DL_FOREACH_SAFE (clients, c, tmp)
+		metrics_client_free (loop, c);
+
+	unlink (listen_path);
+	free (listen_path);
+	listen_path = NULL;
+}
+
+static const char *
+format_ns (char *out, size_t size, uint64_t ns)
+{
+	if (ns < 1000)
+		snprintf (out, size, "%lluns", (unsigned long long)ns);
+	else if (ns < 1000000)
+		snprintf (out, size, "%.1fus", ns / 1e3);
+	else if (ns < 1000000000)
+		snprintf (out, size, "%.1fms", ns / 1e6);
+	else
+		snprintf (out, size, "%.2fs", ns / 1e9);
+	return out;
+}
+
+static const char *
+format_bytes (char *out, size_t size, uint64_t n)
+{
+	if (n < 1024)
+		snprintf (out, size, "%lluB", (unsigned long long)n);
+	else if (n < 1024 * 1024)
+		snprintf (out, size, "%.1fKiB", n / 1024.);
+	else
+		snprintf (out, size, "%.1fMiB", n / (1024. * 1024.));
+	return out;
+}
+
+typedef struct stats_reply
+{
+	const irc_server *s;
+	char *target;
+	/* The modules with the slowest calls */
+	const scm_module *slowest[METRICS_STATS_MODULES];
+	size_t queued[METRICS_STATS_MODULES];
+	int modules;
+} stats_reply;
+
+static void
+stats_send (const stats_reply *r, const char *fmt, ...)
+{
+	char line[400];
+	va_list ap;
+	va_start (ap, fmt);
+	vsnprintf (line, sizeof (line), fmt, ap);
+	va_end (ap);
+
+	char *params[] = { r->target, line };
+	irc_push_command (r->s, "PRIVMSG", 2, params);
+}
+
+static void
+stats_connection (const irc_server *s, bool connected, const irc_conn_stats *stats, void *data)
+{
+	stats_reply *r = data;
+	if (s != r->s)
+		return;
+
+	char in[32], out[32], parse[32], write[32], sendq[32];
+	stats_send (r,
+		    "%s: in %llu lines %s, out %llu lines %s, parse p99 %s, waiting: "
+		    "socket %s, flood control %s, other threads %zu lines, modules %zu lines",
+		    s->name,
+		    (unsigned long long)stats->lines_in,
+		    format_bytes (in, sizeof (in), stats->bytes_in),
+		    (unsigned long long)stats->lines_out,
+		    format_bytes (out, sizeof (out), stats->bytes_out),
+		    format_ns (parse, sizeof (parse), irc_histogram_quantile (&stats->parse, 0.99)),
+		    format_bytes (write, sizeof (write), stats->write_queued),
+		    format_bytes (sendq, sizeof (sendq), stats->sendq_queued),
+		    stats->out_queued,
+		    stats->backlog_msgs);
+	if (stats->read_pauses > 0 || stats->shed > 0 || stats->coalesced > 0 || stats->sendq_dropped > 0)
+		stats_send (r,
+			    "%s: overload: %llu read pauses, %llu lines shed, %llu replies "
+			    "coalesced, %llu dropped",
+			    s->name,
+			    (unsigned long long)stats->read_pauses,
+			    (unsigned long long)stats->shed,
+			    (unsigned long long)stats->coalesced,
+			    (unsigned long long)stats->sendq_dropped);
+}
+
+/* Keep the modules with the highest p99 run time, slowest first */
+static void
+stats_module (const scm_module *mod, size_t queued, void *data)
+{
+	stats_reply *r = data;
+	uint64_t p99 = irc_histogram_quantile (&mod->run_time, 0.99);
+
+	int i = r->modules < METRICS_STATS_MODULES ? r->modules++ : METRICS_STATS_MODULES;
+	for (; i > 0 && irc_histogram_quantile (&r->slowest[i - 1]->run_time, 0.99) < p99; --i) {
+		if (i < METRICS_STATS_MODULES) {
+			r->slowest[i] = r->slowest[i - 1];
+			r->queued[i] = r->queued[i - 1];
+		}
+	}
+	if (i < METRICS_STATS_MODULES) {
+		r->slowest[i] = mod;
+		r->queued[i] = queued;
+	}
+}
+
+static bool
+is_owner (const char *prefix)
+{
+	char **owners = get_config ()->owners;
+	for (; prefix != NULL && owners != NULL && *owners != NULL; ++owners)
+		if (fnmatch (*owners, prefix, FNM_CASEFOLD) == 0)
+			return true;
+
+	return false;
+}
+
+static void
+metrics_stats_hook (const irc_server *s, const irc_msg *msg)
+{
+	if (msg->params.len < 2)
+		return;
+
+	const char *prefix = get_config ()->cmd_prefix;
+	size_t prefix_len = strlen (prefix);
+	const char *text = msg->params.params[1];
+	if (strncmp (text, prefix, prefix_len) != 0 || strncmp (text + prefix_len, "stats", 5) != 0)
+		return;
+	if (text[prefix_len + 5] != '\0' && text[prefix_len + 5] != ' ')
+		return;
+	if (!is_owner (msg->prefix))
+		return;
+
+	/* Channels get the answer where it was asked, queries in private */
+	char target[256];
+	const char *to = msg->params.params[0];
+	if (to[0] == '#' || to[0] == '&') {
+		snprintf (target, sizeof (target), "%s", to);
+	} else {
+		irc_prefix p;
+		irc_prefix_split (msg->prefix, &p);
+		snprintf (target, sizeof (target), "%.*s", (int)p.nick_len, p.nick);
+	}
+
+	stats_reply r = { .s = s, .target = target };
+	irc_foreach_connection (stats_connection, &r);
+	scm_foreach_module (stats_module, &r);
+
+	for (int i = 0; i < r.modules; ++i) {
+		const scm_module *mod = r.slowest[i];
+		const char *name = strrchr (mod->path, '/');
+		name = name != NULL ? name + 1 : mod->path;
+
+		/* Only modules that went over a limit say so */
+		char limits[96] = "";
+		unsigned long long timeouts = atomic_load (&mod->timeouts);
+		unsigned long long heap_hits = atomic_load (&mod->heap_limit_hits);
+		if (timeouts > 0 || heap_hits > 0)
+			snprintf (limits, sizeof (limits), ", %llu timeouts, %llu out of heap%s",
+				  timeouts, heap_hits,
+				  atomic_load (&mod->quarantined) ? ", quarantined" : "");
+
+		char p50[32], p99[32], wait[32], heap[32];
+		stats_send (&r,
+			    "%s: %llu calls, run p50 %s p99 %s, wait p99 %s, %zu queued, heap %s%s",
+			    name,
+			    atomic_load (&mod->run_time.count),
+			    format_ns (p50, sizeof (p50), irc_histogram_quantile (&mod->run_time, 0.5)),
+			    format_ns (p99, sizeof (p99), irc_histogram_quantile (&mod->run_time, 0.99)),
+			    format_ns (wait, sizeof (wait), irc_histogram_quantile (&mod->wait_time, 0.99)),
+			    r.queued[i],
+			    format_bytes (heap, sizeof (heap), atomic_load (&mod->heap_size)),
+			    limits);
+	}
+}
+
+void
+metrics_register_hooks (void)
+{
+	add_hook ("PRIVMSG", metrics_stats_hook);
+}
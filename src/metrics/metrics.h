@@ -0,0 +1,24 @@
+/*
+ * Reports what the connections, hooks and scheme modules record: as
+ * Prometheus text on a local Unix socket, and as a summary through the
+ * stats command for the owners in the config.
+ */
+#ifndef METRICS_H
+#define METRICS_H
+
+/*
+ * Serve the metrics on a Unix socket at path, on the event loop. Every
+ * connection gets a plain HTTP response, written without blocking the
+ * loop, and is closed once the client hangs up, so
+ *   curl --unix-socket path http://circ/metrics
+ * reads them. Returns -1 if the socket couldn't be set up.
+ */
+int
+metrics_listen (const char *path);
+void
+metrics_close (void);
+/* Add the hook answering the stats command */
+void
+metrics_register_hooks (void);
+
+#endif /* METRICS_H */
@@ -0,0 +1,492 @@
+#define _GNU_SOURCE /* pipe2 */
+
+#include <errno.h>
+#include <ev.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <spawn.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "irc/irc.h"
+#include "log/log.h"
+#include "utlist/list.h"
+
+#include "deferred.h"
+
+/* Output past this is dropped, the callback gets the first part */
+#define SCM_READ_MAX (1 << 20)
+
+extern char **environ;
+
+typedef struct scm_timer
+{
+	long id;
+	scm_module *mod;
+	sexp func;
+	const irc_server *serv;
+	irc_msg *msg;
+	ev_timer w;
+	/* Set by scm_cancel_timer, the loop stops the watcher when it sees it */
+	bool cancelled;
+	/* Whether the loop was unref'd for the watcher, only on the loop */
+	bool unrefd;
+	/* In timers while the timer can still fire */
+	struct scm_timer *prev, *next;
+} scm_timer;
+
+typedef struct scm_reader
+{
+	scm_module *mod;
+	sexp func;
+	const irc_server *serv;
+	irc_msg *msg;
+
+	char **argv; /* NULL when reading an fd handed in */
+	pid_t pid;
+	int status;
+	bool exited;
+	ev_child child;
+
+	int fd;
+	bool eof;
+	ev_io io;
+	char *buf;
+	size_t len;
+	size_t cap;
+} scm_reader;
+
+/* Watchers to start or stop, the loop owns all of them */
+typedef struct defer_request
+{
+	enum
+	{
+		DEFER_START_TIMER,
+		DEFER_STOP_TIMER,
+		DEFER_START_READER,
+	} op;
+	void *target;
+	struct defer_request *next;
+} defer_request;
+
+static pthread_mutex_t defer_mtx = PTHREAD_MUTEX_INITIALIZER;
+static scm_timer *timers;
+static long timer_ids;
+static defer_request *requests;
+static ev_async requests_async;
+
+static void
+requests_callback (EV_P_ ev_async *w, int re);
+static void
+timer_callback (EV_P_ ev_timer *w, int re);
+static void
+reader_io_callback (EV_P_ ev_io *w, int re);
+static void
+reader_child_callback (EV_P_ ev_child *w, int re);
+
+void
+scm_deferred_init (void)
+{
+	struct ev_loop *loop = irc_get_event_loop ();
+	ev_async_init (&requests_async, requests_callback);
+	ev_async_start (loop, &requests_async);
+	ev_unref (loop);
+}
+
+/* Called with defer_mtx held */
+static int
+push_request (int op, void *target)
+{
+	defer_request *req = malloc (sizeof (defer_request));
+	if (req == NULL)
+		return -1;
+
+	req->op = op;
+	req->target = target;
+	LL_APPEND (requests, req);
+	return 0;
+}
+
+static void
+timer_done (scm_module *mod, void *data)
+{
+	scm_timer *t = data;
+	/* An unloaded module's context is gone, and the function with it */
+	if (mod->scm_ctx != NULL)
+		sexp_release_object (mod->scm_ctx, t->func);
+	irc_msg_unref (t->msg);
+	free (t);
+}
+
+/* Called from a module's handler, mod is what the calling thread runs */
+long
+scm_add_timer (scm_module *mod, double delay, double repeat, sexp func)
+{
+	scm_timer *t = malloc (sizeof (scm_timer));
+	if (t == NULL)
+		return -1;
+
+	t->mod = mod;
+	t->func = sexp_preserve_object (mod->scm_ctx, func);
+	t->serv = mod->mod_ctx.serv;
+	t->msg = mod->mod_ctx.msg != NULL ? irc_msg_ref (mod->mod_ctx.msg) : NULL;
+	t->cancelled = false;
+	t->unrefd = false;
+	ev_timer_init (&t->w, timer_callback, delay < 0 ? 0 : delay, repeat < 0 ? 0 : repeat);
+
+	pthread_mutex_lock (&defer_mtx);
+	if (push_request (DEFER_START_TIMER, t) < 0) {
+		pthread_mutex_unlock (&defer_mtx);
+		timer_done (mod, t);
+		return -1;
+	}
+	t->id = ++timer_ids;
+	DL_APPEND (timers, t);
+	pthread_mutex_unlock (&defer_mtx);
+
+	ev_async_send (irc_get_event_loop (), &requests_async);
+	return t->id;
+}
+
+bool
+scm_cancel_timer (scm_module *mod, long id)
+{
+	scm_timer *t;
+
+	pthread_mutex_lock (&defer_mtx);
+	DL_FOREACH (timers, t)
+		if (t->id == id && t->mod == mod)
+			break;
+	if (t == NULL || push_request (DEFER_STOP_TIMER, t) < 0) {
+		pthread_mutex_unlock (&defer_mtx);
+		return false;
+	}
+	DL_DELETE (timers, t);
+	t->cancelled = true;
+	pthread_mutex_unlock (&defer_mtx);
+
+	ev_async_send (irc_get_event_loop (), &requests_async);
+	return true;
+}
+
+void
+scm_deferred_forget (scm_module *mod)
+{
+	scm_timer *t, *tmp;
+
+	pthread_mutex_lock (&defer_mtx);
+	DL_FOREACH_SAFE (timers, t, tmp) {
+		if (t->mod != mod || push_request (DEFER_STOP_TIMER, t) < 0)
+			continue;
+		DL_DELETE (timers, t);
+		t->cancelled = true;
+	}
+	pthread_mutex_unlock (&defer_mtx);
+
+	ev_async_send (irc_get_event_loop (), &requests_async);
+}
+
+/*
+ * Undo the unref done when the timer started, once. A one shot timer
+ * cancelled after libev stopped it but before its callback has no
+ * active watcher left, the stop request still gets here.
+ */
+static void
+timer_ref_loop (EV_P_ scm_timer *t)
+{
+	if (t->unrefd) {
+		ev_ref (EV_A);
+		t->unrefd = false;
+	}
+}
+
+static void
+timer_callback (EV_P_ ev_timer *w, int re)
+{
+	scm_timer *t = (scm_timer *)((char *)w - offsetof (scm_timer, w));
+
+	pthread_mutex_lock (&defer_mtx);
+	if (t->cancelled) {
+		/* The stop request is still queued, it cleans up */
+		pthread_mutex_unlock (&defer_mtx);
+		return;
+	}
+	bool last = w->repeat == 0;
+	if (last)
+		DL_DELETE (timers, t);
+	pthread_mutex_unlock (&defer_mtx);
+
+	if (last) {
+		/* One shot timers stop on their own */
+		timer_ref_loop (EV_A_ t);
+		scm_queue_call (t->mod, t->func, t->serv, t->msg, NULL, timer_done, t);
+	} else {
+		scm_queue_call (t->mod, t->func, t->serv, t->msg, NULL, NULL, NULL);
+	}
+}
+
+static void
+reader_done (scm_module *mod, void *data)
+{
+	scm_reader *r = data;
+	if (mod->scm_ctx != NULL)
+		sexp_release_object (mod->scm_ctx, r->func);
+	irc_msg_unref (r->msg);
+
+	if (r->argv != NULL)
+		for (char **a = r->argv; *a != NULL; ++a)
+			free (*a);
+	free (r->argv);
+	free (r->buf);
+	free (r);
+}
+
+static sexp
+reader_args (sexp ctx, void *data)
+{
+	scm_reader *r = data;
+	sexp_gc_var2 (args, str);
+	sexp_gc_preserve2 (ctx, args, str);
+
+	str = sexp_c_string (ctx, r->buf != NULL ? r->buf : "", r->len);
+	args = sexp_cons (ctx, str, SEXP_NULL);
+	if (r->argv != NULL)
+		args = sexp_cons (ctx, sexp_make_fixnum (r->status), args);
+
+	sexp_gc_release2 (ctx);
+	return args;
+}
+
+static void
+reader_maybe_done (scm_reader *r)
+{
+	if (!r->eof || (r->pid > 0 && !r->exited))
+		return;
+
+	scm_queue_call (r->mod, r->func, r->serv, r->msg, reader_args, reader_done, r);
+}
+
+/* Takes ownership of argv, which is NULL terminated */
+static scm_reader *
+new_reader (scm_module *mod, char **argv, int fd, sexp func)
+{
+	scm_reader *r = calloc (1, sizeof (scm_reader));
+	if (r == NULL)
+		return NULL;
+
+	r->mod = mod;
+	r->func = sexp_preserve_object (mod->scm_ctx, func);
+	r->serv = mod->mod_ctx.serv;
+	r->msg = mod->mod_ctx.msg != NULL ? irc_msg_ref (mod->mod_ctx.msg) : NULL;
+	r->argv = argv;
+	r->fd = fd;
+	r->status = -1;
+	return r;
+}
+
+static int
+queue_reader (scm_reader *r)
+{
+	pthread_mutex_lock (&defer_mtx);
+	int ret = push_request (DEFER_START_READER, r);
+	pthread_mutex_unlock (&defer_mtx);
+
+	if (ret < 0) {
+		reader_done (r->mod, r);
+		return -1;
+	}
+
+	ev_async_send (irc_get_event_loop (), &requests_async);
+	return 0;
+}
+
+int
+scm_run_process (scm_module *mod, char **argv, sexp func)
+{
+	size_t argc = 0;
+	while (argv[argc] != NULL)
+		argc++;
+	if (argc == 0)
+		return -1;
+
+	char **copy = calloc (argc + 1, sizeof (char *));
+	if (copy == NULL)
+		return -1;
+	for (size_t i = 0; i < argc; ++i)
+		copy[i] = strdup (argv[i]);
+
+	scm_reader *r = new_reader (mod, copy, -1, func);
+	if (r == NULL) {
+		for (size_t i = 0; i < argc; ++i)
+			free (copy[i]);
+		free (copy);
+		return -1;
+	}
+
+	return queue_reader (r);
+}
+
+int
+scm_read_fd (scm_module *mod, int fd, sexp func)
+{
+	if (fd < 0)
+		return -1;
+
+	scm_reader *r = new_reader (mod, NULL, fd, func);
+	if (r == NULL)
+		return -1;
+
+	return queue_reader (r);
+}
+
+/*
+ * Spawn the process of r, its stdout becomes r->fd. The child watcher
+ * has to be started before the loop runs again, or libev reaps the
+ * process without telling anyone, so this happens on the loop thread.
+ */
+static int
+reader_spawn (EV_P_ scm_reader *r)
+{
+	int fds[2];
+	if (pipe2 (fds, O_CLOEXEC) < 0)
+		return -1;
+
+	posix_spawn_file_actions_t fa;
+	posix_spawn_file_actions_init (&fa);
+	posix_spawn_file_actions_addopen (&fa, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+	posix_spawn_file_actions_adddup2 (&fa, fds[1], STDOUT_FILENO);
+
+	int err = posix_spawnp (&r->pid, r->argv[0], &fa, NULL, r->argv, environ);
+	posix_spawn_file_actions_destroy (&fa);
+	close (fds[1]);
+	if (err != 0) {
+		log_info ("%s: couldn't run %s: %s\n", r->mod->path, r->argv[0], strerror (err));
+		close (fds[0]);
+		r->pid = 0;
+		return -1;
+	}
+
+	ev_child_init (&r->child, reader_child_callback, r->pid, 0);
+	ev_child_start (EV_A_ & r->child);
+	ev_unref (EV_A);
+
+	r->fd = fds[0];
+	return 0;
+}
+
+static void
+reader_start (EV_P_ scm_reader *r)
+{
+	if (r->argv != NULL && reader_spawn (EV_A_ r) < 0) {
+		r->eof = true;
+		reader_maybe_done (r);
+		return;
+	}
+
+	int flags = fcntl (r->fd, F_GETFL);
+	if (flags < 0 || fcntl (r->fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+		close (r->fd);
+		r->eof = true;
+		reader_maybe_done (r);
+		return;
+	}
+
+	ev_io_init (&r->io, reader_io_callback, r->fd, EV_READ);
+	ev_io_start (EV_A_ & r->io);
+	ev_unref (EV_A);
+}
+
+static void
+reader_io_callback (EV_P_ ev_io *w, int re)
+{
+	scm_reader *r = (scm_reader *)((char *)w - offsetof (scm_reader, io));
+
+	for (;;) {
+		char chunk[4096];
+		ssize_t n = read (r->fd, chunk, sizeof (chunk));
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return;
+		if (n <= 0)
+			break;
+
+		size_t keep = (size_t)n;
+		if (r->len + keep > SCM_READ_MAX)
+			keep = SCM_READ_MAX - r->len;
+		if (keep == 0)
+			continue;
+
+		if (r->len + keep > r->cap) {
+			size_t cap = r->cap > 0 ? r->cap : sizeof (chunk);
+			while (cap < r->len + keep)
+				cap *= 2;
+			char *buf = realloc (r->buf, cap);
+			if (buf == NULL)
+				continue;
+			r->buf = buf;
+			r->cap = cap;
+		}
+		memcpy (r->buf + r->len, chunk, keep);
+		r->len += keep;
+	}
+
+	ev_ref (EV_A);
+	ev_io_stop (EV_A_ w);
+	close (r->fd);
+	r->eof = true;
+	reader_maybe_done (r);
+}
+
+static void
+reader_child_callback (EV_P_ ev_child *w, int re)
+{
+	scm_reader *r = (scm_reader *)((char *)w - offsetof (scm_reader, child));
+
+	if (WIFEXITED (w->rstatus))
+		r->status = WEXITSTATUS (w->rstatus);
+	else if (WIFSIGNALED (w->rstatus))
+		r->status = 128 + WTERMSIG (w->rstatus);
+
+	ev_ref (EV_A);
+	ev_child_stop (EV_A_ w);
+	r->exited = true;
+	reader_maybe_done (r);
+}
+
+static void
+requests_callback (EV_P_ ev_async *w, int re)
+{
+	pthread_mutex_lock (&defer_mtx);
+	defer_request *reqs = requests;
+	requests = NULL;
+	pthread_mutex_unlock (&defer_mtx);
+
+	defer_request *req, *tmp;
+	LL_FOREACH_SAFE (reqs, req, tmp) {
+		scm_timer *t = req->target;
+
+		switch (req->op) {
+		case DEFER_START_TIMER:
+			/* A stop for it may be right behind, it does the cleanup */
+			if (!t->cancelled) {
+				ev_timer_start (EV_A_ & t->w);
+				ev_unref (EV_A);
+				t->unrefd = true;
+			}
+			break;
+		case DEFER_STOP_TIMER:
+			timer_ref_loop (EV_A_ t);
+			ev_timer_stop (EV_A_ & t->w);
+			scm_queue_call (t->mod, NULL, NULL, NULL, NULL, timer_done, t);
+			break;
+		case DEFER_START_READER:
+			reader_start (EV_A_ req->target);
+			break;
+		}
+
+		free (req);
+	}
+}
@@ -0,0 +1,43 @@
+/*
+ * Things scheme modules wait for without blocking a worker or the event
+ * loop: timers, child processes and reading an fd to the end. Waiting
+ * happens on the event loop, the callbacks are queued through the
+ * module's mailbox like any other handler call. They see the server and
+ * message of the handler that set them up, so reply works in them.
+ */
+#ifndef SCM_DEFERRED_H
+#define SCM_DEFERRED_H
+
+#include <stdbool.h>
+
+#include "scheme.h"
+
+void
+scm_deferred_init (void);
+
+/*
+ * Call func after delay seconds, then every repeat seconds unless repeat
+ * is 0. Returns the ID of the timer, or -1 if it couldn't be set up.
+ */
+long
+scm_add_timer (scm_module *mod, double delay, double repeat, sexp func);
+/* Returns false if mod has no timer id that can still fire */
+bool
+scm_cancel_timer (scm_module *mod, long id);
+/* Cancel every timer of mod, for unloading it */
+void
+scm_deferred_forget (scm_module *mod);
+
+/*
+ * Run argv[0] from PATH with stdin on /dev/null, then call func with the
+ * exit status and everything the process wrote to stdout. A status of
+ * -1 means the process couldn't be started, 128 + n that it was killed
+ * by signal n. argv is copied.
+ */
+int
+scm_run_process (scm_module *mod, char **argv, sexp func);
+/* Read fd until EOF, then close it and call func with the data */
+int
+scm_read_fd (scm_module *mod, int fd, sexp func);
+
+#endif /* SCM_DEFERRED_H */
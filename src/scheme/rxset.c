@@ -0,0 +1,413 @@
+#include <alloca.h>
+#include <ctype.h>
+#include <regex.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rxset.h"
+
+typedef struct rxset_pattern
+{
+	regex_t rx;
+	char *literal; /* NULL if the pattern has to be tried on everything */
+	size_t literal_len;
+	void *data;
+	int next_at_state; /* next pattern whose literal ends at the same state */
+} rxset_pattern;
+
+struct rxset
+{
+	rxset_pattern *patterns;
+	size_t len;
+	size_t cap;
+
+	/* Bytes that appear in a literal each get a class, the rest share 0 */
+	unsigned char classes[256];
+	int nclasses;
+
+	/* The automaton, next is nstates rows of nclasses */
+	int nstates;
+	int *next;
+	int *first_pattern; /* first pattern whose literal ends at a state */
+	int *output_link;   /* closest suffix state with patterns ending there */
+};
+
+rxset *
+rxset_new (void)
+{
+	rxset *set = calloc (1, sizeof (rxset));
+	if (set == NULL)
+		return NULL;
+
+	set->nclasses = 1;
+	return set;
+}
+
+static void
+free_automaton (rxset *set)
+{
+	free (set->next);
+	free (set->first_pattern);
+	free (set->output_link);
+	set->next = set->first_pattern = set->output_link = NULL;
+	set->nstates = 0;
+}
+
+void
+rxset_free (rxset *set)
+{
+	if (set == NULL)
+		return;
+
+	for (size_t i = 0; i < set->len; ++i) {
+		regfree (&set->patterns[i].rx);
+		free (set->patterns[i].literal);
+	}
+	free (set->patterns);
+	free_automaton (set);
+	free (set);
+}
+
+/*
+ * Past the quantifiers at q, there may be several like +? or +{0,1}.
+ * optional is set if the atom before them may not be there at all.
+ */
+static const char *
+skip_quantifiers (const char *q, bool *optional)
+{
+	*optional = false;
+	for (;;) {
+		if (*q == '+') {
+			q++;
+		} else if (*q == '*' || *q == '?') {
+			*optional = true;
+			q++;
+		} else if (*q == '{') {
+			/* Bounds aren't read, {0} and {0,1} are common enough */
+			*optional = true;
+			while (*q != '\0' && *q != '}')
+				q++;
+			if (*q == '}')
+				q++;
+		} else {
+			return q;
+		}
+	}
+}
+
+/*
+ * Find the longest run of characters any match of the ERE pattern has to
+ * contain. This errs on the side of finding nothing, patterns with
+ * alternations or only optional literals are tried on every text.
+ */
+static char *
+required_literal (const char *pattern, size_t *len)
+{
+	if (strchr (pattern, '|') != NULL)
+		return NULL;
+
+	size_t plen = strlen (pattern);
+	char *run = malloc (plen + 1);
+	char *best = malloc (plen + 1);
+	if (run == NULL || best == NULL) {
+		free (run);
+		free (best);
+		return NULL;
+	}
+
+	size_t run_len = 0, best_len = 0;
+	int depth = 0;
+	bool optional;
+
+#define END_RUN()                                                              \
+	do {                                                                   \
+		if (run_len > best_len) {                                      \
+			memcpy (best, run, run_len);                           \
+			best_len = run_len;                                    \
+		}                                                              \
+		run_len = 0;                                                   \
+	} while (0)
+
+	for (const char *p = pattern; *p != '\0'; ++p) {
+		/* Skip bracket expressions, a leading ] or ^] is part of them */
+		if (*p == '[') {
+			END_RUN ();
+			p++;
+			if (*p == '^')
+				p++;
+			if (*p == ']')
+				p++;
+			while (*p != '\0' && *p != ']') {
+				if (*p == '[' && (p[1] == ':' || p[1] == '.' || p[1] == '=')) {
+					char close = p[1];
+					p += 2;
+					while (*p != '\0' && !(*p == close && p[1] == ']'))
+						p++;
+					if (*p != '\0')
+						p++;
+				}
+				if (*p != '\0')
+					p++;
+			}
+			if (*p == '\0')
+				break;
+			continue;
+		}
+
+		/* Nothing inside a group is counted on, it may be optional */
+		if (depth > 0) {
+			if (*p == '\\' && p[1] != '\0')
+				p++;
+			else if (*p == '(')
+				depth++;
+			else if (*p == ')')
+				depth--;
+			continue;
+		}
+
+		switch (*p) {
+			case '(':
+				END_RUN ();
+				depth = 1;
+				break;
+			case '*':
+			case '?':
+			case '{':
+			case '+':
+				/* Quantifiers on something that isn't a literal */
+				END_RUN ();
+				p = skip_quantifiers (p, &optional) - 1;
+				break;
+			case '.':
+			case '^':
+			case '$':
+			case ')':
+				END_RUN ();
+				break;
+			case '\\':
+				/* \w, \b and backreferences aren't literals */
+				if (p[1] == '\0' || isalnum ((unsigned char)p[1])) {
+					END_RUN ();
+					if (p[1] != '\0')
+						p++;
+					break;
+				}
+				p++;
+				/* fall through */
+			default: {
+				/* A literal only joins the run once it's known whether
+				 * quantifiers follow, stacked ones like +? may make it
+				 * optional */
+				const char *next = skip_quantifiers (p + 1, &optional);
+				if (next == p + 1) {
+					run[run_len++] = *p;
+					break;
+				}
+				if (!optional)
+					run[run_len++] = *p;
+				END_RUN ();
+				p = next - 1;
+				break;
+			}
+		}
+	}
+	END_RUN ();
+#undef END_RUN
+
+	free (run);
+	if (best_len == 0) {
+		free (best);
+		return NULL;
+	}
+
+	best[best_len] = '\0';
+	*len = best_len;
+	return best;
+}
+
+/* Build the automaton over every literal, done whenever a pattern is added */
+static int
+build_automaton (rxset *set)
+{
+	free_automaton (set);
+
+	memset (set->classes, 0, sizeof (set->classes));
+	set->nclasses = 1;
+	int max_states = 1;
+	for (size_t i = 0; i < set->len; ++i) {
+		const rxset_pattern *pat = &set->patterns[i];
+		for (size_t j = 0; j < pat->literal_len; ++j) {
+			unsigned char c = pat->literal[j];
+			if (set->classes[c] == 0)
+				set->classes[c] = set->nclasses++;
+		}
+		max_states += pat->literal_len;
+	}
+
+	int nc = set->nclasses;
+	set->next = malloc (sizeof (int) * max_states * nc);
+	set->first_pattern = malloc (sizeof (int) * max_states);
+	set->output_link = malloc (sizeof (int) * max_states);
+	int *fail = malloc (sizeof (int) * max_states);
+	int *queue = malloc (sizeof (int) * max_states);
+	if (set->next == NULL || set->first_pattern == NULL ||
+	    set->output_link == NULL || fail == NULL || queue == NULL) {
+		free (fail);
+		free (queue);
+		free_automaton (set);
+		return -1;
+	}
+
+	for (int i = 0; i < max_states * nc; ++i)
+		set->next[i] = -1;
+	for (int i = 0; i < max_states; ++i)
+		set->first_pattern[i] = set->output_link[i] = -1;
+
+	/* The trie of literals */
+	set->nstates = 1;
+	for (size_t i = 0; i < set->len; ++i) {
+		rxset_pattern *pat = &set->patterns[i];
+		pat->next_at_state = -1;
+		if (pat->literal == NULL)
+			continue;
+
+		int state = 0;
+		for (size_t j = 0; j < pat->literal_len; ++j) {
+			int *to = &set->next[state * nc + set->classes[(unsigned char)pat->literal[j]]];
+			if (*to == -1)
+				*to = set->nstates++;
+			state = *to;
+		}
+
+		/* Keep patterns at a state in the order they were added */
+		int *link = &set->first_pattern[state];
+		while (*link != -1)
+			link = &set->patterns[*link].next_at_state;
+		*link = i;
+	}
+
+	/* Failure links in breadth first order, folded into next so
+	 * matching is a single lookup per byte */
+	size_t head = 0, tail = 0;
+	fail[0] = 0;
+	for (int c = 0; c < nc; ++c) {
+		int to = set->next[c];
+		if (to == -1) {
+			set->next[c] = 0;
+		} else {
+			fail[to] = 0;
+			queue[tail++] = to;
+		}
+	}
+
+	while (head < tail) {
+		int state = queue[head++];
+		int f = fail[state];
+		set->output_link[state] =
+		  set->first_pattern[f] != -1 ? f : set->output_link[f];
+
+		for (int c = 0; c < nc; ++c) {
+			int *to = &set->next[state * nc + c];
+			if (*to == -1) {
+				*to = set->next[f * nc + c];
+			} else {
+				fail[*to] = set->next[f * nc + c];
+				queue[tail++] = *to;
+			}
+		}
+	}
+
+	free (fail);
+	free (queue);
+	return 0;
+}
+
+int
+rxset_add (rxset *set, const char *pattern, void *data, char *err, size_t err_len)
+{
+	if (set->len == set->cap) {
+		size_t cap = set->cap > 0 ? set->cap * 2 : 16;
+		rxset_pattern *patterns = realloc (set->patterns, cap * sizeof (*patterns));
+		if (patterns == NULL) {
+			snprintf (err, err_len, "out of memory");
+			return -1;
+		}
+		set->patterns = patterns;
+		set->cap = cap;
+	}
+
+	rxset_pattern *pat = &set->patterns[set->len];
+	int ret = regcomp (&pat->rx, pattern, REG_NOSUB | REG_EXTENDED);
+	if (ret != 0) {
+		regerror (ret, &pat->rx, err, err_len);
+		return -1;
+	}
+
+	pat->literal_len = 0;
+	pat->literal = required_literal (pattern, &pat->literal_len);
+	pat->data = data;
+	set->len++;
+
+	if (build_automaton (set) == -1) {
+		/* Without the automaton every pattern is tried */
+		snprintf (err, err_len, "out of memory building the matcher");
+	}
+
+	return 0;
+}
+
+void
+rxset_remove_if (rxset *set, bool (*remove) (void *data, void *user_data), void *user_data)
+{
+	size_t kept = 0;
+	for (size_t i = 0; i < set->len; ++i) {
+		rxset_pattern *pat = &set->patterns[i];
+		if (remove (pat->data, user_data)) {
+			regfree (&pat->rx);
+			free (pat->literal);
+		} else {
+			set->patterns[kept++] = *pat;
+		}
+	}
+
+	if (kept == set->len)
+		return;
+	set->len = kept;
+
+	/* If this runs out of memory every pattern is tried, still correct */
+	build_automaton (set);
+}
+
+void
+rxset_match (const rxset *set,
+	     const char *text,
+	     void (*match) (void *data, void *user_data),
+	     void *user_data)
+{
+	if (set->len == 0)
+		return;
+
+	bool *candidate = alloca (set->len * sizeof (bool));
+	bool scan = set->next != NULL;
+	for (size_t i = 0; i < set->len; ++i)
+		candidate[i] = !scan || set->patterns[i].literal == NULL;
+
+	if (scan) {
+		int nc = set->nclasses;
+		int state = 0;
+		for (const unsigned char *p = (const unsigned char *)text; *p != '\0'; ++p) {
+			state = set->next[state * nc + set->classes[*p]];
+
+			int out = set->first_pattern[state] != -1 ? state : set->output_link[state];
+			for (; out != -1; out = set->output_link[out])
+				for (int i = set->first_pattern[out]; i != -1; i = set->patterns[i].next_at_state)
+					candidate[i] = true;
+		}
+	}
+
+	for (size_t i = 0; i < set->len; ++i)
+		if (candidate[i] && regexec (&set->patterns[i].rx, text, 0, NULL, 0) == 0)
+			match (set->patterns[i].data, user_data);
+}
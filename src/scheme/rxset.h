@@ -0,0 +1,41 @@
+/*
+ * A set of POSIX extended regexes that are matched against a text
+ * together. The longest literal each pattern requires goes into one
+ * Aho-Corasick automaton, one scan of the text then tells which
+ * patterns can match at all and only those go through regexec.
+ */
+#ifndef RXSET_H
+#define RXSET_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct rxset rxset;
+
+rxset *
+rxset_new (void);
+void
+rxset_free (rxset *set);
+
+/*
+ * Add a pattern, data is passed to the match callback. Returns -1 if the
+ * pattern doesn't compile, with the reason in err.
+ */
+int
+rxset_add (rxset *set, const char *pattern, void *data, char *err, size_t err_len);
+
+/*
+ * Drop every pattern remove returns true for. It's called once for each
+ * pattern, so it can free the data of the ones it drops.
+ */
+void
+rxset_remove_if (rxset *set, bool (*remove) (void *data, void *user_data), void *user_data);
+
+/* Call match for the data of every pattern matching text, in order added */
+void
+rxset_match (const rxset *set,
+	     const char *text,
+	     void (*match) (void *data, void *user_data),
+	     void *user_data);
+
+#endif /* RXSET_H */
@@ -1,30 +1,61 @@
+#define _GNU_SOURCE /* FNM_CASEFOLD, memfd_create */
+
+#include <chibi/gc_heap.h>
+#include <err.h>
+#include <ev.h>
+#include <fnmatch.h>
 #include <fts.h>
 #include <glib.h>
 #include <pthread.h>
-#include <regex.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "config/config.h"
+#include "deferred.h"
 #include "irc/hooks.h"
 #include "log/log.h"
+#include "rxset.h"
 #include "scheme.h"
+#include "utlist/list.h"
 
 #define MAX_COMMAND_SIZE 4096
 
+/* Calls a worker makes into one module before giving the others a turn */
+#define SCM_WORKER_BATCH 16
+
+/* How often the watchdog looks for calls past their deadline */
+#define SCM_WATCHDOG_TICK_NS 10000000
+
 typedef struct mod_entry
 {
 	scm_module *mod;
 	sexp func;
+	scm_filter *filter;
 	struct mod_entry *next;
 } mod_entry;
 
+/* A handler call waiting in a module's mailbox */
+typedef struct scm_job
+{
+	sexp func;
+	const irc_server *serv;
+	irc_msg *msg;
+	scm_args_fn args;
+	scm_done_fn done;
+	void *data;
+	uint64_t queued;
+} scm_job;
+
 typedef struct regex_hook
 {
 	scm_module *mod;
 	sexp func;
-	regex_t *regex;
-	struct regex_hook *next;
+	scm_filter *filter;
 } regex_hook;
 
 static unsigned int mod_ids = 0;
@@ -39,17 +70,42 @@ static scm_module *module_list;
 static GHashTable *command_hooks;
 /*
  * Executes hooks to IRC commands
- * The IRC command is used as key
- * A linked list of module entries is used as value
- * IRC command -> mod_entry*
+ * Indexed by the ID of the IRC command
+ * A linked list of module entries is the value
+ * IRC command ID -> mod_entry*
+ */
+static mod_entry *irc_hooks[IRC_CMD_COUNT];
+/*
+ * The patterns of all regex hooks
+ * Matched together against every PRIVMSG that comes in
+ * The data of each pattern is its regex_hook
+ */
+static rxset *regex_hooks;
+/*
+ * Runs the handlers of scheme modules off the event loop. Modules are
+ * pushed when their mailbox gets work, see scm_run_module.
  */
-static GHashTable *irc_hooks;
+static GThreadPool *workers;
 /*
- * A linked list of regex hooks
- * All of the element of this list are tried
- * against every PRIVMSG that comes in
+ * A heap image of the standard environment, built once in scm_init.
+ * Every module loads its own copy instead of expanding the whole R7RS
+ * environment again. Empty if the image couldn't be made.
  */
-static regex_hook *regex_hooks;
+static char base_image[32];
+/*
+ * Watches the module directories, changed modules are reloaded on their
+ * own. inotify watch descriptor -> directory path
+ */
+static int inotify_fd = -1;
+static ev_io reload_watcher;
+static GHashTable *watched_dirs;
+/*
+ * Modules in a call or load with a deadline. The watchdog thread
+ * interrupts the ones that run past it, chibi raises an exception in
+ * the module the next time it checks the thread's fuel.
+ */
+static pthread_mutex_t watchdog_mtx = PTHREAD_MUTEX_INITIALIZER;
+static scm_module *watched;
 
 static void
 scm_exec_irc_hooks (const irc_server *s, const irc_msg *msg);
@@ -63,63 +119,182 @@ scm_run_module (scm_module *mod,
 		const irc_server *s,
 		const irc_msg *msg);
 static void
+scm_worker (gpointer data, gpointer user_data);
+static void
+scm_call_handler (scm_module *mod, scm_job *job);
+static void
+scm_update_heap_stats (scm_module *mod, sexp ctx);
+static void
+scm_drop_msg_cache (scm_module *mod);
+static void
+scm_build_base_image (void);
+static sexp
+scm_new_context (const scm_module *mod);
+static void
 scm_load_modules (char *dir);
 static scm_module *
-scm_create_module (char *path);
+scm_create_module (char *path, bool *loaded);
+static void
+scm_retire_module (scm_module *mod);
+static void
+scm_watch_init (void);
+static void
+scm_watch_dir (const char *dir);
+static void
+scm_reload_callback (EV_P_ ev_io *w, int re);
 static void
 scm_register_module (scm_module *mod);
+static void
+scm_budget_start (scm_module *mod, uint64_t start);
+static bool
+scm_budget_end (scm_module *mod, uint64_t elapsed);
+static void
+scm_check_limits (scm_module *mod, sexp ctx, sexp res, bool late);
+
+static bool
+scm_filter_matches (const scm_filter *filter, const irc_server *s, const irc_msg *msg);
+
+static _Thread_local scm_module *current_module;
+/* Set while the loop thread runs a module's top level */
+static _Thread_local bool loading_module;
 
 static void
 scm_entry (const irc_server *s, const irc_msg *msg)
 {
 	scm_exec_irc_hooks (s, msg);
-	if (strcmp (msg->command, "PRIVMSG") == 0) {
+	if (msg->command_id == IRC_CMD_PRIVMSG) {
 		scm_exec_command_hooks (s, msg);
 		scm_exec_regex_hooks (s, msg);
 	}
 }
 
 void
-scm_add_irc_hook (const char *command, sexp func, scm_module *mod)
+scm_free_filter (scm_filter *filter)
+{
+	if (filter == NULL)
+		return;
+
+	for (char **c = filter->channels; c != NULL && *c != NULL; ++c)
+		free (*c);
+	for (char **m = filter->sources; m != NULL && *m != NULL; ++m)
+		free (*m);
+	free (filter->channels);
+	free (filter->sources);
+	free (filter);
+}
+
+static bool
+scm_filter_matches (const scm_filter *filter, const irc_server *s, const irc_msg *msg)
+{
+	if (filter == NULL)
+		return true;
+
+	if (filter->channels != NULL) {
+		if (msg->params.len == 0)
+			return false;
+
+		/* Channel names compare the way the server says they do */
+		irc_state *st = irc_server_state (s);
+		irc_casemapping map = st != NULL ? irc_state_casemapping (st) : IRC_CASEMAP_RFC1459;
+		const char *target = msg->params.params[0];
+		size_t target_len = strlen (target);
+
+		char **c = filter->channels;
+		while (*c != NULL && !irc_text_caseeq (*c, strlen (*c), target, target_len, map))
+			c++;
+		if (*c == NULL)
+			return false;
+	}
+
+	if (filter->sources != NULL) {
+		if (msg->prefix == NULL)
+			return false;
+
+		char **m = filter->sources;
+		while (*m != NULL && fnmatch (*m, msg->prefix, FNM_CASEFOLD) != 0)
+			m++;
+		if (*m == NULL)
+			return false;
+	}
+
+	if (filter->ctcp != SCM_CTCP_ANY) {
+		const char *text = msg->params.len > 0 ? msg->params.params[msg->params.len - 1] : "";
+		bool ctcp = text[0] == '\x01';
+		if (ctcp != (filter->ctcp == SCM_CTCP_ONLY))
+			return false;
+	}
+
+	return true;
+}
+
+void
+scm_add_irc_hook (const char *command, sexp func, scm_module *mod, scm_filter *filter)
 {
 	mod_entry *me = malloc (sizeof (mod_entry));
+	if (me == NULL) {
+		scm_free_filter (filter);
+		return;
+	}
 	me->mod = mod;
 	me->func = func;
+	me->filter = filter;
 	me->next = NULL;
-	g_hash_table_insert (irc_hooks, strdup (command), me);
+
+	irc_command_id id = irc_command_intern (command);
+	if (id == IRC_CMD_UNKNOWN) {
+		scm_free_filter (filter);
+		free (me);
+		return;
+	}
+
+	mod_entry **tail = &irc_hooks[id];
+	while (*tail != NULL)
+		tail = &(*tail)->next;
+	*tail = me;
 }
 
 static void
 scm_exec_irc_hooks (const irc_server *s, const irc_msg *msg)
 {
-	mod_entry *me = g_hash_table_lookup (irc_hooks, msg->command);
-	if (me == NULL)
-		return;
-
-	do {
-		scm_run_module (me->mod, me->func, s, msg);
-	} while ((me = me->next));
+	mod_entry *me;
+	for (me = irc_hooks[msg->command_id]; me != NULL; me = me->next)
+		if (scm_filter_matches (me->filter, s, msg))
+			scm_run_module (me->mod, me->func, s, msg);
 }
 
 void
-scm_add_command_hook (const char *command, sexp func, scm_module *mod)
+scm_add_command_hook (const char *command, sexp func, scm_module *mod, scm_filter *filter)
 {
 	mod_entry *me = malloc (sizeof (mod_entry));
+	if (me == NULL) {
+		scm_free_filter (filter);
+		return;
+	}
 	me->mod = mod;
 	me->func = func;
+	me->filter = filter;
 	me->next = NULL;
-	g_hash_table_insert (command_hooks, strdup (command), me);
+
+	/* Several modules can have the same command, they all run */
+	mod_entry *head = g_hash_table_lookup (command_hooks, command);
+	if (head == NULL) {
+		g_hash_table_insert (command_hooks, strdup (command), me);
+		return;
+	}
+
+	while (head->next != NULL)
+		head = head->next;
+	head->next = me;
 }
 
 static void
 scm_exec_command_hooks (const irc_server *s, const irc_msg *msg)
 {
-	config_t *config = get_config ();
-
-	if (strcmp (msg->command, "PRIVMSG") != 0)
+	if (msg->params.len < 2)
 		return;
 
-	const char *text = msg->params->params[1];
+	config_t *config = get_config ();
+	const char *text = msg->params.params[1];
 	size_t text_len = strlen (text);
 	size_t cmd_prefix_len = strlen (config->cmd_prefix);
 
@@ -129,93 +304,382 @@ scm_exec_command_hooks (const irc_server *s, const irc_msg *msg)
 
 	int i = cmd_prefix_len, j = 0;
 	char cmd[MAX_COMMAND_SIZE];
-	while (text[i] != ' ' && text[i] != '\0')
+	while (text[i] != ' ' && text[i] != '\0' && j < MAX_COMMAND_SIZE - 1)
 		cmd[j++] = text[i++];
 	cmd[j] = '\0';
 
-	mod_entry *me = g_hash_table_lookup (command_hooks, cmd);
-	if (me == NULL)
-		return;
-
-	do {
-		scm_run_module (me->mod, me->func, s, msg);
-	} while ((me = me->next));
+	mod_entry *me;
+	for (me = g_hash_table_lookup (command_hooks, cmd); me != NULL; me = me->next)
+		if (scm_filter_matches (me->filter, s, msg))
+			scm_run_module (me->mod, me->func, s, msg);
 }
 
 void
-scm_add_regex_hook (const char *rx_str, sexp func, scm_module *mod)
+scm_add_regex_hook (const char *rx_str, sexp func, scm_module *mod, scm_filter *filter)
 {
-	regex_t *rx = malloc (sizeof (regex_t));
-	char errbuf[4096];
-	int ret = regcomp (rx, rx_str, REG_NOSUB | REG_EXTENDED);
-	if (ret) {
-		regerror (ret, rx, errbuf, sizeof (errbuf));
-		log_info (errbuf);
+	regex_hook *rx_hook = malloc (sizeof (regex_hook));
+	if (rx_hook == NULL) {
+		scm_free_filter (filter);
 		return;
 	}
-
-	regex_hook *rx_hook = malloc (sizeof (regex_hook));
 	rx_hook->mod = mod;
 	rx_hook->func = func;
-	rx_hook->regex = rx;
-	rx_hook->next = NULL;
+	rx_hook->filter = filter;
 
-	regex_hook *hooks;
-	if (regex_hooks == NULL)
-		regex_hooks = rx_hook;
-	else {
-		for (hooks = regex_hooks; hooks->next != NULL; hooks = hooks->next)
-			;
-		hooks->next = rx_hook;
+	char errbuf[4096];
+	if (rxset_add (regex_hooks, rx_str, rx_hook, errbuf, sizeof (errbuf)) == -1) {
+		log_info_at (&(log_fields){ .module = mod->path }, "%s: %s\n", rx_str, errbuf);
+		scm_free_filter (filter);
+		free (rx_hook);
 	}
 }
 
+typedef struct regex_match_ctx
+{
+	const irc_server *s;
+	const irc_msg *msg;
+} regex_match_ctx;
+
+static void
+scm_regex_matched (void *data, void *user_data)
+{
+	regex_hook *hook = data;
+	regex_match_ctx *ctx = user_data;
+	if (scm_filter_matches (hook->filter, ctx->s, ctx->msg))
+		scm_run_module (hook->mod, hook->func, ctx->s, ctx->msg);
+}
+
 static void
 scm_exec_regex_hooks (const irc_server *s, const irc_msg *msg)
 {
-	regex_hook *hooks;
-	char *text = msg->params->params[1];
-	for (hooks = regex_hooks; hooks != NULL; hooks = hooks->next)
-		if (regexec (hooks->regex, text, 0, NULL, 0) == 0)
-			scm_run_module (hooks->mod, hooks->func, s, msg);
+	if (msg->params.len < 2)
+		return;
+
+	regex_match_ctx ctx = { s, msg };
+	rxset_match (regex_hooks, msg->params.params[1], scm_regex_matched, &ctx);
+}
+
+/* Chat lines, nothing the connection or a module's state depends on */
+static bool
+scm_is_sheddable (const irc_msg *msg)
+{
+	return msg->command_id == IRC_CMD_PRIVMSG || msg->command_id == IRC_CMD_NOTICE ||
+	       msg->command_id == IRC_CMD_TAGMSG;
 }
 
+/* Queue a call of the handler func in mod for msg */
 static void
 scm_run_module (scm_module *mod,
 		sexp func,
 		const irc_server *s,
 		const irc_msg *msg)
+{
+	if (atomic_load_explicit (&mod->quarantined, memory_order_relaxed)) {
+		irc_counter_add (&mod->quarantine_dropped, 1);
+		return;
+	}
+
+	if (atomic_load_explicit (&mod->sheddable, memory_order_relaxed) &&
+	    scm_is_sheddable (msg) && irc_backlog_full (s)) {
+		irc_backlog_shed (s);
+		irc_counter_add (&mod->shed, 1);
+		return;
+	}
+
+	scm_queue_call (mod, func, s, msg, NULL, NULL, NULL);
+}
+
+/*
+ * The module is handed to the worker pool unless it's already there,
+ * its calls run in the order queued
+ */
+void
+scm_queue_call (scm_module *mod,
+		sexp func,
+		const irc_server *s,
+		const irc_msg *msg,
+		scm_args_fn args,
+		scm_done_fn done,
+		void *data)
+{
+	scm_job *job = malloc (sizeof (scm_job));
+	if (job == NULL) {
+		log_info_at (&(log_fields){ .module = mod->path }, "out of memory, dropping an event\n");
+		return;
+	}
+
+	job->func = func;
+	job->serv = s;
+	job->msg = msg != NULL ? irc_msg_ref (msg) : NULL;
+	job->args = args;
+	job->done = done;
+	job->data = data;
+	job->queued = irc_metrics_now ();
+	if (s != NULL && msg != NULL)
+		irc_backlog_hold (s, msg);
+
+	pthread_mutex_lock (&mod->mailbox_mtx);
+	g_queue_push_tail (&mod->mailbox, job);
+	bool schedule = !mod->scheduled;
+	mod->scheduled = true;
+	pthread_mutex_unlock (&mod->mailbox_mtx);
+
+	if (schedule)
+		g_thread_pool_push (workers, mod, NULL);
+}
+
+/* Work through the mailbox of a module, data is the scm_module */
+static void
+scm_worker (gpointer data, gpointer user_data)
+{
+	scm_module *mod = data;
+
+	for (int i = 0; i < SCM_WORKER_BATCH; ++i) {
+		pthread_mutex_lock (&mod->mailbox_mtx);
+		scm_job *job = g_queue_pop_head (&mod->mailbox);
+		if (job == NULL) {
+			mod->scheduled = false;
+			pthread_mutex_unlock (&mod->mailbox_mtx);
+			return;
+		}
+		pthread_mutex_unlock (&mod->mailbox_mtx);
+
+		scm_call_handler (mod, job);
+		if (job->serv != NULL && job->msg != NULL)
+			irc_backlog_release (job->serv, job->msg);
+		irc_msg_unref (job->msg);
+		free (job);
+	}
+
+	/* Still scheduled, go to the back so other modules get a turn */
+	g_thread_pool_push (workers, mod, NULL);
+}
+
+static void
+scm_call_handler (scm_module *mod, scm_job *job)
 {
 	pthread_mutex_lock (&mod->mtx);
 	sexp ctx = mod->scm_ctx;
-	mod->mod_ctx.serv = s;
-	mod->mod_ctx.msg = msg;
+	mod->mod_ctx.serv = job->serv;
+	mod->mod_ctx.msg = job->msg;
+	if (mod->mod_ctx.cached != job->msg)
+		scm_drop_msg_cache (mod);
+	mod->mod_ctx.cached = job->msg;
+	current_module = mod;
 
-	sexp id_obj = sexp_make_integer (ctx, mod->id);
-	sexp id_sym = sexp_intern (ctx, "circ-module-id", -1);
-	sexp_env_define (ctx, sexp_context_env (ctx), id_sym, id_obj);
+	/* Calls queued for an unloaded module after its context is gone,
+	 * or for one in quarantine, only get cleaned up */
+	bool quarantined = atomic_load_explicit (&mod->quarantined, memory_order_relaxed);
+	if (job->func != NULL && ctx != NULL && quarantined)
+		irc_counter_add (&mod->quarantine_dropped, 1);
+	if (job->func != NULL && ctx != NULL && !quarantined) {
+		uint64_t start = irc_metrics_now ();
+		irc_histogram_record (&mod->wait_time, start - job->queued);
 
-	sexp res = sexp_apply (ctx, func, SEXP_NULL);
-	if (sexp_exceptionp (res))
-		sexp_print_exception (ctx, res, sexp_current_error_port (ctx));
+		sexp args = job->args != NULL ? job->args (ctx, job->data) : SEXP_NULL;
+		scm_budget_start (mod, start);
+		sexp res = sexp_apply (ctx, job->func, args);
+		uint64_t ran = irc_metrics_now () - start;
+		bool late = scm_budget_end (mod, ran);
+		if (sexp_exceptionp (res))
+			sexp_print_exception (ctx, res, sexp_current_error_port (ctx));
+
+		irc_histogram_record (&mod->run_time, ran);
+		scm_update_heap_stats (mod, ctx);
+		scm_check_limits (mod, ctx, res, late);
+	}
+	if (job->done != NULL)
+		job->done (mod, job->data);
+
+	current_module = NULL;
+	mod->mod_ctx.msg = NULL;
+
+	/* Hooks for one message are queued back to back, only they can
+	 * share the cache. The next job's ref keeps the message alive. */
+	pthread_mutex_lock (&mod->mailbox_mtx);
+	scm_job *next = g_queue_peek_head (&mod->mailbox);
+	bool keep = next != NULL && next->msg == job->msg;
+	pthread_mutex_unlock (&mod->mailbox_mtx);
+	if (!keep)
+		scm_drop_msg_cache (mod);
 
 	pthread_mutex_unlock (&mod->mtx);
 }
 
+/* Called with mod->mtx held */
+static void
+scm_update_heap_stats (scm_module *mod, sexp ctx)
+{
+	size_t size = 0;
+	for (sexp_heap h = sexp_context_heap (ctx); h != NULL; h = h->next)
+		size += h->size;
+	atomic_store_explicit (&mod->heap_size, size, memory_order_relaxed);
+
+#if SEXP_USE_TIME_GC
+	atomic_store_explicit (&mod->gc_count, sexp_context_gc_count (ctx), memory_order_relaxed);
+#endif
+}
+
+#if SEXP_USE_GREEN_THREADS
+static void *
+scm_watchdog (void *arg)
+{
+	const struct timespec tick = { 0, SCM_WATCHDOG_TICK_NS };
+
+	for (;;) {
+		nanosleep (&tick, NULL);
+		uint64_t now = irc_metrics_now ();
+
+		pthread_mutex_lock (&watchdog_mtx);
+		scm_module *mod;
+		DL_FOREACH2 (watched, mod, watch_next)
+			if (now >= mod->deadline) {
+				/* Again every tick, the module may catch the first one */
+				mod->interrupted = true;
+				sexp_context_interruptp (mod->scm_ctx) = 1;
+			}
+		pthread_mutex_unlock (&watchdog_mtx);
+	}
+
+	return NULL;
+}
+#endif
+
+/* Give the call mod is starting its deadline, with mod->mtx held */
+static void
+scm_budget_start (scm_module *mod, uint64_t start)
+{
+	if (mod->limits.time_ms <= 0)
+		return;
+
+	pthread_mutex_lock (&watchdog_mtx);
+	mod->deadline = start + (uint64_t)(mod->limits.time_ms * 1e6);
+	mod->interrupted = false;
+	DL_APPEND2 (watched, mod, watch_prev, watch_next);
+	pthread_mutex_unlock (&watchdog_mtx);
+}
+
+/* Whether the call that took elapsed ns ran past its deadline */
+static bool
+scm_budget_end (scm_module *mod, uint64_t elapsed)
+{
+	if (mod->limits.time_ms <= 0)
+		return false;
+
+	pthread_mutex_lock (&watchdog_mtx);
+	DL_DELETE2 (watched, mod, watch_prev, watch_next);
+	bool interrupted = mod->interrupted;
+#if SEXP_USE_GREEN_THREADS
+	/* One the call finished before seeing isn't for the next call */
+	sexp_context_interruptp (mod->scm_ctx) = 0;
+#endif
+	pthread_mutex_unlock (&watchdog_mtx);
+
+	/* Without green threads chibi never looks, slow calls still count */
+	return interrupted || elapsed > (uint64_t)(mod->limits.time_ms * 1e6);
+}
+
+/*
+ * Give mod a strike if the call or load that returned res went over a
+ * limit, quarantining it at the last one. Called with mod->mtx held.
+ */
+static void
+scm_check_limits (scm_module *mod, sexp ctx, sexp res, bool late)
+{
+	const char *what;
+	if (late) {
+		irc_counter_add (&mod->timeouts, 1);
+		what = "ran past its time limit";
+	} else if (res == sexp_global (ctx, SEXP_G_OOM_ERROR)) {
+		irc_counter_add (&mod->heap_limit_hits, 1);
+		what = "ran out of heap";
+	} else {
+		return;
+	}
+
+	log_fields f = { .module = mod->path };
+	mod->strikes++;
+	if (mod->limits.strikes <= 0 || mod->strikes < mod->limits.strikes) {
+		log_info_at (&f, "%s, strike %d\n", what, mod->strikes);
+		return;
+	}
+
+	if (!atomic_exchange (&mod->quarantined, true))
+		log_info_at (&f, "%s, quarantined after %d strikes until it's reloaded\n", what, mod->strikes);
+}
+
+/* Called with mod->mtx held */
+static void
+scm_drop_msg_cache (scm_module *mod)
+{
+	mod_context *mc = &mod->mod_ctx;
+	sexp *parts[] = { &mc->params, &mc->source, &mc->nick, &mc->ident, &mc->host };
+
+	for (size_t i = 0; i < sizeof (parts) / sizeof (parts[0]); ++i)
+		if (*parts[i] != NULL) {
+			sexp_release_object (mod->scm_ctx, *parts[i]);
+			*parts[i] = NULL;
+		}
+	mc->cached = NULL;
+}
+
+scm_module *
+scm_current_module (void)
+{
+	return current_module;
+}
+
+bool
+scm_module_loading (const scm_module *mod)
+{
+	return loading_module && current_module == mod;
+}
+
 void
 scm_init ()
 {
 	config_t *config = get_config ();
 
-	if (irc_hooks == NULL)
-		irc_hooks = g_hash_table_new (g_str_hash, g_str_equal);
 	if (command_hooks == NULL)
 		command_hooks = g_hash_table_new (g_str_hash, g_str_equal);
+	if (regex_hooks == NULL && (regex_hooks = rxset_new ()) == NULL)
+		err (1, "Couldn't set up regex hooks");
 
+	if (workers == NULL) {
+		int n = config->workers > 0 ? config->workers : (int)g_get_num_processors ();
+		workers = g_thread_pool_new (scm_worker, NULL, n, TRUE, NULL);
+		if (workers == NULL)
+			err (1, "Couldn't start the scheme workers");
+	}
+
+	static bool watching;
+	if (!watching) {
+#if SEXP_USE_GREEN_THREADS
+		pthread_t watchdog;
+		if (pthread_create (&watchdog, NULL, scm_watchdog, NULL) != 0)
+			err (1, "Couldn't start the scheme watchdog");
+		pthread_detach (watchdog);
+#else
+		log_info ("chibi was built without green threads, module time limits "
+			  "are counted but don't stop a call\n");
+#endif
+		watching = true;
+	}
+
+	scm_deferred_init ();
+	scm_build_base_image ();
+	scm_watch_init ();
 	scm_load_modules (config->scheme_mod_dir);
 	add_hook ("*", scm_entry);
 }
 
+static bool
+scm_is_module_file (const char *name)
+{
+	size_t len = strlen (name);
+	return len > 4 && (strcmp (name + len - 4, ".scm") == 0 || strcmp (name + len - 3, ".ss") == 0);
+}
+
 static void
 scm_load_modules (char *dir)
 {
@@ -225,33 +689,58 @@ scm_load_modules (char *dir)
 
 	log_info ("-----\nLoading Modules:\n");
 	while ((fe = fts_read (f)))
-		if (strlen (fe->fts_name) > 4 &&
-		    (strncmp (fe->fts_name + (fe->fts_namelen - 4), ".scm", 4) == 0 ||
-		     strncmp (fe->fts_name + (fe->fts_namelen - 2), ".ss", 2) == 0)) {
+		if (fe->fts_info == FTS_D) {
+			scm_watch_dir (fe->fts_path);
+		} else if (scm_is_module_file (fe->fts_name)) {
 			log_info ("%s\n", fe->fts_name);
-			scm_create_module (fe->fts_path);
+			scm_create_module (fe->fts_path, NULL);
 		}
 	log_info ("-----\n");
 
 	fts_close (f);
 }
 
+/* loaded, if not NULL, tells whether the module loaded without errors */
 static scm_module *
-scm_create_module (char *path)
+scm_create_module (char *path, bool *loaded)
 {
 	scm_module *mod = malloc (sizeof (scm_module));
 	mod->id = ++mod_ids;
 	mod->path = strdup (path);
 	mod->next = NULL;
+	mod->mod_ctx = (mod_context){ 0 };
 	pthread_mutex_init (&mod->mtx, NULL);
+	pthread_mutex_init (&mod->mailbox_mtx, NULL);
+	g_queue_init (&mod->mailbox);
+	mod->scheduled = false;
+	memset (&mod->wait_time, 0, sizeof (mod->wait_time));
+	memset (&mod->run_time, 0, sizeof (mod->run_time));
+	atomic_init (&mod->heap_size, 0);
+	atomic_init (&mod->gc_count, 0);
+	atomic_init (&mod->sheddable, false);
+	atomic_init (&mod->shed, 0);
+	mod->limits = *config_scheme_limits (path);
+	mod->strikes = 0;
+	atomic_init (&mod->timeouts, 0);
+	atomic_init (&mod->heap_limit_hits, 0);
+	atomic_init (&mod->quarantined, false);
+	atomic_init (&mod->quarantine_dropped, 0);
+	mod->interrupted = false;
+	mod->watch_prev = mod->watch_next = NULL;
 
 	pthread_mutex_lock (&mod->mtx);
 
 	scm_register_module (mod);
 
-	mod->scm_ctx = sexp_make_eval_context (NULL, NULL, NULL, 0, 0);
+	mod->scm_ctx = scm_new_context (mod);
 	sexp ctx = mod->scm_ctx;
-	sexp_load_standard_env (ctx, NULL, SEXP_SEVEN);
+	if (ctx == NULL) {
+		/* Its calls only get cleaned up, as for an unloaded module */
+		pthread_mutex_unlock (&mod->mtx);
+		if (loaded != NULL)
+			*loaded = false;
+		return mod;
+	}
 	sexp_load_standard_ports (ctx, NULL, stdin, stdout, stderr, 1);
 
 	sexp id_obj = sexp_make_integer (ctx, mod->id);
@@ -260,16 +749,295 @@ scm_create_module (char *path)
 
 	scmapi_define_foreign_functions (ctx);
 
+	/* Loading runs the module's top level, it has the same limits */
+	current_module = mod;
+	loading_module = true;
 	sexp obj = sexp_c_string (ctx, path, -1);
+	uint64_t start = irc_metrics_now ();
+	scm_budget_start (mod, start);
 	sexp res = sexp_load (ctx, obj, NULL);
+	bool late = scm_budget_end (mod, irc_metrics_now () - start);
 	if (sexp_exceptionp (res))
 		sexp_print_exception (ctx, res, sexp_current_error_port (ctx));
+	loading_module = false;
+	current_module = NULL;
+	scm_update_heap_stats (mod, ctx);
+	scm_check_limits (mod, ctx, res, late);
 
 	pthread_mutex_unlock (&mod->mtx);
 
+	if (loaded != NULL)
+		*loaded = !sexp_exceptionp (res);
 	return mod;
 }
 
+static void
+scm_remove_entries (mod_entry **list, scm_module *mod)
+{
+	while (*list != NULL) {
+		mod_entry *me = *list;
+		if (me->mod == mod) {
+			*list = me->next;
+			scm_free_filter (me->filter);
+			free (me);
+		} else {
+			list = &me->next;
+		}
+	}
+}
+
+static bool
+scm_regex_hook_of (void *data, void *user_data)
+{
+	regex_hook *hook = data;
+	if (hook->mod != user_data)
+		return false;
+
+	scm_free_filter (hook->filter);
+	free (hook);
+	return true;
+}
+
+/* Runs on the worker after everything queued for the module before */
+static void
+scm_destroy_module_context (scm_module *mod, void *data)
+{
+	scm_drop_msg_cache (mod);
+	if (mod->scm_ctx != NULL)
+		sexp_destroy_context (mod->scm_ctx);
+	mod->scm_ctx = NULL;
+}
+
+/*
+ * Take a module out of every hook table and the module list, then have
+ * its context destroyed once the calls already queued for it are done.
+ * The scm_module itself stays allocated, deferred calls may still point
+ * to it. Runs on the event loop thread, like the dispatch, so no message
+ * sees a table halfway through.
+ */
+static void
+scm_retire_module (scm_module *mod)
+{
+	for (int id = 0; id < IRC_CMD_COUNT; ++id)
+		scm_remove_entries (&irc_hooks[id], mod);
+
+	GHashTableIter iter;
+	gpointer key, value;
+	g_hash_table_iter_init (&iter, command_hooks);
+	while (g_hash_table_iter_next (&iter, &key, &value)) {
+		mod_entry *head = value;
+		scm_remove_entries (&head, mod);
+		if (head == NULL) {
+			g_hash_table_iter_remove (&iter);
+			free (key);
+		} else if (head != value) {
+			g_hash_table_iter_replace (&iter, head);
+		}
+	}
+
+	rxset_remove_if (regex_hooks, scm_regex_hook_of, mod);
+
+	scm_module **m = &module_list;
+	while (*m != NULL && *m != mod)
+		m = &(*m)->next;
+	if (*m != NULL)
+		*m = mod->next;
+
+	scm_deferred_forget (mod);
+	scm_queue_call (mod, NULL, NULL, NULL, NULL, scm_destroy_module_context, NULL);
+}
+
+static scm_module *
+scm_find_module (const char *path)
+{
+	scm_module *mod;
+	for (mod = module_list; mod != NULL; mod = mod->next)
+		if (strcmp (mod->path, path) == 0)
+			return mod;
+
+	return NULL;
+}
+
+/*
+ * Load the new version of a module next to the old one, then retire the
+ * old one. If the new version doesn't load, the old one stays.
+ */
+static void
+scm_reload_module (char *path)
+{
+	scm_module *old = scm_find_module (path);
+	log_info ("%s %s\n", old != NULL ? "Reloading" : "Loading", path);
+
+	bool loaded;
+	scm_module *mod = scm_create_module (path, &loaded);
+	if (!loaded && old != NULL) {
+		log_info ("%s: keeping the running version\n", path);
+		scm_retire_module (mod);
+		return;
+	}
+
+	if (old != NULL)
+		scm_retire_module (old);
+}
+
+static void
+scm_watch_init (void)
+{
+	inotify_fd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+	if (inotify_fd < 0) {
+		log_info ("Couldn't watch the modules, they won't be reloaded\n");
+		return;
+	}
+
+	watched_dirs = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, g_free);
+
+	struct ev_loop *loop = irc_get_event_loop ();
+	ev_io_init (&reload_watcher, scm_reload_callback, inotify_fd, EV_READ);
+	ev_io_start (loop, &reload_watcher);
+	ev_unref (loop);
+}
+
+static void
+scm_watch_dir (const char *dir)
+{
+	if (inotify_fd < 0)
+		return;
+
+	/* Editors that save through a rename show up as IN_MOVED_TO */
+	int wd = inotify_add_watch (inotify_fd,
+				    dir,
+				    IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE |
+				      IN_CREATE | IN_ONLYDIR);
+	if (wd < 0) {
+		log_info ("Couldn't watch %s\n", dir);
+		return;
+	}
+
+	g_hash_table_replace (watched_dirs, GINT_TO_POINTER (wd), g_strdup (dir));
+}
+
+static void
+scm_reload_event (const struct inotify_event *ev)
+{
+	if (ev->mask & IN_IGNORED) {
+		g_hash_table_remove (watched_dirs, GINT_TO_POINTER (ev->wd));
+		return;
+	}
+
+	const char *dir = g_hash_table_lookup (watched_dirs, GINT_TO_POINTER (ev->wd));
+	if (dir == NULL || ev->len == 0)
+		return;
+
+	char *path = g_build_filename (dir, ev->name, NULL);
+	if (ev->mask & IN_ISDIR) {
+		if (ev->mask & (IN_CREATE | IN_MOVED_TO))
+			scm_watch_dir (path);
+	} else if (scm_is_module_file (ev->name)) {
+		if (ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+			scm_reload_module (path);
+		} else if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+			scm_module *mod = scm_find_module (path);
+			if (mod != NULL) {
+				log_info ("Unloading %s\n", path);
+				scm_retire_module (mod);
+			}
+		}
+	}
+	g_free (path);
+}
+
+static void
+scm_reload_callback (EV_P_ ev_io *w, int re)
+{
+	char buf[4096] __attribute__ ((aligned (__alignof__ (struct inotify_event))));
+
+	ssize_t len;
+	while ((len = read (inotify_fd, buf, sizeof (buf))) > 0) {
+		const struct inotify_event *ev;
+		for (char *p = buf; p < buf + len; p += sizeof (struct inotify_event) + ev->len) {
+			ev = (const struct inotify_event *)p;
+			scm_reload_event (ev);
+		}
+	}
+}
+
+/*
+ * The image lives in an anonymous file, its /proc/self/fd path is what
+ * chibi saves to and loads from
+ */
+static void
+scm_build_base_image (void)
+{
+	int fd = memfd_create ("circ-scheme-env", MFD_CLOEXEC);
+	if (fd < 0) {
+		log_info ("Couldn't create the scheme image, modules load the "
+			  "standard environment on their own\n");
+		return;
+	}
+
+	sexp ctx = sexp_make_eval_context (NULL, NULL, NULL, 0, 0);
+	sexp_load_standard_env (ctx, NULL, SEXP_SEVEN);
+
+	/* Nearly every module imports it through privmsg.scm. This only
+	 * loads the library, an import still decides what a module sees. */
+	sexp res = sexp_eval_string (ctx,
+				     "(load-module '(chibi string))",
+				     -1,
+				     sexp_global (ctx, SEXP_G_META_ENV));
+	if (sexp_exceptionp (res))
+		log_info ("Couldn't preload (chibi string)\n");
+
+	snprintf (base_image, sizeof (base_image), "/proc/self/fd/%d", fd);
+	res = sexp_save_image (ctx, base_image);
+	sexp_destroy_context (ctx);
+
+	if (sexp_exceptionp (res)) {
+		log_info ("Couldn't save the scheme image, modules load the "
+			  "standard environment on their own\n");
+		base_image[0] = '\0';
+		close (fd);
+	}
+}
+
+/*
+ * A fresh context with the standard environment for mod, from the image
+ * if possible, its heap sized as the module's limits say. NULL if the
+ * environment doesn't fit.
+ */
+static sexp
+scm_new_context (const scm_module *mod)
+{
+	const scheme_limits *limits = &mod->limits;
+	log_fields f = { .module = mod->path };
+
+	if (base_image[0] != '\0') {
+		sexp ctx = sexp_load_image (base_image, 0, limits->heap_initial, limits->heap_max);
+		if (ctx != NULL && sexp_contextp (ctx))
+			return ctx;
+
+		log_info_at (&f, "Couldn't load the scheme image: %s\n", sexp_load_image_err ());
+		/* A heap limit smaller than the image only fails this module */
+		if (limits->heap_max == 0)
+			base_image[0] = '\0';
+	}
+
+	sexp ctx = sexp_make_eval_context (NULL, NULL, NULL, limits->heap_initial, limits->heap_max);
+	if (ctx == NULL || !sexp_contextp (ctx)) {
+		log_info_at (&f, "Couldn't make a scheme context\n");
+		return NULL;
+	}
+
+	sexp res = sexp_load_standard_env (ctx, NULL, SEXP_SEVEN);
+	if (sexp_exceptionp (res)) {
+		log_info_at (&f, "Couldn't load the standard environment%s\n",
+			     limits->heap_max > 0 ? ", heap_max_bytes may be too small" : "");
+		sexp_destroy_context (ctx);
+		return NULL;
+	}
+
+	return ctx;
+}
+
 static void
 scm_register_module (scm_module *mod)
 {
@@ -301,3 +1069,16 @@ scm_get_module_from_id (int id)
 
 	return NULL;
 }
+
+void
+scm_foreach_module (scm_module_fn fn, void *data)
+{
+	scm_module *mod;
+	for (mod = module_list; mod != NULL; mod = mod->next) {
+		pthread_mutex_lock (&mod->mailbox_mtx);
+		size_t queued = g_queue_get_length (&mod->mailbox);
+		pthread_mutex_unlock (&mod->mailbox_mtx);
+
+		fn (mod, queued, data);
+	}
+}
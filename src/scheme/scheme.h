@@ -1,15 +1,49 @@
 #ifndef SCHEME_H
 #define SCHEME_H
 
+#include "config/config.h"
 #include "irc/irc.h"
+#include "irc/metrics.h"
 #include <chibi/eval.h>
+#include <glib.h>
+#include <pthread.h>
+#include <stdbool.h>
 
 typedef struct mod_context
 {
 	const irc_server *serv;
 	irc_msg *msg;
+	/*
+	 * The Scheme view of the message cached, each part is built on first
+	 * use and kept while the next call of the module is for the same
+	 * message. NULL parts haven't been asked for yet.
+	 */
+	const irc_msg *cached;
+	sexp params;
+	sexp source;
+	sexp nick;
+	sexp ident;
+	sexp host;
 } mod_context;
 
+typedef enum scm_ctcp_filter
+{
+	SCM_CTCP_ANY,
+	SCM_CTCP_ONLY,
+	SCM_CTCP_NONE,
+} scm_ctcp_filter;
+
+/*
+ * What an event has to look like for a hook to run, checked before
+ * calling into the module. NULL lists match anything.
+ */
+typedef struct scm_filter
+{
+	char **channels; /* the target, first param, has to be one of these */
+	char **sources;	 /* fnmatch masks on nick!ident@host */
+	scm_ctcp_filter ctcp;
+} scm_filter;
+
 typedef struct scm_module
 {
 	int id;
@@ -17,6 +51,43 @@ typedef struct scm_module
 	sexp scm_ctx;
 	mod_context mod_ctx;
 	pthread_mutex_t mtx;
+	/*
+	 * Handler calls waiting to run, in the order their messages came
+	 * in. scheduled is set while the module is queued on or running in
+	 * the worker pool, so only one worker runs a module at a time.
+	 */
+	pthread_mutex_t mailbox_mtx;
+	GQueue mailbox;
+	bool scheduled;
+	/* How long calls waited in the mailbox and how long they ran */
+	irc_histogram wait_time;
+	irc_histogram run_time;
+	/* Size of the module's heap after its last call */
+	atomic_size_t heap_size;
+	/* Collections so far, if chibi was built to count them */
+	atomic_ullong gc_count;
+	/*
+	 * Set by modules that can do without chat lines while the
+	 * connection is behind, shed counts the ones they missed
+	 */
+	atomic_bool sheddable;
+	atomic_ullong shed;
+	/*
+	 * What the module may take and how often it took more. strikes
+	 * is under mtx, reaching limits.strikes sets quarantined and its
+	 * calls are dropped from then on, counted in quarantine_dropped.
+	 * A reload starts the module over with a clean record.
+	 */
+	scheme_limits limits;
+	int strikes;
+	atomic_ullong timeouts;
+	atomic_ullong heap_limit_hits;
+	atomic_bool quarantined;
+	atomic_ullong quarantine_dropped;
+	/* On the watchdog's list while a call with a deadline runs */
+	uint64_t deadline;
+	bool interrupted;
+	struct scm_module *watch_prev, *watch_next;
 	struct scm_module *next;
 } scm_module;
 
@@ -24,13 +95,49 @@ void
 scm_init (void);
 scm_module *
 scm_get_module_from_id (int id);
+/* The module the calling thread is running or loading, if any */
+scm_module *
+scm_current_module (void);
+/* Whether the calling thread is loading mod, on the loop thread */
+bool
+scm_module_loading (const scm_module *mod);
+/*
+ * The hooks take ownership of filter, which may be NULL. They're only
+ * added while their module loads, the loop thread reads the tables
+ * without a lock.
+ */
 void
-scm_add_irc_hook (const char *command, sexp func, scm_module *mod);
+scm_add_irc_hook (const char *command, sexp func, scm_module *mod, scm_filter *filter);
 void
-scm_add_command_hook (const char *command, sexp func, scm_module *mod);
+scm_add_command_hook (const char *command, sexp func, scm_module *mod, scm_filter *filter);
 void
-scm_add_regex_hook (const char *rx_str, sexp func, scm_module *mod);
+scm_add_regex_hook (const char *rx_str, sexp func, scm_module *mod, scm_filter *filter);
+void
+scm_free_filter (scm_filter *filter);
+
+/*
+ * Queue a call of func in mod, with s and msg as the context it sees
+ * (msg may be NULL). On the worker, args builds the argument list from
+ * data before the call and done runs after it with the module's context
+ * still held, e.g. to release objects. Either may be NULL, as may func
+ * to only run done.
+ */
+typedef sexp (*scm_args_fn) (sexp ctx, void *data);
+typedef void (*scm_done_fn) (scm_module *mod, void *data);
+void
+scm_queue_call (scm_module *mod,
+		sexp func,
+		const irc_server *s,
+		const irc_msg *msg,
+		scm_args_fn args,
+		scm_done_fn done,
+		void *data);
 void
 scmapi_define_foreign_functions (sexp ctx);
 
+/* Call fn for every loaded module, on the loop thread */
+typedef void (*scm_module_fn) (const scm_module *mod, size_t queued, void *data);
+void
+scm_foreach_module (scm_module_fn fn, void *data);
+
 #endif
@@ -1,50 +1,176 @@
+#include <stdbool.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include "../chatlog/chatlog.h"
 #include "../config/config.h"
+#include "deferred.h"
+#include "log/log.h"
 #include "scheme.h"
 
 static scm_module *
 get_module (sexp ctx)
 {
-	sexp id_sym = sexp_intern (ctx, "circ-module-id", -1);
-	sexp id_obj = sexp_eval (ctx, id_sym, sexp_context_env (ctx));
-	int id = sexp_unbox_fixnum (id_obj);
-	return scm_get_module_from_id (id);
+	return scm_current_module ();
+}
+
+/* Keep a value built for the message cache alive until it's dropped */
+static sexp
+cache (sexp ctx, sexp *slot, sexp value)
+{
+	if (!sexp_exceptionp (value))
+		*slot = sexp_preserve_object (ctx, value);
+	return value;
+}
+
+/* A string or a list of strings as a NULL terminated array */
+static char **
+string_list (sexp x, bool *ok)
+{
+	size_t len = 0;
+	if (sexp_stringp (x)) {
+		len = 1;
+	} else {
+		for (sexp l = x; sexp_pairp (l); l = sexp_cdr (l)) {
+			if (!sexp_stringp (sexp_car (l))) {
+				*ok = false;
+				return NULL;
+			}
+			len++;
+		}
+	}
+
+	char **list = calloc (len + 1, sizeof (char *));
+	if (list == NULL) {
+		*ok = false;
+		return NULL;
+	}
+
+	if (sexp_stringp (x)) {
+		list[0] = strdup (sexp_string_data (x));
+	} else {
+		size_t i = 0;
+		for (sexp l = x; sexp_pairp (l); l = sexp_cdr (l))
+			list[i++] = strdup (sexp_string_data (sexp_car (l)));
+	}
+
+	return list;
+}
+
+/*
+ * The optional filter of the register functions, an alist of
+ *   (channel . "#chan" or ("#a" "#b"))
+ *   (source . "nick!*@*" or a list of masks)
+ *   (ctcp . #t for only CTCP messages, #f for none)
+ * Sets ok to false if spec isn't a valid filter, NULL means no filter.
+ */
+static scm_filter *
+make_filter (sexp ctx, scm_module *mod, sexp spec, bool *ok)
+{
+	*ok = true;
+	if (spec == SEXP_FALSE || sexp_nullp (spec))
+		return NULL;
+
+	scm_filter *filter = calloc (1, sizeof (scm_filter));
+	if (filter == NULL) {
+		*ok = false;
+		return NULL;
+	}
+	filter->ctcp = SCM_CTCP_ANY;
+
+	sexp channel_sym = sexp_intern (ctx, "channel", -1);
+	sexp source_sym = sexp_intern (ctx, "source", -1);
+	sexp ctcp_sym = sexp_intern (ctx, "ctcp", -1);
+
+	for (sexp l = spec; *ok && sexp_pairp (l); l = sexp_cdr (l)) {
+		sexp entry = sexp_car (l);
+		if (!sexp_pairp (entry)) {
+			*ok = false;
+			break;
+		}
+
+		sexp key = sexp_car (entry), value = sexp_cdr (entry);
+		if (key == channel_sym && filter->channels == NULL)
+			filter->channels = string_list (value, ok);
+		else if (key == source_sym && filter->sources == NULL)
+			filter->sources = string_list (value, ok);
+		else if (key == ctcp_sym && sexp_booleanp (value))
+			filter->ctcp = value == SEXP_TRUE ? SCM_CTCP_ONLY : SCM_CTCP_NONE;
+		else
+			*ok = false;
+	}
+
+	if (!*ok) {
+		log_info_at (&(log_fields){ .module = mod->path }, "invalid hook filter\n");
+		scm_free_filter (filter);
+		return NULL;
+	}
+
+	return filter;
+}
+
+/*
+ * Handlers run on the workers while the loop reads the hook tables,
+ * so hooks can only be registered from a module's top level
+ */
+static bool
+can_register (scm_module *mod, const char *what)
+{
+	if (scm_module_loading (mod))
+		return true;
+
+	log_info_at (&(log_fields){ .module = mod->path }, "%s only works while the module loads\n", what);
+	return false;
 }
 
 sexp
-scmapi_register_hook (sexp ctx, sexp self, sexp n, sexp cmd, sexp func)
+scmapi_register_hook (sexp ctx, sexp self, sexp n, sexp cmd, sexp func, sexp spec)
 {
 	scm_module *mod = get_module (ctx);
-	if (mod == NULL)
+	if (mod == NULL || !can_register (mod, "register-hook"))
+		return SEXP_FALSE;
+
+	bool ok;
+	scm_filter *filter = make_filter (ctx, mod, spec, &ok);
+	if (!ok)
 		return SEXP_FALSE;
 
 	const char *cmd_c = sexp_string_data (cmd);
-	scm_add_irc_hook (cmd_c, func, mod);
+	scm_add_irc_hook (cmd_c, func, mod, filter);
 	return SEXP_TRUE;
 }
 
 sexp
-scmapi_register_command (sexp ctx, sexp self, sexp n, sexp cmd, sexp func)
+scmapi_register_command (sexp ctx, sexp self, sexp n, sexp cmd, sexp func, sexp spec)
 {
 	scm_module *mod = get_module (ctx);
-	if (mod == NULL)
+	if (mod == NULL || !can_register (mod, "register-command"))
+		return SEXP_FALSE;
+
+	bool ok;
+	scm_filter *filter = make_filter (ctx, mod, spec, &ok);
+	if (!ok)
 		return SEXP_FALSE;
 
 	const char *cmd_c = sexp_string_data (cmd);
-	scm_add_command_hook (cmd_c, func, mod);
+	scm_add_command_hook (cmd_c, func, mod, filter);
 	return SEXP_TRUE;
 }
 
 sexp
-scmapi_register_match (sexp ctx, sexp self, sexp n, sexp regex, sexp func)
+scmapi_register_match (sexp ctx, sexp self, sexp n, sexp regex, sexp func, sexp spec)
 {
 	scm_module *mod = get_module (ctx);
-	if (mod == NULL)
+	if (mod == NULL || !can_register (mod, "register-match"))
+		return SEXP_FALSE;
+
+	bool ok;
+	scm_filter *filter = make_filter (ctx, mod, spec, &ok);
+	if (!ok)
 		return SEXP_FALSE;
 
 	const char *regex_c = sexp_string_data (regex);
-	scm_add_regex_hook (regex_c, func, mod);
+	scm_add_regex_hook (regex_c, func, mod, filter);
 	return SEXP_TRUE;
 }
 
@@ -52,12 +178,11 @@ sexp
 scmapi_send_raw (sexp ctx, sexp self, sexp n, sexp raw)
 {
 	scm_module *mod = get_module (ctx);
-	if (mod == NULL)
+	if (mod == NULL || mod->mod_ctx.serv == NULL)
 		return SEXP_NULL;
 
 	if (!sexp_stringp (raw)) {
-		printf ("scmapi_send_raw: %s: The argument is not a string\n",
-			mod->path);
+		log_info_at (&(log_fields){ .module = mod->path }, "send-raw takes a string\n");
 		return SEXP_NULL;
 	}
 
@@ -68,6 +193,46 @@ scmapi_send_raw (sexp ctx, sexp self, sexp n, sexp raw)
 	return SEXP_NULL;
 }
 
+/* Text to target, split over as many lines as it takes */
+static sexp
+send_text (sexp ctx, const char *command, sexp target, sexp text, bool action)
+{
+	scm_module *mod = get_module (ctx);
+	if (mod == NULL || mod->mod_ctx.serv == NULL)
+		return SEXP_FALSE;
+
+	if (!sexp_stringp (target) || !sexp_stringp (text)) {
+		log_info_at (&(log_fields){ .module = mod->path }, "%s takes a target and a string\n", command);
+		return SEXP_FALSE;
+	}
+
+	irc_push_text (mod->mod_ctx.serv,
+		       command,
+		       sexp_string_data (target),
+		       sexp_string_data (text),
+		       sexp_string_size (text),
+		       action);
+	return SEXP_TRUE;
+}
+
+sexp
+scmapi_send_privmsg (sexp ctx, sexp self, sexp n, sexp target, sexp text)
+{
+	return send_text (ctx, "PRIVMSG", target, text, false);
+}
+
+sexp
+scmapi_send_notice (sexp ctx, sexp self, sexp n, sexp target, sexp text)
+{
+	return send_text (ctx, "NOTICE", target, text, false);
+}
+
+sexp
+scmapi_send_action (sexp ctx, sexp self, sexp n, sexp target, sexp text)
+{
+	return send_text (ctx, "PRIVMSG", target, text, true);
+}
+
 sexp
 scmapi_get_cmd_prefix (sexp ctx, sexp self, sexp n)
 {
@@ -86,7 +251,7 @@ sexp
 scmapi_get_server_name (sexp ctx, sexp self, sexp n)
 {
 	scm_module *mod = get_module (ctx);
-	if (mod == NULL)
+	if (mod == NULL || mod->mod_ctx.serv == NULL)
 		return SEXP_NULL;
 
 	const irc_server *s = mod->mod_ctx.serv;
@@ -97,55 +262,429 @@ sexp
 scmapi_get_message_source (sexp ctx, sexp self, sexp n)
 {
 	scm_module *mod = get_module (ctx);
-	if (mod == NULL)
+	if (mod == NULL || mod->mod_ctx.msg == NULL)
 		return SEXP_NULL;
 
-	const irc_msg *msg = mod->mod_ctx.msg;
-	return sexp_c_string (ctx, msg->prefix, -1);
+	mod_context *mc = &mod->mod_ctx;
+	if (mc->source != NULL)
+		return mc->source;
+	if (mc->msg->prefix == NULL)
+		return SEXP_FALSE;
+
+	return cache (ctx, &mc->source, sexp_c_string (ctx, mc->msg->prefix, -1));
+}
+
+/* One part of the message prefix, #f if it doesn't have that part */
+static sexp
+prefix_part (sexp ctx, sexp *slot, const char *part, size_t len)
+{
+	if (*slot != NULL)
+		return *slot;
+	if (part == NULL)
+		return SEXP_FALSE;
+
+	return cache (ctx, slot, sexp_c_string (ctx, part, len));
+}
+
+sexp
+scmapi_get_nick (sexp ctx, sexp self, sexp n)
+{
+	scm_module *mod = get_module (ctx);
+	if (mod == NULL || mod->mod_ctx.msg == NULL)
+		return SEXP_FALSE;
+
+	irc_prefix p;
+	mod_context *mc = &mod->mod_ctx;
+	irc_prefix_split (mc->msg->prefix, &p);
+	return prefix_part (ctx, &mc->nick, p.nick, p.nick_len);
+}
+
+sexp
+scmapi_get_ident (sexp ctx, sexp self, sexp n)
+{
+	scm_module *mod = get_module (ctx);
+	if (mod == NULL || mod->mod_ctx.msg == NULL)
+		return SEXP_FALSE;
+
+	irc_prefix p;
+	mod_context *mc = &mod->mod_ctx;
+	irc_prefix_split (mc->msg->prefix, &p);
+	return prefix_part (ctx, &mc->ident, p.ident, p.ident_len);
+}
+
+sexp
+scmapi_get_host (sexp ctx, sexp self, sexp n)
+{
+	scm_module *mod = get_module (ctx);
+	if (mod == NULL || mod->mod_ctx.msg == NULL)
+		return SEXP_FALSE;
+
+	irc_prefix p;
+	mod_context *mc = &mod->mod_ctx;
+	irc_prefix_split (mc->msg->prefix, &p);
+	return prefix_part (ctx, &mc->host, p.host, p.host_len);
 }
 
 sexp
 scmapi_get_message_command (sexp ctx, sexp self, sexp n)
 {
 	scm_module *mod = get_module (ctx);
-	if (mod == NULL)
+	if (mod == NULL || mod->mod_ctx.msg == NULL)
 		return SEXP_NULL;
 
 	const irc_msg *msg = mod->mod_ctx.msg;
 	return sexp_c_string (ctx, msg->command, -1);
 }
 
-/* sexp */
-/* scmapi_get_message_tags (sexp ctx, sexp self, sexp n) */
-/* { */
-/* scm_module *mod = get_module (ctx); */
-/* if (mod == NULL) */
-/* return SEXP_NULL; */
+sexp
+scmapi_get_message_tag (sexp ctx, sexp self, sexp n, sexp name)
+{
+	scm_module *mod = get_module (ctx);
+	if (mod == NULL || mod->mod_ctx.msg == NULL)
+		return SEXP_FALSE;
+
+	if (!sexp_stringp (name)) {
+		log_info_at (&(log_fields){ .module = mod->path }, "get-message-tag takes a string\n");
+		return SEXP_FALSE;
+	}
 
-/* const irc_msg *msg = mod->mod_ctx.msg; */
-/* return array_to_scheme_list (ctx, *msg->tags, 0); */
-/* } */
+	const irc_msg *msg = mod->mod_ctx.msg;
+	const char *value = irc_msg_get_tag (msg, sexp_string_data (name));
+	if (value == NULL)
+		return SEXP_FALSE;
+
+	return sexp_c_string (ctx, value, -1);
+}
 
 static sexp
-msg_params_to_scheme_list (sexp ctx, struct irc_msg_params *arr, int index)
+msg_params_to_scheme_list (sexp ctx, const struct irc_msg_params *arr)
+{
+	sexp_gc_var2 (list, str);
+	sexp_gc_preserve2 (ctx, list, str);
+
+	list = SEXP_NULL;
+	for (int i = arr->len - 1; i >= 0; --i) {
+		str = sexp_c_string (ctx, arr->params[i], -1);
+		list = sexp_cons (ctx, str, list);
+	}
+
+	sexp_gc_release2 (ctx);
+	return list;
+}
+
+/*
+ * The list is shared by every call for the message, modules mustn't
+ * mutate it
+ */
+sexp
+scmapi_get_message_params (sexp ctx, sexp self, sexp n)
 {
-	if (arr->len == index)
+	scm_module *mod = get_module (ctx);
+	if (mod == NULL || mod->mod_ctx.msg == NULL)
 		return SEXP_NULL;
+
+	mod_context *mc = &mod->mod_ctx;
+	if (mc->params != NULL)
+		return mc->params;
+
+	return cache (ctx, &mc->params, msg_params_to_scheme_list (ctx, &mc->msg->params));
+}
+
+/* (shed-when-busy #t), skip chat lines while the connection is behind */
+sexp
+scmapi_shed_when_busy (sexp ctx, sexp self, sexp n, sexp on)
+{
+	scm_module *mod = get_module (ctx);
+	if (mod == NULL)
+		return SEXP_FALSE;
+
+	atomic_store (&mod->sheddable, on != SEXP_FALSE);
+	return SEXP_TRUE;
+}
+
+/* Seconds as a fixnum or flonum */
+static bool
+get_seconds (sexp x, double *out)
+{
+	if (sexp_fixnump (x))
+		*out = sexp_unbox_fixnum (x);
+	else if (sexp_flonump (x))
+		*out = sexp_flonum_value (x);
 	else
-		return sexp_cons (ctx,
-				  sexp_c_string (ctx, arr->params[index], -1),
-				  msg_params_to_scheme_list (ctx, arr, index + 1));
+		return false;
+
+	return *out >= 0;
 }
 
+static sexp
+make_timer (sexp ctx, sexp delay, sexp repeat, sexp func)
+{
+	scm_module *mod = get_module (ctx);
+	if (mod == NULL)
+		return SEXP_FALSE;
+
+	double delay_s, repeat_s = 0;
+	if (!get_seconds (delay, &delay_s) ||
+	    (repeat != SEXP_FALSE && !get_seconds (repeat, &repeat_s)) ||
+	    !sexp_applicablep (func)) {
+		log_info_at (&(log_fields){ .module = mod->path }, "timers take seconds and a procedure\n");
+		return SEXP_FALSE;
+	}
+
+	long id = scm_add_timer (mod, delay_s, repeat_s, func);
+	return id < 0 ? SEXP_FALSE : sexp_make_fixnum (id);
+}
+
+/* (register-timer delay repeat thunk), repeat may be #f for a one shot */
 sexp
-scmapi_get_message_params (sexp ctx, sexp self, sexp n)
+scmapi_register_timer (sexp ctx, sexp self, sexp n, sexp delay, sexp repeat, sexp func)
+{
+	return make_timer (ctx, delay, repeat, func);
+}
+
+sexp
+scmapi_after (sexp ctx, sexp self, sexp n, sexp delay, sexp func)
+{
+	return make_timer (ctx, delay, SEXP_FALSE, func);
+}
+
+sexp
+scmapi_every (sexp ctx, sexp self, sexp n, sexp interval, sexp func)
+{
+	return make_timer (ctx, interval, interval, func);
+}
+
+sexp
+scmapi_cancel_timer (sexp ctx, sexp self, sexp n, sexp id)
+{
+	scm_module *mod = get_module (ctx);
+	if (mod == NULL || !sexp_fixnump (id))
+		return SEXP_FALSE;
+
+	return sexp_make_boolean (scm_cancel_timer (mod, sexp_unbox_fixnum (id)));
+}
+
+/* (run-process '("cmd" "arg" ...) (lambda (status output) ...)) */
+sexp
+scmapi_run_process (sexp ctx, sexp self, sexp n, sexp argv, sexp func)
 {
 	scm_module *mod = get_module (ctx);
 	if (mod == NULL)
-		return SEXP_NULL;
+		return SEXP_FALSE;
 
-	const irc_msg *msg = mod->mod_ctx.msg;
-	return msg_params_to_scheme_list (ctx, msg->params, 0);
+	bool ok = sexp_pairp (argv) && sexp_applicablep (func);
+	char **argv_c = ok ? string_list (argv, &ok) : NULL;
+	if (!ok) {
+		log_info_at (&(log_fields){ .module = mod->path },
+			     "run-process takes a list of strings and a procedure\n");
+		return SEXP_FALSE;
+	}
+
+	int ret = scm_run_process (mod, argv_c, func);
+	for (char **a = argv_c; *a != NULL; ++a)
+		free (*a);
+	free (argv_c);
+
+	return sexp_make_boolean (ret == 0);
+}
+
+/* (read-fd fd (lambda (data) ...)), the fd is closed at EOF */
+sexp
+scmapi_read_fd (sexp ctx, sexp self, sexp n, sexp fd, sexp func)
+{
+	scm_module *mod = get_module (ctx);
+	if (mod == NULL)
+		return SEXP_FALSE;
+
+	if (!sexp_fixnump (fd) || !sexp_applicablep (func)) {
+		log_info_at (&(log_fields){ .module = mod->path }, "read-fd takes an fd and a procedure\n");
+		return SEXP_FALSE;
+	}
+
+	return sexp_make_boolean (scm_read_fd (mod, sexp_unbox_fixnum (fd), func) == 0);
+}
+
+/* A string argument as a C string, #f as NULL */
+static bool
+optional_string (sexp x, const char **out)
+{
+	if (x == SEXP_FALSE)
+		*out = NULL;
+	else if (sexp_stringp (x))
+		*out = sexp_string_data (x);
+	else
+		return false;
+
+	return true;
+}
+
+/* (log-append server channel nick message action?), only queues the row */
+sexp
+scmapi_log_append (sexp ctx,
+		   sexp self,
+		   sexp n,
+		   sexp server,
+		   sexp channel,
+		   sexp nick,
+		   sexp message,
+		   sexp action)
+{
+	const char *server_c, *channel_c, *nick_c, *message_c;
+	if (!optional_string (server, &server_c) || !optional_string (channel, &channel_c) ||
+	    !optional_string (nick, &nick_c) || !optional_string (message, &message_c))
+		return SEXP_FALSE;
+
+	return sexp_make_boolean (
+	  chatlog_append (server_c, channel_c, nick_c, message_c, action != SEXP_FALSE));
+}
+
+/* The channel state of the module's server, NULL if it isn't connected */
+static irc_state *
+get_state (sexp ctx)
+{
+	scm_module *mod = get_module (ctx);
+	if (mod == NULL || mod->mod_ctx.serv == NULL)
+		return NULL;
+
+	return irc_server_state (mod->mod_ctx.serv);
+}
+
+typedef struct name_list
+{
+	sexp ctx;
+	sexp *list;
+	sexp *str;
+} name_list;
+
+static void
+cons_name (const char *name, void *data)
+{
+	name_list *l = data;
+	*l->str = sexp_c_string (l->ctx, name, -1);
+	*l->list = sexp_cons (l->ctx, *l->str, *l->list);
+}
+
+/* A list of the names query calls back with, #f if it fails */
+static sexp
+name_query (sexp ctx,
+	    bool (*query) (irc_state *, const char *, irc_state_name_fn, void *),
+	    sexp arg)
+{
+	irc_state *st = get_state (ctx);
+	if (st == NULL || !sexp_stringp (arg))
+		return SEXP_FALSE;
+
+	sexp_gc_var2 (list, str);
+	sexp_gc_preserve2 (ctx, list, str);
+
+	list = SEXP_NULL;
+	name_list l = { ctx, &list, &str };
+	if (!query (st, sexp_string_data (arg), cons_name, &l))
+		list = SEXP_FALSE;
+
+	sexp_gc_release2 (ctx);
+	return list;
+}
+
+/* (channel-users "#chan"), #f unless we're in the channel */
+sexp
+scmapi_channel_users (sexp ctx, sexp self, sexp n, sexp channel)
+{
+	return name_query (ctx, irc_state_channel_users, channel);
+}
+
+/* (user-channels nick), the channels nick shares with us */
+sexp
+scmapi_user_channels (sexp ctx, sexp self, sexp n, sexp nick)
+{
+	return name_query (ctx, irc_state_user_channels, nick);
+}
+
+/* (user-modes "#chan" nick), e.g. "o" for an op, #f if nick isn't there */
+sexp
+scmapi_user_modes (sexp ctx, sexp self, sexp n, sexp channel, sexp nick)
+{
+	irc_state *st = get_state (ctx);
+	if (st == NULL || !sexp_stringp (channel) || !sexp_stringp (nick))
+		return SEXP_FALSE;
+
+	char modes[IRC_STATE_MAX_PREFIXES + 1];
+	if (!irc_state_user_modes (st, sexp_string_data (channel), sexp_string_data (nick), modes))
+		return SEXP_FALSE;
+
+	return sexp_c_string (ctx, modes, -1);
+}
+
+/* (user-host nick), their ident@host if a message showed it */
+sexp
+scmapi_user_host (sexp ctx, sexp self, sexp n, sexp nick)
+{
+	irc_state *st = get_state (ctx);
+	if (st == NULL || !sexp_stringp (nick))
+		return SEXP_FALSE;
+
+	char host[512];
+	if (!irc_state_user_host (st, sexp_string_data (nick), host, sizeof (host)))
+		return SEXP_FALSE;
+
+	return sexp_c_string (ctx, host, -1);
+}
+
+/* How the module's server compares names, RFC 1459 until it says */
+static irc_casemapping
+get_casemapping (sexp ctx)
+{
+	irc_state *st = get_state (ctx);
+	return st != NULL ? irc_state_casemapping (st) : IRC_CASEMAP_RFC1459;
+}
+
+/* (strip-formatting text), text without colours, bold and the like */
+sexp
+scmapi_strip_formatting (sexp ctx, sexp self, sexp n, sexp text)
+{
+	if (!sexp_stringp (text))
+		return SEXP_FALSE;
+
+	size_t len = sexp_string_size (text);
+	char *buf = malloc (len + 1);
+	if (buf == NULL)
+		return SEXP_FALSE;
+
+	len = irc_text_strip_formatting (buf, sexp_string_data (text), len);
+	sexp res = sexp_c_string (ctx, buf, len);
+	free (buf);
+	return res;
+}
+
+/* (irc-casefold name), name folded under the server's casemapping */
+sexp
+scmapi_irc_casefold (sexp ctx, sexp self, sexp n, sexp name)
+{
+	if (!sexp_stringp (name))
+		return SEXP_FALSE;
+
+	/* Only ASCII changes, the folded string is as long as the original */
+	sexp res = sexp_c_string (ctx, sexp_string_data (name), sexp_string_size (name));
+	if (!sexp_exceptionp (res))
+		irc_text_casefold (sexp_string_data (res),
+				   sexp_string_data (res),
+				   sexp_string_size (res),
+				   get_casemapping (ctx));
+	return res;
+}
+
+/* (irc-string=? a b), whether a and b name the same nick or channel */
+sexp
+scmapi_irc_string_eq (sexp ctx, sexp self, sexp n, sexp a, sexp b)
+{
+	if (!sexp_stringp (a) || !sexp_stringp (b))
+		return SEXP_FALSE;
+
+	return sexp_make_boolean (irc_text_caseeq (sexp_string_data (a),
+						   sexp_string_size (a),
+						   sexp_string_data (b),
+						   sexp_string_size (b),
+						   get_casemapping (ctx)));
 }
 
 void
@@ -153,13 +692,28 @@ scmapi_define_foreign_functions (sexp ctx)
 {
 	sexp env = sexp_context_env (ctx);
 
-	/* Entry registrations */
-	sexp_define_foreign (ctx, env, "register-hook", 2, scmapi_register_hook);
-	sexp_define_foreign (ctx, env, "register-command", 2, scmapi_register_command);
-	sexp_define_foreign (ctx, env, "register-match", 2, scmapi_register_match);
+	/* Entry registrations, each takes an optional filter alist */
+	sexp_define_foreign_opt (ctx, env, "register-hook", 3, scmapi_register_hook, SEXP_FALSE);
+	sexp_define_foreign_opt (ctx, env, "register-command", 3, scmapi_register_command, SEXP_FALSE);
+	sexp_define_foreign_opt (ctx, env, "register-match", 3, scmapi_register_match, SEXP_FALSE);
+	sexp_define_foreign (ctx, env, "shed-when-busy", 1, scmapi_shed_when_busy);
+
+	/* Deferred calls */
+	sexp_define_foreign (ctx, env, "register-timer", 3, scmapi_register_timer);
+	sexp_define_foreign (ctx, env, "after", 2, scmapi_after);
+	sexp_define_foreign (ctx, env, "every", 2, scmapi_every);
+	sexp_define_foreign (ctx, env, "cancel-timer", 1, scmapi_cancel_timer);
+	sexp_define_foreign (ctx, env, "run-process", 2, scmapi_run_process);
+	sexp_define_foreign (ctx, env, "read-fd", 2, scmapi_read_fd);
+
+	/* Channel log */
+	sexp_define_foreign (ctx, env, "log-append", 5, scmapi_log_append);
 
 	/* Server interactions */
 	sexp_define_foreign (ctx, env, "send-raw", 1, scmapi_send_raw);
+	sexp_define_foreign (ctx, env, "send-privmsg", 2, scmapi_send_privmsg);
+	sexp_define_foreign (ctx, env, "send-notice", 2, scmapi_send_notice);
+	sexp_define_foreign (ctx, env, "send-action", 2, scmapi_send_action);
 
 	/* IRC config information */
 	sexp_define_foreign (ctx, env, "get-cmd-prefix", 0, scmapi_get_cmd_prefix);
@@ -169,9 +723,23 @@ scmapi_define_foreign_functions (sexp ctx)
 	sexp_define_foreign (
 	  ctx, env, "get-server-name", 0, scmapi_get_server_name);
 
+	/* Channel state */
+	sexp_define_foreign (ctx, env, "channel-users", 1, scmapi_channel_users);
+	sexp_define_foreign (ctx, env, "user-channels", 1, scmapi_user_channels);
+	sexp_define_foreign (ctx, env, "user-modes", 2, scmapi_user_modes);
+	sexp_define_foreign (ctx, env, "user-host", 1, scmapi_user_host);
+
+	/* Text */
+	sexp_define_foreign (ctx, env, "strip-formatting", 1, scmapi_strip_formatting);
+	sexp_define_foreign (ctx, env, "irc-casefold", 1, scmapi_irc_casefold);
+	sexp_define_foreign (ctx, env, "irc-string=?", 2, scmapi_irc_string_eq);
+
 	/* message information */
 	sexp_define_foreign (ctx, env, "get-message-source", 0, scmapi_get_message_source);
 	sexp_define_foreign (ctx, env, "get-message-command", 0, scmapi_get_message_command);
 	sexp_define_foreign (ctx, env, "get-message-params", 0, scmapi_get_message_params);
-	/* sexp_define_foreign (ctx, env, "get-message-tags", 0, scmapi_get_message_tags); */
+	sexp_define_foreign (ctx, env, "get-message-tag", 1, scmapi_get_message_tag);
+	sexp_define_foreign (ctx, env, "get-nick", 0, scmapi_get_nick);
+	sexp_define_foreign (ctx, env, "get-ident", 0, scmapi_get_ident);
+	sexp_define_foreign (ctx, env, "get-host", 0, scmapi_get_host);
 }
@@ -0,0 +1,139 @@
+/*
+ * rxset has to report exactly the patterns regexec matches, the literal
+ * prefilter may only ever save work. Checked on patterns that trip up
+ * the literal extraction and on random ones, against regexec.
+ */
+#include <regex.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "scheme/rxset.h"
+
+#define RANDOM_PATTERNS 60
+#define RANDOM_TEXTS 200
+#define RANDOM_ROUNDS 300
+
+static const char *fixed_patterns[] = {
+	"foo+?",  "fo+*bar", "ab+{0,1}c", "x+*",     "b+?",	"a+{0}b",
+	"ab*c",	  "ab?c",    "abc+",	  "a\\.+?b", "[ab]+?c", "(ab)+?c",
+	"^ab+?$", "a{2}b",   "ab{1,}c",	  "a\\+?b",  "ab++c",	"hello",
+};
+
+static const char *fixed_texts[] = {
+	"fo",  "f",   "foo", "fbar", "a", "ac",	 "abc", "c",  "",   "b",
+	"a.b", "ab",  "cab", "x",    "abbc", "b", "aab", "a+b", "hello", "ababc",
+};
+
+static void
+count_match (void *data, void *user_data)
+{
+	bool *matched = user_data;
+	matched[(size_t)data] = true;
+}
+
+static unsigned long seed = 1;
+
+static unsigned
+next_random (void)
+{
+	seed = seed * 6364136223846793005ul + 1442695040888963407ul;
+	return seed >> 33;
+}
+
+static void
+random_pattern (char *buf, size_t len)
+{
+	static const char *atoms[] = { "a", "b", "c", ".", "[ab]", "(ab)", "\\." };
+	static const char *quants[] = { "", "", "", "+", "*", "?", "+?", "+*", "{0,1}", "+{0,1}", "{2}" };
+
+	buf[0] = '\0';
+	int n = 1 + next_random () % 5;
+	for (int i = 0; i < n; ++i) {
+		strncat (buf, atoms[next_random () % (sizeof (atoms) / sizeof (atoms[0]))], len - strlen (buf) - 1);
+		strncat (buf, quants[next_random () % (sizeof (quants) / sizeof (quants[0]))], len - strlen (buf) - 1);
+	}
+}
+
+static void
+random_text (char *buf, size_t len)
+{
+	static const char alphabet[] = "abc.";
+	size_t n = next_random () % (len - 1);
+	for (size_t i = 0; i < n; ++i)
+		buf[i] = alphabet[next_random () % (sizeof (alphabet) - 1)];
+	buf[n] = '\0';
+}
+
+/* The mismatches between rxset and regexec for every text */
+static int
+check (const char **patterns, size_t npatterns, const char **texts, size_t ntexts)
+{
+	rxset *set = rxset_new ();
+	regex_t *rx = calloc (npatterns, sizeof (regex_t));
+	bool *matched = calloc (npatterns, sizeof (bool));
+	if (set == NULL || rx == NULL || matched == NULL) {
+		fprintf (stderr, "out of memory\n");
+		exit (1);
+	}
+
+	char err[256];
+	for (size_t i = 0; i < npatterns; ++i) {
+		if (rxset_add (set, patterns[i], (void *)i, err, sizeof (err)) == -1
+		    || regcomp (&rx[i], patterns[i], REG_EXTENDED | REG_NOSUB) != 0) {
+			fprintf (stderr, "%s: %s\n", patterns[i], err);
+			exit (1);
+		}
+	}
+
+	int mismatches = 0;
+	for (size_t t = 0; t < ntexts; ++t) {
+		memset (matched, 0, npatterns * sizeof (bool));
+		rxset_match (set, texts[t], count_match, matched);
+		for (size_t i = 0; i < npatterns; ++i) {
+			bool want = regexec (&rx[i], texts[t], 0, NULL, 0) == 0;
+			if (matched[i] != want) {
+				fprintf (stderr, "\"%s\" on \"%s\": rxset says %d, regexec %d\n",
+					 patterns[i], texts[t], matched[i], want);
+				mismatches++;
+			}
+		}
+	}
+
+	for (size_t i = 0; i < npatterns; ++i)
+		regfree (&rx[i]);
+	free (rx);
+	free (matched);
+	rxset_free (set);
+	return mismatches;
+}
+
+int
+main (void)
+{
+	int mismatches = check (fixed_patterns,
+				sizeof (fixed_patterns) / sizeof (fixed_patterns[0]),
+				fixed_texts,
+				sizeof (fixed_texts) / sizeof (fixed_texts[0]));
+
+	static char pattern_buf[RANDOM_PATTERNS][64], text_buf[RANDOM_TEXTS][16];
+	const char *patterns[RANDOM_PATTERNS], *texts[RANDOM_TEXTS];
+	for (int round = 0; round < RANDOM_ROUNDS; ++round) {
+		for (int i = 0; i < RANDOM_PATTERNS; ++i) {
+			random_pattern (pattern_buf[i], sizeof (pattern_buf[i]));
+			patterns[i] = pattern_buf[i];
+		}
+		for (int i = 0; i < RANDOM_TEXTS; ++i) {
+			random_text (text_buf[i], sizeof (text_buf[i]));
+			texts[i] = text_buf[i];
+		}
+		mismatches += check (patterns, RANDOM_PATTERNS, texts, RANDOM_TEXTS);
+	}
+
+	if (mismatches > 0) {
+		fprintf (stderr, "%d mismatches\n", mismatches);
+		return 1;
+	}
+	return 0;
+}